@@ -0,0 +1,31 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+# - Find the MySQL (or MariaDB) client library
+#
+# Defines:
+#
+#  MySQL_FOUND        - whether the client library was found
+#  MySQL_INCLUDE_DIRS - the directories containing mysql.h
+#  MySQL_LIBRARIES    - the libraries to link against
+
+find_path(MySQL_INCLUDE_DIR mysql.h
+        PATH_SUFFIXES mysql mariadb
+        )
+
+find_library(MySQL_LIBRARY
+        NAMES mysqlclient mariadb mariadbclient
+        PATH_SUFFIXES mysql mariadb
+        )
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(MySQL DEFAULT_MSG MySQL_LIBRARY MySQL_INCLUDE_DIR)
+
+if(MySQL_FOUND)
+    set(MySQL_INCLUDE_DIRS ${MySQL_INCLUDE_DIR})
+    set(MySQL_LIBRARIES ${MySQL_LIBRARY})
+endif()
+
+mark_as_advanced(MySQL_INCLUDE_DIR MySQL_LIBRARY)
@@ -0,0 +1,96 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+from core import Arena
+
+
+class FrameArenas:
+    """
+    Per-frame arenas, one per robot per pipeline slot.
+
+    Everything a frame produces (boxes, landmarks, crops, matches) is
+    allocated from the arena of the slot the frame occupies. When the frame
+    retires, its arena is reset wholesale, so the steady state allocates
+    nothing from the system allocator.
+
+    Given a robot placement, each robot's arenas are allocated on the NUMA
+    node its pipeline threads are pinned to. Given budgets, a robot's slots
+    share its budget evenly, and allocations past a slot's share raise
+    MemoryError.
+    """
+
+    def __init__(self, slots: int = 2, block_size: int = 64 * 1024, placement=None, budgets: dict = None):
+        """
+        :param slots: The frames each robot may have in flight
+        :param block_size: The smallest arena block
+        :param placement: The robot placement, or None for no NUMA preference
+        :param budgets: The most bytes each robot's arenas may hold, by robot ID
+        """
+
+        self.slots = slots
+        self.block_size = block_size
+        self.placement = placement
+        self.budgets = budgets or {}
+        self._arenas = {}
+
+    def arena(self, robot_id: int, frame_number: int) -> Arena:
+        """
+        Get the arena for a frame in flight.
+
+        :param robot_id: The robot ID
+        :param frame_number: The frame number
+        :return: The arena
+        """
+
+        key = (robot_id, frame_number % self.slots)
+
+        arena = self._arenas.get(key)
+        if arena is None:
+            node = self.placement.node(robot_id) if self.placement is not None else -1
+            limit = self.budgets.get(robot_id, 0) // self.slots
+            arena = Arena(block_size=min(self.block_size, limit or self.block_size), node=node, limit=limit)
+            self._arenas[key] = arena
+
+        return arena
+
+    def retire(self, robot_id: int, frame_number: int):
+        """
+        Release everything a frame allocated. Raises BufferError if any of it
+        is still viewed (e.g. by a NumPy array kept past the frame).
+
+        :param robot_id: The robot ID
+        :param frame_number: The frame number
+        """
+
+        arena = self._arenas.get((robot_id, frame_number % self.slots))
+        if arena is not None:
+            arena.reset()
+
+    def forget(self, robot_id: int):
+        """
+        Drop the arenas of a robot that has gone away.
+
+        :param robot_id: The robot ID
+        """
+
+        for key in [key for key in self._arenas if key[0] == robot_id]:
+            del self._arenas[key]
+
+    def usage(self) -> dict:
+        """
+        Get the memory each robot's arenas hold.
+
+        :return: The bytes held, the most bytes used between two resets, and
+          the budget (zero for none), by robot ID
+        """
+
+        result = {}
+        for (robot_id, _), arena in self._arenas.items():
+            stats = arena.stats()
+            robot = result.setdefault(robot_id, {'bytes': 0, 'peak': 0, 'budget': self.budgets.get(robot_id, 0)})
+            robot['bytes'] += stats['capacity']
+            robot['peak'] += max(stats['peak'], stats['used'])
+
+        return result
@@ -0,0 +1,339 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import asyncio
+import collections
+import concurrent.futures
+import threading
+import time
+from typing import Dict, Optional
+
+# Command kinds
+KIND_HEAD = 'head'
+KIND_LIFT = 'lift'
+KIND_TURN = 'turn'
+KIND_DRIVE = 'drive'
+KIND_SPEAK = 'speak'
+KIND_ANIMATE = 'animate'
+
+# Motion commands are set-points, so a newer one makes an unsent older one of the same kind pointless
+_MOTION_KINDS = {KIND_HEAD, KIND_LIFT, KIND_TURN, KIND_DRIVE}
+
+# Command outcomes (the result of the future returned by submit)
+SENT = 'sent'
+SUPERSEDED = 'superseded'
+EXPIRED = 'expired'
+FAILED = 'failed'
+CANCELLED = 'cancelled'
+
+
+class Command:
+    """
+    A command waiting to be sent to a robot.
+    """
+
+    __slots__ = ('kind', 'args', 'deadline', 'submitted', 'future')
+
+    def __init__(self, kind: str, args: dict, deadline: float, submitted: float,
+                 future: concurrent.futures.Future):
+        self.kind = kind
+        self.args = args
+        self.deadline = deadline
+        self.submitted = submitted
+        self.future = future
+
+    def resolve(self, outcome: str):
+        if not self.future.done():
+            self.future.set_result(outcome)
+
+
+class MockRobot:
+    """
+    A local stand-in for the robot SDK link, for exercising the scheduler
+    without hardware. It records what it was sent and can be made slow.
+    """
+
+    def __init__(self, latency: float = 0.0):
+        """
+        :param latency: How long each send takes, in seconds
+        """
+
+        self.latency = latency
+        self.sent = []
+
+    async def send(self, robot_id: int, kind: str, args: dict):
+        if self.latency:
+            await asyncio.sleep(self.latency)
+
+        self.sent.append((time.monotonic(), robot_id, kind, args))
+
+
+class _RobotQueue:
+    """
+    The pending commands and send worker of one robot.
+    """
+
+    def __init__(self, scheduler: 'CommandScheduler', robot_id: int):
+        self.scheduler = scheduler
+        self.robot_id = robot_id
+
+        # Speech and animations go out in order, ahead of any motion
+        self.actions = collections.deque()
+
+        # At most one pending motion command per kind, oldest kind first
+        self.motion = collections.OrderedDict()
+
+        # Built on the scheduler's loop thread, so the event binds to that loop
+        self.wakeup = asyncio.Event()
+        self.tokens = float(scheduler.burst)
+        self.refilled = time.monotonic()
+        self.counts = collections.Counter()
+        self.queue_delay = 0.0
+
+        self.task = asyncio.ensure_future(self._run(), loop=scheduler.loop)
+
+    def push(self, command: Command):
+        self.counts['submitted'] += 1
+
+        if command.kind in _MOTION_KINDS:
+            older = self.motion.pop(command.kind, None)
+            if older is not None:
+                older.resolve(SUPERSEDED)
+                self.counts[SUPERSEDED] += 1
+            self.motion[command.kind] = command
+        else:
+            self.actions.append(command)
+
+        self.wakeup.set()
+
+    def drop_all(self, outcome: str):
+        for command in list(self.actions) + list(self.motion.values()):
+            command.resolve(outcome)
+            self.counts[outcome] += 1
+
+        self.actions.clear()
+        self.motion.clear()
+
+    def _next(self, now: float) -> Optional[Command]:
+        # Anything past its deadline is stale, so drop it instead of sending it late
+        for command in [c for c in self.actions if c.deadline <= now]:
+            self.actions.remove(command)
+            command.resolve(EXPIRED)
+            self.counts[EXPIRED] += 1
+
+        for kind in [k for k, c in self.motion.items() if c.deadline <= now]:
+            self.motion.pop(kind).resolve(EXPIRED)
+            self.counts[EXPIRED] += 1
+
+        if self.actions:
+            return self.actions[0]
+        if self.motion:
+            return next(iter(self.motion.values()))
+        return None
+
+    def _take_token(self, now: float) -> float:
+        # Token bucket; returns how long to wait for a token, or zero if one was taken
+        self.tokens = min(float(self.scheduler.burst), self.tokens + (now - self.refilled) * self.scheduler.rate)
+        self.refilled = now
+
+        if self.tokens >= 1.0:
+            self.tokens -= 1.0
+            return 0.0
+
+        return (1.0 - self.tokens) / self.scheduler.rate
+
+    async def _run(self):
+        while True:
+            now = time.monotonic()
+
+            command = self._next(now)
+            if command is None:
+                self.wakeup.clear()
+                await self.wakeup.wait()
+                continue
+
+            # Wait out the rate limit, then choose again since the command may have been superseded meanwhile
+            delay = self._take_token(now)
+            if delay > 0:
+                await asyncio.sleep(min(delay, command.deadline - now))
+                continue
+
+            # Take it off the queue only now, so a newer motion command replaces it up until the send
+            if self.actions and self.actions[0] is command:
+                self.actions.popleft()
+            else:
+                self.motion.pop(command.kind)
+
+            self.queue_delay = now - command.submitted
+
+            # A send may take up to the send timeout, but never past the deadline
+            remaining = command.deadline - time.monotonic()
+            if remaining <= 0:
+                command.resolve(EXPIRED)
+                self.counts[EXPIRED] += 1
+                continue
+
+            timeout = min(remaining, self.scheduler.send_timeout)
+
+            try:
+                await asyncio.wait_for(self.scheduler.endpoint.send(self.robot_id, command.kind, command.args),
+                                       timeout=timeout)
+            except asyncio.CancelledError:
+                command.resolve(CANCELLED)
+                raise
+            except asyncio.TimeoutError:
+                outcome = EXPIRED if timeout == remaining else FAILED
+                command.resolve(outcome)
+                self.counts[outcome] += 1
+                continue
+            except Exception:
+                command.resolve(FAILED)
+                self.counts[FAILED] += 1
+                continue
+
+            command.resolve(SENT)
+            self.counts[SENT] += 1
+
+
+class CommandScheduler:
+    """
+    Sends commands to robots without letting them pile up.
+
+    Tracking produces a head or turn set-point per frame, far faster than the
+    SDK link wants them. Motion commands of the same kind coalesce, so only
+    the newest unsent one goes out. Speech and animations are never coalesced
+    and always go ahead of motion. Each robot has its own rate limit and its
+    own send task, so a slow robot never holds up another robot's commands.
+    Commands not sent by their deadline are dropped.
+
+    Sends run on an event loop of the scheduler's own, on its own thread, so
+    recognition work on the caller's loop never delays a command. Every method
+    may be called from any thread.
+
+    Endpoints provide a coroutine send(robot_id, kind, args), run on the
+    scheduler's loop; see MockRobot.
+    """
+
+    def __init__(self, endpoint, rate: float = 15.0, burst: int = 3, motion_deadline: float = 0.25,
+                 action_deadline: float = 5.0, send_timeout: float = 0.5):
+        """
+        :param endpoint: Where commands are sent
+        :param rate: The most commands per second sent to one robot
+        :param burst: How many commands may go out back to back
+        :param motion_deadline: How long a motion command may wait, in seconds
+        :param action_deadline: How long speech or an animation may wait, in seconds
+        :param send_timeout: The most time allowed for one send, in seconds
+        """
+
+        self.endpoint = endpoint
+        self.rate = rate
+        self.burst = burst
+        self.motion_deadline = motion_deadline
+        self.action_deadline = action_deadline
+        self.send_timeout = send_timeout
+
+        # Only touched on the scheduler's loop
+        self._robots: Dict[int, _RobotQueue] = {}
+
+        self.loop = asyncio.new_event_loop()
+        self._thread = threading.Thread(target=self._serve, name='command-scheduler', daemon=True)
+        self._thread.start()
+
+    def submit(self, robot_id: int, kind: str, deadline: float = None, **args) -> concurrent.futures.Future:
+        """
+        Queue a command. There is no need to wait on the result unless the
+        outcome matters; from a coroutine, await asyncio.wrap_future(result).
+
+        :param robot_id: The robot ID
+        :param kind: The command kind (one of the KIND_* constants)
+        :param deadline: How long the command may wait, in seconds (defaults by kind)
+        :param args: The command arguments
+        :return: A future resolving to the outcome (SENT, SUPERSEDED, EXPIRED, FAILED or CANCELLED)
+        """
+
+        if deadline is None:
+            deadline = self.motion_deadline if kind in _MOTION_KINDS else self.action_deadline
+
+        now = time.monotonic()
+        future = concurrent.futures.Future()
+        self.loop.call_soon_threadsafe(self._push, robot_id, Command(kind, args, now + deadline, now, future))
+        return future
+
+    def forget(self, robot_id: int):
+        """
+        Drop a robot that has gone away, along with its pending commands.
+        """
+
+        self.loop.call_soon_threadsafe(self._forget, robot_id)
+
+    def metrics(self) -> dict:
+        """
+        Get command counts and the last queueing delay of each robot.
+        """
+
+        return self._call(lambda: {
+            robot.robot_id: {
+                'counts': dict(robot.counts),
+                'pending': len(robot.actions) + len(robot.motion),
+                'queue_delay_ms': robot.queue_delay * 1e3,
+            }
+            for robot in self._robots.values()
+        })
+
+    def close(self):
+        """
+        Stop all send tasks and the scheduler's thread. Pending commands
+        resolve as CANCELLED.
+        """
+
+        if not self._thread.is_alive():
+            return
+
+        asyncio.run_coroutine_threadsafe(self._close(), self.loop).result()
+
+        self.loop.call_soon_threadsafe(self.loop.stop)
+        self._thread.join()
+        self.loop.close()
+
+    def _serve(self):
+        asyncio.set_event_loop(self.loop)
+        self.loop.run_forever()
+
+    def _call(self, fn):
+        # Run a function on the scheduler's loop and wait for its result
+        future = concurrent.futures.Future()
+
+        def run():
+            try:
+                future.set_result(fn())
+            except Exception as e:
+                future.set_exception(e)
+
+        self.loop.call_soon_threadsafe(run)
+        return future.result()
+
+    def _push(self, robot_id: int, command: Command):
+        robot = self._robots.get(robot_id)
+        if robot is None:
+            robot = _RobotQueue(self, robot_id)
+            self._robots[robot_id] = robot
+
+        robot.push(command)
+
+    def _forget(self, robot_id: int):
+        robot = self._robots.pop(robot_id, None)
+        if robot is not None:
+            robot.task.cancel()
+            robot.drop_all(CANCELLED)
+
+    async def _close(self):
+        robots = list(self._robots.values())
+        self._robots.clear()
+
+        for robot in robots:
+            robot.task.cancel()
+            robot.drop_all(CANCELLED)
+
+        await asyncio.gather(*[robot.task for robot in robots], return_exceptions=True)
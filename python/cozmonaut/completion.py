@@ -0,0 +1,88 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import asyncio
+
+from core import CompletionChannel
+
+
+class CompletionDispatcher:
+    """
+    Routes finished native operations back to the event loop.
+
+    Native work runs on its own threads and posts to a completion channel. The
+    channel's file descriptor is registered with the loop, so one wakeup
+    resolves every future that finished since the last one.
+    """
+
+    def __init__(self, loop: asyncio.AbstractEventLoop):
+        self.loop = loop
+        self.channel = CompletionChannel()
+        self._futures = {}
+
+        # Batching counters, for metrics()
+        self._wakeups = 0
+        self._completions = 0
+        self._largest_batch = 0
+
+        # Wake up whenever completions are posted
+        self.loop.add_reader(self.channel.fileno(), self._on_readable)
+
+    def watch(self, ticket: int) -> asyncio.Future:
+        """
+        Get a future for a native operation.
+
+        :param ticket: The ticket returned when the operation was submitted
+        :return: A future resolving to the operation result
+        """
+
+        future = self.loop.create_future()
+        self._futures[ticket] = future
+        return future
+
+    def metrics(self) -> dict:
+        """
+        Get how well completions are being batched per loop wakeup.
+
+        :return: The wakeups, completions, mean and largest batch, and futures outstanding
+        """
+
+        return {
+            'wakeups': self._wakeups,
+            'completions': self._completions,
+            'mean_batch': self._completions / self._wakeups if self._wakeups else 0.0,
+            'largest_batch': self._largest_batch,
+            'outstanding': len(self._futures),
+        }
+
+    def close(self):
+        """
+        Stop watching the channel. Outstanding futures are cancelled.
+        """
+
+        self.loop.remove_reader(self.channel.fileno())
+
+        for future in self._futures.values():
+            future.cancel()
+        self._futures.clear()
+
+    def _on_readable(self):
+        batch = self.channel.drain()
+
+        self._wakeups += 1
+        self._completions += len(batch)
+        self._largest_batch = max(self._largest_batch, len(batch))
+
+        for ticket, ok, value in batch:
+            future = self._futures.pop(ticket, None)
+
+            # Nobody is waiting anymore
+            if future is None or future.cancelled():
+                continue
+
+            if ok:
+                future.set_result(value)
+            else:
+                future.set_exception(value)
@@ -0,0 +1,181 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import asyncio
+from typing import Dict, List, Optional
+
+from core import FriendIndex, SqlError
+
+from cozmonaut.sql import AsyncSqlClient
+
+# The MySQL error code for a duplicate key
+_ER_DUP_ENTRY = 1062
+
+# The most tries at taking the next free ID when another client takes it first
+_MAX_TRIES = 8
+
+# How long to wait between checks for in-flight searches to finish, in seconds
+_SEARCH_DRAIN_POLL = 0.002
+
+
+class Enrollment:
+    """
+    Turns unknown faces into friends while the session runs.
+
+    Embeddings of an unrecognized track (ideally the best crops chosen by
+    BestCropSelector) are collected until there are enough. They are then
+    averaged into a template, leaving out any that disagree. The template is
+    written to the friends table and appended to the live index once the
+    searches in flight finish, so the new friend is recognized without a
+    rebuild.
+    """
+
+    def __init__(self, index: FriendIndex, sql: Optional[AsyncSqlClient], samples: int = 5,
+                 min_agreement: float = 0.7):
+        """
+        :param index: The live friend index
+        :param sql: The SQL client, or None to enroll into the index only
+        :param samples: The embeddings collected per enrollment
+        :param min_agreement: The least similarity to the average an embedding needs to count
+        """
+
+        self.index = index
+        self.sql = sql
+        self.samples = samples
+        self.min_agreement = min_agreement
+        self._tracks: Dict[int, List[bytes]] = {}
+
+        # The highest friend ID seen (IDs come from here when there is no database)
+        self._last_id = 0
+
+    async def load(self) -> int:
+        """
+        Fill the index with the friends in the database.
+
+        An index that already holds friends (from a snapshot or its log) only
+        takes the database changes newer than its watermark. So friends
+        imported, added or removed since the snapshot was written reach it
+        too.
+
+        :return: The number of friends loaded
+        """
+
+        if self.sql is None:
+            return 0
+
+        row = await self.sql.query_one('SELECT COALESCE(MAX(id), 0) FROM friends')
+        self._last_id = max(self._last_id, row[0])
+
+        if self.index.generation > 0 or self.index.watermark > 0:
+            return await self._load_changes()
+
+        # Taken first, so changes racing the load below are applied again by the next one
+        row = await self.sql.query_one('SELECT COALESCE(MAX(seq), 0) FROM friend_changes')
+        watermark = row[0]
+
+        rows = await self.sql.query('SELECT id, embedding FROM friends WHERE embedding IS NOT NULL')
+
+        loaded = 0
+        for friend_id, embedding in rows:
+            # Skip embeddings from some other model
+            if len(embedding) == self.index.dim * 4:
+                self.index.append(friend_id, embedding)
+                loaded += 1
+
+        self.index.set_watermark(watermark)
+        return loaded
+
+    async def _load_changes(self) -> int:
+        # Each changed friend is replaced by what the database holds now, so applying a change twice is harmless
+        rows = await self.sql.query('SELECT c.seq, c.friend_id, f.embedding '
+                                    'FROM (SELECT friend_id, MAX(seq) AS seq FROM friend_changes WHERE seq > ? '
+                                    'GROUP BY friend_id) c LEFT JOIN friends f ON f.id = c.friend_id',
+                                    self.index.watermark)
+
+        loaded = 0
+        watermark = self.index.watermark
+        for seq, friend_id, embedding in rows:
+            watermark = max(watermark, seq)
+            self.index.remove(friend_id)
+
+            if embedding is not None and len(embedding) == self.index.dim * 4:
+                self.index.append(friend_id, embedding)
+                loaded += 1
+
+        self.index.set_watermark(watermark)
+        return loaded
+
+    def offer(self, track_id: int, embedding) -> bool:
+        """
+        Offer an embedding of an unknown track.
+
+        :param track_id: The track ID
+        :param embedding: The embedding (float32 array or raw bytes)
+        :return: True once the track has enough embeddings to enroll
+        """
+
+        collected = self._tracks.setdefault(track_id, [])
+        if len(collected) < self.samples:
+            collected.append(bytes(memoryview(embedding).cast('B')))
+
+        return len(collected) >= self.samples
+
+    def forget(self, track_id: int):
+        """
+        Drop the embeddings of a track that has ended.
+        """
+
+        self._tracks.pop(track_id, None)
+
+    async def enroll(self, track_id: int, name: str) -> Optional[int]:
+        """
+        Enroll a track as a new friend.
+
+        :param track_id: The track ID
+        :param name: The friend name
+        :return: The new friend ID, or None if the embeddings did not agree on one face
+        """
+
+        collected = self._tracks.pop(track_id, [])
+        if not collected:
+            return None
+
+        template = self.index.template(b''.join(collected), min_agreement=self.min_agreement)
+        if template is None:
+            return None
+
+        friend_id = await self._store(name, template)
+        await self._append(friend_id, template)
+        return friend_id
+
+    async def _append(self, friend_id: int, template: bytes):
+        # The friend is in the database already, so the index must take it too
+        # Searches running on workers hold the index still, and nothing signals the last one finishing, so poll
+        while self.index.searches:
+            await asyncio.sleep(_SEARCH_DRAIN_POLL)
+
+        # Nothing awaits between the check and the append, so no search starts in between
+        self.index.append(friend_id, template)
+
+    async def _store(self, name: str, template: bytes) -> int:
+        if self.sql is None:
+            self._last_id += 1
+            return self._last_id
+
+        for _ in range(_MAX_TRIES):
+            row = await self.sql.query_one('SELECT COALESCE(MAX(id), 0) + 1 FROM friends')
+            friend_id = int(row[0])
+
+            try:
+                await self.sql.query('INSERT INTO friends (id, name, embedding) VALUES (?, ?, ?)', friend_id, name,
+                                     template)
+                self._last_id = max(self._last_id, friend_id)
+                return friend_id
+            except SqlError as e:
+                # Another client took the ID first
+                if e.errno != _ER_DUP_ENTRY:
+                    raise
+
+        raise SqlError('failed to take a free friend id')
@@ -3,23 +3,103 @@
 # Copyright 2019 The Cozmonaut Contributors
 #
 
+import array
 import asyncio
+import collections
+import json
+import sys
+import time
 
-import cv2
-
+from cozmonaut.arena import FrameArenas
+from cozmonaut.completion import CompletionDispatcher
+from cozmonaut.enroll import Enrollment
 from cozmonaut.entry_point import EntryPoint
+from cozmonaut.governor import Governor, PRIORITY_ENGAGED, PRIORITY_IDLE, PRIORITY_WATCHING
+from cozmonaut.handles import AsyncHandleReader
+from cozmonaut.memory import REPORT_SIGNAL, parse_budget, peak_mb, remove_report, report, set_budget, write_report
+from cozmonaut.placement import RobotPlacement
+from cozmonaut.preload import Preloader
+from cozmonaut.replay import ReplayMetrics, check_baseline, load_frames, write_metrics
+from cozmonaut.scheduler import TaskScheduler
+from cozmonaut.snapshot import SnapshotCompactor
+from cozmonaut.sql import AsyncSqlClient
+from cozmonaut.watchdog import LoopWatchdog
 
 
 import core
 
+# The face embedding size
+EMBEDDING_DIM = 128
+
+# How long a robot counts as engaged after it last saw a face, in seconds
+ENGAGED_HOLD = 3.0
+
+
 class EntryPointInteract(EntryPoint):
     """
     An entry point for actual robot interaction.
     """
 
-    def __init__(self):
+    def __init__(self, args=None):
+        self.args = args or {}
         self.stop = False
 
+        # Hold native memory to its budgets before anything below allocates
+        # Budgets given per robot hold that robot's frame arenas instead
+        budgets, robot_budgets = parse_budget(self.args.get('memory_budget') or '')
+        set_budget(budgets)
+
+        # The async SQL client (set up on the loop in main)
+        self.sql = None
+
+        # The write-behind encounter log (set up in main)
+        self.encounters = None
+
+        # Trades detection rate and resolution for recognition latency, per robot
+        # Its decisions are available from self.governor.metrics()
+        self.governor = Governor()
+
+        # Imports OpenCV and NumPy in the background (started in main)
+        self.modules = None
+
+        # The live friend index, and the loader that fills it from the database (set up in main)
+        # With a snapshot, processes on this host share one mapped copy of the embeddings
+        self.friends = core.FriendIndex(EMBEDDING_DIM, snapshot=self.args.get('friend_snapshot'))
+        self.enrollment = None
+        self.compactor = None
+
+        # Where each robot's pipeline threads and buffers go
+        self.placement = RobotPlacement(self.args.get('cpu_policy'))
+
+        # What each frame in flight produces comes from its slot's arena, on the robot's NUMA node
+        self.arenas = FrameArenas(placement=self.placement, budgets={
+            robot_id: int(tags['arena'] * (1 << 20)) for robot_id, tags in robot_budgets.items()
+        })
+
+        # Frames handed from the video coroutines to the face coroutine, as handles into face_frames (set up in main)
+        # A frame's arena slot stays taken until the face coroutine is done with it
+        self.faces = None
+        self.face_frames = {}
+        self.face_backlog = collections.Counter()
+        self._next_face_handle = 0
+
+        # Scores detected faces for embedding, on the scheduler pool
+        self.quality = core.FaceQuality()
+
+        # When each robot last saw a face (wall-clock seconds), for its governor priority
+        self.face_seen = {}
+
+        # Runs decode, detect and embed work from all robots, oldest frames first (set up in main)
+        self.scheduler = None
+
+        # The metrics of a replay, and an event set each time the face coroutine finishes a frame (set up in
+        # replay_video)
+        self.replay = None
+        self.face_retired = None
+
+        # Reports any coroutine that holds up the loop, and with it every robot
+        self.watchdog = LoopWatchdog()
+
     async def demo_video(self):
         """
         This coroutine grabs video frames. It's job is to go as fast as it can.
@@ -28,6 +108,8 @@ class EntryPointInteract(EntryPoint):
         will give us frames via its frame callback. Not a big change at all.
         """
 
+        cv2 = await self.modules.wait('cv2')
+
         # Open the first video device
         cap = cv2.VideoCapture(0)
 
@@ -37,6 +119,7 @@ class EntryPointInteract(EntryPoint):
 
             # Show the frame
             cv2.imshow('Output', frame)
+            core.startup_mark('first frame')
 
             # Update window and stop on Q key down
             if cv2.waitKey(1) == ord('q'):
@@ -45,33 +128,396 @@ class EntryPointInteract(EntryPoint):
             # Yield control
             await asyncio.sleep(0)
 
+    async def ring_video(self, ring, robot_id: int = 0):
+        """
+        This coroutine shows frames published into a shared-memory frame ring
+        by the robot SDK process. JPEG frames are decoded where they sit in
+        shared memory, and raw frames are copied once, into the arena of the
+        frame's pipeline slot.
+
+        The governor picks which frames get detection and at what scale. Frame
+        timestamps are expected in wall-clock seconds (time.time()).
+        """
+
+        loop = asyncio.get_event_loop()
+
+        # This robot's blocking stages run on threads pinned near each other
+        executor = self.placement.executor(robot_id)
+
+        cv2, np = await self.modules.wait('cv2', 'numpy')
+
+        # Decodes JPEG frames where they sit in the ring
+        decoder = core.JpegDecoder()
+
+        # Counts frames taken into the pipeline, picking each one's arena slot
+        seq = 0
+
+        while not self.stop:
+            # Sleep on the ring off the loop thread, waking now and then to check for stop
+            try:
+                frame = await loop.run_in_executor(executor, ring.wait, 0.1)
+            except EOFError:
+                # The producer went away
+                break
+
+            if frame is None:
+                # Nothing in front of this robot is moving, so it gives up its budget first
+                self.governor.set_priority(robot_id, PRIORITY_IDLE)
+                continue
+
+            # Skip frames the governor has taken out of this robot's detection budget
+            if not self.governor.should_detect(robot_id, frame.number):
+                del frame
+                continue
+
+            # Skip frames while every arena slot is held by a frame the face coroutine hasn't finished
+            if self.face_backlog[robot_id] >= self.arenas.slots:
+                del frame
+                continue
+
+            if frame.format == core.FRAME_FORMAT_JPEG:
+                # Detection only needs a small gray image, which DCT-domain scaling gets cheaply
+                # Faces that need embedding get full resolution later via decoder.decode_region(frame, ...)
+                # The decode runs natively on the pool, so the loop keeps the GIL meanwhile
+                with self.governor.stage(robot_id, 'decode'):
+                    data, width, height = await self.scheduler.decode(decoder, frame,
+                                                                      scale=self.governor.detect_scale(robot_id),
+                                                                      gray=True,
+                                                                      frame_time=frame.timestamp)
+                image = np.frombuffer(data, dtype=np.uint8).reshape(height, width)
+            else:
+                # View the slot in place, and copy out of it into the frame's arena
+                # The copy comes first, since a view would go on reading the slot after the check below
+                rows = np.frombuffer(frame, dtype=np.uint8).reshape(frame.height, frame.stride)
+                channels = 3 if frame.format == core.FRAME_FORMAT_RGB24 else 1
+
+                try:
+                    data = self.arenas.arena(robot_id, seq).alloc(frame.height * frame.width * channels)
+                except MemoryError:
+                    # The robot is over its memory budget, so the frame goes
+                    del rows, frame
+                    self.arenas.retire(robot_id, seq)
+                    continue
+
+                if channels == 3:
+                    image = np.frombuffer(data, dtype=np.uint8).reshape(frame.height, frame.width, 3)
+                    cv2.cvtColor(rows[:, :frame.width * 3].reshape(frame.height, frame.width, 3), cv2.COLOR_RGB2BGR,
+                                 dst=image)
+                else:
+                    image = np.frombuffer(data, dtype=np.uint8).reshape(frame.height, frame.width)
+                    np.copyto(image, rows[:, :frame.width])
+                del rows
+
+            # Drop the frame if the producer wrapped around onto it while we copied it out
+            handed_off = False
+            if image is not None and frame.valid():
+                cv2.imshow('Output', image)
+                core.startup_mark('first frame')
+                self.governor.record_latency(robot_id, time.time() - frame.timestamp)
+                handed_off = self.hand_off_faces(robot_id, seq, image, frame.timestamp)
+
+            # Release the views before the next wait
+            del data, image, frame
+
+            # A frame kept by the face coroutine holds its slot, otherwise the next frame reuses it
+            if handed_off:
+                seq += 1
+            else:
+                self.arenas.retire(robot_id, seq)
+
+            # Update window and stop on Q key down
+            if cv2.waitKey(1) == ord('q'):
+                self.stop = True
+
+        self.arenas.forget(robot_id)
+
+    async def replay_video(self, frames, metrics: ReplayMetrics, robot_id: int = 0):
+        """
+        This coroutine runs recorded frames through the pipeline as fast as it
+        can, with no window, for measuring throughput and latency. Frames go
+        the way JPEG frames from the ring do: decoded on the pool, then handed
+        to the face coroutine, and a frame's latency runs until the face
+        coroutine is done with it. The governor is not running, and frames
+        wait for an arena slot rather than being skipped, so every replay does
+        the same work.
+        """
+
+        decoder = core.JpegDecoder()
+
+        # Counts frames taken into the pipeline, picking each one's arena slot
+        seq = 0
+
+        # Set by the face coroutine each time it finishes a frame
+        self.replay = metrics
+        self.face_retired = asyncio.Event()
+
+        metrics.begin()
+
+        for number, data in enumerate(frames):
+            if self.stop:
+                break
+
+            # Wait for the face coroutine to give up a slot
+            while self.face_backlog[robot_id] >= self.arenas.slots:
+                self.face_retired.clear()
+                await self.face_retired.wait()
+
+            frame_time = time.time()
+
+            handed_off = False
+            if self.governor.should_detect(robot_id, number):
+                # The decode runs natively on the pool, so the loop keeps the GIL meanwhile
+                with self.governor.stage(robot_id, 'decode'):
+                    data, width, height = await self.scheduler.decode(decoder, data,
+                                                                      scale=self.governor.detect_scale(robot_id),
+                                                                      gray=True,
+                                                                      frame_time=frame_time)
+                image = memoryview(data).cast('B', (height, width))
+                core.startup_mark('first frame')
+                handed_off = self.hand_off_faces(robot_id, seq, image, frame_time)
+                del image
+
+            del data
+
+            # A frame kept by the face coroutine holds its slot, and is measured once it is done there
+            if handed_off:
+                seq += 1
+            else:
+                self.arenas.retire(robot_id, seq)
+                metrics.record(time.time() - frame_time)
+
+        # Wait for the face coroutine to finish the frames in flight
+        while self.face_backlog[robot_id]:
+            self.face_retired.clear()
+            await self.face_retired.wait()
+
+        metrics.finish()
+        self.stop = True
+
+    def hand_off_faces(self, robot_id: int, seq: int, image, frame_time: float) -> bool:
+        """
+        Hand a frame to the face coroutine, which retires its arena slot once
+        done with it.
+
+        :return: True if handed off, or False if the face queue is full or closed
+        """
+
+        handle = self._next_face_handle
+        self._next_face_handle += 1
+
+        self.face_frames[handle] = (robot_id, seq, image, frame_time)
+
+        try:
+            pushed = self.faces.push(handle, timeout=0)
+        except EOFError:
+            pushed = False
+
+        if not pushed:
+            del self.face_frames[handle]
+            return False
+
+        self.face_backlog[robot_id] += 1
+        return True
+
     async def demo_faces(self):
         """
         This coroutine is designed to take its time handling faces. It will not
         bring the video coroutine above down in this demo, and it likewise will
         not bring Cozmo down in production.
+
+        Frames arrive as handles on a native queue, so a burst of them costs
+        one loop wakeup. It finishes once the queue is closed and drained.
         """
 
-        while not self.stop:
-            # Yield control
-            await asyncio.sleep(0)
+        reader = AsyncHandleReader(self.faces)
+
+        try:
+            while True:
+                try:
+                    handles = await reader.get_many()
+                except EOFError:
+                    break
+
+                for handle in handles:
+                    robot_id, seq, image, frame_time = self.face_frames.pop(handle)
+
+                    # The frame's faces, as columns in the frame's arena
+                    # A detector appends to these; until one runs on the frame they stay empty
+                    detections = core.Detections(arena=self.arenas.arena(robot_id, seq))
+
+                    # Score the faces on the pool, and keep those worth embedding, best first
+                    if len(detections) and image.ndim == 2:
+                        scores = await self.scheduler.score(self.quality, image, detections, frame_time=frame_time)
+                        order = sorted((i for i, s in enumerate(scores) if s.score > 0), key=lambda i: -scores[i].score)
+                        detections = detections.select(array.array('q', order))
+
+                    # A robot with someone in front of it keeps its detection budget longest
+                    if len(detections):
+                        self.face_seen[robot_id] = frame_time
+                    engaged = frame_time - self.face_seen.get(robot_id, float('-inf')) < ENGAGED_HOLD
+                    self.governor.set_priority(robot_id, PRIORITY_ENGAGED if engaged else PRIORITY_WATCHING)
+
+                    # Release the faces and the image, then the frame's slot
+                    del detections, image
+                    self.face_backlog[robot_id] -= 1
+                    self.arenas.retire(robot_id, seq)
+
+                    # A replayed frame is done here
+                    if self.replay is not None:
+                        self.replay.record(time.time() - frame_time)
+                        self.face_retired.set()
+        finally:
+            reader.close()
+
+    def write_memory_report(self):
+        """
+        Write this process's memory report, with each robot's share, for
+        stats memory --pid.
+        """
+
+        write_report(report(robots=self.arenas.usage()))
+
+    def on_friend_recognized(self, robot_id: int, track_id: int, friend_id: int, confidence: float):
+        """
+        Note that a robot recognized a friend. Cheap enough to call per frame;
+        repeats on the same track are collapsed natively.
+        """
+
+        if self.encounters is not None:
+            self.encounters.record(friend_id, robot_id, track_id, confidence)
 
     def main(self) -> int:
         """
         The main method.
         """
 
+        core.startup_mark('entry point')
+
+        # Load video dependencies while the connections below are set up
+        # Headless replay does not need them
+        if not self.args.get('replay'):
+            self.modules = Preloader('numpy', 'cv2')
+
         # Get event loop for this thread
         loop = asyncio.get_event_loop()
 
+        # Route native completions (SQL results, etc.) back to the loop
+        dispatcher = CompletionDispatcher(loop)
+
+        # Per-frame work from every robot shares one work-stealing pool
+        self.scheduler = TaskScheduler(dispatcher)
+
+        # Frames go from the video coroutines to the face coroutine through here
+        self.faces = core.HandleQueue(64)
+
+        # Connect to the database, if configured
+        if self.args.get('sql_host'):
+            self.sql = AsyncSqlClient(dispatcher,
+                                      host=self.args['sql_host'],
+                                      user=self.args.get('sql_user'),
+                                      password=self.args.get('sql_pass'),
+                                      database=self.args.get('sql_db'))
+
+            # Encounters are batched and written behind on their own connection
+            self.encounters = core.EncounterLog(host=self.args['sql_host'],
+                                                user=self.args.get('sql_user'),
+                                                password=self.args.get('sql_pass'),
+                                                database=self.args.get('sql_db'))
+
+        # Load known friends (nothing here enrolls new ones yet; Enrollment.offer and enroll are not wired in)
+        self.enrollment = Enrollment(self.friends, self.sql)
+        loop.run_until_complete(self.enrollment.load())
+
+        # Publish what was loaded, and keep folding in logged changes
+        future_compactor = None
+        if self.args.get('friend_snapshot'):
+            self.compactor = SnapshotCompactor(self.friends)
+            loop.run_until_complete(self.compactor.step(force=True))
+            future_compactor = asyncio.ensure_future(self.compactor.run(), loop=loop)
+
+        # Replay recorded frames, take frames from the robot SDK process, or capture from a local camera
+        ring = None
+        replay = None
+        if self.args.get('replay'):
+            replay = ReplayMetrics()
+            video = self.replay_video(load_frames(self.args['replay']), replay)
+        elif self.args.get('frame_ring'):
+            ring = core.FrameRing(self.args['frame_ring'])
+            video = self.ring_video(ring)
+        else:
+            video = self.demo_video()
+
+        core.startup_mark('connections')
+
         # Call our demo coroutines and set them up for running on the loop
-        future_demo_video = asyncio.ensure_future(self.demo_video(), loop=loop)
+        future_demo_video = asyncio.ensure_future(video, loop=loop)
         future_demo_faces = asyncio.ensure_future(self.demo_faces(), loop=loop)
 
+        # The face coroutine finishes what it was handed, then stops, once the video ends
+        future_demo_video.add_done_callback(lambda _: self.faces.close())
+
+        # The governor would make replays differ from run to run
+        future_governor = None
+        if replay is None:
+            future_governor = asyncio.ensure_future(self.governor.run(), loop=loop)
+
+        future_watchdog = asyncio.ensure_future(self.watchdog.run(), loop=loop)
+
+        # Serve memory reports to stats memory --pid, starting with one that says this process serves them
+        self.write_memory_report()
+        loop.add_signal_handler(REPORT_SIGNAL, self.write_memory_report)
+
         # Bundle the coroutines together so we can treat them like one
         future_demo = asyncio.gather(future_demo_video, future_demo_faces)
 
         # Run the loop until the demo is done
         # This blocks on the main thread of the program
         loop.run_until_complete(future_demo)
-        return 0
+
+        # Let the governor finish its last step
+        if future_governor is not None:
+            self.governor.stop()
+            loop.run_until_complete(future_governor)
+
+        self.watchdog.stop()
+        loop.run_until_complete(future_watchdog)
+
+        # Fold this process's log into the snapshot before leaving
+        if future_compactor is not None:
+            self.compactor.stop()
+            loop.run_until_complete(future_compactor)
+
+        # Report the replay, and fail if it missed the baseline
+        status = 0
+        if replay is not None:
+            result = replay.result()
+            result['governor'] = self.governor.metrics()
+            result['watchdog'] = self.watchdog.metrics()
+            result['memory'] = report(limit=5, robots=self.arenas.usage())
+            result['memory']['native_peak_mb'] = peak_mb(result['memory'])
+            write_metrics(result, self.args.get('metrics'))
+
+            if self.args.get('baseline'):
+                with open(self.args['baseline']) as file:
+                    misses = check_baseline(result, json.load(file))
+
+                for miss in misses:
+                    print('replay missed baseline: {}'.format(miss), file=sys.stderr)
+                if misses:
+                    status = 1
+
+        # Stop saying this process serves reports before it stops serving them
+        remove_report()
+        loop.remove_signal_handler(REPORT_SIGNAL)
+
+        if ring is not None:
+            ring.close()
+        self.placement.close()
+        self.scheduler.close()
+        self.watchdog.close()
+        if self.encounters is not None:
+            self.encounters.close()
+        if self.sql is not None:
+            self.sql.close()
+        dispatcher.close()
+        return status
@@ -0,0 +1,131 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import ctypes
+import ctypes.util
+import os
+
+# Frame formats (see enum frame_format)
+FRAME_FORMAT_UNKNOWN = 0
+FRAME_FORMAT_GRAY8 = 1
+FRAME_FORMAT_RGB24 = 2
+FRAME_FORMAT_JPEG = 3
+
+
+class _FrameInfo(ctypes.Structure):
+    """
+    Mirror of struct frame_info.
+    """
+
+    _fields_ = [
+        ('number', ctypes.c_uint64),
+        ('timestamp', ctypes.c_double),
+        ('width', ctypes.c_uint32),
+        ('height', ctypes.c_uint32),
+        ('stride', ctypes.c_uint32),
+        ('format', ctypes.c_uint32),
+        ('len', ctypes.c_uint32),
+    ]
+
+
+def _load_library() -> ctypes.CDLL:
+    # An explicit path wins, then the usual library search
+    path = os.environ.get('COZMO_FRAMES_LIBRARY') or ctypes.util.find_library('cozmo_frames') or 'libcozmo_frames.so'
+    lib = ctypes.CDLL(path)
+
+    lib.frame_producer_open.argtypes = [ctypes.c_char_p, ctypes.c_uint32, ctypes.c_uint32]
+    lib.frame_producer_open.restype = ctypes.c_void_p
+
+    lib.frame_producer_close.argtypes = [ctypes.c_void_p]
+    lib.frame_producer_close.restype = None
+
+    lib.frame_producer_acquire.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_size_t)]
+    lib.frame_producer_acquire.restype = ctypes.c_void_p
+
+    lib.frame_producer_commit.argtypes = [ctypes.c_void_p, ctypes.POINTER(_FrameInfo)]
+    lib.frame_producer_commit.restype = ctypes.c_uint64
+
+    lib.frame_producer_publish_jpeg.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_int,
+                                                ctypes.c_int, ctypes.c_double]
+    lib.frame_producer_publish_jpeg.restype = ctypes.c_int
+
+    return lib
+
+
+class FrameProducer:
+    """
+    Publishes frames into a shared-memory frame ring for cozmo to consume.
+
+    This runs in the robot SDK process, which does not embed the core module,
+    so it binds the producer library with ctypes. Only one producer may publish
+    to a ring. Consumers attach by name with core.FrameRing.
+    """
+
+    def __init__(self, name: str, num_slots: int = 8, slot_size: int = 320 * 240 * 3):
+        self._lib = _load_library()
+        self._ring = self._lib.frame_producer_open(name.encode(), num_slots, slot_size)
+        if not self._ring:
+            raise OSError('failed to create frame ring {}'.format(name))
+
+        self.name = name
+        self.slot_size = slot_size
+
+    def acquire(self) -> memoryview:
+        """
+        Get the slot for the next frame, to be filled in place (e.g. by a
+        numpy array over it) and then passed to commit.
+
+        :return: A writable view of the slot
+        """
+
+        capacity = ctypes.c_size_t()
+        address = self._lib.frame_producer_acquire(self._ring, ctypes.byref(capacity))
+        return memoryview((ctypes.c_char * capacity.value).from_address(address)).cast('B')
+
+    def commit(self, length: int, width: int, height: int, stride: int, format: int, timestamp: float) -> int:
+        """
+        Publish the frame written into the acquired slot.
+
+        :return: The frame number
+        """
+
+        info = _FrameInfo(0, timestamp, width, height, stride, format, length)
+        return self._lib.frame_producer_commit(self._ring, ctypes.byref(info))
+
+    def publish(self, data, width: int, height: int, stride: int, format: int, timestamp: float) -> int:
+        """
+        Copy a frame into the ring.
+
+        :param data: The frame data (any bytes-like object)
+        :return: The frame number
+        """
+
+        data = memoryview(data).cast('B')
+        if len(data) > self.slot_size:
+            raise ValueError('frame of {} bytes exceeds slot size {}'.format(len(data), self.slot_size))
+
+        self.acquire()[:len(data)] = data
+        return self.commit(len(data), width, height, stride, format, timestamp)
+
+    def publish_jpeg(self, data: bytes, timestamp: float, scale: int = 1, gray: bool = True):
+        """
+        Decode a JPEG frame (e.g. from an MJPEG camera) straight into the ring,
+        scaled down by 1, 2, 4 or 8 in the DCT domain.
+
+        To let the consumer decode full-resolution face crops later, publish
+        the JPEG unchanged with publish(..., FRAME_FORMAT_JPEG, ...) instead.
+        """
+
+        if self._lib.frame_producer_publish_jpeg(self._ring, data, len(data), scale, int(gray), timestamp):
+            raise ValueError('failed to decode frame')
+
+    def close(self):
+        """
+        Close and unlink the ring. Attached consumers see it close.
+        """
+
+        if self._ring:
+            self._lib.frame_producer_close(self._ring)
+            self._ring = None
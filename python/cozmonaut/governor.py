@@ -0,0 +1,319 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import asyncio
+import collections
+import time
+from contextlib import contextmanager
+from typing import Dict, List, Optional, Tuple
+
+# The quality ladder, best first, as (detection interval in frames, detection scale denominator)
+# Scales match the DCT-domain JPEG scales, so a lower resolution is also a cheaper decode
+LADDER: List[Tuple[int, int]] = [
+    (1, 1),
+    (1, 2),
+    (2, 2),
+    (2, 4),
+    (3, 4),
+    (4, 4),
+    (4, 8),
+    (6, 8),
+    (8, 8),
+]
+
+# Robot priorities
+PRIORITY_IDLE = 0
+PRIORITY_WATCHING = 1
+PRIORITY_ENGAGED = 2
+
+# The worst ladder level each priority may be pushed to
+# Robots engaged with a person keep the budget for as long as possible
+_LEVEL_CAP = {
+    PRIORITY_IDLE: len(LADDER) - 1,
+    PRIORITY_WATCHING: len(LADDER) - 2,
+    PRIORITY_ENGAGED: 3,
+}
+
+
+class _Window:
+    """
+    A sliding window of latency samples.
+    """
+
+    def __init__(self, size: int):
+        self.samples = collections.deque(maxlen=size)
+
+    def add(self, seconds: float):
+        self.samples.append(seconds)
+
+    def clear(self):
+        self.samples.clear()
+
+    def __len__(self) -> int:
+        return len(self.samples)
+
+    def quantile(self, q: float) -> Optional[float]:
+        if not self.samples:
+            return None
+
+        ordered = sorted(self.samples)
+        return ordered[min(len(ordered) - 1, int(q * len(ordered)))]
+
+
+class _Robot:
+    """
+    The governor's view of one robot.
+    """
+
+    def __init__(self, robot_id: int, window: int):
+        self.robot_id = robot_id
+        self.priority = PRIORITY_WATCHING
+        self.level = 0
+        self.stages: Dict[str, _Window] = collections.defaultdict(lambda: _Window(window))
+        self.latency = _Window(window)
+        self.upgrades = 0
+        self.downgrades = 0
+
+
+class Governor:
+    """
+    Holds recognition latency at a target by trading away detection work.
+
+    Each robot sits on a quality ladder of detection interval and detection
+    input scale. A control loop compares recognition latency (capture to
+    result) and CPU headroom against their targets. When over budget, it
+    moves the lowest-priority robot one step down the ladder. When comfortably
+    under, it moves the highest-priority degraded robot one step up. So
+    overload degrades idle robots first and engaged robots last, instead of
+    everyone at once.
+
+    Robots share the CPU, so any level change makes every latency window
+    stale. The windows are cleared on each change, and a robot is judged again
+    only once it has enough fresh samples; otherwise the loop would keep acting
+    on latencies from before its last decision and overshoot.
+    """
+
+    def __init__(self, target_latency: float = 0.15, min_headroom: float = 0.1, period: float = 0.5,
+                 window: int = 64, settle: int = 16):
+        """
+        :param target_latency: The recognition latency to hold, in seconds
+        :param min_headroom: The host-wide CPU headroom (fraction of all cores left idle) to keep free
+        :param period: The control loop period, in seconds
+        :param window: The number of latency samples to judge by
+        :param settle: The number of fresh latency samples a robot needs after a level change to be judged
+        """
+
+        self.target_latency = target_latency
+        self.min_headroom = min_headroom
+        self.period = period
+        self.window = window
+        self.settle = min(settle, window)
+
+        self._robots: Dict[int, _Robot] = {}
+        self._decisions = collections.deque(maxlen=32)
+        self._headroom = 1.0
+        self._last_cpu = None
+        self._stop = False
+
+    def _robot(self, robot_id: int) -> _Robot:
+        robot = self._robots.get(robot_id)
+        if robot is None:
+            robot = _Robot(robot_id, self.window)
+            self._robots[robot_id] = robot
+        return robot
+
+    def set_priority(self, robot_id: int, priority: int):
+        """
+        Set a robot's priority (one of the PRIORITY_* constants).
+        """
+
+        robot = self._robot(robot_id)
+        robot.priority = priority
+
+        # An engaged robot gets its budget back right away
+        cap = _LEVEL_CAP[priority]
+        if robot.level > cap:
+            self._decide(robot, cap, 'priority raised')
+
+    def forget(self, robot_id: int):
+        """
+        Stop governing a robot that has gone away.
+        """
+
+        self._robots.pop(robot_id, None)
+
+    def should_detect(self, robot_id: int, frame_number: int) -> bool:
+        """
+        Decide whether to run detection on a frame.
+        """
+
+        interval, _ = LADDER[self._robot(robot_id).level]
+        return frame_number % interval == 0
+
+    def detect_scale(self, robot_id: int) -> int:
+        """
+        Get the scale denominator for a robot's detection input.
+        """
+
+        _, scale = LADDER[self._robot(robot_id).level]
+        return scale
+
+    def record(self, robot_id: int, stage: str, seconds: float):
+        """
+        Record how long a pipeline stage took.
+        """
+
+        self._robot(robot_id).stages[stage].add(seconds)
+
+    def record_latency(self, robot_id: int, seconds: float):
+        """
+        Record a recognition latency (frame capture to result).
+        """
+
+        self._robot(robot_id).latency.add(seconds)
+
+    @contextmanager
+    def stage(self, robot_id: int, name: str):
+        """
+        Time a pipeline stage.
+        """
+
+        start = time.perf_counter()
+        try:
+            yield
+        finally:
+            self.record(robot_id, name, time.perf_counter() - start)
+
+    def step(self):
+        """
+        Run one control decision. The run task calls this every period.
+        """
+
+        self._headroom = self._measure_headroom()
+
+        # Only robots with enough samples since the last level change have a say
+        latencies = [r.latency.quantile(0.9) for r in self._robots.values() if len(r.latency) >= self.settle]
+        if not latencies:
+            return
+
+        worst = max(latencies)
+
+        if worst > self.target_latency or self._headroom < self.min_headroom:
+            # Over budget, so shed work from the least important robot that can still give some
+            candidates = [r for r in self._robots.values() if r.level < _LEVEL_CAP[r.priority]]
+            if candidates:
+                robot = min(candidates, key=lambda r: (r.priority, -r.level))
+                reason = 'latency {:.0f} ms over target'.format(worst * 1e3) \
+                    if worst > self.target_latency else 'headroom {:.0%}'.format(self._headroom)
+                self._decide(robot, robot.level + 1, reason)
+        elif worst < 0.7 * self.target_latency and self._headroom > 2 * self.min_headroom:
+            # Comfortably under, so give work back to the most important degraded robot
+            candidates = [r for r in self._robots.values() if r.level > 0]
+            if candidates:
+                robot = max(candidates, key=lambda r: (r.priority, r.level))
+                self._decide(robot, robot.level - 1, 'latency {:.0f} ms under target'.format(worst * 1e3))
+
+    async def run(self):
+        """
+        Run the control loop until stopped.
+        """
+
+        while not self._stop:
+            self.step()
+            await asyncio.sleep(self.period)
+
+    def stop(self):
+        """
+        Stop the control loop.
+        """
+
+        self._stop = True
+
+    def metrics(self) -> dict:
+        """
+        Get the governor's state and recent decisions.
+        """
+
+        def ms(value):
+            return None if value is None else value * 1e3
+
+        robots = {}
+        for robot in self._robots.values():
+            interval, scale = LADDER[robot.level]
+            robots[robot.robot_id] = {
+                'priority': robot.priority,
+                'level': robot.level,
+                'detect_interval': interval,
+                'detect_scale': scale,
+                'latency_p50_ms': ms(robot.latency.quantile(0.5)),
+                'latency_p90_ms': ms(robot.latency.quantile(0.9)),
+                'stages_p90_ms': {name: ms(w.quantile(0.9)) for name, w in robot.stages.items()},
+                'upgrades': robot.upgrades,
+                'downgrades': robot.downgrades,
+            }
+
+        return {
+            'target_latency_ms': self.target_latency * 1e3,
+            'headroom': self._headroom,
+            'robots': robots,
+            'decisions': list(self._decisions),
+        }
+
+    def _decide(self, robot: _Robot, level: int, reason: str):
+        if level == robot.level:
+            return
+
+        if level > robot.level:
+            robot.downgrades += 1
+        else:
+            robot.upgrades += 1
+
+        self._decisions.append({
+            'time': time.time(),
+            'robot_id': robot.robot_id,
+            'from': robot.level,
+            'to': level,
+            'reason': reason,
+        })
+
+        robot.level = level
+
+        # Latencies from before the change no longer say anything about the load
+        for other in self._robots.values():
+            other.latency.clear()
+
+    def _measure_headroom(self) -> float:
+        # The share of all cores the whole host left idle since the last step
+        # Other processes (other cozmo go shards included) count, since they take the same cores
+        now = _host_cpu_times()
+
+        last, self._last_cpu = self._last_cpu, now
+        if now is None or last is None or now[1] <= last[1]:
+            return self._headroom
+
+        return max(0.0, min(1.0, (now[0] - last[0]) / (now[1] - last[1])))
+
+
+def _host_cpu_times() -> Optional[Tuple[int, int]]:
+    """
+    Read the host's idle and total CPU time (in clock ticks, summed over all
+    cores) from /proc/stat.
+
+    :return: An (idle, total) tuple, or None if unavailable
+    """
+
+    try:
+        with open('/proc/stat') as file:
+            fields = file.readline().split()
+    except OSError:
+        return None
+
+    if len(fields) < 5 or fields[0] != 'cpu':
+        return None
+
+    # user nice system idle iowait irq softirq steal (guest time is already in user and nice)
+    ticks = [int(value) for value in fields[1:9]]
+    idle = ticks[3] + ticks[4]
+    return idle, sum(ticks)
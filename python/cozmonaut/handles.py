@@ -0,0 +1,104 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import asyncio
+import collections
+from typing import List
+
+from core import HandleQueue
+
+
+class AsyncHandleReader:
+    """
+    Pops handles from a native handle queue on the event loop.
+
+    The queue's eventfd is registered with the loop once. While coroutines are
+    waiting, the queue is armed so the next push signals it; one wakeup then
+    hands out as many handles as there are waiters, so a burst of pushes costs
+    one loop iteration rather than one per handle. Producers on other threads
+    never touch the loop or the GIL to hand a handle over.
+    """
+
+    def __init__(self, queue: HandleQueue, loop: asyncio.AbstractEventLoop = None):
+        self.queue = queue
+        self.loop = loop or asyncio.get_event_loop()
+        self._waiters = collections.deque()
+
+        self.loop.add_reader(self.queue.fileno(), self._on_readable)
+
+    async def get(self) -> int:
+        """
+        Pop the oldest handle, waiting without blocking the loop.
+
+        :return: The handle
+        :raises EOFError: Once the queue is closed and empty
+        """
+
+        handles = await self.get_many(1)
+        return handles[0]
+
+    async def get_many(self, max: int = 64) -> List[int]:
+        """
+        Pop up to max handles once at least one is available.
+
+        :param max: The most handles wanted
+        :return: The handles, oldest first
+        :raises EOFError: Once the queue is closed and empty
+        """
+
+        # Skip the loop entirely when handles are already waiting and no one is ahead
+        if not self._waiters:
+            handles = self.queue.pop_many(max, timeout=0)
+            if handles:
+                return handles
+
+        future = self.loop.create_future()
+        self._waiters.append((future, max))
+        self._arm()
+        return await future
+
+    def close(self):
+        """
+        Stop watching the queue. Waiting coroutines are cancelled.
+        """
+
+        self.loop.remove_reader(self.queue.fileno())
+
+        for future, _ in self._waiters:
+            future.cancel()
+        self._waiters.clear()
+
+    def _arm(self):
+        # A push may have slipped in before arming, so look again right away
+        if self.queue.arm():
+            self.loop.call_soon(self._on_readable)
+
+    def _on_readable(self):
+        self.queue.clear()
+
+        while self._waiters:
+            future, max = self._waiters[0]
+            if future.done():
+                self._waiters.popleft()
+                continue
+
+            try:
+                handles = self.queue.pop_many(max, timeout=0)
+            except EOFError as e:
+                # Closed and drained, so nobody will ever get anything
+                for future, _ in self._waiters:
+                    if not future.done():
+                        future.set_exception(EOFError(str(e)))
+                self._waiters.clear()
+                return
+
+            if not handles:
+                break
+
+            self._waiters.popleft()
+            future.set_result(handles)
+
+        if self._waiters:
+            self._arm()
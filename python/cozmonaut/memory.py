@@ -0,0 +1,280 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import json
+import os
+import resource
+import signal
+import sys
+import tempfile
+import time
+import tracemalloc
+from typing import Dict, Tuple
+
+import core
+
+# The signal that makes a running interact process write its memory report
+REPORT_SIGNAL = signal.SIGUSR1
+
+# The native tags that can be budgeted per robot (each robot's frame arenas)
+ROBOT_TAGS = {'arena'}
+
+
+def _process() -> dict:
+    """
+    Get the process resident set size and its high-water mark, in bytes.
+    """
+
+    result = {'rss': None, 'rss_peak': resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024}
+
+    try:
+        with open('/proc/self/status') as file:
+            for line in file:
+                if line.startswith('VmRSS:'):
+                    result['rss'] = int(line.split()[1]) * 1024
+    except OSError:
+        pass
+
+    return result
+
+
+def _sites(snapshot, domain: int, limit: int) -> list:
+    """
+    Get the Python lines behind the most memory traced in one domain.
+    """
+
+    stats = snapshot.filter_traces([tracemalloc.DomainFilter(True, domain)]).statistics('lineno')
+    return [{
+        'site': '{}:{}'.format(stat.traceback[0].filename, stat.traceback[0].lineno),
+        'bytes': stat.size,
+        'count': stat.count,
+    } for stat in stats[:limit]]
+
+
+def report(limit: int = 10, robots: dict = None) -> dict:
+    """
+    Break this process's memory down.
+
+    Native memory is counted by subsystem tag, as heap and mapped bytes with
+    the high-water mark of each. While tracemalloc is tracing, the Python lines
+    behind the most Python memory, and behind the most native memory of each
+    tag, are listed too; a site that keeps growing between reports is a leak.
+
+    :param limit: The most allocation sites to list per domain
+    :param robots: The memory held for each robot, as from FrameArenas.usage()
+    :return: The report
+    """
+
+    # Tags come in order, so the nth is traced in the nth domain
+    native = core.memory_stats()
+
+    result = {
+        'native': native,
+        'native_bytes': sum(tag['bytes'] + tag['mapped'] for tag in native.values()),
+        'process': _process(),
+        'python': {'blocks': sys.getallocatedblocks()},
+        'pid': os.getpid(),
+        'robots': {str(robot_id): usage for robot_id, usage in (robots or {}).items()},
+    }
+
+    if tracemalloc.is_tracing():
+        current, peak = tracemalloc.get_traced_memory()
+        snapshot = tracemalloc.take_snapshot()
+
+        result['python'].update({
+            'traced': current,
+            'traced_peak': peak,
+            'sites': _sites(snapshot, 0, limit),
+        })
+
+        result['native_sites'] = {
+            tag: _sites(snapshot, core.MEMORY_TRACE_DOMAIN + i, limit) for i, tag in enumerate(native)
+        }
+
+    return result
+
+
+def peak_mb(result: dict) -> dict:
+    """
+    Get the high-water mark of each native tag (heap and mapped), in MiB.
+    """
+
+    return {tag: (stats['peak'] + stats['mapped_peak']) / (1 << 20) for tag, stats in result['native'].items()}
+
+
+def parse_budget(text: str) -> Tuple[Dict[str, float], Dict[int, Dict[str, float]]]:
+    """
+    Parse native memory budgets.
+
+    A budget without a robot holds the whole process to it. A budget with a
+    robot ID holds just that robot's share of a tag, for the tags in
+    ROBOT_TAGS.
+
+    :param text: The budgets, as "[robot:]tag=mib,..." (e.g. "jpeg=16,0:arena=32,1:arena=8")
+    :return: The most MiB for each tag, and for each robot the most MiB for each tag
+    """
+
+    tags = {}
+    robots = {}
+    for item in filter(None, text.split(',')):
+        key, sep, mb = item.partition('=')
+        if not sep:
+            raise ValueError('malformed memory budget: {}'.format(item))
+
+        robot, sep, tag = key.strip().rpartition(':')
+        if not sep:
+            tags[tag] = float(mb)
+        elif tag in ROBOT_TAGS:
+            robots.setdefault(int(robot), {})[tag] = float(mb)
+        else:
+            raise ValueError('tag cannot be budgeted per robot: {}'.format(tag))
+
+    return tags, robots
+
+
+def set_budget(budget: dict):
+    """
+    Hold native tags to a budget. An allocation that would take a tag over
+    its budget fails as if out of memory, so a leak shows up as errors in one
+    subsystem rather than the host running out of memory.
+
+    :param budget: The most MiB for each tag (zero to lift a budget)
+    """
+
+    for tag, mb in budget.items():
+        core.memory_limit(tag, int(mb * (1 << 20)))
+
+
+def report_path(pid: int) -> str:
+    """
+    Get where a process writes its memory report.
+    """
+
+    return os.path.join(tempfile.gettempdir(), 'cozmo-{}.memory.json'.format(pid))
+
+
+def write_report(result: dict):
+    """
+    Write this process's memory report where stats memory --pid looks for it.
+    The file is replaced whole, so a reader never sees half a report.
+    """
+
+    path = report_path(os.getpid())
+    with open(path + '.tmp', 'w') as file:
+        json.dump(result, file)
+    os.replace(path + '.tmp', path)
+
+
+def remove_report():
+    """
+    Remove this process's memory report.
+    """
+
+    try:
+        os.remove(report_path(os.getpid()))
+    except OSError:
+        pass
+
+
+def request_report(pid: int, timeout: float = 5.0) -> dict:
+    """
+    Get a fresh memory report from a running interact process.
+
+    The process writes its report once when it starts, so a missing report
+    means it would not handle the signal (and would die of it).
+
+    :param pid: The process ID
+    :param timeout: How long to wait for the report, in seconds
+    :return: The report
+    """
+
+    path = report_path(pid)
+    try:
+        before = os.stat(path).st_mtime_ns
+    except OSError:
+        raise ValueError('process {} does not serve memory reports'.format(pid))
+
+    os.kill(pid, REPORT_SIGNAL)
+
+    deadline = time.monotonic() + timeout
+    while True:
+        try:
+            if os.stat(path).st_mtime_ns != before:
+                with open(path) as file:
+                    return json.load(file)
+        except OSError:
+            pass
+
+        if time.monotonic() > deadline:
+            raise TimeoutError('process {} did not write its memory report'.format(pid))
+
+        time.sleep(0.02)
+
+
+def _mb(n) -> str:
+    return '-' if n is None else '{:.1f}'.format(n / (1 << 20))
+
+
+def print_report(fmt: str = 'text', limit: int = 10, pid: int = 0) -> int:
+    """
+    Print the memory report.
+
+    :param fmt: The format (text or json)
+    :param limit: The most allocation sites to list per domain
+    :param pid: The running interact process to report on, or zero for this one
+    :return: The exit status
+    """
+
+    if pid:
+        try:
+            result = request_report(pid)
+        except (OSError, TimeoutError, ValueError) as e:
+            print(e, file=sys.stderr)
+            return 1
+    else:
+        result = report(limit)
+
+    if fmt == 'json':
+        print(json.dumps(result, indent=2, sort_keys=True))
+        return 0
+
+    print('{:<12} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>9}'.format(
+        'tag', 'heap_mb', 'peak_mb', 'mapped_mb', 'mpeak_mb', 'limit_mb', 'live', 'failures'))
+
+    for tag, stats in result['native'].items():
+        print('{:<12} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>9}'.format(
+            tag, _mb(stats['bytes']), _mb(stats['peak']), _mb(stats['mapped']), _mb(stats['mapped_peak']),
+            _mb(stats['limit'] or None), stats['live'], stats['failures']))
+
+    process = result['process']
+    print()
+    print('pid {}: native {} MiB, rss {} MiB (peak {} MiB), {} python blocks'.format(
+        result['pid'], _mb(result['native_bytes']), _mb(process['rss']), _mb(process['rss_peak']),
+        result['python']['blocks']))
+
+    if result['robots']:
+        print()
+        print('{:<12} {:>10} {:>10} {:>10}'.format('robot', 'arena_mb', 'peak_mb', 'budget_mb'))
+        for robot_id, usage in sorted(result['robots'].items(), key=lambda item: int(item[0])):
+            print('{:<12} {:>10} {:>10} {:>10}'.format(robot_id, _mb(usage['bytes']), _mb(usage['peak']),
+                                                       _mb(usage['budget'] or None)))
+
+    if 'traced' not in result['python']:
+        print('set PYTHONTRACEMALLOC=1 to see the python lines behind this memory')
+        return 0
+
+    print('tracemalloc {} MiB (peak {} MiB)'.format(_mb(result['python']['traced']),
+                                                    _mb(result['python']['traced_peak'])))
+
+    sections = [('python', result['python']['sites'])]
+    sections += [(tag, sites) for tag, sites in result['native_sites'].items() if sites]
+
+    for name, sites in sections:
+        print()
+        print('top {} sites:'.format(name))
+        for site in sites[:limit]:
+            print('  {:>10} KiB {:>8}  {}'.format('{:.1f}'.format(site['bytes'] / 1024), site['count'], site['site']))
+
+    return 0
@@ -0,0 +1,128 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import concurrent.futures
+
+from core import Arena, Placement, Topology
+
+
+class RobotPlacement:
+    """
+    Places each robot's pipeline on the CPUs of one L3 domain.
+
+    A robot's capture, preprocess and detect stages hand the same frame from
+    thread to thread, so keeping those threads under one L3 cache lets each
+    stage find the frame still in cache. Each robot gets its own executor
+    whose threads are pinned to its placement, and its frame arenas come from
+    the NUMA node that placement sits on.
+
+    Robots are placed in order of arrival. With the "none" policy nothing is
+    pinned and everything is left to the kernel, as before.
+    """
+
+    def __init__(self, policy: str = None, threads: int = 3, topology: Topology = None):
+        self.policy = policy or 'none'
+        self.threads = threads
+        self.topology = topology or Topology()
+
+        # Fail on a bad policy now rather than when the first robot arrives
+        self.topology.place(0, self.policy, self.threads)
+
+        self._placements = {}
+        self._executors = {}
+
+    def placement(self, robot_id: int) -> Placement:
+        """
+        Get where a robot's pipeline goes, placing it on first use.
+
+        :param robot_id: The robot ID
+        :return: The placement
+        """
+
+        placement = self._placements.get(robot_id)
+        if placement is None:
+            placement = self.topology.place(len(self._placements), self.policy, self.threads)
+            self._placements[robot_id] = placement
+
+        return placement
+
+    def node(self, robot_id: int) -> int:
+        """
+        Get the NUMA node for a robot's buffers.
+
+        :param robot_id: The robot ID
+        :return: The node, or -1 for no preference
+        """
+
+        return self.placement(robot_id).node
+
+    def executor(self, robot_id: int) -> concurrent.futures.ThreadPoolExecutor:
+        """
+        Get the executor for a robot's blocking pipeline stages (waiting on the
+        frame ring, decoding, detecting). Its threads are pinned to the robot's
+        CPUs as they start.
+
+        :param robot_id: The robot ID
+        :return: The executor
+        """
+
+        executor = self._executors.get(robot_id)
+        if executor is None:
+            cpus = self.placement(robot_id).cpus
+            executor = concurrent.futures.ThreadPoolExecutor(max_workers=self.threads,
+                                                             thread_name_prefix='robot-{}'.format(robot_id),
+                                                             initializer=self.topology.pin,
+                                                             initargs=(cpus,))
+            self._executors[robot_id] = executor
+
+        return executor
+
+    def arena(self, robot_id: int, block_size: int = 64 * 1024) -> Arena:
+        """
+        Make an arena whose blocks live on a robot's NUMA node.
+
+        :param robot_id: The robot ID
+        :param block_size: The smallest block to allocate
+        :return: The arena
+        """
+
+        return Arena(block_size=block_size, node=self.node(robot_id))
+
+    def forget(self, robot_id: int):
+        """
+        Shut down the executor of a robot that has gone away. Its placement is
+        kept, so a robot that comes back lands on the same CPUs.
+
+        :param robot_id: The robot ID
+        """
+
+        executor = self._executors.pop(robot_id, None)
+        if executor is not None:
+            executor.shutdown(wait=False)
+
+    def close(self):
+        """
+        Shut down every robot's executor, waiting for running stages.
+        """
+
+        for executor in self._executors.values():
+            executor.shutdown(wait=True)
+        self._executors.clear()
+
+    def metrics(self) -> dict:
+        """
+        Get the placements made so far.
+
+        :return: The placements by robot ID
+        """
+
+        return {
+            'policy': self.policy,
+            'cpus': self.topology.num_cpus,
+            'domains': self.topology.num_domains,
+            'nodes': self.topology.num_nodes,
+            'robots': {robot_id: {'domain': p.domain, 'node': p.node, 'cpus': list(p.cpus)}
+                       for robot_id, p in self._placements.items()},
+        }
@@ -0,0 +1,70 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import asyncio
+import importlib
+import threading
+
+import core
+
+
+class Preloader:
+    """
+    Imports heavy modules (OpenCV, NumPy) on a background thread.
+
+    Importing cv2 alone takes hundreds of milliseconds, most of it loading
+    shared libraries. Started first thing, the imports overlap with connecting
+    to the database and the robots instead of delaying them, and operations
+    that never touch video never pay for them.
+    """
+
+    def __init__(self, *names: str):
+        """
+        :param names: The module names, in import order
+        """
+
+        self.names = names
+        self._modules = {}
+        self._error = None
+
+        self._thread = threading.Thread(target=self._run, name='preload', daemon=True)
+        self._thread.start()
+
+    def _run(self):
+        for name in self.names:
+            try:
+                self._modules[name] = importlib.import_module(name)
+            except BaseException as e:
+                self._error = e
+                return
+
+            core.startup_mark('import ' + name)
+
+    def get(self, *names: str):
+        """
+        Get preloaded modules, waiting for them if need be.
+
+        :param names: The module names
+        :return: The module, or a tuple of modules if given several names
+        """
+
+        self._thread.join()
+
+        if self._error is not None:
+            raise self._error
+
+        modules = tuple(self._modules[name] for name in names)
+        return modules[0] if len(modules) == 1 else modules
+
+    async def wait(self, *names: str):
+        """
+        Get preloaded modules without blocking the event loop.
+
+        :param names: The module names
+        :return: The module, or a tuple of modules if given several names
+        """
+
+        await asyncio.get_event_loop().run_in_executor(None, self._thread.join)
+        return self.get(*names)
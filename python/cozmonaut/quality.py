@@ -0,0 +1,95 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import time
+from typing import Any, Dict, List, Tuple
+
+
+class _Candidate:
+    """
+    The best crop of a track so far in the current window.
+    """
+
+    __slots__ = ('score', 'crop', 'opened')
+
+    def __init__(self, score: float, crop: Any, opened: float):
+        self.score = score
+        self.crop = crop
+        self.opened = opened
+
+
+class BestCropSelector:
+    """
+    Picks one crop per track per time window for the embedder.
+
+    A track yields a crop every frame, nearly all of them alike. Offering each
+    one here with its quality score (see core.FaceQuality) keeps only the best
+    of each window, and crops under the minimum score are never kept, so the
+    embedder sees a few good crops per person instead of every frame.
+    """
+
+    def __init__(self, window: float = 1.0, min_score: float = 0.3):
+        """
+        :param window: How long to collect crops of a track before choosing, in seconds
+        :param min_score: The lowest score worth embedding
+        """
+
+        self.window = window
+        self.min_score = min_score
+        self._tracks: Dict[int, _Candidate] = {}
+        self.offered = 0
+        self.chosen = 0
+
+    def offer(self, track_id: int, score: float, crop: Any, now: float = None):
+        """
+        Offer a crop of a track.
+
+        :param track_id: The track ID
+        :param score: The crop quality score
+        :param crop: Whatever the embedder needs to embed the crop later
+        :param now: The current time (defaults to the monotonic clock)
+        """
+
+        self.offered += 1
+
+        if score < self.min_score:
+            return
+
+        if now is None:
+            now = time.monotonic()
+
+        candidate = self._tracks.get(track_id)
+        if candidate is None:
+            self._tracks[track_id] = _Candidate(score, crop, now)
+        elif score > candidate.score:
+            candidate.score = score
+            candidate.crop = crop
+
+    def due(self, now: float = None) -> List[Tuple[int, float, Any]]:
+        """
+        Take the best crop of each track whose window has closed.
+
+        :param now: The current time (defaults to the monotonic clock)
+        :return: A list of (track ID, score, crop)
+        """
+
+        if now is None:
+            now = time.monotonic()
+
+        ready = [(track_id, c) for track_id, c in self._tracks.items() if now - c.opened >= self.window]
+        for track_id, _ in ready:
+            del self._tracks[track_id]
+
+        self.chosen += len(ready)
+        return [(track_id, c.score, c.crop) for track_id, c in ready]
+
+    def forget(self, track_id: int):
+        """
+        Drop a track that has ended, along with its pending crop.
+
+        Call due() first if an ended track's last crop should still be embedded.
+        """
+
+        self._tracks.pop(track_id, None)
@@ -0,0 +1,127 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import json
+import os
+import resource
+import time
+from typing import List
+
+
+def load_frames(directory: str) -> List[bytes]:
+    """
+    Load a directory of JPEG frames in name order.
+
+    Everything is read up front so disk reads stay out of the measurements.
+
+    :param directory: The directory path
+    :return: The encoded frames
+    """
+
+    names = sorted(name for name in os.listdir(directory) if name.lower().endswith(('.jpg', '.jpeg')))
+    if not names:
+        raise ValueError('no jpeg frames in {}'.format(directory))
+
+    frames = []
+    for name in names:
+        with open(os.path.join(directory, name), 'rb') as file:
+            frames.append(file.read())
+
+    return frames
+
+
+class ReplayMetrics:
+    """
+    Throughput, latency and memory of a headless replay.
+    """
+
+    def __init__(self):
+        self.latencies = []
+        self.start = None
+        self.end = None
+
+    def begin(self):
+        self.start = time.perf_counter()
+
+    def finish(self):
+        self.end = time.perf_counter()
+
+    def record(self, seconds: float):
+        """
+        Record the latency of one frame, from being taken up to its result.
+        """
+
+        self.latencies.append(seconds)
+
+    def result(self) -> dict:
+        """
+        Summarize the replay.
+        """
+
+        def quantile(ordered, q):
+            return ordered[min(len(ordered) - 1, int(q * len(ordered)))] * 1e3 if ordered else None
+
+        ordered = sorted(self.latencies)
+        elapsed = (self.end or time.perf_counter()) - self.start
+
+        return {
+            'frames': len(ordered),
+            'seconds': elapsed,
+            'fps': len(ordered) / elapsed if elapsed > 0 else None,
+            'latency_p50_ms': quantile(ordered, 0.5),
+            'latency_p99_ms': quantile(ordered, 0.99),
+            'latency_max_ms': ordered[-1] * 1e3 if ordered else None,
+
+            # Linux reports the high-water mark in KiB
+            'peak_rss_mb': resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 1024,
+        }
+
+
+def check_baseline(metrics: dict, baseline: dict) -> List[str]:
+    """
+    Check replay metrics against a baseline.
+
+    The baseline may hold min_fps, max_latency_p99_ms, max_peak_rss_mb and
+    max_native_peak_mb (the most MiB each native memory tag may reach, e.g.
+    {"jpeg": 16}). Any it leaves out are not checked.
+
+    :param metrics: The replay metrics (see ReplayMetrics.result)
+    :param baseline: The baseline
+    :return: A description of each miss (empty if none)
+    """
+
+    misses = []
+
+    if 'min_fps' in baseline and (metrics['fps'] or 0) < baseline['min_fps']:
+        misses.append('fps {:.1f} below {}'.format(metrics['fps'] or 0, baseline['min_fps']))
+
+    if 'max_latency_p99_ms' in baseline and metrics['latency_p99_ms'] is not None \
+            and metrics['latency_p99_ms'] > baseline['max_latency_p99_ms']:
+        misses.append('p99 latency {:.2f} ms above {}'.format(metrics['latency_p99_ms'],
+                                                             baseline['max_latency_p99_ms']))
+
+    if 'max_peak_rss_mb' in baseline and metrics['peak_rss_mb'] > baseline['max_peak_rss_mb']:
+        misses.append('peak rss {:.1f} MiB above {}'.format(metrics['peak_rss_mb'], baseline['max_peak_rss_mb']))
+
+    native = metrics.get('memory', {}).get('native_peak_mb', {})
+    for tag, most in sorted(baseline.get('max_native_peak_mb', {}).items()):
+        if native.get(tag, 0) > most:
+            misses.append('{} native peak {:.1f} MiB above {}'.format(tag, native[tag], most))
+
+    return misses
+
+
+def write_metrics(metrics: dict, path: str = None):
+    """
+    Write metrics as JSON to a file, or to stdout if no path is given.
+    """
+
+    text = json.dumps(metrics, indent=2, sort_keys=True)
+
+    if path is None:
+        print(text)
+    else:
+        with open(path, 'w') as file:
+            file.write(text + '\n')
@@ -0,0 +1,104 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+from core import Scheduler
+
+from cozmonaut.completion import CompletionDispatcher
+
+
+class TaskScheduler:
+    """
+    Runs per-frame pipeline work from all robots on one work-stealing pool.
+
+    Work per frame is uneven (a frame with no faces is nearly free, a crowd
+    means dozens of embeddings), so rather than giving each robot threads of
+    its own, every robot's tasks go to a shared pool whose idle workers steal
+    from busy ones. Tasks carrying a frame timestamp run oldest first, so a
+    backlog drains in frame order. Results come back through the completion
+    dispatcher, and per-kind latencies are available from stats().
+    """
+
+    def __init__(self, dispatcher: CompletionDispatcher, workers: int = 0):
+        self.dispatcher = dispatcher
+        self.scheduler = Scheduler(dispatcher.channel, workers=workers)
+
+    async def run(self, fn, *args, frame_time: float = None, kind: str = 'task', **kwargs):
+        """
+        Run a call on the pool.
+
+        The call takes the GIL on its worker, so it should spend its time in
+        native operations that release it (decode, detect, embed, search).
+
+        :param fn: The callable
+        :param args: The positional arguments
+        :param frame_time: The timestamp of the frame the work is for (older runs first), or None for now
+        :param kind: The task kind, for latency stats
+        :param kwargs: The keyword arguments
+        :return: The call's result
+        """
+
+        ticket = self.scheduler.submit(fn, args, kwargs or None, frame_time, kind)
+        return await self.dispatcher.watch(ticket)
+
+    async def decode(self, decoder, data, scale: int = 1, gray: bool = True, frame_time: float = None):
+        """
+        Decode a JPEG image on the pool without taking the GIL.
+
+        :param decoder: The JPEG decoder (busy until the decode finishes)
+        :param data: The compressed data
+        :param scale: The downscale factor (1, 2, 4 or 8)
+        :param gray: Whether to decode to grayscale
+        :param frame_time: The timestamp of the frame the work is for, or None for now
+        :return: A (buffer, width, height) tuple
+        """
+
+        ticket = decoder.decode_async(self.scheduler, data, scale=scale, gray=gray, priority=frame_time)
+        return await self.dispatcher.watch(ticket)
+
+    async def score(self, quality, image, detections, frame_time: float = None):
+        """
+        Score detected faces on the pool without taking the GIL.
+
+        :param quality: The face quality scorer
+        :param image: The grayscale image
+        :param detections: The detections
+        :param frame_time: The timestamp of the frame the work is for, or None for now
+        :return: The scores, as from quality.score_detections()
+        """
+
+        ticket = quality.score_detections_async(self.scheduler, image, detections, priority=frame_time)
+        return await self.dispatcher.watch(ticket)
+
+    async def search(self, index, query, k: int = 1, frame_time: float = None):
+        """
+        Search a friend index on the pool without taking the GIL.
+
+        The index refuses changes until the search finishes.
+
+        :param index: The friend index
+        :param query: The query embedding
+        :param k: The number of matches
+        :param frame_time: The timestamp of the frame the work is for, or None for now
+        :return: The matches, as from index.search()
+        """
+
+        ticket = index.search_async(self.scheduler, query, k=k, priority=frame_time)
+        return await self.dispatcher.watch(ticket)
+
+    def stats(self) -> dict:
+        """
+        Get the steal counters and per-kind latencies (in seconds).
+
+        :return: The stats
+        """
+
+        return self.scheduler.stats()
+
+    def close(self):
+        """
+        Finish queued tasks and stop the workers.
+        """
+
+        self.scheduler.close()
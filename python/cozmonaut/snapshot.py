@@ -0,0 +1,93 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import asyncio
+import sys
+
+from core import FriendIndex
+
+
+class SnapshotCompactor:
+    """
+    Keeps a snapshot-backed friend index compact and current.
+
+    Every cozmo process on a host maps the same friend snapshot, so the
+    embeddings live in the page cache once. Each process logs its own
+    enrollments and removals to a write-ahead log. Now and then this folds the
+    log into a new snapshot generation (off the loop thread, since it writes
+    the whole file), and picks up generations other processes published.
+    """
+
+    def __init__(self, index: FriendIndex, period: float = 30.0, min_pending: int = 64 * 1024):
+        """
+        :param index: The friend index (opened with a snapshot)
+        :param period: How often to check, in seconds
+        :param min_pending: The logged bytes that make a compaction worthwhile
+        """
+
+        self.index = index
+        self.period = period
+        self.min_pending = min_pending
+        self.compactions = 0
+        self.refreshes = 0
+        self._stop = False
+        self._wakeup = None
+
+    async def step(self, force: bool = False):
+        """
+        Pick up a newer snapshot, then compact if enough has been logged.
+
+        :param force: Compact whenever anything is logged
+        """
+
+        loop = asyncio.get_event_loop()
+
+        try:
+            if self.index.refresh():
+                self.refreshes += 1
+
+            pending = self.index.pending
+            if pending >= self.min_pending or (force and pending > 0):
+                await loop.run_in_executor(None, self.index.compact)
+                self.compactions += 1
+        except (OSError, RuntimeError) as e:
+            # The log still has everything, so the next step tries again
+            print('friend snapshot: {}'.format(e), file=sys.stderr)
+
+    async def run(self):
+        """
+        Run until stopped, then fold in whatever is left.
+        """
+
+        # Made here so it belongs to the running loop
+        self._wakeup = asyncio.Event()
+
+        while not self._stop:
+            try:
+                await asyncio.wait_for(self._wakeup.wait(), self.period)
+            except asyncio.TimeoutError:
+                pass
+
+            if not self._stop:
+                await self.step()
+
+        await self.step(force=True)
+
+    def stop(self):
+        """
+        Stop running.
+        """
+
+        self._stop = True
+        if self._wakeup is not None:
+            self._wakeup.set()
+
+    def metrics(self) -> dict:
+        return {
+            'generation': self.index.generation,
+            'pending_bytes': self.index.pending,
+            'compactions': self.compactions,
+            'refreshes': self.refreshes,
+        }
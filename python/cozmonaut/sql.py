@@ -0,0 +1,50 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+from core import SqlClient
+
+from cozmonaut.completion import CompletionDispatcher
+
+
+class AsyncSqlClient:
+    """
+    A non-blocking SQL client for coroutines.
+
+    Statements run on a native I/O thread with its own connection. Statements
+    submitted while a round trip is in flight are pipelined into the next one.
+    Use `?` placeholders for parameters and one statement per call.
+    """
+
+    def __init__(self, dispatcher: CompletionDispatcher, host=None, user=None, password=None, database=None):
+        self.dispatcher = dispatcher
+        self.client = SqlClient(dispatcher.channel, host=host, user=user, password=password, database=database)
+
+    async def query(self, sql: str, *params):
+        """
+        Run a statement.
+
+        :param sql: The statement text
+        :param params: The placeholder values
+        :return: A list of row tuples, or (affected_rows, insert_id) for
+                 statements without a result set
+        """
+
+        ticket = self.client.submit(sql, params)
+        return await self.dispatcher.watch(ticket)
+
+    async def query_one(self, sql: str, *params):
+        """
+        Run a statement and return its first row, or None.
+        """
+
+        rows = await self.query(sql, *params)
+        return rows[0] if rows else None
+
+    def close(self):
+        """
+        Stop the I/O thread. Statements still queued fail with SqlError.
+        """
+
+        self.client.close()
@@ -0,0 +1,88 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+import asyncio
+import collections
+import sys
+import time
+
+from core import Watchdog
+
+
+class LoopWatchdog:
+    """
+    Catches coroutines that hold up the event loop.
+
+    Every robot shares the one loop, so a handler that blocks it for 50 ms
+    stalls them all without any error to show for it. The loop beats a native
+    watchdog at a fixed interval. When a beat is late past the threshold, the
+    watchdog's own thread captures the loop thread's Python stack while the
+    stall is still going on, which names the handler at fault. Stalls are
+    reported on stderr once the loop is back, and their durations are kept in
+    a histogram for metrics().
+    """
+
+    def __init__(self, interval: float = 0.01, threshold: float = 0.05, keep: int = 16):
+        """
+        :param interval: The heartbeat interval, in seconds
+        :param threshold: The lateness that counts as a stall, in seconds
+        :param keep: The number of recent stalls to keep for metrics()
+        """
+
+        self.watchdog = Watchdog(interval=interval, threshold=threshold)
+        self._recent = collections.deque(maxlen=keep)
+        self._stop = False
+
+    async def run(self):
+        """
+        Beat until stopped.
+        """
+
+        try:
+            while not self._stop:
+                if self.watchdog.beat():
+                    self._report()
+                await asyncio.sleep(self.watchdog.interval)
+        finally:
+            # The loop thread may exit once it stops beating
+            self.watchdog.unwatch()
+
+    def stop(self):
+        """
+        Stop beating.
+        """
+
+        self._stop = True
+
+    def metrics(self) -> dict:
+        """
+        Get the stall counters, duration histogram (bucket i counting stalls of
+        2^i to 2^(i+1) ms) and the most recent stalls.
+        """
+
+        result = self.watchdog.stats()
+        result['threshold_ms'] = self.watchdog.threshold * 1e3
+        result['recent'] = list(self._recent)
+        return result
+
+    def close(self):
+        """
+        Stop the watchdog thread.
+        """
+
+        self.watchdog.close()
+
+    def _report(self):
+        for stall in self.watchdog.stalls():
+            stamp = time.strftime('%H:%M:%S', time.localtime(stall.at))
+            print('event loop stalled for {:.0f} ms at {}'.format(stall.duration * 1e3, stamp), file=sys.stderr)
+            if stall.stack:
+                print(stall.stack, end='', file=sys.stderr)
+
+            self._recent.append({
+                'at': stall.at,
+                'duration_ms': stall.duration * 1e3,
+                'stack': stall.stack,
+            })
@@ -0,0 +1,43 @@
+--
+-- Cozmonaut
+-- Copyright 2019 The Cozmonaut Contributors
+--
+
+-- Known friends
+CREATE TABLE IF NOT EXISTS friends (
+  id INT UNSIGNED NOT NULL PRIMARY KEY,
+  name VARCHAR(255) NOT NULL,
+  embedding BLOB
+);
+
+-- Every change to friends, in order (written by the triggers below)
+-- Processes sharing a friend snapshot load only the changes newer than its watermark
+CREATE TABLE IF NOT EXISTS friend_changes (
+  seq BIGINT UNSIGNED NOT NULL AUTO_INCREMENT PRIMARY KEY,
+  friend_id INT UNSIGNED NOT NULL
+);
+
+DROP TRIGGER IF EXISTS friends_inserted;
+CREATE TRIGGER friends_inserted AFTER INSERT ON friends
+  FOR EACH ROW INSERT INTO friend_changes (friend_id) VALUES (NEW.id);
+
+DROP TRIGGER IF EXISTS friends_updated;
+CREATE TRIGGER friends_updated AFTER UPDATE ON friends
+  FOR EACH ROW INSERT INTO friend_changes (friend_id) VALUES (OLD.id), (NEW.id);
+
+DROP TRIGGER IF EXISTS friends_deleted;
+CREATE TRIGGER friends_deleted AFTER DELETE ON friends
+  FOR EACH ROW INSERT INTO friend_changes (friend_id) VALUES (OLD.id);
+
+-- Robots recognizing friends (written behind by _core.EncounterLog)
+-- The natural key lets spill file replays insert with IGNORE, so a row replayed twice lands once
+CREATE TABLE IF NOT EXISTS encounters (
+  id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT PRIMARY KEY,
+  friend_id INT UNSIGNED NOT NULL,
+  robot_id INT UNSIGNED NOT NULL,
+  track_id BIGINT NOT NULL,
+  time DATETIME(3) NOT NULL,
+  confidence FLOAT NOT NULL,
+  INDEX encounters_friend_time (friend_id, time),
+  UNIQUE KEY encounters_natural (robot_id, track_id, friend_id, time)
+);
@@ -0,0 +1,96 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+/*
+ * Command-line parser benchmark.
+ *
+ * Parses typical command lines against cozmo's own command tree, the way
+ * batch does: option data is restored before each line. Reports the time to
+ * index the tree and the time per parse of each line.
+ *
+ * Usage: command_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "command.h"
+#include "command_tree.h"
+
+/** A command line to parse. */
+struct bench_line {
+  /** The name. */
+  const char* name;
+
+  /** The argument count (including the program name). */
+  int argc;
+
+  /** The argument vector (including the program name). */
+  const char** argv;
+};
+
+/** Get monotonic time in seconds. */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: command_bench [iterations]\n");
+    return 1;
+  }
+
+  const struct bench_line lines[] = {
+    { "empty", 1, (const char*[]) {"cozmo"} },
+    { "help", 2, (const char*[]) {"cozmo", "-h"} },
+    { "nested", 5, (const char*[]) {"cozmo", "friend", "list", "--format", "json-lines"} },
+    { "long_eq", 6, (const char*[]) {"cozmo", "--sql-host=db", "--sql-user=cozmo", "fr", "ls", "--limit=50"} },
+    { "short", 8, (const char*[]) {"cozmo", "fr", "add", "-n", "Alice", "-f", "4", "alice.bin"} },
+    { "positional", 6, (const char*[]) {"cozmo", "friend", "import", "-j", "4", "friends.csv"} },
+    { "go", 6, (const char*[]) {"cozmo", "go", "--replay", "frames", "--metrics", "out.json"} },
+  };
+
+  struct command_parser parser;
+  struct option_state state = {0};
+
+  double t0 = now();
+  if (command_parser_init(&parser, &g_subcommand_root)) {
+    return 1;
+  }
+  double t_init = now() - t0;
+
+  if (option_state_save(&g_subcommand_root, &state)) {
+    fprintf(stderr, "too many option slots\n");
+    return 1;
+  }
+
+  printf("index: %zu aliases in %.2f us\n", parser.index_len, t_init * 1e6);
+  printf("%-12s %10s %8s\n", "line", "ns/parse", "op");
+
+  for (size_t i = 0; i < sizeof lines / sizeof *lines; ++i) {
+    const struct bench_line* line = &lines[i];
+    struct command_chain chain;
+    int op = -1;
+
+    double t1 = now();
+    for (long n = 0; n < iterations; ++n) {
+      option_state_restore(&state);
+      if (command_parse(&parser, line->argc, line->argv, &chain)) {
+        fprintf(stderr, "%s: parse failed\n", line->name);
+        return 1;
+      }
+      op = chain.cmds[chain.len - 1]->operation;
+    }
+    double t2 = now();
+
+    printf("%-12s %10.1f %8d\n", line->name, (t2 - t1) * 1e9 / (double) iterations, op);
+  }
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+/*
+ * Command-line parser fuzzer (libFuzzer).
+ *
+ * Each input is split on NUL bytes into an argument vector and parsed
+ * against cozmo's own command tree. On success, the chain must start at the
+ * root, each link must be a subcommand of the one before it, and all option
+ * data must point into the argument vector.
+ *
+ * Usage: command_fuzz [-close_fd_mask=2] [corpus...]
+ *
+ * Parse errors go to stderr; -close_fd_mask=2 keeps them out of the way.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "command.h"
+#include "command_tree.h"
+
+/** The most arguments taken from one input. */
+#define FUZZ_ARGS_MAX 64
+
+/** The parser, indexed on the first input. */
+static struct command_parser g_fuzz_parser;
+
+/** The option data before any parse. */
+static struct option_state g_fuzz_state;
+
+/**
+ * Check that an option data slot is unset or points into the arguments.
+ *
+ * @param data The slot value
+ * @param buf The argument storage
+ * @param len The argument storage length
+ */
+static void check_data(const char* data, const char* buf, size_t len) {
+  if (data == NULL || strcmp(data, "true") == 0) {
+    return;
+  }
+
+  if (data < buf || data >= buf + len) {
+    abort();
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  if (g_fuzz_parser.root == NULL) {
+    if (command_parser_init(&g_fuzz_parser, &g_subcommand_root)
+        || option_state_save(&g_subcommand_root, &g_fuzz_state)) {
+      abort();
+    }
+  }
+
+  // Copy with a terminator, so the last argument ends like the rest
+  char* buf = malloc(size + 1);
+  if (buf == NULL) {
+    return 0;
+  }
+
+  memcpy(buf, data, size);
+  buf[size] = '\0';
+
+  const char* argv[FUZZ_ARGS_MAX] = {"cozmo"};
+  int argc = 1;
+
+  for (size_t i = 0; i < size && argc < FUZZ_ARGS_MAX; i += strlen(buf + i) + 1) {
+    argv[argc++] = buf + i;
+  }
+
+  option_state_restore(&g_fuzz_state);
+
+  struct command_chain chain;
+  if (command_parse(&g_fuzz_parser, argc, argv, &chain) == 0) {
+    if (chain.len == 0 || chain.len > COMMAND_CHAIN_MAX || chain.cmds[0] != &g_subcommand_root) {
+      abort();
+    }
+
+    for (size_t i = 1; i < chain.len; ++i) {
+      const struct subcommand* parent = chain.cmds[i - 1];
+      if (chain.cmds[i] < parent->subcommands || chain.cmds[i] >= parent->subcommands + parent->num_subcommands) {
+        abort();
+      }
+    }
+
+    for (size_t i = 0; i < g_fuzz_state.len; ++i) {
+      check_data(*g_fuzz_state.slots[i], buf, size + 1);
+    }
+  }
+
+  free(buf);
+  return 0;
+}
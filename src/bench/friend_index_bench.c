@@ -0,0 +1,208 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+/*
+ * Friend index recall and latency benchmark.
+ *
+ * Builds a synthetic gallery of clustered embeddings (several noisy samples
+ * around each identity, like enrolled friends), indexes it in each storage
+ * mode, and searches it with fresh noisy queries. Recall is measured against
+ * exact float search over the same gallery.
+ *
+ * Usage: friend_index_bench [rows] [dim] [queries]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core/friend_index.h"
+
+/** The samples per identity. */
+#define BENCH_SAMPLES_PER_ID 8
+
+/** The noise added around each identity. */
+#define BENCH_NOISE 0.35f
+
+/** The neighbors compared for recall@10. */
+#define BENCH_K 10
+
+/** Draw a standard normal (Box-Muller). */
+static float gaussian(unsigned int* seed) {
+  float u = ((float) rand_r(seed) + 1) / ((float) RAND_MAX + 2);
+  float v = ((float) rand_r(seed) + 1) / ((float) RAND_MAX + 2);
+  return sqrtf(-2 * logf(u)) * cosf(6.2831853f * v);
+}
+
+/** Get monotonic time in seconds. */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Run one configuration.
+ *
+ * @param name The configuration name
+ * @param options The index options
+ * @param gallery The gallery, rows of dim floats
+ * @param rows The number of gallery rows
+ * @param queries The queries, num_queries rows of dim floats
+ * @param num_queries The number of queries
+ * @param dim The dimension
+ * @param truth The exact top BENCH_K rows of each query
+ * @return Zero on success, otherwise nonzero
+ */
+static int run(const char* name, const struct friend_index_options* options, const float* gallery, size_t rows,
+    const float* queries, size_t num_queries, size_t dim, const int32_t* truth) {
+  struct friend_index idx;
+  if (friend_index_init(&idx, dim, options)) {
+    return 1;
+  }
+
+  if (friend_index_train(&idx, gallery, rows < 20000 ? rows : 20000)) {
+    fprintf(stderr, "%s: training failed\n", name);
+    friend_index_destroy(&idx);
+    return 1;
+  }
+
+  // Rows are indexed by their position, so results compare directly against the truth
+  for (size_t i = 0; i < rows; ++i) {
+    if (friend_index_append(&idx, (int32_t) i, &gallery[i * dim])) {
+      fprintf(stderr, "%s: append failed\n", name);
+      friend_index_destroy(&idx);
+      return 1;
+    }
+  }
+
+  struct friend_match matches[BENCH_K];
+  size_t hits1 = 0;
+  size_t hits10 = 0;
+
+  double start = now();
+
+  for (size_t q = 0; q < num_queries; ++q) {
+    size_t found = friend_index_search(&idx, &queries[q * dim], BENCH_K, matches);
+
+    if (found > 0 && matches[0].friend_id == truth[q * BENCH_K]) {
+      ++hits1;
+    }
+
+    for (size_t i = 0; i < found; ++i) {
+      for (size_t j = 0; j < BENCH_K; ++j) {
+        if (matches[i].friend_id == truth[q * BENCH_K + j]) {
+          ++hits10;
+          break;
+        }
+      }
+    }
+  }
+
+  double elapsed = now() - start;
+
+  printf("%-12s %10.3f %10.3f %12.1f %12.2f\n", name, (double) hits1 / (double) num_queries,
+    (double) hits10 / (double) (num_queries * BENCH_K), elapsed / (double) num_queries * 1e6,
+    (double) friend_index_memory(&idx) / (1024 * 1024));
+
+  friend_index_destroy(&idx);
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  size_t rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  size_t dim = argc > 2 ? strtoul(argv[2], NULL, 10) : 128;
+  size_t num_queries = argc > 3 ? strtoul(argv[3], NULL, 10) : 200;
+
+  if (rows < BENCH_K || dim == 0 || num_queries == 0) {
+    fprintf(stderr, "usage: %s [rows] [dim] [queries]\n", argv[0]);
+    return 1;
+  }
+
+  unsigned int seed = 2019;
+  size_t ids = (rows + BENCH_SAMPLES_PER_ID - 1) / BENCH_SAMPLES_PER_ID;
+
+  float* centers = malloc(ids * dim * sizeof(float));
+  float* gallery = malloc(rows * dim * sizeof(float));
+  float* queries = malloc(num_queries * dim * sizeof(float));
+  int32_t* truth = malloc(num_queries * BENCH_K * sizeof(int32_t));
+  if (centers == NULL || gallery == NULL || queries == NULL || truth == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < ids * dim; ++i) {
+    centers[i] = gaussian(&seed);
+  }
+
+  for (size_t r = 0; r < rows; ++r) {
+    for (size_t i = 0; i < dim; ++i) {
+      gallery[r * dim + i] = centers[(r / BENCH_SAMPLES_PER_ID) * dim + i] + BENCH_NOISE * gaussian(&seed);
+    }
+  }
+
+  for (size_t q = 0; q < num_queries; ++q) {
+    size_t id = (size_t) rand_r(&seed) % ids;
+    for (size_t i = 0; i < dim; ++i) {
+      queries[q * dim + i] = centers[id * dim + i] + BENCH_NOISE * gaussian(&seed);
+    }
+  }
+
+  // Exact search gives the ground truth
+  struct friend_index exact;
+  friend_index_init(&exact, dim, NULL);
+  for (size_t r = 0; r < rows; ++r) {
+    friend_index_append(&exact, (int32_t) r, &gallery[r * dim]);
+  }
+
+  struct friend_match matches[BENCH_K];
+  for (size_t q = 0; q < num_queries; ++q) {
+    size_t found = friend_index_search(&exact, &queries[q * dim], BENCH_K, matches);
+    for (size_t i = 0; i < BENCH_K; ++i) {
+      truth[q * BENCH_K + i] = i < found ? matches[i].friend_id : -1;
+    }
+  }
+
+  friend_index_destroy(&exact);
+
+  char rerank_path[] = "/tmp/friend_index_bench.XXXXXX";
+  int fd = mkstemp(rerank_path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  size_t subquantizers = dim % 32 == 0 ? 32 : dim % 16 == 0 ? 16 : 1;
+
+  struct {
+    const char* name;
+    struct friend_index_options options;
+  } configs[] = {
+    {"float", {.mode = friend_index_mode_float}},
+    {"sq8", {.mode = friend_index_mode_sq8}},
+    {"sq8+rerank", {.mode = friend_index_mode_sq8, .rerank_path = rerank_path, .rerank = 32}},
+    {"pq", {.mode = friend_index_mode_pq, .subquantizers = subquantizers}},
+    {"pq+rerank", {.mode = friend_index_mode_pq, .subquantizers = subquantizers, .rerank_path = rerank_path,
+      .rerank = 64}},
+  };
+
+  printf("%zu rows, %zu dimensions, %zu queries, %s kernels\n", rows, dim, num_queries, friend_index_kernels());
+  printf("%-12s %10s %10s %12s %12s\n", "mode", "recall@1", "recall@10", "us/query", "MiB");
+
+  int status = 0;
+  for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    status |= run(configs[i].name, &configs[i].options, gallery, rows, queries, num_queries, dim, truth);
+  }
+
+  unlink(rerank_path);
+  free(centers);
+  free(gallery);
+  free(queries);
+  free(truth);
+  return status;
+}
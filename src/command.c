@@ -0,0 +1,380 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "command.h"
+
+/**
+ * Order two alias index entries.
+ *
+ * @param a The first entry
+ * @param b The second entry
+ * @return Negative, zero, or positive as a is before, equal to, or after b
+ */
+static int compare_aliases(const void* a, const void* b) {
+  const struct command_alias* x = a;
+  const struct command_alias* y = b;
+
+  if (x->owner != y->owner) {
+    return (uintptr_t) x->owner < (uintptr_t) y->owner ? -1 : 1;
+  }
+
+  if (x->is_option != y->is_option) {
+    return x->is_option - y->is_option;
+  }
+
+  // Compare lengths first, so lookups never need a null terminator
+  if (x->len != y->len) {
+    return x->len < y->len ? -1 : 1;
+  }
+
+  return memcmp(x->alias, y->alias, x->len);
+}
+
+/**
+ * Add a subcommand's aliases (and those of everything under it) to the index.
+ *
+ * @param parser The parser
+ * @param cmd The subcommand
+ * @return Zero on success, otherwise nonzero (index full)
+ */
+static int index_subcommand(struct command_parser* parser, const struct subcommand* cmd) {
+  // Option aliases
+  for (size_t i = 0; i < cmd->num_options; ++i) {
+    const struct option* o = &cmd->options[i];
+
+    for (size_t j = 0; j < o->num_aliases; ++j) {
+      if (parser->index_len == COMMAND_ALIAS_MAX) {
+        return 1;
+      }
+
+      parser->index[parser->index_len++] = (struct command_alias) {
+        .owner = cmd,
+        .is_option = 1,
+        .alias = o->aliases[j],
+        .len = strlen(o->aliases[j]),
+        .target = o,
+      };
+    }
+  }
+
+  // Subcommand aliases, then recurse into the subcommands themselves
+  for (size_t i = 0; i < cmd->num_subcommands; ++i) {
+    const struct subcommand* c = &cmd->subcommands[i];
+
+    for (size_t j = 0; j < c->num_aliases; ++j) {
+      if (parser->index_len == COMMAND_ALIAS_MAX) {
+        return 1;
+      }
+
+      parser->index[parser->index_len++] = (struct command_alias) {
+        .owner = cmd,
+        .is_option = 0,
+        .alias = c->aliases[j],
+        .len = strlen(c->aliases[j]),
+        .target = c,
+      };
+    }
+
+    if (index_subcommand(parser, c)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int command_parser_init(struct command_parser* parser, const struct subcommand* root) {
+  parser->root = root;
+  parser->index_len = 0;
+
+  if (index_subcommand(parser, root)) {
+    fprintf(stderr, "too many command aliases (raise COMMAND_ALIAS_MAX)\n");
+    return 1;
+  }
+
+  qsort(parser->index, parser->index_len, sizeof *parser->index, &compare_aliases);
+  return 0;
+}
+
+/**
+ * Look up an alias declared on a subcommand.
+ *
+ * @param parser The parser
+ * @param owner The subcommand
+ * @param is_option Nonzero to look for an option, zero for a subcommand
+ * @param text The alias text (need not be null-terminated)
+ * @param len The alias length
+ * @return The option or subcommand, or NULL if there is none
+ */
+static const void* lookup_alias(const struct command_parser* parser, const struct subcommand* owner, int is_option,
+    const char* text, size_t len) {
+  struct command_alias key = {
+    .owner = owner,
+    .is_option = is_option,
+    .alias = text,
+    .len = len,
+  };
+
+  const struct command_alias* e = bsearch(&key, parser->index, parser->index_len, sizeof *parser->index,
+    &compare_aliases);
+  return e ? e->target : NULL;
+}
+
+/**
+ * Try to match a command-line argument to a subcommand option.
+ *
+ * @param parser The parser
+ * @param chain The subcommand chain
+ * @param text The option text, including dashes (need not be null-terminated)
+ * @param len The option text length
+ * @return The option or NULL on failure
+ */
+static const struct option* match_option(const struct command_parser* parser, const struct command_chain* chain,
+    const char* text, size_t len) {
+  // Walk in reverse up the command chain
+  // This simulates inheritance (allowing, e.g., friend subcommands to inherit the --help option)
+  for (size_t i = chain->len; i-- > 0;) {
+    const struct option* o = lookup_alias(parser, chain->cmds[i], 1, text, len);
+    if (o) {
+      return o;
+    }
+  }
+
+  // Control fell out somewhere without an option
+  return NULL;
+}
+
+/**
+ * Try to match a command-line argument to a subcommand.
+ *
+ * @param parser The parser
+ * @param chain The subcommand chain
+ * @param arg The raw argument text
+ * @param len The argument length
+ * @return The subcommand or NULL on failure
+ */
+static const struct subcommand* match_subcommand(const struct command_parser* parser,
+    const struct command_chain* chain, const char* arg, size_t len) {
+  // We do not walk the subcommand chain when matching subcommands
+  // Only the topmost subcommand on the chain can influence the next subcommand
+  return lookup_alias(parser, chain->cmds[chain->len - 1], 0, arg, len);
+}
+
+int command_parse(const struct command_parser* parser, int argc, const char** argv, struct command_chain* out) {
+  // The command chain (initialized to root)
+  // This will grow as subcommands are encountered
+  // It's job is to act like a running filter for matching subcommands and options
+  struct command_chain cur = {
+    .len = 1,
+    .cmds = {parser->root},
+  };
+
+  // Loop through user-given command-line arguments
+  // We skip the first argument, as it holds the program name
+  for (int i = 1; i < argc; ++i) {
+    // The argument under consideration
+    const char* arg = argv[i];
+    size_t arg_len = strlen(arg);
+
+    // Try to classify the argument as either an option or a subcommand
+    if (arg_len > 2 && arg[0] == '-' && arg[1] == '-') {
+      // Argument starts with two dashes, so treat it like a long (GNU-style) option
+
+      // Length of the double-dash-prefixed option name
+      size_t opt_arg_len = arg_len;
+
+      // The option data payload (null-terminated)
+      const char* opt_data = NULL;
+
+      // Search the argument for the first equal sign
+      // Long options can contain data in the form --key=value
+      const char* equal_sign = memchr(arg + 2, '=', arg_len - 2);
+
+      // If there is an equal sign
+      if (equal_sign) {
+        // Truncate the name, as it erroneously contains the data payload
+        opt_arg_len = equal_sign - arg;
+
+        // Create a view of the data payload
+        // This is safe, as we will always hit the null terminator
+        opt_data = equal_sign + 1;
+      }
+
+      // Try to match option
+      // Lookups are length-delimited, so the name needs no copy to terminate it
+      const struct option* opt;
+      if ((opt = match_option(parser, &cur, arg, opt_arg_len)) != NULL) {
+        // If option is a flag
+        if (opt->is_flag) {
+          // Set flag data
+          *opt->data = "true";
+        } else {
+          // Option is not a flag, so it has a data requirement
+          // Long options can get data either from their data payloads or from more arguments
+
+          // If data payload is non-empty
+          if (opt_data) {
+            // Map data payload directly
+            *opt->data = opt_data;
+          } else {
+            // Data payload is empty
+
+            // Read data from next argument
+            // This advances the argument iterator above (variable i)
+            if (++i >= argc) {
+              fprintf(stderr, "no data given to long option: %.*s\n", (int) opt_arg_len, arg);
+              return 1;
+            }
+
+            // Map next argument as this argument's data
+            *opt->data = argv[i];
+          }
+        }
+
+        // Go to next argument
+        continue;
+      }
+
+      fprintf(stderr, "no such long option: %s\n", arg);
+      return 1;
+    } else if (arg_len > 1 && arg[0] == '-') {
+      // Argument starts with one dash and is not a long option, so treat it like a short (POSIX-style) option(s)
+
+      // Loop through characters in argument
+      // For short options, compounding can occur (e.g. -abc means -a -b -c)
+      // So, we treat each character as its own individual short option
+      for (size_t j = 1; j < arg_len; ++j) {
+        // The character under consideration
+        char c = arg[j];
+
+        // Make a small string buffer framing the character as an independent argument
+        const char c_arg[2] = {'-', c};
+
+        // Try to match option
+        const struct option* opt;
+        if ((opt = match_option(parser, &cur, c_arg, sizeof c_arg)) != NULL) {
+          // If option is a flag
+          if (opt->is_flag) {
+            // Set flag data
+            *opt->data = "true";
+          } else {
+            // Option is not a flag, so it has a data requirement
+            // Short options can only get data from more arguments
+
+            // Read data from next argument
+            // This advances the argument iterator above (variable i)
+            if (++i >= argc) {
+              fprintf(stderr, "no data given to short option: -%c\n", c);
+              return 1;
+            }
+
+            // Map next argument as this argument's data
+            *opt->data = argv[i];
+          }
+
+          // Go to next short option
+          // This jumps back into the character iteration
+          continue;
+        }
+
+        fprintf(stderr, "no such short option: -%c\n", c);
+        return 1;
+      }
+    } else {
+      // Argument is not an option, so treat it like a subcommand
+
+      // Try to match subcommand
+      const struct subcommand* cmd;
+      if ((cmd = match_subcommand(parser, &cur, arg, arg_len)) != NULL) {
+        if (cur.len == COMMAND_CHAIN_MAX) {
+          fprintf(stderr, "subcommands nested too deeply: %s\n", arg);
+          return 1;
+        }
+
+        // Append to the subcommand chain
+        cur.cmds[cur.len++] = cmd;
+
+        // Go to next argument
+        continue;
+      }
+
+      // If the topmost command takes a positional argument not yet given, this is it
+      const struct subcommand* cmd_back = cur.cmds[cur.len - 1];
+      if (cmd_back->positional && *cmd_back->positional == NULL) {
+        *cmd_back->positional = arg;
+
+        // Go to next argument
+        continue;
+      }
+
+      fprintf(stderr, "no such subcommand: %s\n", arg);
+      return 1;
+    }
+  }
+
+  // Return the command chain (the caller takes the operation from its top)
+  *out = cur;
+  return 0;
+}
+
+/**
+ * Add a data slot to an option state, unless it's already there.
+ *
+ * Several options share storage (e.g. every -f goes to the friend ID), so the
+ * tree holds fewer slots than options.
+ *
+ * @param state The option state
+ * @param slot The data slot
+ * @param value The value to save
+ * @return Zero on success, otherwise nonzero (state full)
+ */
+static int add_option_slot(struct option_state* state, const char** slot, const char* value) {
+  for (size_t i = 0; i < state->len; ++i) {
+    if (state->slots[i] == slot) {
+      return 0;
+    }
+  }
+
+  if (state->len == COMMAND_STATE_MAX) {
+    return 1;
+  }
+
+  state->slots[state->len] = slot;
+  state->values[state->len] = value;
+  ++state->len;
+  return 0;
+}
+
+int option_state_save(const struct subcommand* cmd, struct option_state* state) {
+  for (size_t i = 0; i < cmd->num_options; ++i) {
+    const char** slot = cmd->options[i].data;
+    if (add_option_slot(state, slot, *slot)) {
+      return 1;
+    }
+  }
+
+  if (cmd->positional && add_option_slot(state, cmd->positional, NULL)) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < cmd->num_subcommands; ++i) {
+    if (option_state_save(&cmd->subcommands[i], state)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void option_state_restore(const struct option_state* state) {
+  for (size_t i = 0; i < state->len; ++i) {
+    *state->slots[i] = state->values[i];
+  }
+}
@@ -0,0 +1,175 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+
+/** The deepest subcommand nesting supported. */
+#define COMMAND_CHAIN_MAX 8
+
+/** The most aliases (of options and subcommands) in the whole command tree. */
+#define COMMAND_ALIAS_MAX 128
+
+/** The most option and positional data slots in the whole command tree. */
+#define COMMAND_STATE_MAX 64
+
+/** A command-line option. */
+struct option {
+  /** The number of aliases. */
+  size_t num_aliases;
+
+  /** The option aliases. */
+  const char** aliases;
+
+  /** The option description. */
+  const char* description;
+
+  /** Whether the option is a flag. A flag has no data. */
+  int is_flag;
+
+  /** The option data storage. */
+  const char** data;
+};
+
+/** A command-line subcommand. */
+struct subcommand {
+  /** The command canonical name. */
+  const char* canon_name;
+
+  /** The command description. */
+  const char* description;
+
+  /** The number of aliases. */
+  size_t num_aliases;
+
+  /** The command aliases. */
+  const char** aliases;
+
+  /** The command operation (meaning is up to the program). */
+  int operation;
+
+  /** The number of subcommands. */
+  size_t num_subcommands;
+
+  /** The command subcommands. */
+  const struct subcommand* subcommands;
+
+  /** The number of options. */
+  size_t num_options;
+
+  /** The command options. */
+  const struct option* options;
+
+  /** The positional argument name, or NULL if the command takes none. */
+  const char* positional_name;
+
+  /** The positional argument description. */
+  const char* positional_description;
+
+  /** The positional argument data storage. */
+  const char** positional;
+};
+
+/** A chain of subcommands, from the root to the topmost one given. */
+struct command_chain {
+  /** The number of subcommands on the chain. */
+  size_t len;
+
+  /** The subcommands. */
+  const struct subcommand* cmds[COMMAND_CHAIN_MAX];
+};
+
+/** An entry in the alias index. */
+struct command_alias {
+  /** The subcommand the alias is declared on. */
+  const struct subcommand* owner;
+
+  /** Nonzero if the alias names an option, zero if it names a subcommand. */
+  int is_option;
+
+  /** The alias text. */
+  const char* alias;
+
+  /** The alias length. */
+  size_t len;
+
+  /** The option or subcommand the alias names. */
+  const void* target;
+};
+
+/**
+ * A parser over a static command tree.
+ *
+ * The tree never changes, so its aliases are indexed once, sorted by owner,
+ * kind, length and text, and every lookup after that is a binary search with
+ * no allocation.
+ */
+struct command_parser {
+  /** The root of the command tree. */
+  const struct subcommand* root;
+
+  /** The alias index. */
+  struct command_alias index[COMMAND_ALIAS_MAX];
+
+  /** The number of entries in the alias index. */
+  size_t index_len;
+};
+
+/** A snapshot of all option and positional data. */
+struct option_state {
+  /** The number of slots. */
+  size_t len;
+
+  /** The data slots. */
+  const char** slots[COMMAND_STATE_MAX];
+
+  /** The saved slot values. */
+  const char* values[COMMAND_STATE_MAX];
+};
+
+/**
+ * Initialize a parser, indexing the aliases of a command tree.
+ *
+ * @param parser The parser
+ * @param root The root of the command tree
+ * @return Zero on success, otherwise nonzero (too many aliases)
+ */
+int command_parser_init(struct command_parser* parser, const struct subcommand* root);
+
+/**
+ * Parse command-line arguments.
+ *
+ * Option and positional data are written through the tree's data pointers as
+ * they are matched, and point into the argument vector. The chain is only
+ * written on success. Parsing never allocates.
+ *
+ * @param parser The parser
+ * @param argc The argument count (including the program name)
+ * @param argv The argument vector (including the program name)
+ * @param [out] out The command chain (the operation is that of its topmost subcommand)
+ * @return Zero on success, otherwise nonzero
+ */
+int command_parse(const struct command_parser* parser, int argc, const char** argv, struct command_chain* out);
+
+/**
+ * Save the option data under a subcommand. Positional data is saved as unset,
+ * since positionals never carry over from one command line to the next.
+ *
+ * @param cmd The subcommand
+ * @param state The option state
+ * @return Zero on success, otherwise nonzero (state full)
+ */
+int option_state_save(const struct subcommand* cmd, struct option_state* state);
+
+/**
+ * Restore saved option data.
+ *
+ * @param state The option state
+ */
+void option_state_restore(const struct option_state* state);
+
+#endif // #ifndef COMMAND_H
@@ -0,0 +1,371 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stddef.h>
+
+#include "command_tree.h"
+
+const char* g_opt_data_help;
+const char* g_opt_data_legal;
+const char* g_opt_data_version;
+const char* g_opt_data_profile_startup;
+const char* g_opt_data_profile;
+const char* g_opt_data_profile_hz;
+const char* g_opt_data_sql_host;
+const char* g_opt_data_sql_user;
+const char* g_opt_data_sql_pass;
+const char* g_opt_data_sql_db;
+const char* g_opt_data_name;
+const char* g_opt_data_friend_id;
+const char* g_opt_data_format;
+const char* g_opt_data_limit;
+const char* g_opt_data_offset;
+const char* g_opt_data_jobs;
+const char* g_opt_data_frame_ring;
+const char* g_opt_data_replay;
+const char* g_opt_data_metrics;
+const char* g_opt_data_baseline;
+const char* g_opt_data_friend_snapshot;
+const char* g_opt_data_cpu_policy;
+const char* g_opt_data_memory_budget;
+const char* g_opt_data_pid;
+const char* g_pos_data_file;
+const char* g_pos_data_script;
+
+const struct subcommand g_subcommand_root = {
+  .canon_name = NULL,
+  .description = NULL,
+  .num_aliases = 0,
+  .aliases = NULL,
+  .operation = op_nop,
+  .num_subcommands = 4,
+  .subcommands = (struct subcommand[]) {
+    {
+      .canon_name = "batch",
+      .description = "run command lines from a script",
+      .num_aliases = 1,
+      .aliases = (const char* []) {"batch"},
+      .operation = op_batch,
+      .num_subcommands = 0,
+      .subcommands = NULL,
+      .num_options = 0,
+      .options = NULL,
+      .positional_name = "[<file>]",
+      .positional_description = "the script, one command per line (default stdin)",
+      .positional = &g_pos_data_script,
+    },
+    {
+      .canon_name = "friend",
+      .description = "friend management kit",
+      .num_aliases = 2,
+      .aliases = (const char* []) {"friend", "fr"},
+      .operation = op_nop,
+      .num_subcommands = 5,
+      .subcommands = (struct subcommand[]) {
+        {
+          .canon_name = "friend add",
+          .description = "add a friend from face embeddings",
+          .num_aliases = 1,
+          .aliases = (const char* []) {"add"},
+          .operation = op_friend_add,
+          .num_subcommands = 0,
+          .subcommands = NULL,
+          .num_options = 2,
+          .options = (struct option[]) {
+            {
+              .num_aliases = 2,
+              .aliases = (const char* []) {"-n", "--name"},
+              .description = "the friend name",
+              .is_flag = 0,
+              .data = &g_opt_data_name,
+            },
+            {
+              .num_aliases = 2,
+              .aliases = (const char* []) {"-f", "--friend"},
+              .description = "the friend id (default next free)",
+              .is_flag = 0,
+              .data = &g_opt_data_friend_id,
+            },
+          },
+          .positional_name = "<file>",
+          .positional_description = "base64 embeddings, one per line (- for stdin)",
+          .positional = &g_pos_data_file,
+        },
+        {
+          .canon_name = "friend list",
+          .description = "list friend details",
+          .num_aliases = 2,
+          .aliases = (const char* []) {"list", "ls"},
+          .operation = op_friend_list,
+          .num_subcommands = 0,
+          .subcommands = NULL,
+          .num_options = 4,
+          .options = (struct option[]) {
+            {
+              .num_aliases = 2,
+              .aliases = (const char* []) {"-f", "--friend"},
+              .description = "the friend id",
+              .is_flag = 0,
+              .data = &g_opt_data_friend_id,
+            },
+            {
+              .num_aliases = 1,
+              .aliases = (const char* []) {"--format"},
+              .description = "output format (tsv, json-lines)",
+              .is_flag = 0,
+              .data = &g_opt_data_format,
+            },
+            {
+              .num_aliases = 1,
+              .aliases = (const char* []) {"--limit"},
+              .description = "list at most this many friends",
+              .is_flag = 0,
+              .data = &g_opt_data_limit,
+            },
+            {
+              .num_aliases = 1,
+              .aliases = (const char* []) {"--offset"},
+              .description = "list friends after this friend id",
+              .is_flag = 0,
+              .data = &g_opt_data_offset,
+            },
+          },
+        },
+        {
+          .canon_name = "friend remove",
+          .description = "remove friends from memory",
+          .num_aliases = 2,
+          .aliases = (const char* []) {"remove", "rm"},
+          .operation = op_friend_remove,
+          .num_subcommands = 0,
+          .subcommands = NULL,
+          .num_options = 1,
+          .options = (struct option[]) {
+            {
+              .num_aliases = 2,
+              .aliases = (const char* []) {"-f", "--friend"},
+              .description = "the friend id",
+              .is_flag = 0,
+              .data = &g_opt_data_friend_id,
+            },
+          },
+        },
+        {
+          .canon_name = "friend import",
+          .description = "load friends from a csv file",
+          .num_aliases = 1,
+          .aliases = (const char* []) {"import"},
+          .operation = op_friend_import,
+          .num_subcommands = 0,
+          .subcommands = NULL,
+          .num_options = 1,
+          .options = (struct option[]) {
+            {
+              .num_aliases = 2,
+              .aliases = (const char* []) {"-j", "--jobs"},
+              .description = "number of loader connections",
+              .is_flag = 0,
+              .data = &g_opt_data_jobs,
+            },
+          },
+          .positional_name = "<file>",
+          .positional_description = "the csv file (- for stdin)",
+          .positional = &g_pos_data_file,
+        },
+        {
+          .canon_name = "friend export",
+          .description = "save friends to a csv file",
+          .num_aliases = 1,
+          .aliases = (const char* []) {"export"},
+          .operation = op_friend_export,
+          .num_subcommands = 0,
+          .subcommands = NULL,
+          .num_options = 0,
+          .options = NULL,
+          .positional_name = "<file>",
+          .positional_description = "the csv file (- for stdout)",
+          .positional = &g_pos_data_file,
+        },
+      },
+    },
+    {
+      .canon_name = "go",
+      .description = "start interactive session",
+      .num_aliases = 1,
+      .aliases = (const char* []) {"go"},
+      .operation = op_interact,
+      .num_subcommands = 0,
+      .subcommands = NULL,
+      .num_options = 7,
+      .options = (struct option[]) {
+        {
+          .num_aliases = 2,
+          .aliases = (const char* []) {"-r", "--frame-ring"},
+          .description = "consume frames from this shared-memory ring",
+          .is_flag = 0,
+          .data = &g_opt_data_frame_ring,
+        },
+        {
+          .num_aliases = 1,
+          .aliases = (const char* []) {"--replay"},
+          .description = "replay a directory of jpeg frames headless",
+          .is_flag = 0,
+          .data = &g_opt_data_replay,
+        },
+        {
+          .num_aliases = 1,
+          .aliases = (const char* []) {"--metrics"},
+          .description = "write replay metrics (json) to this file",
+          .is_flag = 0,
+          .data = &g_opt_data_metrics,
+        },
+        {
+          .num_aliases = 1,
+          .aliases = (const char* []) {"--baseline"},
+          .description = "fail if replay metrics miss this baseline",
+          .is_flag = 0,
+          .data = &g_opt_data_baseline,
+        },
+        {
+          .num_aliases = 1,
+          .aliases = (const char* []) {"--friend-snapshot"},
+          .description = "share friend embeddings with other processes through this snapshot file",
+          .is_flag = 0,
+          .data = &g_opt_data_friend_snapshot,
+        },
+        {
+          .num_aliases = 1,
+          .aliases = (const char* []) {"--cpu-policy"},
+          .description = "place robot pipelines on cpus: compact, spread or manual:<cpus>;...",
+          .is_flag = 0,
+          .data = &g_opt_data_cpu_policy,
+        },
+        {
+          .num_aliases = 1,
+          .aliases = (const char* []) {"--memory-budget"},
+          .description = "fail native allocations past these budgets: [<robot>:]<tag>=<mib>,...",
+          .is_flag = 0,
+          .data = &g_opt_data_memory_budget,
+        },
+      },
+    },
+    {
+      .canon_name = "stats",
+      .description = "process statistics kit",
+      .num_aliases = 1,
+      .aliases = (const char* []) {"stats"},
+      .operation = op_nop,
+      .num_subcommands = 1,
+      .subcommands = (struct subcommand[]) {
+        {
+          .canon_name = "stats memory",
+          .description = "report memory by subsystem with high-water marks",
+          .num_aliases = 2,
+          .aliases = (const char* []) {"memory", "mem"},
+          .operation = op_stats_memory,
+          .num_subcommands = 0,
+          .subcommands = NULL,
+          .num_options = 3,
+          .options = (struct option[]) {
+            {
+              .num_aliases = 1,
+              .aliases = (const char* []) {"--format"},
+              .description = "output format (text, json)",
+              .is_flag = 0,
+              .data = &g_opt_data_format,
+            },
+            {
+              .num_aliases = 1,
+              .aliases = (const char* []) {"--limit"},
+              .description = "show at most this many python allocation sites (default 10)",
+              .is_flag = 0,
+              .data = &g_opt_data_limit,
+            },
+            {
+              .num_aliases = 1,
+              .aliases = (const char* []) {"--pid"},
+              .description = "report on this running `cozmo go' process instead",
+              .is_flag = 0,
+              .data = &g_opt_data_pid,
+            },
+          },
+        },
+      },
+    },
+  },
+  .num_options = 10,
+  .options = (struct option[]) {
+    {
+      .num_aliases = 2,
+      .aliases = (const char* []) {"-h", "--help"},
+      .description = "show help information",
+      .is_flag = 1,
+      .data = &g_opt_data_help,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--legal"},
+      .description = "show legal information",
+      .is_flag = 1,
+      .data = &g_opt_data_legal,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--version"},
+      .description = "show version information",
+      .is_flag = 1,
+      .data = &g_opt_data_version,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--profile-startup"},
+      .description = "report time spent in each startup phase",
+      .is_flag = 1,
+      .data = &g_opt_data_profile_startup,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--profile"},
+      .description = "sample c and python stacks of all threads into this file (collapsed)",
+      .is_flag = 0,
+      .data = &g_opt_data_profile,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--profile-hz"},
+      .description = "samples per second of each thread's cpu time (default 99)",
+      .is_flag = 0,
+      .data = &g_opt_data_profile_hz,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--sql-host"},
+      .description = "set hostname for sql server",
+      .is_flag = 0,
+      .data = &g_opt_data_sql_host,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--sql-user"},
+      .description = "set username for sql server",
+      .is_flag = 0,
+      .data = &g_opt_data_sql_user,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--sql-pass"},
+      .description = "set password for sql server",
+      .is_flag = 0,
+      .data = &g_opt_data_sql_pass,
+    },
+    {
+      .num_aliases = 1,
+      .aliases = (const char* []) {"--sql-db"},
+      .description = "set database for sql server",
+      .is_flag = 0,
+      .data = &g_opt_data_sql_db,
+    },
+  },
+};
@@ -0,0 +1,110 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef COMMAND_TREE_H
+#define COMMAND_TREE_H
+
+#include "command.h"
+
+/*
+ * The cozmo command tree. It lives apart from main so the parser benchmark
+ * and fuzzer run against the real thing.
+ */
+
+/** A program operation. */
+enum operation {
+  op_nop = 0,
+  op_batch,
+  op_friend_add,
+  op_friend_export,
+  op_friend_import,
+  op_friend_list,
+  op_friend_remove,
+  op_interact,
+  op_stats_memory,
+};
+
+/** Option data for help flag. */
+extern const char* g_opt_data_help;
+
+/** Option data for legal flag. */
+extern const char* g_opt_data_legal;
+
+/** Option data for version flag. */
+extern const char* g_opt_data_version;
+
+/** Option data for startup profile flag. */
+extern const char* g_opt_data_profile_startup;
+
+/** Option data for sampling profile output files. */
+extern const char* g_opt_data_profile;
+
+/** Option data for sampling profile rates. */
+extern const char* g_opt_data_profile_hz;
+
+/** Option data for SQL hostname. */
+extern const char* g_opt_data_sql_host;
+
+/** Option data for SQL server username. */
+extern const char* g_opt_data_sql_user;
+
+/** Option data for SQL server password. */
+extern const char* g_opt_data_sql_pass;
+
+/** Option data for SQL database name. */
+extern const char* g_opt_data_sql_db;
+
+/** Option data for friend names. */
+extern const char* g_opt_data_name;
+
+/** Option data for friend IDs. */
+extern const char* g_opt_data_friend_id;
+
+/** Option data for output formats. */
+extern const char* g_opt_data_format;
+
+/** Option data for result limits. */
+extern const char* g_opt_data_limit;
+
+/** Option data for result offsets. */
+extern const char* g_opt_data_offset;
+
+/** Option data for worker counts. */
+extern const char* g_opt_data_jobs;
+
+/** Option data for frame ring names. */
+extern const char* g_opt_data_frame_ring;
+
+/** Option data for replay frame directories. */
+extern const char* g_opt_data_replay;
+
+/** Option data for metrics output files. */
+extern const char* g_opt_data_metrics;
+
+/** Option data for metrics baseline files. */
+extern const char* g_opt_data_baseline;
+
+/** Option data for friend snapshot files. */
+extern const char* g_opt_data_friend_snapshot;
+
+/** Option data for CPU placement policies. */
+extern const char* g_opt_data_cpu_policy;
+
+/** Option data for native memory budgets. */
+extern const char* g_opt_data_memory_budget;
+
+/** Option data for process IDs. */
+extern const char* g_opt_data_pid;
+
+/** Positional data for file paths. */
+extern const char* g_pos_data_file;
+
+/** Positional data for batch script paths. */
+extern const char* g_pos_data_script;
+
+/** The subcommand layout. */
+extern const struct subcommand g_subcommand_root;
+
+#endif // #ifndef COMMAND_TREE_H
@@ -0,0 +1,141 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+#include "memory.h"
+#include "topology.h"
+
+/**
+ * Allocate a new block and push it onto an arena.
+ *
+ * @param a The arena
+ * @param size The block capacity
+ * @return The block, or NULL if out of memory (or over the limit)
+ */
+static struct arena_block* push_block(struct arena* a, size_t size) {
+  if (a->limit && (size > a->limit || a->stats.capacity > a->limit - size)) {
+    return NULL;
+  }
+
+  struct arena_block* b;
+  if (a->node >= 0) {
+    if (memory_map(memory_tag_arena, sizeof *b + size)) {
+      return NULL;
+    }
+
+    b = topology_alloc_local(sizeof *b + size, a->node);
+    if (b == NULL) {
+      memory_unmap(memory_tag_arena, sizeof *b + size);
+    }
+  } else {
+    b = memory_alloc(memory_tag_arena, sizeof *b + size);
+  }
+
+  if (b == NULL) {
+    return NULL;
+  }
+
+  b->next = a->head;
+  b->size = size;
+  b->used = 0;
+  a->head = b;
+
+  ++a->stats.blocks;
+  ++a->stats.mallocs;
+  a->stats.capacity += size;
+  return b;
+}
+
+/**
+ * Free all blocks of an arena.
+ *
+ * @param a The arena
+ */
+static void free_blocks(struct arena* a) {
+  struct arena_block* b = a->head;
+  while (b) {
+    struct arena_block* next = b->next;
+    if (a->node >= 0) {
+      memory_unmap(memory_tag_arena, sizeof *b + b->size);
+      topology_free_local(b, sizeof *b + b->size);
+    } else {
+      memory_free(b);
+    }
+    b = next;
+  }
+
+  a->head = NULL;
+  a->stats.blocks = 0;
+  a->stats.capacity = 0;
+}
+
+void arena_init(struct arena* a, size_t block_size, int node, size_t limit) {
+  a->head = NULL;
+  a->block_size = block_size ? block_size : 4096;
+  a->node = node < 0 ? -1 : node;
+  a->limit = limit;
+  a->stats = (struct arena_stats) {0};
+}
+
+void arena_destroy(struct arena* a) {
+  free_blocks(a);
+}
+
+void* arena_alloc(struct arena* a, size_t size, size_t align) {
+  struct arena_block* b = a->head;
+
+  // Bump within the current block if it fits
+  if (b) {
+    uintptr_t base = (uintptr_t) b->data;
+    uintptr_t p = (base + b->used + align - 1) & ~(uintptr_t) (align - 1);
+    if (p - base <= b->size && size <= b->size - (p - base)) {
+      a->stats.used += p + size - (base + b->used);
+      b->used = p + size - base;
+      return (void*) p;
+    }
+  }
+
+  // Start a new block, with room to align within it
+  // The rest of the old block goes unused until the next reset
+  size_t need = size + align;
+  if (need < size) {
+    return NULL;
+  }
+
+  b = push_block(a, need > a->block_size ? need : a->block_size);
+  if (b == NULL) {
+    return NULL;
+  }
+
+  uintptr_t base = (uintptr_t) b->data;
+  uintptr_t p = (base + align - 1) & ~(uintptr_t) (align - 1);
+  b->used = p + size - base;
+  a->stats.used += b->used;
+  return (void*) p;
+}
+
+int arena_reset(struct arena* a) {
+  if (a->stats.used > a->stats.peak) {
+    a->stats.peak = a->stats.used;
+  }
+
+  a->stats.used = 0;
+  ++a->stats.resets;
+
+  // One block is the steady state, so just rewind it
+  if (a->stats.blocks <= 1) {
+    if (a->head) {
+      a->head->used = 0;
+    }
+    return 0;
+  }
+
+  // This cycle outgrew one block, so merge into one that holds a whole cycle
+  size_t capacity = a->stats.capacity;
+  free_blocks(a);
+  return push_block(a, capacity) ? 0 : 1;
+}
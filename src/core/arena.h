@@ -0,0 +1,113 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_ARENA_H
+#define CORE_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** A block of arena memory. */
+struct arena_block {
+  /** The next (older) block. */
+  struct arena_block* next;
+
+  /** The block capacity. */
+  size_t size;
+
+  /** The bytes handed out from the block. */
+  size_t used;
+
+  /** The block memory. */
+  unsigned char data[];
+};
+
+/** Arena counters. */
+struct arena_stats {
+  /** The number of blocks held. */
+  size_t blocks;
+
+  /** The bytes held across all blocks. */
+  size_t capacity;
+
+  /** The bytes handed out since the last reset (including alignment padding). */
+  size_t used;
+
+  /** The most bytes handed out between two resets. */
+  size_t peak;
+
+  /** The number of resets. */
+  uint64_t resets;
+
+  /** The number of block allocations (calls to malloc) over the arena's life. */
+  uint64_t mallocs;
+};
+
+/**
+ * A bump allocator for data that all dies at once (e.g. with a frame).
+ *
+ * Allocation bumps a pointer within the current block. Nothing is freed
+ * individually. A reset makes all memory reusable at once. If a cycle needed
+ * more than one block, the reset merges them into one block big enough for
+ * the whole cycle, so once the arena has seen its peak it never calls malloc
+ * again.
+ */
+struct arena {
+  /** The current block (the head of the block list). */
+  struct arena_block* head;
+
+  /** The smallest block to allocate. */
+  size_t block_size;
+
+  /** The NUMA node blocks are allocated on, or -1 for the heap. */
+  int node;
+
+  /** The most bytes held across all blocks, or zero for no limit. */
+  size_t limit;
+
+  /** The counters. */
+  struct arena_stats stats;
+};
+
+/**
+ * Initialize an arena. No memory is allocated until the first allocation.
+ *
+ * Blocks for a node are mapped and bound to it (see topology_alloc_local),
+ * so a robot's frame data stays next to the cores that work on it.
+ *
+ * @param a The arena
+ * @param block_size The smallest block to allocate
+ * @param node The NUMA node for blocks (negative for the heap)
+ * @param limit The most bytes to hold across all blocks (zero for no limit)
+ */
+void arena_init(struct arena* a, size_t block_size, int node, size_t limit);
+
+/**
+ * Free all arena memory.
+ *
+ * @param a The arena
+ */
+void arena_destroy(struct arena* a);
+
+/**
+ * Allocate from an arena.
+ *
+ * @param a The arena
+ * @param size The size
+ * @param align The alignment (a power of two)
+ * @return The memory, or NULL if out of memory (or over the limit)
+ */
+void* arena_alloc(struct arena* a, size_t size, size_t align);
+
+/**
+ * Make all arena memory reusable. Everything allocated before is invalid.
+ *
+ * @param a The arena
+ * @return Zero on success, otherwise nonzero (out of memory when merging
+ *   blocks, in which case the arena is empty but usable)
+ */
+int arena_reset(struct arena* a);
+
+#endif // #ifndef CORE_ARENA_H
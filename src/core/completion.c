@@ -0,0 +1,84 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "completion.h"
+
+int completion_channel_init(struct completion_channel* ch) {
+  // Create the wakeup eventfd
+  // Non-blocking so a spurious drain never stalls the event loop
+  ch->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ch->fd < 0) {
+    return 1;
+  }
+
+  if (pthread_mutex_init(&ch->lock, NULL)) {
+    close(ch->fd);
+    return 1;
+  }
+
+  ch->head = NULL;
+  ch->tail = NULL;
+  ch->next_ticket = 1;
+  return 0;
+}
+
+void completion_channel_destroy(struct completion_channel* ch) {
+  // Throw away anything nobody came to collect
+  struct completion* c = completion_channel_take(ch);
+  while (c) {
+    struct completion* next = c->next;
+    c->destroy(c);
+    c = next;
+  }
+
+  pthread_mutex_destroy(&ch->lock);
+  close(ch->fd);
+}
+
+uint64_t completion_channel_ticket(struct completion_channel* ch) {
+  return __atomic_fetch_add(&ch->next_ticket, 1, __ATOMIC_RELAXED);
+}
+
+void completion_channel_post(struct completion_channel* ch, struct completion* c) {
+  c->next = NULL;
+
+  pthread_mutex_lock(&ch->lock);
+
+  // Only the first post after a drain needs to wake the consumer
+  int was_empty = ch->head == NULL;
+
+  // Append to the list
+  if (ch->tail) {
+    ch->tail->next = c;
+  } else {
+    ch->head = c;
+  }
+  ch->tail = c;
+
+  pthread_mutex_unlock(&ch->lock);
+
+  if (was_empty) {
+    uint64_t one = 1;
+    while (write(ch->fd, &one, sizeof one) < 0 && errno == EINTR);
+  }
+}
+
+struct completion* completion_channel_take(struct completion_channel* ch) {
+  // Clear the signal first, so a post racing with us re-arms it
+  uint64_t count;
+  while (read(ch->fd, &count, sizeof count) < 0 && errno == EINTR);
+
+  pthread_mutex_lock(&ch->lock);
+  struct completion* head = ch->head;
+  ch->head = NULL;
+  ch->tail = NULL;
+  pthread_mutex_unlock(&ch->lock);
+
+  return head;
+}
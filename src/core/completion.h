@@ -0,0 +1,105 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_COMPLETION_H
+#define CORE_COMPLETION_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+/**
+ * A finished native operation waiting to be handed back to Python.
+ *
+ * Producers embed this at the head of their own request structures and post
+ * it to a completion channel from whatever thread did the work.
+ */
+struct completion {
+  /** The next completion in the channel. */
+  struct completion* next;
+
+  /** The ticket identifying the operation. */
+  uint64_t ticket;
+
+  /**
+   * Resolve the completion to a Python value.
+   *
+   * Called with the GIL held. Returns a new reference, or NULL with an
+   * exception set if the operation failed.
+   */
+  PyObject* (* resolve)(struct completion* self);
+
+  /**
+   * Destroy the completion. Called with the GIL held after resolution.
+   */
+  void (* destroy)(struct completion* self);
+};
+
+/**
+ * A multi-producer, single-consumer channel of completions.
+ *
+ * Any thread may post. The consumer watches an eventfd, which only becomes
+ * readable on the transition from empty to non-empty, so a burst of posts
+ * costs one wakeup and is drained in one go.
+ */
+struct completion_channel {
+  /** The eventfd signalled when completions are available. */
+  int fd;
+
+  /** The lock guarding the list. */
+  pthread_mutex_t lock;
+
+  /** The oldest posted completion. */
+  struct completion* head;
+
+  /** The newest posted completion. */
+  struct completion* tail;
+
+  /** The next ticket to hand out. */
+  uint64_t next_ticket;
+};
+
+/**
+ * Initialize a completion channel.
+ *
+ * @param ch The channel
+ * @return Zero on success, otherwise nonzero
+ */
+int completion_channel_init(struct completion_channel* ch);
+
+/**
+ * Destroy a completion channel. Pending completions are destroyed unresolved.
+ *
+ * @param ch The channel
+ */
+void completion_channel_destroy(struct completion_channel* ch);
+
+/**
+ * Allocate a ticket unique within the channel. Thread-safe.
+ *
+ * @param ch The channel
+ * @return The ticket
+ */
+uint64_t completion_channel_ticket(struct completion_channel* ch);
+
+/**
+ * Post a completion. Thread-safe, never blocks on the consumer.
+ *
+ * @param ch The channel
+ * @param c The completion
+ */
+void completion_channel_post(struct completion_channel* ch, struct completion* c);
+
+/**
+ * Take every posted completion at once and clear the wakeup signal.
+ *
+ * @param ch The channel
+ * @return The completions in posting order, or NULL if there are none
+ */
+struct completion* completion_channel_take(struct completion_channel* ch);
+
+#endif // #ifndef CORE_COMPLETION_H
@@ -0,0 +1,118 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <string.h>
+
+#include "detections.h"
+
+/** Round a size up to the column alignment. */
+#define DETECTIONS_ROUND(n) (((n) + DETECTIONS_ALIGN - 1) / DETECTIONS_ALIGN * DETECTIONS_ALIGN)
+
+size_t detections_column_item(enum detections_column column, size_t* width) {
+  *width = 1;
+
+  switch (column) {
+    case detections_column_landmarks:
+      *width = DETECTIONS_LANDMARKS;
+      return sizeof(float);
+    case detections_column_track_id:
+      return sizeof(int64_t);
+    case detections_column_friend_id:
+      return sizeof(int32_t);
+    default:
+      return sizeof(float);
+  }
+}
+
+size_t detections_size(size_t cap) {
+  size_t size = 0;
+
+  for (int c = 0; c < detections_column_count; ++c) {
+    size_t width;
+    size_t item = detections_column_item(c, &width);
+
+    // Guard the multiplication, as capacities can come from Python
+    if (cap > (SIZE_MAX / 2) / (item * width)) {
+      return 0;
+    }
+
+    size += DETECTIONS_ROUND(cap * item * width);
+  }
+
+  return size ? size : DETECTIONS_ALIGN;
+}
+
+void detections_bind(struct detections* d, void* mem, size_t cap) {
+  char* p = mem;
+  void* columns[detections_column_count];
+
+  for (int c = 0; c < detections_column_count; ++c) {
+    size_t width;
+    size_t item = detections_column_item(c, &width);
+
+    columns[c] = p;
+    p += DETECTIONS_ROUND(cap * item * width);
+  }
+
+  d->len = 0;
+  d->cap = cap;
+  d->x = columns[detections_column_x];
+  d->y = columns[detections_column_y];
+  d->w = columns[detections_column_w];
+  d->h = columns[detections_column_h];
+  d->score = columns[detections_column_score];
+  d->landmarks = columns[detections_column_landmarks];
+  d->track_id = columns[detections_column_track_id];
+  d->friend_id = columns[detections_column_friend_id];
+}
+
+void detections_rebind(struct detections* d, void* mem, size_t cap) {
+  struct detections old = *d;
+  detections_bind(d, mem, cap);
+
+  // Columns move one at a time
+  for (int c = 0; c < detections_column_count; ++c) {
+    size_t width;
+    size_t item = detections_column_item(c, &width);
+    memcpy(detections_column_data(d, c), detections_column_data(&old, c), old.len * item * width);
+  }
+
+  d->len = old.len;
+}
+
+void detections_copy_row(struct detections* dst, size_t dst_row, const struct detections* src, size_t src_row) {
+  dst->x[dst_row] = src->x[src_row];
+  dst->y[dst_row] = src->y[src_row];
+  dst->w[dst_row] = src->w[src_row];
+  dst->h[dst_row] = src->h[src_row];
+  dst->score[dst_row] = src->score[src_row];
+  memcpy(&dst->landmarks[dst_row * DETECTIONS_LANDMARKS], &src->landmarks[src_row * DETECTIONS_LANDMARKS],
+    DETECTIONS_LANDMARKS * sizeof(float));
+  dst->track_id[dst_row] = src->track_id[src_row];
+  dst->friend_id[dst_row] = src->friend_id[src_row];
+}
+
+void* detections_column_data(const struct detections* d, enum detections_column column) {
+  switch (column) {
+    case detections_column_x:
+      return d->x;
+    case detections_column_y:
+      return d->y;
+    case detections_column_w:
+      return d->w;
+    case detections_column_h:
+      return d->h;
+    case detections_column_score:
+      return d->score;
+    case detections_column_landmarks:
+      return d->landmarks;
+    case detections_column_track_id:
+      return d->track_id;
+    case detections_column_friend_id:
+      return d->friend_id;
+    default:
+      return NULL;
+  }
+}
@@ -0,0 +1,124 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_DETECTIONS_H
+#define CORE_DETECTIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The landmark coordinates per detection (five x, y points). */
+#define DETECTIONS_LANDMARKS 10
+
+/** The alignment of each column. */
+#define DETECTIONS_ALIGN 64
+
+/** A detections column. */
+enum detections_column {
+  detections_column_x = 0,
+  detections_column_y,
+  detections_column_w,
+  detections_column_h,
+  detections_column_score,
+  detections_column_landmarks,
+  detections_column_track_id,
+  detections_column_friend_id,
+  detections_column_count,
+};
+
+/**
+ * Face detections for one frame, stored as struct-of-arrays columns.
+ *
+ * Each column is contiguous, so a detector can write a field for all faces in
+ * one pass and Python can view each column as an array without a copy. The
+ * columns share one allocation, which the caller provides.
+ */
+struct detections {
+  /** The number of detections. */
+  size_t len;
+
+  /** The capacity. */
+  size_t cap;
+
+  /** The box left edges. */
+  float* x;
+
+  /** The box top edges. */
+  float* y;
+
+  /** The box widths. */
+  float* w;
+
+  /** The box heights. */
+  float* h;
+
+  /** The detection scores. */
+  float* score;
+
+  /** The landmarks (DETECTIONS_LANDMARKS per detection). */
+  float* landmarks;
+
+  /** The track IDs (-1 if untracked). */
+  int64_t* track_id;
+
+  /** The friend IDs (-1 if unknown). */
+  int32_t* friend_id;
+};
+
+/**
+ * Get the memory needed for detections of a capacity.
+ *
+ * @param cap The capacity
+ * @return The size (aligned to DETECTIONS_ALIGN), or zero on overflow
+ */
+size_t detections_size(size_t cap);
+
+/**
+ * Point detections columns into memory. The length is set to zero.
+ *
+ * @param d The detections
+ * @param mem The memory (detections_size(cap) bytes, aligned to DETECTIONS_ALIGN)
+ * @param cap The capacity
+ */
+void detections_bind(struct detections* d, void* mem, size_t cap);
+
+/**
+ * Move detections into bigger memory, keeping the rows.
+ *
+ * @param d The detections
+ * @param mem The new memory (detections_size(cap) bytes, aligned to DETECTIONS_ALIGN)
+ * @param cap The new capacity (at least the length)
+ */
+void detections_rebind(struct detections* d, void* mem, size_t cap);
+
+/**
+ * Copy a detection row.
+ *
+ * @param dst The destination detections
+ * @param dst_row The destination row
+ * @param src The source detections
+ * @param src_row The source row
+ */
+void detections_copy_row(struct detections* dst, size_t dst_row, const struct detections* src, size_t src_row);
+
+/**
+ * Get a column's base address.
+ *
+ * @param d The detections
+ * @param column The column
+ * @return The column
+ */
+void* detections_column_data(const struct detections* d, enum detections_column column);
+
+/**
+ * Get a column's element size and width (elements per detection).
+ *
+ * @param column The column
+ * @param [out] width The elements per detection
+ * @return The element size
+ */
+size_t detections_column_item(enum detections_column column, size_t* width);
+
+#endif // #ifndef CORE_DETECTIONS_H
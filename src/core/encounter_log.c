@@ -0,0 +1,612 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <errmsg.h>
+
+#include "encounter_log.h"
+#include "memory.h"
+
+/** The spill file magic. Bump the digits if the record layout changes. */
+#define ENCOUNTER_SPILL_MAGIC "CZENC001"
+
+/** The spill file magic length. */
+#define ENCOUNTER_SPILL_MAGIC_LEN 8
+
+/** The most rows sent in one INSERT (keeps us well under max_allowed_packet). */
+#define ENCOUNTER_INSERT_MAX_ROWS 512
+
+/** The longest we back off from an unreachable server, in seconds. */
+#define ENCOUNTER_RETRY_MAX 30.0
+
+/**
+ * Get the current UNIX time in seconds.
+ *
+ * @return The time
+ */
+static double encounter_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Hash a track key.
+ *
+ * @param robot_id The robot ID
+ * @param track_id The track ID
+ * @return The hash
+ */
+static uint64_t encounter_track_hash(int32_t robot_id, int64_t track_id) {
+  // Fibonacci hashing over the mixed key
+  uint64_t k = (uint64_t) track_id ^ ((uint64_t) (uint32_t) robot_id << 32 | (uint32_t) robot_id);
+  return k * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+/**
+ * Find the dedup slot for a track, or the empty slot where it would go.
+ *
+ * @param tracks The table
+ * @param cap The table capacity (power of two)
+ * @param robot_id The robot ID
+ * @param track_id The track ID
+ * @return The slot
+ */
+static struct encounter_track* encounter_track_find(struct encounter_track* tracks, size_t cap, int32_t robot_id,
+    int64_t track_id) {
+  size_t i = (size_t) (encounter_track_hash(robot_id, track_id) >> 32) & (cap - 1);
+
+  // Linear probing; the table is never more than half full
+  while (tracks[i].used && (tracks[i].robot_id != robot_id || tracks[i].track_id != track_id)) {
+    i = (i + 1) & (cap - 1);
+  }
+
+  return &tracks[i];
+}
+
+/**
+ * Rebuild the dedup table, dropping tracks that went quiet and forgetting
+ * pending indices (the pending rows are being flushed).
+ *
+ * @param log The log
+ * @param now The current time
+ * @param min_cap The minimum capacity of the new table
+ * @return Zero on success, otherwise nonzero
+ */
+static int encounter_tracks_rebuild(struct encounter_log* log, double now, size_t min_cap) {
+  size_t cap = 64;
+  while (cap < min_cap) {
+    cap *= 2;
+  }
+
+  struct encounter_track* tracks = memory_calloc(memory_tag_encounters, cap, sizeof *tracks);
+  if (tracks == NULL) {
+    return 1;
+  }
+
+  size_t num = 0;
+  for (size_t i = 0; i < log->cap_tracks; ++i) {
+    struct encounter_track* t = &log->tracks[i];
+
+    if (!t->used || now - t->time > log->dedup_window) {
+      continue;
+    }
+
+    struct encounter_track* slot = encounter_track_find(tracks, cap, t->robot_id, t->track_id);
+    *slot = *t;
+    slot->pending = -1;
+    ++num;
+  }
+
+  memory_free(log->tracks);
+  log->tracks = tracks;
+  log->num_tracks = num;
+  log->cap_tracks = cap;
+  return 0;
+}
+
+int encounter_log_record(struct encounter_log* log, const struct encounter* e) {
+  pthread_mutex_lock(&log->lock);
+
+  ++log->stats.recorded;
+
+  // Keep the table at most half full
+  if ((log->num_tracks + 1) * 2 > log->cap_tracks) {
+    // Only flushes forget pending indices, so carry them over here
+    size_t cap = log->cap_tracks * 2;
+    struct encounter_track* tracks = memory_calloc(memory_tag_encounters, cap, sizeof *tracks);
+    if (tracks == NULL) {
+      pthread_mutex_unlock(&log->lock);
+      return 1;
+    }
+
+    for (size_t i = 0; i < log->cap_tracks; ++i) {
+      if (log->tracks[i].used) {
+        *encounter_track_find(tracks, cap, log->tracks[i].robot_id, log->tracks[i].track_id) = log->tracks[i];
+      }
+    }
+
+    memory_free(log->tracks);
+    log->tracks = tracks;
+    log->cap_tracks = cap;
+  }
+
+  struct encounter_track* t = encounter_track_find(log->tracks, log->cap_tracks, e->robot_id, e->track_id);
+
+  // Same friend on the same track, not long ago, so it's the same encounter
+  if (t->used && t->friend_id == e->friend_id && e->time - t->time <= log->dedup_window) {
+    t->time = e->time;
+
+    // Keep the best confidence if the row hasn't gone out yet
+    if (t->pending >= 0 && log->pending[t->pending].confidence < e->confidence) {
+      log->pending[t->pending].confidence = e->confidence;
+    }
+
+    ++log->stats.deduped;
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+  }
+
+  // Make room for a new row
+  if (log->num_pending == log->cap_pending) {
+    size_t cap = log->cap_pending ? log->cap_pending * 2 : log->batch_size;
+    struct encounter* pending = memory_realloc(memory_tag_encounters, log->pending, cap * sizeof *pending);
+    if (pending == NULL) {
+      pthread_mutex_unlock(&log->lock);
+      return 1;
+    }
+
+    log->pending = pending;
+    log->cap_pending = cap;
+  }
+
+  log->pending[log->num_pending] = *e;
+
+  if (!t->used) {
+    ++log->num_tracks;
+  }
+
+  t->used = 1;
+  t->robot_id = e->robot_id;
+  t->track_id = e->track_id;
+  t->friend_id = e->friend_id;
+  t->time = e->time;
+  t->pending = (ptrdiff_t) log->num_pending++;
+
+  // Wake the flusher once a batch is ready
+  if (log->num_pending == log->batch_size) {
+    pthread_cond_signal(&log->cond);
+  }
+
+  pthread_mutex_unlock(&log->lock);
+  return 0;
+}
+
+/**
+ * Insert rows into the database.
+ *
+ * @param log The log
+ * @param rows The rows
+ * @param num_rows The number of rows
+ * @param buf A scratch buffer
+ * @return The number of rows inserted (stops at the first failure)
+ */
+static size_t encounter_insert(struct encounter_log* log, const struct encounter* rows, size_t num_rows,
+    struct sql_buf* buf) {
+  size_t done = 0;
+
+  while (done < num_rows) {
+    size_t n = num_rows - done;
+    if (n > ENCOUNTER_INSERT_MAX_ROWS) {
+      n = ENCOUNTER_INSERT_MAX_ROWS;
+    }
+
+    // Build one multi-row insert
+    // Rows already present (on the natural key) are left alone, so replaying a spill file twice is harmless
+    // Unlike INSERT IGNORE, this still fails on bad data rather than storing it with a warning
+    buf->len = 0;
+    int err = sql_buf_appendf(buf, "INSERT INTO encounters (friend_id, robot_id, track_id, time, confidence) VALUES ");
+    for (size_t i = 0; i < n && !err; ++i) {
+      const struct encounter* e = &rows[done + i];
+      err = sql_buf_appendf(buf, "%s(%d,%d,%lld,FROM_UNIXTIME(%.3f),%.6g)", i ? "," : "", e->friend_id, e->robot_id,
+        (long long) e->track_id, e->time, (double) e->confidence);
+    }
+
+    if (!err) {
+      err = sql_buf_appendf(buf, " ON DUPLICATE KEY UPDATE id = id");
+    }
+
+    if (err) {
+      break;
+    }
+
+    if (mysql_real_query(log->conn, buf->data, buf->len)) {
+      unsigned int err_no = mysql_errno(log->conn);
+      fprintf(stderr, "failed to insert encounters: %s\n", mysql_error(log->conn));
+
+      // Drop the connection on anything that smells like a network problem
+      if (err_no == CR_SERVER_GONE_ERROR || err_no == CR_SERVER_LOST) {
+        mysql_close(log->conn);
+        log->conn = NULL;
+      }
+
+      break;
+    }
+
+    done += n;
+  }
+
+  return done;
+}
+
+/**
+ * Append rows to the spill file.
+ *
+ * @param log The log
+ * @param rows The rows
+ * @param num_rows The number of rows
+ * @return Zero on success, otherwise nonzero
+ */
+static int encounter_spill(struct encounter_log* log, const struct encounter* rows, size_t num_rows) {
+  int fd = open(log->spill_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "failed to open encounter spill file %s: %s\n", log->spill_path, strerror(errno));
+    return 1;
+  }
+
+  // Other processes may share the file, so hold off their replays (and truncation) while appending
+  while (flock(fd, LOCK_EX) < 0) {
+    if (errno != EINTR) {
+      fprintf(stderr, "failed to lock encounter spill file %s: %s\n", log->spill_path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+  }
+
+  // A fresh file gets the magic first
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size == 0 && write(fd, ENCOUNTER_SPILL_MAGIC, ENCOUNTER_SPILL_MAGIC_LEN) != ENCOUNTER_SPILL_MAGIC_LEN) {
+    close(fd);
+    return 1;
+  }
+
+  const char* data = (const char*) rows;
+  size_t left = num_rows * sizeof *rows;
+  while (left > 0) {
+    ssize_t n = write(fd, data, left);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      fprintf(stderr, "failed to write encounter spill file: %s\n", strerror(errno));
+      close(fd);
+      return 1;
+    }
+
+    data += n;
+    left -= (size_t) n;
+  }
+
+  // The whole point is surviving an outage, so make it durable
+  fdatasync(fd);
+  close(fd);
+  return 0;
+}
+
+/**
+ * Replay the spill file into the database.
+ *
+ * The file may be shared with other processes, so it is locked throughout;
+ * if another process holds it, this gives up until the next flush. Every
+ * replay starts from the top, and inserts leave rows already present, so a
+ * replay cut short (by an outage or a crash before the truncate) only sends
+ * some rows twice rather than inserting them twice. The file is truncated
+ * once fully replayed.
+ *
+ * @param log The log
+ * @param [out] drained Nonzero if the file is now empty (or missing)
+ * @param buf A scratch buffer
+ * @return The number of rows replayed
+ */
+static size_t encounter_replay(struct encounter_log* log, int* drained, struct sql_buf* buf) {
+  *drained = 0;
+
+  int fd = open(log->spill_path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    *drained = errno == ENOENT;
+    return 0;
+  }
+
+  // Another process is appending or replaying, so try again later
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    close(fd);
+    return 0;
+  }
+
+  // An empty file means there's nothing to do
+  char magic[ENCOUNTER_SPILL_MAGIC_LEN];
+  ssize_t magic_len = pread(fd, magic, sizeof magic, 0);
+  if (magic_len <= 0) {
+    *drained = magic_len == 0;
+    close(fd);
+    return 0;
+  }
+
+  // Check the magic
+  if (magic_len != sizeof magic || memcmp(magic, ENCOUNTER_SPILL_MAGIC, sizeof magic)) {
+    fprintf(stderr, "ignoring unrecognized encounter spill file %s\n", log->spill_path);
+    *drained = 1;
+    close(fd);
+    return 0;
+  }
+
+  struct encounter rows[ENCOUNTER_INSERT_MAX_ROWS];
+  off_t offset = ENCOUNTER_SPILL_MAGIC_LEN;
+  size_t replayed = 0;
+
+  while (1) {
+    ssize_t n = pread(fd, rows, sizeof rows, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    // Keep the file for the next flush rather than mistaking a failed read for the end
+    if (n < 0) {
+      fprintf(stderr, "failed to read encounter spill file %s: %s\n", log->spill_path, strerror(errno));
+      break;
+    }
+
+    // A torn trailing record (crash mid-write) is ignored
+    size_t num_rows = n > 0 ? (size_t) n / sizeof *rows : 0;
+    if (num_rows == 0) {
+      // All caught up
+      *drained = ftruncate(fd, 0) == 0;
+      break;
+    }
+
+    size_t done = encounter_insert(log, rows, num_rows, buf);
+    offset += (off_t) (done * sizeof *rows);
+    replayed += done;
+
+    if (done < num_rows) {
+      break;
+    }
+  }
+
+  close(fd);
+  return replayed;
+}
+
+/**
+ * Get a connection, respecting the retry backoff.
+ *
+ * @param log The log
+ * @param now The current time
+ * @param retry_at [in,out] The earliest time to try connecting again
+ * @param retry_delay [in,out] The current backoff
+ * @return Nonzero if connected
+ */
+static int encounter_connect(struct encounter_log* log, double now, double* retry_at, double* retry_delay) {
+  if (log->conn) {
+    return 1;
+  }
+
+  if (now < *retry_at) {
+    return 0;
+  }
+
+  log->conn = sql_connect(&log->params, 0);
+  if (log->conn == NULL) {
+    *retry_at = now + *retry_delay;
+    *retry_delay = *retry_delay * 2 > ENCOUNTER_RETRY_MAX ? ENCOUNTER_RETRY_MAX : *retry_delay * 2;
+    return 0;
+  }
+
+  *retry_delay = 1.0;
+  return 1;
+}
+
+/**
+ * The flusher thread main function.
+ *
+ * @param arg The log
+ * @return Nothing
+ */
+static void* encounter_log_thread_main(void* arg) {
+  struct encounter_log* log = arg;
+
+  mysql_thread_init();
+
+  // Rows being flushed (swapped with the pending rows)
+  struct encounter* rows = NULL;
+  size_t cap_rows = 0;
+
+  // Scratch buffer for statements
+  struct sql_buf buf = {0};
+
+  // Reconnection backoff
+  double retry_at = 0;
+  double retry_delay = 1.0;
+
+  // Leftovers from a previous run (or another process) get replayed too
+  int spill_dirty = access(log->spill_path, F_OK) == 0;
+
+  pthread_mutex_lock(&log->lock);
+  while (1) {
+    // Sleep until a batch is ready, someone asks, or the interval elapses
+    double deadline = encounter_now() + log->flush_interval;
+    struct timespec ts = {
+      .tv_sec = (time_t) deadline,
+      .tv_nsec = (long) ((deadline - (double) (time_t) deadline) * 1e9),
+    };
+
+    while (!log->stop && log->num_pending < log->batch_size && log->flush_requested == log->flush_served) {
+      if (pthread_cond_timedwait(&log->cond, &log->lock, &ts) == ETIMEDOUT) {
+        break;
+      }
+    }
+
+    // Swap the pending rows out so recording can carry on meanwhile
+    struct encounter* taken = log->pending;
+    size_t cap_taken = log->cap_pending;
+    size_t num_taken = log->num_pending;
+    log->pending = rows;
+    log->cap_pending = cap_rows;
+    log->num_pending = 0;
+    rows = taken;
+    cap_rows = cap_taken;
+
+    // The rows are gone from the pending list, so tracks must stop pointing at them
+    double now = encounter_now();
+    if (encounter_tracks_rebuild(log, now, log->num_tracks * 2)) {
+      for (size_t i = 0; i < log->cap_tracks; ++i) {
+        log->tracks[i].pending = -1;
+      }
+    }
+
+    uint64_t request = log->flush_requested;
+    int stop = log->stop;
+    pthread_mutex_unlock(&log->lock);
+
+    struct encounter_log_stats delta = {0};
+
+    if (num_taken > 0 || spill_dirty) {
+      int connected = encounter_connect(log, now, &retry_at, &retry_delay);
+
+      // Catch up on spilled rows first, so they keep their order
+      if (connected && spill_dirty) {
+        int drained;
+        delta.replayed = encounter_replay(log, &drained, &buf);
+        spill_dirty = !drained;
+      }
+
+      size_t inserted = connected && !spill_dirty ? encounter_insert(log, rows, num_taken, &buf) : 0;
+      delta.inserted = inserted + delta.replayed;
+
+      // Whatever didn't make it goes to disk
+      if (inserted < num_taken) {
+        if (encounter_spill(log, rows + inserted, num_taken - inserted) == 0) {
+          delta.spilled = num_taken - inserted;
+          spill_dirty = 1;
+        } else {
+          delta.dropped = num_taken - inserted;
+        }
+      }
+    }
+
+    pthread_mutex_lock(&log->lock);
+
+    log->stats.inserted += delta.inserted;
+    log->stats.spilled += delta.spilled;
+    log->stats.replayed += delta.replayed;
+    log->stats.dropped += delta.dropped;
+
+    log->flush_served = request;
+    pthread_cond_broadcast(&log->flushed);
+
+    if (stop && log->num_pending == 0) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&log->lock);
+
+  if (log->conn) {
+    mysql_close(log->conn);
+    log->conn = NULL;
+  }
+
+  memory_free(rows);
+  sql_buf_release(&buf);
+  mysql_thread_end();
+  return NULL;
+}
+
+int encounter_log_start(struct encounter_log* log, const struct sql_params* params, const char* spill_path,
+    size_t batch_size, double flush_interval, double dedup_window) {
+  sql_library_init();
+
+  memset(log, 0, sizeof *log);
+
+  log->params.host = params->host ? memory_strdup(memory_tag_encounters, params->host) : NULL;
+  log->params.user = params->user ? memory_strdup(memory_tag_encounters, params->user) : NULL;
+  log->params.pass = params->pass ? memory_strdup(memory_tag_encounters, params->pass) : NULL;
+  log->params.db = params->db ? memory_strdup(memory_tag_encounters, params->db) : NULL;
+  log->params.port = params->port;
+  log->spill_path = memory_strdup(memory_tag_encounters, spill_path);
+  log->batch_size = batch_size ? batch_size : 1;
+  log->flush_interval = flush_interval > 0 ? flush_interval : 1.0;
+  log->dedup_window = dedup_window;
+
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->cond, NULL);
+  pthread_cond_init(&log->flushed, NULL);
+
+  if (encounter_tracks_rebuild(log, encounter_now(), 64) || log->spill_path == NULL
+      || pthread_create(&log->thread, NULL, &encounter_log_thread_main, log)) {
+    log->running = 0;
+    encounter_log_stop(log);
+    return 1;
+  }
+
+  log->running = 1;
+  return 0;
+}
+
+void encounter_log_flush(struct encounter_log* log) {
+  pthread_mutex_lock(&log->lock);
+
+  if (log->running) {
+    uint64_t request = ++log->flush_requested;
+    pthread_cond_signal(&log->cond);
+
+    while (log->flush_served < request) {
+      pthread_cond_wait(&log->flushed, &log->lock);
+    }
+  }
+
+  pthread_mutex_unlock(&log->lock);
+}
+
+void encounter_log_get_stats(struct encounter_log* log, struct encounter_log_stats* stats) {
+  pthread_mutex_lock(&log->lock);
+  *stats = log->stats;
+  pthread_mutex_unlock(&log->lock);
+}
+
+void encounter_log_stop(struct encounter_log* log) {
+  pthread_mutex_lock(&log->lock);
+  int running = log->running;
+  log->stop = 1;
+  log->running = 0;
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+
+  // The flusher drains what's pending before it exits
+  if (running) {
+    pthread_join(log->thread, NULL);
+  }
+
+  pthread_cond_destroy(&log->flushed);
+  pthread_cond_destroy(&log->cond);
+  pthread_mutex_destroy(&log->lock);
+
+  memory_free(log->pending);
+  memory_free(log->tracks);
+  memory_free(log->spill_path);
+  memory_free((char*) log->params.host);
+  memory_free((char*) log->params.user);
+  memory_free((char*) log->params.pass);
+  memory_free((char*) log->params.db);
+  memset(log, 0, sizeof *log);
+}
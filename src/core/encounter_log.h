@@ -0,0 +1,196 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_ENCOUNTER_LOG_H
+#define CORE_ENCOUNTER_LOG_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sql.h"
+
+/** A robot recognizing a friend. */
+struct encounter {
+  /** The friend ID. */
+  int32_t friend_id;
+
+  /** The robot ID. */
+  int32_t robot_id;
+
+  /** The face track ID (unique per robot). */
+  int64_t track_id;
+
+  /** The UNIX time in seconds. */
+  double time;
+
+  /** The match confidence. */
+  float confidence;
+};
+
+/** A dedup table slot remembering the last encounter on a track. */
+struct encounter_track {
+  /** The robot ID. */
+  int32_t robot_id;
+
+  /** The friend ID last seen on the track. */
+  int32_t friend_id;
+
+  /** The track ID. */
+  int64_t track_id;
+
+  /** The time the track last produced an encounter. */
+  double time;
+
+  /** The pending index of the encounter, or -1 if already flushed. */
+  ptrdiff_t pending;
+
+  /** Nonzero if the slot is in use. */
+  int used;
+};
+
+/** Encounter log counters. */
+struct encounter_log_stats {
+  /** Encounters recorded. */
+  uint64_t recorded;
+
+  /** Encounters folded into an earlier one on the same track. */
+  uint64_t deduped;
+
+  /** Rows inserted into the database. */
+  uint64_t inserted;
+
+  /** Rows written to the spill file. */
+  uint64_t spilled;
+
+  /** Rows replayed from the spill file. */
+  uint64_t replayed;
+
+  /** Rows dropped because they could be neither inserted nor spilled. */
+  uint64_t dropped;
+};
+
+/**
+ * A write-behind log of encounters.
+ *
+ * Recording only appends to memory. A flusher thread turns what has
+ * accumulated into multi-row INSERTs once enough rows are pending or the
+ * flush interval elapses. Repeats from the same track within the dedup window
+ * collapse into one row. If the database can't be reached, rows go to an
+ * append-only spill file and are replayed once it comes back. Processes may
+ * share a spill file: appends and replays hold an flock, and replayed rows are
+ * inserted idempotently.
+ */
+struct encounter_log {
+  /** The connection parameters (strings owned). */
+  struct sql_params params;
+
+  /** The spill file path (owned). */
+  char* spill_path;
+
+  /** The number of pending rows that triggers a flush. */
+  size_t batch_size;
+
+  /** The longest time a row may stay pending, in seconds. */
+  double flush_interval;
+
+  /** The window in which a track's repeats are collapsed, in seconds. */
+  double dedup_window;
+
+  /** The flusher thread. */
+  pthread_t thread;
+
+  /** The lock guarding everything below. */
+  pthread_mutex_t lock;
+
+  /** Signalled when a flush is wanted or the log stops. */
+  pthread_cond_t cond;
+
+  /** Signalled when a flush completes. */
+  pthread_cond_t flushed;
+
+  /** The pending rows. */
+  struct encounter* pending;
+
+  /** The number of pending rows. */
+  size_t num_pending;
+
+  /** The capacity of the pending rows. */
+  size_t cap_pending;
+
+  /** The dedup table (open addressing). */
+  struct encounter_track* tracks;
+
+  /** The number of used dedup table slots. */
+  size_t num_tracks;
+
+  /** The dedup table capacity (power of two). */
+  size_t cap_tracks;
+
+  /** Incremented by each explicit flush request. */
+  uint64_t flush_requested;
+
+  /** The last flush request the flusher has served. */
+  uint64_t flush_served;
+
+  /** The counters. */
+  struct encounter_log_stats stats;
+
+  /** Nonzero once the log is stopping. */
+  int stop;
+
+  /** Nonzero while the flusher thread runs. */
+  int running;
+
+  /** The connection. Only touched by the flusher thread. */
+  MYSQL* conn;
+};
+
+/**
+ * Start an encounter log.
+ *
+ * @param log The log
+ * @param params The connection parameters (copied)
+ * @param spill_path The spill file path (copied)
+ * @param batch_size The number of pending rows that triggers a flush
+ * @param flush_interval The longest a row may stay pending, in seconds
+ * @param dedup_window The window in which a track's repeats collapse, in seconds
+ * @return Zero on success, otherwise nonzero
+ */
+int encounter_log_start(struct encounter_log* log, const struct sql_params* params, const char* spill_path,
+    size_t batch_size, double flush_interval, double dedup_window);
+
+/**
+ * Record an encounter. Never touches the database.
+ *
+ * @param log The log
+ * @param e The encounter
+ * @return Zero on success, otherwise nonzero (out of memory)
+ */
+int encounter_log_record(struct encounter_log* log, const struct encounter* e);
+
+/**
+ * Flush everything pending and wait for it to land (or spill).
+ *
+ * @param log The log
+ */
+void encounter_log_flush(struct encounter_log* log);
+
+/**
+ * Read the counters.
+ *
+ * @param log The log
+ * @param [out] stats The counters
+ */
+void encounter_log_get_stats(struct encounter_log* log, struct encounter_log_stats* stats);
+
+/**
+ * Flush what's pending and stop the flusher thread.
+ *
+ * @param log The log
+ */
+void encounter_log_stop(struct encounter_log* log);
+
+#endif // #ifndef CORE_ENCOUNTER_LOG_H
@@ -0,0 +1,189 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "face_quality.h"
+
+/** The pitch ratio of a frontal face (nose between the eye and mouth lines). */
+#define FRONTAL_PITCH_RATIO 0.55f
+
+/** Radians to degrees. */
+#define DEGREES (180.0f / 3.14159265f)
+
+void face_quality_defaults(struct face_quality_params* params) {
+  params->min_size = 40;
+  params->good_size = 112;
+  params->good_sharpness = 300;
+  params->max_yaw = 50;
+  params->max_pitch = 40;
+}
+
+/**
+ * Sum the Laplacian and its square along one row.
+ *
+ * @param above The row above
+ * @param row The row
+ * @param below The row below
+ * @param width The row width
+ * @param sum The running sum
+ * @param sum_sq The running sum of squares
+ */
+static void laplacian_row(const uint8_t* above, const uint8_t* row, const uint8_t* below, size_t width, int64_t* sum,
+    int64_t* sum_sq) {
+  size_t x = 1;
+
+#ifdef __SSE2__
+  // Eight pixels per step in 16-bit lanes, where the Laplacian (within +/-1020) fits
+  // Squares accumulate pairwise in 32-bit lanes, so flush before they could overflow
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  __m128i acc = _mm_setzero_si128();
+  __m128i acc_sq = _mm_setzero_si128();
+  int steps = 0;
+
+  for (; x + 8 < width; x += 8) {
+    __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (row + x)), zero);
+    __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (row + x - 1)), zero);
+    __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (row + x + 1)), zero);
+    __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (above + x)), zero);
+    __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (below + x)), zero);
+
+    __m128i lap = _mm_sub_epi16(_mm_slli_epi16(c, 2), _mm_add_epi16(_mm_add_epi16(l, r), _mm_add_epi16(u, d)));
+
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(lap, ones));
+    acc_sq = _mm_add_epi32(acc_sq, _mm_madd_epi16(lap, lap));
+
+    // Each step adds at most 2 * 1020^2 to a lane
+    if (++steps == 512 || x + 16 >= width) {
+      int32_t lanes[4];
+      int32_t lanes_sq[4];
+      _mm_storeu_si128((__m128i*) lanes, acc);
+      _mm_storeu_si128((__m128i*) lanes_sq, acc_sq);
+
+      for (int i = 0; i < 4; ++i) {
+        *sum += lanes[i];
+        *sum_sq += (uint32_t) lanes_sq[i];
+      }
+
+      acc = _mm_setzero_si128();
+      acc_sq = _mm_setzero_si128();
+      steps = 0;
+    }
+  }
+#endif
+
+  // The rest one pixel at a time
+  for (; x + 1 < width; ++x) {
+    int lap = 4 * row[x] - row[x - 1] - row[x + 1] - above[x] - below[x];
+    *sum += lap;
+    *sum_sq += lap * lap;
+  }
+}
+
+float face_quality_sharpness(const uint8_t* gray, size_t width, size_t height, size_t stride) {
+  if (width < 3 || height < 3) {
+    return 0;
+  }
+
+  int64_t sum = 0;
+  int64_t sum_sq = 0;
+
+  for (size_t y = 1; y + 1 < height; ++y) {
+    laplacian_row(gray + (y - 1) * stride, gray + y * stride, gray + (y + 1) * stride, width, &sum, &sum_sq);
+  }
+
+  double n = (double) (width - 2) * (double) (height - 2);
+  double mean = (double) sum / n;
+  return (float) ((double) sum_sq / n - mean * mean);
+}
+
+void face_quality_pose(const float* landmarks, struct face_pose* pose) {
+  float left_eye_x = landmarks[0];
+  float left_eye_y = landmarks[1];
+  float right_eye_x = landmarks[2];
+  float right_eye_y = landmarks[3];
+  float nose_x = landmarks[4];
+  float nose_y = landmarks[5];
+  float mouth_y = (landmarks[7] + landmarks[9]) / 2;
+
+  float eye_dx = right_eye_x - left_eye_x;
+  float eye_dy = right_eye_y - left_eye_y;
+  float eye_dist = sqrtf(eye_dx * eye_dx + eye_dy * eye_dy);
+
+  pose->roll = atan2f(eye_dy, eye_dx) * DEGREES;
+
+  if (eye_dist < 1e-3f) {
+    pose->yaw = 90;
+    pose->pitch = 0;
+    return;
+  }
+
+  // The nose swings off the eye midpoint by about sin(yaw) half eye distances
+  float offset = (nose_x - (left_eye_x + right_eye_x) / 2) / (eye_dist / 2);
+  if (offset > 1) {
+    offset = 1;
+  } else if (offset < -1) {
+    offset = -1;
+  }
+  pose->yaw = asinf(offset) * DEGREES;
+
+  // Looking down pushes the nose toward the mouth line, looking up toward the eyes
+  float eye_y = (left_eye_y + right_eye_y) / 2;
+  float span = mouth_y - eye_y;
+  if (span < 1e-3f) {
+    pose->pitch = 90;
+    return;
+  }
+
+  float ratio = (nose_y - eye_y) / span - FRONTAL_PITCH_RATIO;
+  if (ratio > 1) {
+    ratio = 1;
+  } else if (ratio < -1) {
+    ratio = -1;
+  }
+  pose->pitch = asinf(ratio) * DEGREES;
+}
+
+/**
+ * Map a value onto 0..1 between an unusable and a good value.
+ *
+ * @param value The value
+ * @param bad The unusable value
+ * @param good The good value
+ * @return The term
+ */
+static float ramp(float value, float bad, float good) {
+  float t = (value - bad) / (good - bad);
+  return t < 0 ? 0 : t > 1 ? 1 : t;
+}
+
+void face_quality_score(const struct face_quality_params* params, const uint8_t* gray, size_t width, size_t height,
+    size_t stride, const float* landmarks, struct face_quality* quality) {
+  quality->size = (float) (width < height ? width : height);
+  quality->sharpness = face_quality_sharpness(gray, width, height, stride);
+
+  float score = ramp(quality->size, params->min_size, params->good_size);
+  score *= ramp(quality->sharpness, 0, params->good_sharpness);
+
+  if (landmarks) {
+    face_quality_pose(landmarks, &quality->pose);
+
+    // Roll is undone by alignment, but yaw and pitch hide half the face
+    score *= ramp(fabsf(quality->pose.yaw), params->max_yaw, 0);
+    score *= ramp(fabsf(quality->pose.pitch), params->max_pitch, 0);
+  } else {
+    quality->pose.yaw = 0;
+    quality->pose.pitch = 0;
+    quality->pose.roll = 0;
+  }
+
+  quality->score = score;
+}
@@ -0,0 +1,111 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_FACE_QUALITY_H
+#define CORE_FACE_QUALITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Face quality thresholds.
+ *
+ * A crop gets full marks for a term once it reaches the "good" value, and
+ * none at or past the limit. The score is the product of the terms, so any
+ * one bad term (blurry, tiny or turned away) sinks the crop.
+ */
+struct face_quality_params {
+  /** The smallest usable face side, in pixels. */
+  float min_size;
+
+  /** The face side that earns full marks, in pixels. */
+  float good_size;
+
+  /** The Laplacian variance that earns full marks. */
+  float good_sharpness;
+
+  /** The yaw at which a face is unusable, in degrees. */
+  float max_yaw;
+
+  /** The pitch at which a face is unusable, in degrees. */
+  float max_pitch;
+};
+
+/** A rough head pose, in degrees. */
+struct face_pose {
+  /** Turn left or right (positive when the nose points to image right). */
+  float yaw;
+
+  /** Nod up or down (positive when the nose points down). */
+  float pitch;
+
+  /** Tilt in the image plane (positive clockwise). */
+  float roll;
+};
+
+/** A quality verdict. */
+struct face_quality {
+  /** The overall score, from 0 (useless) to 1. */
+  float score;
+
+  /** The Laplacian variance of the crop. */
+  float sharpness;
+
+  /** The face side (the shorter of width and height), in pixels. */
+  float size;
+
+  /** The pose. */
+  struct face_pose pose;
+};
+
+/**
+ * Fill in default thresholds, tuned for 112 px embedder input.
+ *
+ * @param params The thresholds
+ */
+void face_quality_defaults(struct face_quality_params* params);
+
+/**
+ * Measure sharpness as the variance of the 4-neighbour Laplacian.
+ *
+ * Blur removes high frequencies, which flattens the Laplacian, so sharper
+ * images score higher. Border pixels are skipped. Uses SSE2 where available.
+ *
+ * @param gray The top-left pixel of the 8-bit gray image
+ * @param width The width (at least 3 to measure anything)
+ * @param height The height (at least 3 to measure anything)
+ * @param stride The bytes between rows
+ * @return The variance, or zero if the image is too small
+ */
+float face_quality_sharpness(const uint8_t* gray, size_t width, size_t height, size_t stride);
+
+/**
+ * Estimate head pose from five landmarks.
+ *
+ * Points are (x, y) pairs in order: left eye, right eye, nose, left mouth
+ * corner, right mouth corner. Yaw comes from how far the nose sits off the
+ * eye midpoint, pitch from where it sits between the eye and mouth lines,
+ * and roll from the eye line. Good enough to rank crops, not to measure.
+ *
+ * @param landmarks The ten landmark coordinates
+ * @param pose The pose
+ */
+void face_quality_pose(const float* landmarks, struct face_pose* pose);
+
+/**
+ * Score a face crop.
+ *
+ * @param params The thresholds
+ * @param gray The top-left pixel of the face crop (8-bit gray)
+ * @param width The crop width
+ * @param height The crop height
+ * @param stride The bytes between crop rows
+ * @param landmarks The ten landmark coordinates, or NULL to ignore pose
+ * @param quality The verdict
+ */
+void face_quality_score(const struct face_quality_params* params, const uint8_t* gray, size_t width, size_t height,
+    size_t stride, const float* landmarks, struct face_quality* quality);
+
+#endif // #ifndef CORE_FACE_QUALITY_H
@@ -0,0 +1,80 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "frame_producer.h"
+
+struct frame_producer* frame_producer_open(const char* name, uint32_t num_slots, uint32_t slot_size) {
+  struct frame_producer* p = malloc(sizeof *p);
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return NULL;
+  }
+
+  if (frame_ring_create(&p->ring, name, num_slots, slot_size)) {
+    free(p);
+    return NULL;
+  }
+
+  jpeg_decoder_init(&p->decoder);
+  return p;
+}
+
+void frame_producer_close(struct frame_producer* p) {
+  if (p == NULL) {
+    return;
+  }
+
+  jpeg_decoder_destroy(&p->decoder);
+  frame_ring_detach(&p->ring);
+  free(p);
+}
+
+void* frame_producer_acquire(struct frame_producer* p, size_t* capacity) {
+  return frame_ring_acquire(&p->ring, capacity);
+}
+
+uint64_t frame_producer_commit(struct frame_producer* p, const struct frame_info* info) {
+  return frame_ring_commit(&p->ring, info);
+}
+
+int frame_producer_publish_jpeg(struct frame_producer* p, const void* data, size_t len, int scale, int gray,
+    double timestamp) {
+  // Learn the output shape before giving up a slot
+  struct jpeg_image image;
+  if (jpeg_decoder_begin(&p->decoder, data, len, scale, gray, &image)) {
+    fprintf(stderr, "failed to decode frame: %s\n", p->decoder.message);
+    return 1;
+  }
+
+  size_t size = (size_t) image.width * image.height * image.components;
+  if (size > p->ring.header->slot_size) {
+    fprintf(stderr, "decoded frame of %zu bytes exceeds slot size %u\n", size, p->ring.header->slot_size);
+    jpeg_decoder_abort(&p->decoder);
+    return 1;
+  }
+
+  size_t capacity;
+  void* slot = frame_ring_acquire(&p->ring, &capacity);
+
+  // A failed decode leaves the slot acquired, and the next acquire takes it over
+  if (jpeg_decoder_finish(&p->decoder, slot, capacity)) {
+    fprintf(stderr, "failed to decode frame: %s\n", p->decoder.message);
+    return 1;
+  }
+
+  frame_ring_commit(&p->ring, &(struct frame_info) {
+    .timestamp = timestamp,
+    .width = image.width,
+    .height = image.height,
+    .stride = image.width * image.components,
+    .format = gray ? frame_format_gray8 : frame_format_rgb24,
+    .len = (uint32_t) size,
+  });
+
+  return 0;
+}
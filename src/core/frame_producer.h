@@ -0,0 +1,85 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_FRAME_PRODUCER_H
+#define CORE_FRAME_PRODUCER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame_ring.h"
+#include "jpeg_decoder.h"
+
+/*
+ * The producer library.
+ *
+ * These are the entry points of the shared library loaded by the robot SDK
+ * process (through ctypes) to publish frames for cozmo to consume. The handle
+ * lives on the heap, so callers never need to know its layout.
+ */
+
+/** A frame producer. */
+struct frame_producer {
+  /** The ring. */
+  struct frame_ring ring;
+
+  /** The JPEG decoder. */
+  struct jpeg_decoder decoder;
+};
+
+/**
+ * Create a frame ring and return a producer handle for it.
+ *
+ * @param name The shared memory object name (e.g. "/cozmo-frames-1")
+ * @param num_slots The number of slots
+ * @param slot_size The data capacity of each slot
+ * @return The handle, or NULL on failure
+ */
+struct frame_producer* frame_producer_open(const char* name, uint32_t num_slots, uint32_t slot_size);
+
+/**
+ * Close and unlink a frame ring, and free its producer handle.
+ *
+ * @param p The handle
+ */
+void frame_producer_close(struct frame_producer* p);
+
+/**
+ * Get the slot the next frame should be written into.
+ *
+ * @param p The handle
+ * @param [out] capacity The slot data capacity
+ * @return The slot data
+ */
+void* frame_producer_acquire(struct frame_producer* p, size_t* capacity);
+
+/**
+ * Publish the frame written into the acquired slot.
+ *
+ * @param p The handle
+ * @param info The frame metadata (the number is assigned here)
+ * @return The frame number
+ */
+uint64_t frame_producer_commit(struct frame_producer* p, const struct frame_info* info);
+
+/**
+ * Decode a JPEG (e.g. an MJPEG camera frame) straight into the next slot and
+ * publish it, downscaled in the DCT domain and optionally gray.
+ *
+ * Consumers that need full-resolution crops should have the JPEG itself
+ * published instead, and decode regions from it on their side.
+ *
+ * @param p The handle
+ * @param data The JPEG data
+ * @param len The JPEG data length
+ * @param scale The scale denominator (1, 2, 4 or 8)
+ * @param gray Nonzero for gray output, zero for RGB
+ * @param timestamp The capture time, in seconds
+ * @return Zero on success, otherwise nonzero
+ */
+int frame_producer_publish_jpeg(struct frame_producer* p, const void* data, size_t len, int scale, int gray,
+    double timestamp);
+
+#endif // #ifndef CORE_FRAME_PRODUCER_H
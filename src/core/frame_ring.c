@@ -0,0 +1,409 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame_ring.h"
+#include "memory.h"
+
+/** The layout magic ("CZFRAME1" in memory order). */
+#define FRAME_RING_MAGIC 0x31454d4152465a43ULL
+
+/** The alignment of the header, slots and frame data (one cache line). */
+#define FRAME_RING_ALIGN 64
+
+/** Round a size up to the ring alignment. */
+#define FRAME_RING_ROUND(n) (((n) + FRAME_RING_ALIGN - 1) / FRAME_RING_ALIGN * FRAME_RING_ALIGN)
+
+/** The offset of the first slot. */
+#define FRAME_RING_SLOTS_OFFSET FRAME_RING_ROUND(sizeof(struct frame_ring_header))
+
+/** The offset of frame data within a slot. */
+#define FRAME_RING_DATA_OFFSET FRAME_RING_ROUND(sizeof(struct frame_ring_slot))
+
+/**
+ * Get a slot header.
+ *
+ * @param header The ring header
+ * @param index The slot index
+ * @return The slot header
+ */
+static struct frame_ring_slot* slot_at(struct frame_ring_header* header, uint64_t index) {
+  char* base = (char*) header + FRAME_RING_SLOTS_OFFSET;
+  return (struct frame_ring_slot*) (base + (size_t) index * header->slot_stride);
+}
+
+/**
+ * Get the frame data following a slot header.
+ *
+ * @param slot The slot header
+ * @return The slot data
+ */
+static void* slot_data(const struct frame_ring_slot* slot) {
+  return (char*) slot + FRAME_RING_DATA_OFFSET;
+}
+
+/**
+ * Wake every consumer sleeping on a ring.
+ *
+ * The futex is not process-private, as the word lives in shared memory.
+ *
+ * @param header The ring header
+ */
+static void wake_consumers(struct frame_ring_header* header) {
+  __atomic_add_fetch(&header->signal, 1, __ATOMIC_SEQ_CST);
+
+  // Skip the syscall when nobody sleeps, which is the common case
+  if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST)) {
+    syscall(SYS_futex, &header->signal, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+/**
+ * Mark a ring closed so its consumers stop waiting on it.
+ *
+ * @param header The ring header
+ */
+static void close_ring(struct frame_ring_header* header) {
+  __atomic_store_n(&header->closed, 1, __ATOMIC_SEQ_CST);
+  wake_consumers(header);
+}
+
+/**
+ * Close a stale ring left under a name, if there is one.
+ *
+ * @param name The shared memory object name
+ */
+static void close_stale_ring(const char* name) {
+  int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct frame_ring_header)) {
+    struct frame_ring_header* header = mmap(NULL, sizeof *header, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header != MAP_FAILED) {
+      if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == FRAME_RING_MAGIC) {
+        close_ring(header);
+      }
+
+      munmap(header, sizeof *header);
+    }
+  }
+
+  close(fd);
+  shm_unlink(name);
+}
+
+/**
+ * Copy a ring name into a handle.
+ *
+ * @param ring The ring
+ * @param name The shared memory object name
+ * @return Zero on success, otherwise nonzero
+ */
+static int set_name(struct frame_ring* ring, const char* name) {
+  size_t len = strlen(name);
+
+  // POSIX only promises portable behavior for one leading slash
+  if (len < 2 || len >= FRAME_RING_NAME_MAX || name[0] != '/' || strchr(name + 1, '/')) {
+    fprintf(stderr, "invalid frame ring name: %s\n", name);
+    return 1;
+  }
+
+  memcpy(ring->name, name, len + 1);
+  return 0;
+}
+
+int frame_ring_create(struct frame_ring* ring, const char* name, uint32_t num_slots, uint32_t slot_size) {
+  memset(ring, 0, sizeof *ring);
+
+  if (set_name(ring, name)) {
+    return 1;
+  }
+
+  // A single slot would leave consumers spinning on the frame being written
+  if (num_slots < 2 || slot_size == 0) {
+    fprintf(stderr, "frame ring needs at least two non-empty slots\n");
+    return 1;
+  }
+
+  size_t slot_stride = FRAME_RING_ROUND(FRAME_RING_DATA_OFFSET + (size_t) slot_size);
+  if (slot_stride > UINT32_MAX || num_slots > (SIZE_MAX - FRAME_RING_SLOTS_OFFSET) / slot_stride) {
+    fprintf(stderr, "frame ring too large\n");
+    return 1;
+  }
+
+  size_t size = FRAME_RING_SLOTS_OFFSET + (size_t) num_slots * slot_stride;
+
+  if (memory_map(memory_tag_frames, size)) {
+    fprintf(stderr, "frame ring %s is over the frames memory limit\n", name);
+    return 1;
+  }
+
+  close_stale_ring(name);
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "failed to create frame ring %s: %s\n", name, strerror(errno));
+    memory_unmap(memory_tag_frames, size);
+    return 1;
+  }
+
+  if (ftruncate(fd, (off_t) size) < 0) {
+    fprintf(stderr, "failed to size frame ring %s: %s\n", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    memory_unmap(memory_tag_frames, size);
+    return 1;
+  }
+
+  struct frame_ring_header* header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (header == MAP_FAILED) {
+    fprintf(stderr, "failed to map frame ring %s: %s\n", name, strerror(errno));
+    shm_unlink(name);
+    memory_unmap(memory_tag_frames, size);
+    return 1;
+  }
+
+  // The object starts zeroed, so slots are empty (sequence zero)
+  header->version = FRAME_RING_VERSION;
+  header->num_slots = num_slots;
+  header->slot_size = slot_size;
+  header->slot_stride = (uint32_t) slot_stride;
+
+  // Publish the magic last, so attachers never see a half-built header
+  __atomic_store_n(&header->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+
+  ring->header = header;
+  ring->size = size;
+  ring->producer = 1;
+  return 0;
+}
+
+int frame_ring_attach(struct frame_ring* ring, const char* name) {
+  memset(ring, 0, sizeof *ring);
+
+  if (set_name(ring, name)) {
+    return 1;
+  }
+
+  int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "failed to open frame ring %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "failed to stat frame ring %s: %s\n", name, strerror(errno));
+    close(fd);
+    return 1;
+  }
+
+  size_t size = (size_t) st.st_size;
+  if (size < FRAME_RING_SLOTS_OFFSET) {
+    fprintf(stderr, "not a frame ring: %s\n", name);
+    close(fd);
+    return 1;
+  }
+
+  struct frame_ring_header* header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (header == MAP_FAILED) {
+    fprintf(stderr, "failed to map frame ring %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != FRAME_RING_MAGIC) {
+    fprintf(stderr, "not a frame ring: %s\n", name);
+    munmap(header, size);
+    return 1;
+  }
+
+  if (header->version != FRAME_RING_VERSION) {
+    fprintf(stderr, "frame ring %s has version %u (expected %u)\n", name, header->version, FRAME_RING_VERSION);
+    munmap(header, size);
+    return 1;
+  }
+
+  // Don't trust the header to describe more memory than is mapped
+  if (header->num_slots < 2 || header->slot_stride < FRAME_RING_DATA_OFFSET + (size_t) header->slot_size
+      || (size - FRAME_RING_SLOTS_OFFSET) / header->slot_stride < header->num_slots) {
+    fprintf(stderr, "frame ring %s is corrupt\n", name);
+    munmap(header, size);
+    return 1;
+  }
+
+  if (memory_map(memory_tag_frames, size)) {
+    fprintf(stderr, "frame ring %s is over the frames memory limit\n", name);
+    munmap(header, size);
+    return 1;
+  }
+
+  ring->header = header;
+  ring->size = size;
+  ring->producer = 0;
+  return 0;
+}
+
+void frame_ring_detach(struct frame_ring* ring) {
+  if (ring->header == NULL) {
+    return;
+  }
+
+  if (ring->producer) {
+    close_ring(ring->header);
+    shm_unlink(ring->name);
+  }
+
+  munmap(ring->header, ring->size);
+  memory_unmap(memory_tag_frames, ring->size);
+  ring->header = NULL;
+}
+
+void* frame_ring_acquire(struct frame_ring* ring, size_t* capacity) {
+  struct frame_ring_header* header = ring->header;
+
+  // Only we write the commit count, so a relaxed read sees our own last store
+  uint64_t n = __atomic_load_n(&header->committed, __ATOMIC_RELAXED);
+  struct frame_ring_slot* slot = slot_at(header, n % header->num_slots);
+
+  // Mark the slot as being written before touching its data
+  __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  ring->writing = n;
+  *capacity = header->slot_size;
+  return slot_data(slot);
+}
+
+uint64_t frame_ring_commit(struct frame_ring* ring, const struct frame_info* info) {
+  struct frame_ring_header* header = ring->header;
+
+  uint64_t n = ring->writing;
+  struct frame_ring_slot* slot = slot_at(header, n % header->num_slots);
+
+  slot->info = *info;
+  slot->info.number = n;
+
+  // Complete the slot, then make it the newest frame
+  __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->committed, n + 1, __ATOMIC_RELEASE);
+
+  wake_consumers(header);
+  return n;
+}
+
+int frame_ring_publish(struct frame_ring* ring, const void* data, const struct frame_info* info) {
+  if (info->len > ring->header->slot_size) {
+    return 1;
+  }
+
+  size_t capacity;
+  void* dst = frame_ring_acquire(ring, &capacity);
+  memcpy(dst, data, info->len);
+  frame_ring_commit(ring, info);
+  return 0;
+}
+
+enum frame_ring_wait_result frame_ring_wait(struct frame_ring* ring, uint64_t after, double timeout,
+    struct frame_view* view) {
+  struct frame_ring_header* header = ring->header;
+
+  // Work out the deadline, if any
+  struct timespec deadline;
+  if (timeout >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t) timeout;
+    deadline.tv_nsec += (long) ((timeout - (double) (time_t) timeout) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  while (1) {
+    // Read the futex word before looking for frames, so a commit in between can't be missed
+    uint32_t signal = __atomic_load_n(&header->signal, __ATOMIC_SEQ_CST);
+
+    uint64_t committed = __atomic_load_n(&header->committed, __ATOMIC_ACQUIRE);
+    if (committed > after) {
+      // Take the newest frame
+      uint64_t n = committed - 1;
+      const struct frame_ring_slot* slot = slot_at(header, n % header->num_slots);
+
+      uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      if (seq == 2 * n + 2) {
+        view->info = slot->info;
+
+        // If the sequence held across the copy, the copy is consistent
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+          view->data = slot_data(slot);
+          view->seq = seq;
+          view->slot = slot;
+          return frame_ring_wait_ok;
+        }
+      }
+
+      // The producer lapped us mid-read, so there is a newer frame to take
+      continue;
+    }
+
+    if (__atomic_load_n(&header->closed, __ATOMIC_SEQ_CST)) {
+      return frame_ring_wait_closed;
+    }
+
+    // Work out how long we may sleep
+    struct timespec remaining;
+    if (timeout >= 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+      remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (remaining.tv_nsec < 0) {
+        remaining.tv_sec -= 1;
+        remaining.tv_nsec += 1000000000L;
+      }
+
+      if (remaining.tv_sec < 0) {
+        return frame_ring_wait_timeout;
+      }
+    }
+
+    // Sleep until the futex word moves on
+    __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    long r = syscall(SYS_futex, &header->signal, FUTEX_WAIT, signal, timeout >= 0 ? &remaining : NULL, NULL, 0);
+    int error = errno;
+    __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+
+    if (r < 0 && error != EAGAIN && error != EINTR && error != ETIMEDOUT) {
+      fprintf(stderr, "failed to wait on frame ring %s: %s\n", ring->name, strerror(error));
+      return frame_ring_wait_error;
+    }
+  }
+}
+
+int frame_ring_validate(const struct frame_view* view) {
+  // Order the caller's reads of the data before the sequence check
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&view->slot->seq, __ATOMIC_RELAXED) == view->seq;
+}
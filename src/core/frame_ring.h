@@ -0,0 +1,224 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_FRAME_RING_H
+#define CORE_FRAME_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The frame ring layout version. Bumped whenever the shared layout changes. */
+#define FRAME_RING_VERSION 1
+
+/** The longest frame ring name, including the leading slash. */
+#define FRAME_RING_NAME_MAX 64
+
+/** A frame pixel format. */
+enum frame_format {
+  frame_format_unknown = 0,
+  frame_format_gray8,
+  frame_format_rgb24,
+  frame_format_jpeg,
+};
+
+/** Frame metadata. */
+struct frame_info {
+  /** The frame number (assigned on commit). */
+  uint64_t number;
+
+  /** The capture time, in seconds. */
+  double timestamp;
+
+  /** The image width. */
+  uint32_t width;
+
+  /** The image height. */
+  uint32_t height;
+
+  /** The bytes per row (zero for compressed formats). */
+  uint32_t stride;
+
+  /** The pixel format (an enum frame_format). */
+  uint32_t format;
+
+  /** The length of the frame data. */
+  uint32_t len;
+};
+
+/**
+ * The shared ring header. Lives at the start of the mapping.
+ *
+ * Only the producer writes here, except for the waiter count.
+ */
+struct frame_ring_header {
+  /** The layout magic. */
+  uint64_t magic;
+
+  /** The layout version. */
+  uint32_t version;
+
+  /** The number of slots. */
+  uint32_t num_slots;
+
+  /** The data capacity of each slot. */
+  uint32_t slot_size;
+
+  /** The distance between slots. */
+  uint32_t slot_stride;
+
+  /** The number of frames committed so far. */
+  uint64_t committed;
+
+  /** The futex word. Bumped on every commit and on close. */
+  uint32_t signal;
+
+  /** The number of consumers sleeping on the futex word. */
+  uint32_t waiters;
+
+  /** Nonzero once the producer has gone away. */
+  uint32_t closed;
+};
+
+/**
+ * A slot header. Frame data follows it.
+ *
+ * The sequence works as a seqlock: odd (2n + 1) while frame n is being
+ * written, even (2n + 2) once it is complete.
+ */
+struct frame_ring_slot {
+  /** The slot sequence. */
+  uint64_t seq;
+
+  /** The metadata of the frame in the slot. */
+  struct frame_info info;
+};
+
+/** A process's handle on a frame ring. */
+struct frame_ring {
+  /** The shared memory object name. */
+  char name[FRAME_RING_NAME_MAX];
+
+  /** The mapping. */
+  struct frame_ring_header* header;
+
+  /** The mapping size. */
+  size_t size;
+
+  /** Nonzero if this handle created the ring (and so publishes to it). */
+  int producer;
+
+  /** The frame being written (producer only). */
+  uint64_t writing;
+};
+
+/** A consumer's view of a frame sitting in the ring. */
+struct frame_view {
+  /** The frame metadata (copied out of the slot). */
+  struct frame_info info;
+
+  /** The frame data (in the slot). */
+  const void* data;
+
+  /** The slot sequence the view was taken at. */
+  uint64_t seq;
+
+  /** The slot header. */
+  const struct frame_ring_slot* slot;
+};
+
+/** The result of waiting on a frame ring. */
+enum frame_ring_wait_result {
+  frame_ring_wait_ok = 0,
+  frame_ring_wait_timeout,
+  frame_ring_wait_closed,
+  frame_ring_wait_error,
+};
+
+/**
+ * Create a frame ring and become its producer.
+ *
+ * Any stale ring left under the same name (e.g. by a crashed producer) is
+ * replaced. Consumers still attached to it see it close.
+ *
+ * @param ring The ring
+ * @param name The shared memory object name (e.g. "/cozmo-frames-1")
+ * @param num_slots The number of slots
+ * @param slot_size The data capacity of each slot
+ * @return Zero on success, otherwise nonzero
+ */
+int frame_ring_create(struct frame_ring* ring, const char* name, uint32_t num_slots, uint32_t slot_size);
+
+/**
+ * Attach to an existing frame ring as a consumer.
+ *
+ * @param ring The ring
+ * @param name The shared memory object name
+ * @return Zero on success, otherwise nonzero
+ */
+int frame_ring_attach(struct frame_ring* ring, const char* name);
+
+/**
+ * Detach from a frame ring. The producer closes the ring and unlinks it.
+ *
+ * @param ring The ring
+ */
+void frame_ring_detach(struct frame_ring* ring);
+
+/**
+ * Get the slot the next frame should be written into.
+ *
+ * Consumers still reading the frame previously in the slot will see it go
+ * invalid. Follow up with frame_ring_commit.
+ *
+ * @param ring The ring (producer only)
+ * @param [out] capacity The slot data capacity
+ * @return The slot data
+ */
+void* frame_ring_acquire(struct frame_ring* ring, size_t* capacity);
+
+/**
+ * Publish the frame written into the acquired slot and wake consumers.
+ *
+ * @param ring The ring (producer only)
+ * @param info The frame metadata (the number is assigned here)
+ * @return The frame number
+ */
+uint64_t frame_ring_commit(struct frame_ring* ring, const struct frame_info* info);
+
+/**
+ * Copy a frame into the ring. Shorthand for acquire, copy, commit.
+ *
+ * @param ring The ring (producer only)
+ * @param data The frame data
+ * @param info The frame metadata (the number is assigned here)
+ * @return Zero on success, otherwise nonzero (frame too large)
+ */
+int frame_ring_publish(struct frame_ring* ring, const void* data, const struct frame_info* info);
+
+/**
+ * Wait for the newest frame numbered at least the given number.
+ *
+ * Frames older than the newest are skipped, so a slow consumer sheds load
+ * instead of falling behind. Sleeps on a futex in the shared header.
+ *
+ * @param ring The ring
+ * @param after The lowest acceptable frame number
+ * @param timeout The longest to wait, in seconds (negative waits forever)
+ * @param [out] view The frame
+ * @return The wait result
+ */
+enum frame_ring_wait_result frame_ring_wait(struct frame_ring* ring, uint64_t after, double timeout,
+    struct frame_view* view);
+
+/**
+ * Check that a frame view is still intact, i.e. the producer has not started
+ * reusing its slot. Check after reading the data to trust what was read.
+ *
+ * @param view The frame view
+ * @return Nonzero if intact, otherwise zero
+ */
+int frame_ring_validate(const struct frame_view* view);
+
+#endif // #ifndef CORE_FRAME_RING_H
@@ -0,0 +1,889 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRIEND_INDEX_X86 1
+#endif
+
+#include "friend_index.h"
+#include "memory.h"
+
+/** The k-means iterations per product quantizer subspace. */
+#define PQ_TRAIN_ITERATIONS 12
+
+/** A candidate row during search. */
+struct candidate {
+  /** The global row (within the appended rows). */
+  size_t row;
+
+  /** The friend ID. */
+  int32_t friend_id;
+
+  /** The score. */
+  float score;
+};
+
+/** The search kernels. */
+struct kernels {
+  /** The kernel set name. */
+  const char* name;
+
+  /** Take the dot product of two float vectors. */
+  float (* dot)(const float* a, const float* b, size_t dim);
+
+  /** Score a float query against rows of int8 codes with per-row scales. */
+  void (* score_sq8)(const float* query, const uint8_t* codes, const float* scales, size_t rows, size_t dim,
+      float* out);
+
+  /** Score rows of product quantizer codes from a query lookup table, [subspace][centroid]. */
+  void (* score_pq)(const float* table, const uint8_t* codes, size_t rows, size_t m, float* out);
+};
+
+/**
+ * Take the dot product of two vectors.
+ *
+ * Four accumulators break the dependency chain so the adds can overlap.
+ */
+static float dot_scalar(const float* a, const float* b, size_t dim) {
+  float s0 = 0;
+  float s1 = 0;
+  float s2 = 0;
+  float s3 = 0;
+
+  size_t i = 0;
+  for (; i + 4 <= dim; i += 4) {
+    s0 += a[i] * b[i];
+    s1 += a[i + 1] * b[i + 1];
+    s2 += a[i + 2] * b[i + 2];
+    s3 += a[i + 3] * b[i + 3];
+  }
+
+  for (; i < dim; ++i) {
+    s0 += a[i] * b[i];
+  }
+
+  return (s0 + s1) + (s2 + s3);
+}
+
+static void score_sq8_scalar(const float* query, const uint8_t* codes, const float* scales, size_t rows, size_t dim,
+    float* out) {
+  for (size_t r = 0; r < rows; ++r) {
+    const int8_t* row = (const int8_t*) &codes[r * dim];
+
+    float s = 0;
+    for (size_t i = 0; i < dim; ++i) {
+      s += query[i] * (float) row[i];
+    }
+
+    out[r] = s * scales[r];
+  }
+}
+
+/**
+ * Score rows of product quantizer codes.
+ *
+ * Four rows go at once so their table lookups overlap. There is no AVX2
+ * version: gathering from the table measured slower than plain loads.
+ */
+static void score_pq_scalar(const float* table, const uint8_t* codes, size_t rows, size_t m, float* out) {
+  size_t r = 0;
+  for (; r + 4 <= rows; r += 4) {
+    const uint8_t* row = &codes[r * m];
+
+    float s0 = 0;
+    float s1 = 0;
+    float s2 = 0;
+    float s3 = 0;
+
+    for (size_t j = 0; j < m; ++j) {
+      const float* sub = &table[j * FRIEND_INDEX_PQ_CENTROIDS];
+      s0 += sub[row[j]];
+      s1 += sub[row[m + j]];
+      s2 += sub[row[2 * m + j]];
+      s3 += sub[row[3 * m + j]];
+    }
+
+    out[r] = s0;
+    out[r + 1] = s1;
+    out[r + 2] = s2;
+    out[r + 3] = s3;
+  }
+
+  for (; r < rows; ++r) {
+    const uint8_t* row = &codes[r * m];
+
+    float s = 0;
+    for (size_t j = 0; j < m; ++j) {
+      s += table[j * FRIEND_INDEX_PQ_CENTROIDS + row[j]];
+    }
+
+    out[r] = s;
+  }
+}
+
+#ifdef FRIEND_INDEX_X86
+
+/** Sum the lanes of a vector. */
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float* a, const float* b, size_t dim) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+
+  size_t i = 0;
+  for (; i + 16 <= dim; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+  }
+
+  for (; i + 8 <= dim; i += 8) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+  }
+
+  float s = hsum_avx2(_mm256_add_ps(acc0, acc1));
+  for (; i < dim; ++i) {
+    s += a[i] * b[i];
+  }
+
+  return s;
+}
+
+__attribute__((target("avx2,fma")))
+static void score_sq8_avx2(const float* query, const uint8_t* codes, const float* scales, size_t rows, size_t dim,
+    float* out) {
+  for (size_t r = 0; r < rows; ++r) {
+    const int8_t* row = (const int8_t*) &codes[r * dim];
+
+    // Widen eight codes at a time to float and multiply-add against the float query
+    __m256 acc = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+      __m256i wide = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*) (row + i)));
+      acc = _mm256_fmadd_ps(_mm256_loadu_ps(query + i), _mm256_cvtepi32_ps(wide), acc);
+    }
+
+    float s = hsum_avx2(acc);
+    for (; i < dim; ++i) {
+      s += query[i] * (float) row[i];
+    }
+
+    out[r] = s * scales[r];
+  }
+}
+
+#endif // #ifdef FRIEND_INDEX_X86
+
+/** The kernels in use, chosen on first use. */
+static const struct kernels* g_kernels;
+
+/** Choose the best kernels this CPU runs. */
+static const struct kernels* kernels() {
+  static const struct kernels scalar = {
+    .name = "scalar",
+    .dot = dot_scalar,
+    .score_sq8 = score_sq8_scalar,
+    .score_pq = score_pq_scalar,
+  };
+
+#ifdef FRIEND_INDEX_X86
+  static const struct kernels avx2 = {
+    .name = "avx2",
+    .dot = dot_avx2,
+    .score_sq8 = score_sq8_avx2,
+    .score_pq = score_pq_scalar,
+  };
+#endif
+
+  // Racing threads all pick the same set, so no lock is needed
+  if (g_kernels == NULL) {
+    const struct kernels* k = &scalar;
+
+#ifdef FRIEND_INDEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      k = &avx2;
+    }
+#endif
+
+    g_kernels = k;
+  }
+
+  return g_kernels;
+}
+
+const char* friend_index_kernels() {
+  return kernels()->name;
+}
+
+/**
+ * Scale a vector to unit length.
+ *
+ * @param out The output
+ * @param in The input (may be the output)
+ * @param dim The dimension
+ * @return Zero on success, otherwise nonzero (a zero vector)
+ */
+static int normalize(float* out, const float* in, size_t dim) {
+  float norm = sqrtf(kernels()->dot(in, in, dim));
+  if (!(norm > 0)) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < dim; ++i) {
+    out[i] = in[i] / norm;
+  }
+
+  return 0;
+}
+
+int friend_index_init(struct friend_index* idx, size_t dim, const struct friend_index_options* options) {
+  memset(idx, 0, sizeof(*idx));
+  idx->dim = dim;
+  idx->rerank_fd = -1;
+
+  if (options == NULL) {
+    return 0;
+  }
+
+  idx->mode = options->mode;
+
+  switch (idx->mode) {
+    case friend_index_mode_float:
+      break;
+    case friend_index_mode_sq8:
+      idx->code_size = dim;
+      break;
+    case friend_index_mode_pq:
+      if (options->subquantizers == 0 || dim % options->subquantizers != 0) {
+        fprintf(stderr, "subquantizers (%zu) must divide the dimension (%zu)\n", options->subquantizers, dim);
+        return 1;
+      }
+
+      idx->subquantizers = options->subquantizers;
+      idx->code_size = options->subquantizers;
+      break;
+  }
+
+  // Full-precision copies are only worth keeping beside quantized codes
+  if (options->rerank_path && idx->mode != friend_index_mode_float) {
+    idx->rerank_fd = open(options->rerank_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (idx->rerank_fd < 0) {
+      fprintf(stderr, "failed to open %s: %s\n", options->rerank_path, strerror(errno));
+      return 1;
+    }
+
+    idx->rerank = options->rerank ? options->rerank : 32;
+  }
+
+  return 0;
+}
+
+void friend_index_destroy(struct friend_index* idx) {
+  for (size_t i = 0; i < idx->num_chunks; ++i) {
+    memory_free(idx->chunks[i]->vectors);
+    memory_free(idx->chunks[i]->codes);
+    memory_free(idx->chunks[i]->scales);
+    memory_free(idx->chunks[i]);
+  }
+
+  if (idx->rerank_map) {
+    munmap((void*) idx->rerank_map, idx->rerank_rows * idx->dim * sizeof(float));
+    memory_unmap(memory_tag_friends, idx->rerank_rows * idx->dim * sizeof(float));
+  }
+
+  if (idx->rerank_fd >= 0) {
+    close(idx->rerank_fd);
+  }
+
+  memory_free(idx->base_dead);
+  memory_free(idx->codebook);
+  memory_free(idx->chunks);
+  memset(idx, 0, sizeof(*idx));
+  idx->rerank_fd = -1;
+}
+
+/**
+ * Find the nearest centroid of one subspace (by squared distance).
+ *
+ * @param centroids The subspace centroids
+ * @param k The number of centroids
+ * @param x The subvector
+ * @param dsub The subspace dimension
+ * @return The centroid index
+ */
+static size_t nearest_centroid(const float* centroids, size_t k, const float* x, size_t dsub) {
+  size_t best = 0;
+  float best_dist = FLT_MAX;
+
+  for (size_t c = 0; c < k; ++c) {
+    float dist = 0;
+    for (size_t i = 0; i < dsub; ++i) {
+      float d = x[i] - centroids[c * dsub + i];
+      dist += d * d;
+    }
+
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = c;
+    }
+  }
+
+  return best;
+}
+
+int friend_index_train(struct friend_index* idx, const float* samples, size_t n) {
+  if (idx->mode != friend_index_mode_pq) {
+    return 0;
+  }
+
+  if (n == 0) {
+    return 1;
+  }
+
+  size_t m = idx->subquantizers;
+  size_t dsub = idx->dim / m;
+
+  // With fewer samples than centroids, every sample is a centroid and the rest repeat
+  size_t k = n < FRIEND_INDEX_PQ_CENTROIDS ? n : FRIEND_INDEX_PQ_CENTROIDS;
+
+  float* codebook = memory_calloc(memory_tag_friends, m * FRIEND_INDEX_PQ_CENTROIDS * dsub, sizeof(float));
+  float* units = memory_alloc(memory_tag_friends, n * idx->dim * sizeof(float));
+  float* sums = memory_alloc(memory_tag_friends, k * dsub * sizeof(float));
+  size_t* counts = memory_alloc(memory_tag_friends, k * sizeof(size_t));
+  if (codebook == NULL || units == NULL || sums == NULL || counts == NULL) {
+    memory_free(codebook);
+    memory_free(units);
+    memory_free(sums);
+    memory_free(counts);
+    return 1;
+  }
+
+  // Train on what will be stored, i.e. unit vectors
+  size_t valid = 0;
+  for (size_t i = 0; i < n; ++i) {
+    valid += !normalize(&units[valid * idx->dim], &samples[i * idx->dim], idx->dim);
+  }
+
+  for (size_t j = 0; j < m && valid > 0; ++j) {
+    float* centroids = &codebook[j * FRIEND_INDEX_PQ_CENTROIDS * dsub];
+
+    // Seed with samples spread evenly through the input
+    for (size_t c = 0; c < k; ++c) {
+      memcpy(&centroids[c * dsub], &units[(c * valid / k) * idx->dim + j * dsub], dsub * sizeof(float));
+    }
+
+    // Lloyd iterations
+    for (int it = 0; it < PQ_TRAIN_ITERATIONS; ++it) {
+      memset(sums, 0, k * dsub * sizeof(float));
+      memset(counts, 0, k * sizeof(size_t));
+
+      for (size_t i = 0; i < valid; ++i) {
+        const float* x = &units[i * idx->dim + j * dsub];
+        size_t c = nearest_centroid(centroids, k, x, dsub);
+
+        for (size_t d = 0; d < dsub; ++d) {
+          sums[c * dsub + d] += x[d];
+        }
+        ++counts[c];
+      }
+
+      // Empty clusters keep their old centroid
+      for (size_t c = 0; c < k; ++c) {
+        if (counts[c] == 0) {
+          continue;
+        }
+
+        for (size_t d = 0; d < dsub; ++d) {
+          centroids[c * dsub + d] = sums[c * dsub + d] / (float) counts[c];
+        }
+      }
+    }
+
+    // Unused centroids repeat the trained ones, so codes never land on garbage
+    for (size_t c = k; c < FRIEND_INDEX_PQ_CENTROIDS; ++c) {
+      memcpy(&centroids[c * dsub], &centroids[(c % k) * dsub], dsub * sizeof(float));
+    }
+  }
+
+  memory_free(units);
+  memory_free(sums);
+  memory_free(counts);
+
+  if (valid == 0) {
+    memory_free(codebook);
+    return 1;
+  }
+
+  memory_free(idx->codebook);
+  idx->codebook = codebook;
+  return 0;
+}
+
+/**
+ * Encode a unit vector into a row.
+ *
+ * @param idx The index
+ * @param chunk The chunk
+ * @param row The row within the chunk
+ * @param unit The unit vector
+ */
+static void encode(struct friend_index* idx, struct friend_index_chunk* chunk, size_t row, const float* unit) {
+  switch (idx->mode) {
+    case friend_index_mode_float:
+      memcpy(&chunk->vectors[row * idx->dim], unit, idx->dim * sizeof(float));
+      break;
+    case friend_index_mode_sq8: {
+      // Symmetric per-row scale, so the largest component maps to +/-127
+      float max = 0;
+      for (size_t i = 0; i < idx->dim; ++i) {
+        if (fabsf(unit[i]) > max) {
+          max = fabsf(unit[i]);
+        }
+      }
+
+      float scale = max / 127;
+      int8_t* codes = (int8_t*) &chunk->codes[row * idx->code_size];
+      for (size_t i = 0; i < idx->dim; ++i) {
+        codes[i] = (int8_t) lrintf(unit[i] / scale);
+      }
+
+      chunk->scales[row] = scale;
+      break;
+    }
+    case friend_index_mode_pq: {
+      size_t dsub = idx->dim / idx->subquantizers;
+      uint8_t* codes = &chunk->codes[row * idx->code_size];
+
+      for (size_t j = 0; j < idx->subquantizers; ++j) {
+        codes[j] = (uint8_t) nearest_centroid(&idx->codebook[j * FRIEND_INDEX_PQ_CENTROIDS * dsub],
+          FRIEND_INDEX_PQ_CENTROIDS, &unit[j * dsub], dsub);
+      }
+      break;
+    }
+  }
+}
+
+/**
+ * Make a chunk for the index's mode.
+ *
+ * @param idx The index
+ * @return The chunk, or NULL if out of memory
+ */
+static struct friend_index_chunk* new_chunk(const struct friend_index* idx) {
+  struct friend_index_chunk* chunk = memory_calloc(memory_tag_friends, 1, sizeof(*chunk));
+  if (chunk == NULL) {
+    return NULL;
+  }
+
+  int failed = 0;
+  if (idx->mode == friend_index_mode_float) {
+    failed = memory_aligned_alloc(memory_tag_friends, (void**) &chunk->vectors, FRIEND_INDEX_ALIGN,
+      FRIEND_INDEX_CHUNK * idx->dim * sizeof(float));
+  } else {
+    failed = memory_aligned_alloc(memory_tag_friends, (void**) &chunk->codes, FRIEND_INDEX_ALIGN,
+      FRIEND_INDEX_CHUNK * idx->code_size);
+
+    if (!failed && idx->mode == friend_index_mode_sq8) {
+      chunk->scales = memory_alloc(memory_tag_friends, FRIEND_INDEX_CHUNK * sizeof(float));
+      failed = chunk->scales == NULL;
+    }
+  }
+
+  if (failed) {
+    memory_free(chunk->vectors);
+    memory_free(chunk->codes);
+    memory_free(chunk->scales);
+    memory_free(chunk);
+    return NULL;
+  }
+
+  return chunk;
+}
+
+/**
+ * Map the re-ranking file far enough to cover every row.
+ *
+ * The mapping grows by doubling, so few appends remap. Rows past the end of
+ * the file are never read. Only appends call this: searches may overlap each
+ * other but never an append, so no search sees the mapping move.
+ *
+ * @param idx The index
+ * @return Zero on success, otherwise nonzero
+ */
+static int map_rerank(struct friend_index* idx) {
+  if (idx->rerank_rows >= idx->len) {
+    return 0;
+  }
+
+  size_t size = idx->dim * sizeof(float);
+
+  size_t rows = idx->rerank_rows ? idx->rerank_rows : FRIEND_INDEX_CHUNK;
+  while (rows < idx->len) {
+    rows *= 2;
+  }
+
+  if (idx->rerank_map) {
+    munmap((void*) idx->rerank_map, idx->rerank_rows * size);
+    memory_unmap(memory_tag_friends, idx->rerank_rows * size);
+    idx->rerank_map = NULL;
+    idx->rerank_rows = 0;
+  }
+
+  // Over the limit, searches go on without re-ranking
+  if (memory_map(memory_tag_friends, rows * size)) {
+    return 1;
+  }
+
+  // Only the candidate rows are ever touched, so little of the file is paged in
+  void* map = mmap(NULL, rows * size, PROT_READ, MAP_SHARED, idx->rerank_fd, 0);
+  if (map == MAP_FAILED) {
+    memory_unmap(memory_tag_friends, rows * size);
+    return 1;
+  }
+
+  idx->rerank_map = map;
+  idx->rerank_rows = rows;
+  return 0;
+}
+
+int friend_index_append(struct friend_index* idx, int32_t friend_id, const float* embedding) {
+  if (idx->mode == friend_index_mode_pq && idx->codebook == NULL) {
+    return 1;
+  }
+
+  size_t row = idx->len % FRIEND_INDEX_CHUNK;
+
+  // Start a new chunk when the last is full
+  if (row == 0 && idx->len / FRIEND_INDEX_CHUNK == idx->num_chunks) {
+    if (idx->num_chunks == idx->cap_chunks) {
+      size_t cap = idx->cap_chunks ? idx->cap_chunks * 2 : 8;
+
+      // Only the directory of chunk pointers moves, never the embeddings
+      struct friend_index_chunk** chunks = memory_realloc(memory_tag_friends, idx->chunks, cap * sizeof(*chunks));
+      if (chunks == NULL) {
+        return 1;
+      }
+
+      idx->chunks = chunks;
+      idx->cap_chunks = cap;
+    }
+
+    struct friend_index_chunk* chunk = new_chunk(idx);
+    if (chunk == NULL) {
+      return 1;
+    }
+
+    idx->chunks[idx->num_chunks++] = chunk;
+  }
+
+  float* unit = memory_alloc(memory_tag_friends, idx->dim * sizeof(float));
+  if (unit == NULL) {
+    return 1;
+  }
+
+  if (normalize(unit, embedding, idx->dim)) {
+    memory_free(unit);
+    return 1;
+  }
+
+  // Keep the full-precision copy at the same row in the re-ranking file
+  if (idx->rerank_fd >= 0) {
+    size_t size = idx->dim * sizeof(float);
+    if (pwrite(idx->rerank_fd, unit, size, (off_t) (idx->len * size)) != (ssize_t) size) {
+      memory_free(unit);
+      return 1;
+    }
+  }
+
+  struct friend_index_chunk* chunk = idx->chunks[idx->len / FRIEND_INDEX_CHUNK];
+  encode(idx, chunk, row, unit);
+  memory_free(unit);
+
+  chunk->ids[row] = friend_id;
+  ++idx->len;
+  ++idx->live;
+
+  // The mapping only changes here, never under a search
+  // If it can't grow (e.g. over the memory limit), searches skip re-ranking until it can
+  if (idx->rerank_fd >= 0) {
+    map_rerank(idx);
+  }
+
+  return 0;
+}
+
+size_t friend_index_remove(struct friend_index* idx, int32_t friend_id) {
+  size_t removed = 0;
+
+  // Snapshot rows are read-only, so this process keeps its own marks for them
+  for (size_t i = 0; i < idx->base_rows; ++i) {
+    if (idx->base_ids[i] == friend_id && !idx->base_dead[i]) {
+      idx->base_dead[i] = 1;
+      ++removed;
+    }
+  }
+
+  for (size_t i = 0; i < idx->len; ++i) {
+    int32_t* id = &idx->chunks[i / FRIEND_INDEX_CHUNK]->ids[i % FRIEND_INDEX_CHUNK];
+    if (*id == friend_id) {
+      *id = -1;
+      ++removed;
+    }
+  }
+
+  idx->live -= removed;
+  return removed;
+}
+
+int friend_index_attach(struct friend_index* idx, const float* vectors, const int32_t* ids, size_t rows) {
+  if (rows > 0 && idx->mode != friend_index_mode_float) {
+    return 1;
+  }
+
+  uint8_t* dead = NULL;
+  if (rows > 0) {
+    dead = memory_calloc(memory_tag_friends, rows, 1);
+    if (dead == NULL) {
+      return 1;
+    }
+  }
+
+  size_t base_live = 0;
+  for (size_t i = 0; i < idx->base_rows; ++i) {
+    base_live += !idx->base_dead[i];
+  }
+
+  memory_free(idx->base_dead);
+  idx->base_vectors = vectors;
+  idx->base_ids = ids;
+  idx->base_rows = rows;
+  idx->base_dead = dead;
+  idx->live = idx->live - base_live + rows;
+  return 0;
+}
+
+/**
+ * Offer a scored row to the best candidates so far.
+ *
+ * @param best The candidates, best first
+ * @param found The number of candidates
+ * @param cap The most candidates kept
+ * @param row The row
+ * @param friend_id The row's friend ID
+ * @param score The row score
+ */
+static void offer(struct candidate* best, size_t* found, size_t cap, size_t row, int32_t friend_id, float score) {
+  if (*found == cap && score <= best[cap - 1].score) {
+    return;
+  }
+
+  // Keep the best sorted by insertion (cap is small)
+  size_t at = *found < cap ? (*found)++ : cap - 1;
+  while (at > 0 && best[at - 1].score < score) {
+    best[at] = best[at - 1];
+    --at;
+  }
+
+  best[at].row = row;
+  best[at].friend_id = friend_id;
+  best[at].score = score;
+}
+
+size_t friend_index_search(struct friend_index* idx, const float* query, size_t k, struct friend_match* matches) {
+  if (k == 0 || idx->len + idx->base_rows == 0) {
+    return 0;
+  }
+
+  const struct kernels* kern = kernels();
+
+  // Re-ranking looks at more candidates than asked for
+  int rerank = idx->rerank_map != NULL && idx->rerank_rows >= idx->len;
+  size_t cap = rerank && idx->rerank > k ? idx->rerank : k;
+
+  size_t dsub = idx->subquantizers ? idx->dim / idx->subquantizers : 0;
+  size_t table_len = idx->mode == friend_index_mode_pq ? idx->subquantizers * FRIEND_INDEX_PQ_CENTROIDS : 0;
+
+  float* unit = memory_alloc(memory_tag_friends, idx->dim * sizeof(float));
+  float* scores = memory_alloc(memory_tag_friends, FRIEND_INDEX_CHUNK * sizeof(float));
+  float* table = memory_alloc(memory_tag_friends, (table_len ? table_len : 1) * sizeof(float));
+  struct candidate* best = memory_alloc(memory_tag_friends, cap * sizeof(*best));
+  size_t found = 0;
+
+  if (unit == NULL || scores == NULL || table == NULL || best == NULL || normalize(unit, query, idx->dim)) {
+    goto done;
+  }
+
+  // Product quantized scores are sums of query-to-centroid dot products, computed once per query
+  for (size_t j = 0; j < idx->subquantizers && table_len; ++j) {
+    for (size_t c = 0; c < FRIEND_INDEX_PQ_CENTROIDS; ++c) {
+      table[j * FRIEND_INDEX_PQ_CENTROIDS + c] = kern->dot(&unit[j * dsub],
+        &idx->codebook[(j * FRIEND_INDEX_PQ_CENTROIDS + c) * dsub], dsub);
+    }
+  }
+
+  // Snapshot rows are scored in place from the shared mapping
+  for (size_t r = 0; r < idx->base_rows; ++r) {
+    if (!idx->base_dead[r]) {
+      offer(best, &found, cap, 0, idx->base_ids[r], kern->dot(unit, &idx->base_vectors[r * idx->dim], idx->dim));
+    }
+  }
+
+  for (size_t c = 0; c < idx->num_chunks; ++c) {
+    const struct friend_index_chunk* chunk = idx->chunks[c];
+
+    size_t rows = idx->len - c * FRIEND_INDEX_CHUNK;
+    if (rows > FRIEND_INDEX_CHUNK) {
+      rows = FRIEND_INDEX_CHUNK;
+    }
+
+    // Score the whole chunk, then pick from it
+    switch (idx->mode) {
+      case friend_index_mode_float:
+        for (size_t r = 0; r < rows; ++r) {
+          scores[r] = kern->dot(unit, &chunk->vectors[r * idx->dim], idx->dim);
+        }
+        break;
+      case friend_index_mode_sq8:
+        kern->score_sq8(unit, chunk->codes, chunk->scales, rows, idx->dim, scores);
+        break;
+      case friend_index_mode_pq:
+        kern->score_pq(table, chunk->codes, rows, idx->code_size, scores);
+        break;
+    }
+
+    for (size_t r = 0; r < rows; ++r) {
+      if (chunk->ids[r] >= 0) {
+        offer(best, &found, cap, c * FRIEND_INDEX_CHUNK + r, chunk->ids[r], scores[r]);
+      }
+    }
+  }
+
+  // Score the candidates again at full precision and re-sort
+  if (rerank) {
+    size_t n = found;
+    found = 0;
+
+    struct candidate* exact = memory_alloc(memory_tag_friends, cap * sizeof(*exact));
+    if (exact == NULL) {
+      goto done;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      offer(exact, &found, cap, best[i].row, best[i].friend_id,
+        kern->dot(unit, &idx->rerank_map[best[i].row * idx->dim], idx->dim));
+    }
+
+    memory_free(best);
+    best = exact;
+  }
+
+  if (found > k) {
+    found = k;
+  }
+
+  for (size_t i = 0; i < found; ++i) {
+    matches[i].friend_id = best[i].friend_id;
+    matches[i].similarity = best[i].score;
+  }
+
+done:
+  memory_free(unit);
+  memory_free(scores);
+  memory_free(table);
+  memory_free(best);
+  return found;
+}
+
+size_t friend_index_memory(const struct friend_index* idx) {
+  size_t row = idx->mode == friend_index_mode_float ? idx->dim * sizeof(float) : idx->code_size;
+  if (idx->mode == friend_index_mode_sq8) {
+    row += sizeof(float);
+  }
+
+  size_t memory = idx->num_chunks * (FRIEND_INDEX_CHUNK * (row + sizeof(int32_t)) + sizeof(struct friend_index_chunk));
+  memory += idx->cap_chunks * sizeof(struct friend_index_chunk*);
+  memory += idx->base_rows;
+
+  if (idx->codebook) {
+    memory += FRIEND_INDEX_PQ_CENTROIDS * idx->dim * sizeof(float);
+  }
+
+  return memory;
+}
+
+size_t friend_template(const float* samples, size_t n, size_t dim, float min_agreement, float* out) {
+  if (n == 0 || dim == 0) {
+    return 0;
+  }
+
+  float* units = memory_alloc(memory_tag_friends, n * dim * sizeof(float));
+  float* mean = memory_calloc(memory_tag_friends, dim, sizeof(float));
+  if (units == NULL || mean == NULL) {
+    memory_free(units);
+    memory_free(mean);
+    return 0;
+  }
+
+  // Average the unit samples, skipping any zero vectors
+  size_t valid = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (normalize(&units[valid * dim], &samples[i * dim], dim)) {
+      continue;
+    }
+
+    for (size_t j = 0; j < dim; ++j) {
+      mean[j] += units[valid * dim + j];
+    }
+
+    ++valid;
+  }
+
+  size_t kept = 0;
+
+  if (valid > 0 && !normalize(mean, mean, dim)) {
+    // Average again over the samples that agree with the first average
+    memset(out, 0, dim * sizeof(float));
+
+    for (size_t i = 0; i < valid; ++i) {
+      if (kernels()->dot(&units[i * dim], mean, dim) < min_agreement) {
+        continue;
+      }
+
+      for (size_t j = 0; j < dim; ++j) {
+        out[j] += units[i * dim + j];
+      }
+
+      ++kept;
+    }
+
+    // A template needs a clear majority of the samples behind it
+    if (kept * 2 <= n || normalize(out, out, dim)) {
+      kept = 0;
+    }
+  }
+
+  memory_free(units);
+  memory_free(mean);
+  return kept;
+}
@@ -0,0 +1,262 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_FRIEND_INDEX_H
+#define CORE_FRIEND_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The embeddings per chunk. */
+#define FRIEND_INDEX_CHUNK 1024
+
+/** The alignment of chunk vectors. */
+#define FRIEND_INDEX_ALIGN 64
+
+/** The centroids per product quantizer subspace (one byte per code). */
+#define FRIEND_INDEX_PQ_CENTROIDS 256
+
+/** How embeddings are stored in memory. */
+enum friend_index_mode {
+  /** Full float32 (4 bytes per dimension). */
+  friend_index_mode_float = 0,
+
+  /** Int8 scalar quantization with a scale per embedding (about 4x smaller). */
+  friend_index_mode_sq8,
+
+  /** Product quantization, one byte per subspace (e.g. 16x smaller for 32 subspaces of 128). */
+  friend_index_mode_pq,
+};
+
+/** Index options. */
+struct friend_index_options {
+  /** The storage mode. */
+  enum friend_index_mode mode;
+
+  /** The number of product quantizer subspaces (must divide the dimension). */
+  size_t subquantizers;
+
+  /**
+   * The file to keep full-precision embeddings in for re-ranking, or NULL.
+   *
+   * Quantized modes only. The file is a per-process scratch file, truncated
+   * on open and filled as embeddings are appended. Searches map it and score
+   * the best quantized candidates again at full precision, so only those few
+   * rows are ever paged in.
+   */
+  const char* rerank_path;
+
+  /** The number of quantized candidates re-ranked per search. */
+  size_t rerank;
+};
+
+/** A fixed-size run of embeddings. Chunks never move or grow once made. */
+struct friend_index_chunk {
+  /** The unit-length embeddings (float mode), FRIEND_INDEX_CHUNK rows of the index dimension. */
+  float* vectors;
+
+  /** The codes (quantized modes), FRIEND_INDEX_CHUNK rows of the code size. */
+  uint8_t* codes;
+
+  /** The scale of each row (int8 mode). */
+  float* scales;
+
+  /** The friend ID of each row (-1 for removed rows). */
+  int32_t ids[FRIEND_INDEX_CHUNK];
+};
+
+/**
+ * An in-memory index of friend embeddings for brute-force cosine search.
+ *
+ * Embeddings are stored unit length, so similarity is a dot product. Storage
+ * is chunked: appending writes into the last chunk and starts a new one when
+ * it fills, so no append ever copies earlier embeddings, and enrolling a
+ * friend into a live index costs the same however large it is. Removal marks
+ * rows dead rather than compacting.
+ *
+ * Float indexes may also search a snapshot in place (see friend_snapshot.h):
+ * rows mapped read-only and shared with other processes, searched ahead of
+ * the appended rows. Removing a snapshot row only marks it in this process.
+ *
+ * Quantized modes score the query in float against the codes (asymmetric
+ * distance), so only the stored side loses precision. Kernels use AVX2 and
+ * FMA when the CPU has them, chosen once at run time.
+ */
+struct friend_index {
+  /** The embedding dimension. */
+  size_t dim;
+
+  /** The storage mode. */
+  enum friend_index_mode mode;
+
+  /** The bytes per row of codes (quantized modes). */
+  size_t code_size;
+
+  /** The number of product quantizer subspaces. */
+  size_t subquantizers;
+
+  /** The product quantizer centroids, [subspace][centroid][dim / subquantizers], or NULL until trained. */
+  float* codebook;
+
+  /** The number of appended rows (including removed ones). */
+  size_t len;
+
+  /** The number of live rows (snapshot and appended). */
+  size_t live;
+
+  /** The attached snapshot's unit-length embeddings (mapped read-only, not owned), or NULL. */
+  const float* base_vectors;
+
+  /** The attached snapshot's friend IDs. */
+  const int32_t* base_ids;
+
+  /** The number of snapshot rows. */
+  size_t base_rows;
+
+  /** Nonzero for each snapshot row removed in this process. */
+  uint8_t* base_dead;
+
+  /** The chunks. */
+  struct friend_index_chunk** chunks;
+
+  /** The number of chunks. */
+  size_t num_chunks;
+
+  /** The chunk directory capacity. */
+  size_t cap_chunks;
+
+  /** The re-ranking file descriptor, or -1. */
+  int rerank_fd;
+
+  /** The number of candidates re-ranked per search. */
+  size_t rerank;
+
+  /** The re-ranking file mapping, or NULL. */
+  const float* rerank_map;
+
+  /** The number of rows the mapping covers (it may run past the end of the file). */
+  size_t rerank_rows;
+};
+
+/** A search hit. */
+struct friend_match {
+  /** The friend ID. */
+  int32_t friend_id;
+
+  /** The cosine similarity. */
+  float similarity;
+};
+
+/**
+ * Initialize an index.
+ *
+ * @param idx The index
+ * @param dim The embedding dimension
+ * @param options The options, or NULL for float storage
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+int friend_index_init(struct friend_index* idx, size_t dim, const struct friend_index_options* options);
+
+/**
+ * Destroy an index.
+ *
+ * @param idx The index
+ */
+void friend_index_destroy(struct friend_index* idx);
+
+/**
+ * Train the product quantizer on sample embeddings (k-means per subspace).
+ *
+ * Product quantized indexes must be trained before the first append. The
+ * samples should look like the embeddings to be stored (e.g. the friends
+ * about to be loaded).
+ *
+ * @param idx The index
+ * @param samples The samples, n rows of the index dimension
+ * @param n The number of samples
+ * @return Zero on success, otherwise nonzero
+ */
+int friend_index_train(struct friend_index* idx, const float* samples, size_t n);
+
+/**
+ * Append an embedding.
+ *
+ * The embedding is normalized on the way in.
+ *
+ * @param idx The index
+ * @param friend_id The friend ID (non-negative)
+ * @param embedding The embedding
+ * @return Zero on success, otherwise nonzero (out of memory, a zero vector, untrained, or a failed write)
+ */
+int friend_index_append(struct friend_index* idx, int32_t friend_id, const float* embedding);
+
+/**
+ * Remove every embedding of a friend.
+ *
+ * @param idx The index
+ * @param friend_id The friend ID
+ * @return The number of embeddings removed
+ */
+size_t friend_index_remove(struct friend_index* idx, int32_t friend_id);
+
+/**
+ * Attach snapshot rows to search in place, replacing any attached before.
+ *
+ * The rows stay owned by the caller and must outlive the attachment. Float
+ * indexes only.
+ *
+ * @param idx The index
+ * @param vectors The unit-length embeddings, rows of the index dimension (NULL to detach)
+ * @param ids The friend IDs
+ * @param rows The number of rows
+ * @return Zero on success, otherwise nonzero (out of memory or a quantized index)
+ */
+int friend_index_attach(struct friend_index* idx, const float* vectors, const int32_t* ids, size_t rows);
+
+/**
+ * Find the embeddings most similar to a query.
+ *
+ * @param idx The index
+ * @param query The query embedding (need not be unit length)
+ * @param k The most matches wanted
+ * @param matches The matches, best first (room for k)
+ * @return The number of matches
+ */
+size_t friend_index_search(struct friend_index* idx, const float* query, size_t k, struct friend_match* matches);
+
+/**
+ * Get the memory held by an index's embeddings, IDs and codebook.
+ *
+ * An attached snapshot is not counted, since it is shared page cache.
+ *
+ * @param idx The index
+ * @return The size in bytes
+ */
+size_t friend_index_memory(const struct friend_index* idx);
+
+/**
+ * Get the name of the kernels in use (e.g. "avx2" or "scalar").
+ *
+ * @return The name
+ */
+const char* friend_index_kernels();
+
+/**
+ * Combine several embeddings of one face into a template.
+ *
+ * The samples are normalized and averaged. Samples that disagree with the
+ * average (e.g. a passer-by caught on the same track, or a bad crop) are then
+ * dropped and the rest averaged again.
+ *
+ * @param samples The samples, n rows of dim floats
+ * @param n The number of samples
+ * @param dim The embedding dimension
+ * @param min_agreement The least cosine similarity to the average a sample needs to be kept
+ * @param out The template (dim floats, unit length)
+ * @return The number of samples kept, or zero if fewer than half agree (or on failure)
+ */
+size_t friend_template(const float* samples, size_t n, size_t dim, float min_agreement, float* out);
+
+#endif // #ifndef CORE_FRIEND_INDEX_H
@@ -0,0 +1,900 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "friend_snapshot.h"
+#include "memory.h"
+
+/** The snapshot layout magic ("CZFRIDX1" in memory order). */
+#define FRIEND_SNAPSHOT_MAGIC 0x3158444952465a43ULL
+
+/** The log layout magic ("CZFRWAL1" in memory order). */
+#define FRIEND_WAL_MAGIC 0x314c415752465a43ULL
+
+/** Log operations. */
+enum {
+  wal_op_add = 1,
+  wal_op_remove = 2,
+  wal_op_watermark = 3,
+};
+
+/** The log file header. */
+struct wal_header {
+  /** The layout magic. */
+  uint64_t magic;
+
+  /** The embedding dimension. */
+  uint32_t dim;
+
+  /** Reserved. */
+  uint32_t reserved;
+};
+
+/** A log record. Additions are followed by the embedding, and watermarks by the watermark. */
+struct wal_record {
+  /** The operation. */
+  uint32_t op;
+
+  /** The friend ID. */
+  int32_t friend_id;
+};
+
+/** The latest removal of a friend during compaction. */
+struct removal {
+  /** The friend ID. */
+  int32_t friend_id;
+
+  /** The record number of the removal. */
+  size_t seq;
+};
+
+int friend_snapshot_open(struct friend_snapshot* snap, const char* path, size_t dim) {
+  memset(snap, 0, sizeof(*snap));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+
+    fprintf(stderr, "failed to open snapshot %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct friend_snapshot_header)) {
+    fprintf(stderr, "snapshot %s is truncated\n", path);
+    close(fd);
+    return 1;
+  }
+
+  void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "failed to map snapshot %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  const struct friend_snapshot_header* header = map;
+
+  // Check the layout, and that the rows it claims fit in the file
+  size_t end = (size_t) header->vectors_offset + (size_t) header->rows * dim * sizeof(float);
+  if (header->magic != FRIEND_SNAPSHOT_MAGIC || header->version != FRIEND_SNAPSHOT_VERSION
+      || header->dim != dim || header->vectors_offset % FRIEND_INDEX_ALIGN != 0
+      || header->vectors_offset < sizeof(*header) + header->rows * sizeof(int32_t) || end > (size_t) st.st_size) {
+    fprintf(stderr, "snapshot %s is not a %zu-dimension friend snapshot\n", path, dim);
+    munmap(map, (size_t) st.st_size);
+    return 1;
+  }
+
+  if (memory_map(memory_tag_friends, (size_t) st.st_size)) {
+    fprintf(stderr, "snapshot %s is over the friends memory limit\n", path);
+    munmap(map, (size_t) st.st_size);
+    return 1;
+  }
+
+  snap->map = map;
+  snap->size = (size_t) st.st_size;
+  snap->generation = header->generation;
+  snap->rows = (size_t) header->rows;
+  snap->watermark = header->watermark;
+  snap->ids = (const int32_t*) (header + 1);
+  snap->vectors = (const float*) ((const char*) map + header->vectors_offset);
+  return 0;
+}
+
+void friend_snapshot_close(struct friend_snapshot* snap) {
+  if (snap->map) {
+    munmap(snap->map, snap->size);
+    memory_unmap(memory_tag_friends, snap->size);
+  }
+
+  memset(snap, 0, sizeof(*snap));
+}
+
+int friend_snapshot_peek(const char* path, uint64_t* generation) {
+  *generation = 0;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno == ENOENT ? 0 : 1;
+  }
+
+  struct friend_snapshot_header header;
+  ssize_t n = pread(fd, &header, sizeof(header), 0);
+  close(fd);
+
+  if (n != sizeof(header) || header.magic != FRIEND_SNAPSHOT_MAGIC) {
+    return 1;
+  }
+
+  *generation = header.generation;
+  return 0;
+}
+
+/**
+ * Get the size of a log record.
+ *
+ * @param op The operation
+ * @param dim The embedding dimension
+ * @return The size in bytes
+ */
+static size_t record_size(uint32_t op, size_t dim) {
+  switch (op) {
+    case wal_op_add:
+      return sizeof(struct wal_record) + dim * sizeof(float);
+    case wal_op_watermark:
+      return sizeof(struct wal_record) + sizeof(uint64_t);
+    default:
+      return sizeof(struct wal_record);
+  }
+}
+
+/**
+ * Read part of a log into memory.
+ *
+ * @param wal The log
+ * @param from The start offset
+ * @param to The end offset
+ * @param len The number of bytes read
+ * @return The bytes (to be freed), or NULL on failure
+ */
+static char* read_range(const struct friend_wal* wal, off_t from, off_t to, size_t* len) {
+  *len = to > from ? (size_t) (to - from) : 0;
+
+  char* buf = memory_alloc(memory_tag_friends, *len ? *len : 1);
+  if (buf == NULL) {
+    return NULL;
+  }
+
+  size_t done = 0;
+  while (done < *len) {
+    ssize_t n = pread(wal->fd, buf + done, *len - done, from + (off_t) done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      memory_free(buf);
+      return NULL;
+    }
+
+    done += (size_t) n;
+  }
+
+  return buf;
+}
+
+/**
+ * Step through buffered log records.
+ *
+ * @param buf The records
+ * @param len The buffer length
+ * @param pos The position, advanced past the record
+ * @param dim The embedding dimension
+ * @param record The record
+ * @param payload The embedding of an addition or the watermark of a watermark (not aligned), or NULL
+ * @return Nonzero if a whole record was read, otherwise zero
+ */
+static int next_record(const char* buf, size_t len, size_t* pos, size_t dim, struct wal_record* record,
+    const char** payload) {
+  if (len - *pos < sizeof(*record)) {
+    return 0;
+  }
+
+  memcpy(record, buf + *pos, sizeof(*record));
+
+  size_t size = record_size(record->op, dim);
+  if (len - *pos < size || record->op < wal_op_add || record->op > wal_op_watermark) {
+    return 0;
+  }
+
+  *payload = size > sizeof(*record) ? buf + *pos + sizeof(*record) : NULL;
+  *pos += size;
+  return 1;
+}
+
+/**
+ * Read the watermark of a watermark record.
+ *
+ * @param payload The record payload
+ * @return The watermark
+ */
+static uint64_t record_watermark(const char* payload) {
+  uint64_t watermark;
+  memcpy(&watermark, payload, sizeof(watermark));
+  return watermark;
+}
+
+/**
+ * Cut a torn record (e.g. from a crash) off the end of a log, so records
+ * appended from here on follow whole ones.
+ *
+ * @param wal The log
+ * @return Zero on success, otherwise nonzero
+ */
+static int trim_torn(struct friend_wal* wal) {
+  off_t end = friend_wal_end(wal);
+  if (end < 0) {
+    return 1;
+  }
+
+  size_t len;
+  char* buf = read_range(wal, friend_wal_start(), end, &len);
+  if (buf == NULL) {
+    return 1;
+  }
+
+  size_t pos = 0;
+  struct wal_record record;
+  const char* payload;
+
+  // Find the end of the last whole record
+  while (next_record(buf, len, &pos, wal->dim, &record, &payload)) {
+  }
+
+  memory_free(buf);
+
+  if (pos == len) {
+    return 0;
+  }
+
+  return ftruncate(wal->fd, friend_wal_start() + (off_t) pos) < 0;
+}
+
+int friend_wal_open(struct friend_wal* wal, const char* path, size_t dim) {
+  wal->fd = -1;
+  wal->dim = dim;
+  wal->path = memory_strdup(memory_tag_friends, path);
+  if (wal->path == NULL) {
+    return 1;
+  }
+
+  // Records go on with single appending writes, so a crash can only tear the last one
+  wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (wal->fd < 0) {
+    fprintf(stderr, "failed to open log %s: %s\n", path, strerror(errno));
+    friend_wal_close(wal, 0);
+    return 1;
+  }
+
+  struct wal_header header;
+  ssize_t n = pread(wal->fd, &header, sizeof(header), 0);
+
+  if (n == 0) {
+    header.magic = FRIEND_WAL_MAGIC;
+    header.dim = (uint32_t) dim;
+    header.reserved = 0;
+
+    if (write(wal->fd, &header, sizeof(header)) != sizeof(header)) {
+      fprintf(stderr, "failed to write log %s: %s\n", path, strerror(errno));
+      friend_wal_close(wal, 0);
+      return 1;
+    }
+  } else if (n != sizeof(header) || header.magic != FRIEND_WAL_MAGIC || header.dim != dim) {
+    fprintf(stderr, "log %s is not a %zu-dimension friend log\n", path, dim);
+    friend_wal_close(wal, 0);
+    return 1;
+  }
+
+  if (trim_torn(wal)) {
+    fprintf(stderr, "failed to trim log %s: %s\n", path, strerror(errno));
+    friend_wal_close(wal, 0);
+    return 1;
+  }
+
+  return 0;
+}
+
+void friend_wal_close(struct friend_wal* wal, int unlink_file) {
+  if (wal->fd >= 0) {
+    close(wal->fd);
+  }
+
+  if (unlink_file && wal->path) {
+    unlink(wal->path);
+  }
+
+  memory_free(wal->path);
+  wal->path = NULL;
+  wal->fd = -1;
+}
+
+int friend_wal_add(struct friend_wal* wal, int32_t friend_id, const float* embedding) {
+  size_t size = record_size(wal_op_add, wal->dim);
+
+  char* buf = memory_alloc(memory_tag_friends, size);
+  if (buf == NULL) {
+    return 1;
+  }
+
+  struct wal_record record = {
+    .op = wal_op_add,
+    .friend_id = friend_id,
+  };
+
+  memcpy(buf, &record, sizeof(record));
+  memcpy(buf + sizeof(record), embedding, wal->dim * sizeof(float));
+
+  ssize_t n = write(wal->fd, buf, size);
+  memory_free(buf);
+
+  return n != (ssize_t) size;
+}
+
+int friend_wal_remove(struct friend_wal* wal, int32_t friend_id) {
+  struct wal_record record = {
+    .op = wal_op_remove,
+    .friend_id = friend_id,
+  };
+
+  return write(wal->fd, &record, sizeof(record)) != sizeof(record);
+}
+
+int friend_wal_watermark(struct friend_wal* wal, uint64_t watermark) {
+  char buf[sizeof(struct wal_record) + sizeof(uint64_t)];
+
+  struct wal_record record = {
+    .op = wal_op_watermark,
+  };
+
+  memcpy(buf, &record, sizeof(record));
+  memcpy(buf + sizeof(record), &watermark, sizeof(watermark));
+
+  return write(wal->fd, buf, sizeof(buf)) != sizeof(buf);
+}
+
+off_t friend_wal_start() {
+  return sizeof(struct wal_header);
+}
+
+off_t friend_wal_end(const struct friend_wal* wal) {
+  struct stat st;
+  if (fstat(wal->fd, &st) < 0) {
+    return -1;
+  }
+
+  return st.st_size;
+}
+
+int friend_wal_replay(const struct friend_wal* wal, off_t from, off_t to, struct friend_index* idx,
+    uint64_t* watermark) {
+  size_t len;
+  char* buf = read_range(wal, from, to, &len);
+  if (buf == NULL) {
+    return 1;
+  }
+
+  float* vector = memory_alloc(memory_tag_friends, wal->dim * sizeof(float));
+  if (vector == NULL) {
+    memory_free(buf);
+    return 1;
+  }
+
+  size_t pos = 0;
+  struct wal_record record;
+  const char* embedding;
+
+  while (next_record(buf, len, &pos, wal->dim, &record, &embedding)) {
+    if (record.op == wal_op_add) {
+      // Zero vectors were refused when first appended, and are again
+      memcpy(vector, embedding, wal->dim * sizeof(float));
+      friend_index_append(idx, record.friend_id, vector);
+    } else if (record.op == wal_op_remove) {
+      friend_index_remove(idx, record.friend_id);
+    } else if (record_watermark(embedding) > *watermark) {
+      *watermark = record_watermark(embedding);
+    }
+  }
+
+  memory_free(vector);
+  memory_free(buf);
+  return 0;
+}
+
+int friend_wal_discard(struct friend_wal* wal, off_t from) {
+  off_t end = friend_wal_end(wal);
+  if (end < 0) {
+    return 1;
+  }
+
+  size_t len;
+  char* buf = read_range(wal, from, end, &len);
+  if (buf == NULL) {
+    return 1;
+  }
+
+  size_t tmp_len = strlen(wal->path) + 8;
+  char* tmp = memory_alloc(memory_tag_friends, tmp_len);
+  if (tmp == NULL) {
+    memory_free(buf);
+    return 1;
+  }
+
+  snprintf(tmp, tmp_len, "%s.tmp", wal->path);
+
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    memory_free(tmp);
+    memory_free(buf);
+    return 1;
+  }
+
+  struct wal_header header = {
+    .magic = FRIEND_WAL_MAGIC,
+    .dim = (uint32_t) wal->dim,
+  };
+
+  int failed = write(fd, &header, sizeof(header)) != sizeof(header)
+    || (len > 0 && write(fd, buf, len) != (ssize_t) len)
+    || rename(tmp, wal->path) < 0;
+
+  memory_free(buf);
+
+  if (failed) {
+    close(fd);
+    unlink(tmp);
+    memory_free(tmp);
+    return 1;
+  }
+
+  memory_free(tmp);
+
+  close(wal->fd);
+  wal->fd = fd;
+  return 0;
+}
+
+static int compare_removals(const void* a, const void* b) {
+  const struct removal* x = a;
+  const struct removal* y = b;
+
+  if (x->friend_id != y->friend_id) {
+    return x->friend_id < y->friend_id ? -1 : 1;
+  }
+
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * Find the latest removal of a friend.
+ *
+ * @param removals The removals, sorted, one per friend
+ * @param n The number of removals
+ * @param friend_id The friend ID
+ * @return The removal, or NULL if the friend was not removed
+ */
+static const struct removal* find_removal(const struct removal* removals, size_t n, int32_t friend_id) {
+  struct removal key = {
+    .friend_id = friend_id,
+  };
+
+  size_t lo = 0;
+  size_t hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (removals[mid].friend_id < key.friend_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo < n && removals[lo].friend_id == friend_id ? &removals[lo] : NULL;
+}
+
+/**
+ * Get the length of an embedding stored unaligned in a log buffer.
+ *
+ * @param embedding The embedding
+ * @param dim The dimension
+ * @return The length
+ */
+static float embedding_norm(const char* embedding, size_t dim) {
+  double sum = 0;
+  for (size_t i = 0; i < dim; ++i) {
+    float x;
+    memcpy(&x, embedding + i * sizeof(float), sizeof(x));
+    sum += (double) x * x;
+  }
+
+  return (float) sqrt(sum);
+}
+
+/**
+ * Write rows of the new snapshot: IDs, then padding, then embeddings.
+ *
+ * @param file The file, positioned after the header
+ * @param base The old snapshot
+ * @param buf The log records
+ * @param len The log buffer length
+ * @param dim The dimension
+ * @param removals The removals
+ * @param num_removals The number of removals
+ * @param rows The number of rows being written
+ * @param vectors_offset The offset of the embeddings
+ * @return Zero on success, otherwise nonzero
+ */
+static int write_rows(FILE* file, const struct friend_snapshot* base, const char* buf, size_t len, size_t dim,
+    const struct removal* removals, size_t num_removals, size_t rows, uint64_t vectors_offset) {
+  // Each pass decides keep or drop the same way: a row survives unless its friend was removed after it was added
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < base->rows; ++i) {
+      if (find_removal(removals, num_removals, base->ids[i])) {
+        continue;
+      }
+
+      if (pass == 0) {
+        fwrite(&base->ids[i], sizeof(int32_t), 1, file);
+      } else {
+        fwrite(&base->vectors[i * dim], sizeof(float), dim, file);
+      }
+    }
+
+    size_t pos = 0;
+    size_t seq = 0;
+    struct wal_record record;
+    const char* embedding;
+
+    for (; next_record(buf, len, &pos, dim, &record, &embedding); ++seq) {
+      if (record.op != wal_op_add) {
+        continue;
+      }
+
+      const struct removal* removal = find_removal(removals, num_removals, record.friend_id);
+      float norm = embedding_norm(embedding, dim);
+      if ((removal && removal->seq > seq) || !(norm > 0)) {
+        continue;
+      }
+
+      if (pass == 0) {
+        fwrite(&record.friend_id, sizeof(int32_t), 1, file);
+        continue;
+      }
+
+      // The log holds embeddings as appended, but snapshots hold them unit length
+      for (size_t d = 0; d < dim; ++d) {
+        float x;
+        memcpy(&x, embedding + d * sizeof(float), sizeof(x));
+        x /= norm;
+        fwrite(&x, sizeof(x), 1, file);
+      }
+    }
+
+    if (pass == 0) {
+      long at = (long) (sizeof(struct friend_snapshot_header) + rows * sizeof(int32_t));
+      for (; at < (long) vectors_offset; ++at) {
+        fputc(0, file);
+      }
+    }
+  }
+
+  return ferror(file);
+}
+
+/**
+ * Take the compaction lock of a snapshot.
+ *
+ * One compaction at a time runs per snapshot, across processes. The lock is
+ * held until the returned descriptor is closed.
+ *
+ * @param path The snapshot path
+ * @return The lock file descriptor, or -1 on failure (message printed to stderr)
+ */
+static int lock_snapshot(const char* path) {
+  size_t path_len = strlen(path) + 8;
+  char* lock_path = memory_alloc(memory_tag_friends, path_len);
+  if (lock_path == NULL) {
+    return -1;
+  }
+
+  snprintf(lock_path, path_len, "%s.lock", path);
+
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0) {
+    fprintf(stderr, "failed to lock %s: %s\n", lock_path, strerror(errno));
+
+    if (lock_fd >= 0) {
+      close(lock_fd);
+      lock_fd = -1;
+    }
+  }
+
+  memory_free(lock_path);
+  return lock_fd;
+}
+
+/**
+ * Fold logged records into a new snapshot generation, with the compaction
+ * lock held.
+ *
+ * @param path The snapshot path
+ * @param wal The log
+ * @param to The offset to stop reading records at
+ * @param generation The new generation
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+static int compact_locked(const char* path, const struct friend_wal* wal, off_t to, uint64_t* generation) {
+  size_t path_len = strlen(path) + 32;
+  char* tmp_path = memory_alloc(memory_tag_friends, path_len);
+  if (tmp_path == NULL) {
+    return 1;
+  }
+
+  snprintf(tmp_path, path_len, "%s.%d.tmp", path, (int) getpid());
+
+  int status = 1;
+  FILE* file = NULL;
+  char* buf = NULL;
+  struct removal* removals = NULL;
+  struct friend_snapshot base = {0};
+
+  // Build on the newest snapshot, which another process may have written since this one mapped its own
+  if (friend_snapshot_open(&base, path, wal->dim)) {
+    goto done;
+  }
+
+  size_t len;
+  buf = read_range(wal, friend_wal_start(), to, &len);
+  if (buf == NULL) {
+    fprintf(stderr, "failed to read log %s\n", wal->path);
+    goto done;
+  }
+
+  // Collect the latest removal of each friend
+  size_t num_records = 0;
+  size_t num_removals = 0;
+  size_t pos = 0;
+  struct wal_record record;
+  const char* embedding;
+
+  while (next_record(buf, len, &pos, wal->dim, &record, &embedding)) {
+    ++num_records;
+  }
+
+  removals = memory_alloc(memory_tag_friends, (num_records ? num_records : 1) * sizeof(*removals));
+  if (removals == NULL) {
+    goto done;
+  }
+
+  // The watermark only moves forward, whichever process logged it
+  uint64_t watermark = base.watermark;
+
+  pos = 0;
+  for (size_t seq = 0; next_record(buf, len, &pos, wal->dim, &record, &embedding); ++seq) {
+    if (record.op == wal_op_remove) {
+      removals[num_removals].friend_id = record.friend_id;
+      removals[num_removals].seq = seq;
+      ++num_removals;
+    } else if (record.op == wal_op_watermark && record_watermark(embedding) > watermark) {
+      watermark = record_watermark(embedding);
+    }
+  }
+
+  qsort(removals, num_removals, sizeof(*removals), compare_removals);
+
+  // Keep only the latest removal of each friend
+  size_t unique = 0;
+  for (size_t i = 0; i < num_removals; ++i) {
+    if (unique > 0 && removals[unique - 1].friend_id == removals[i].friend_id) {
+      removals[unique - 1] = removals[i];
+    } else {
+      removals[unique++] = removals[i];
+    }
+  }
+
+  num_removals = unique;
+
+  // Count the surviving rows, which fixes the layout up front
+  size_t rows = 0;
+  for (size_t i = 0; i < base.rows; ++i) {
+    rows += find_removal(removals, num_removals, base.ids[i]) == NULL;
+  }
+
+  pos = 0;
+  for (size_t seq = 0; next_record(buf, len, &pos, wal->dim, &record, &embedding); ++seq) {
+    if (record.op == wal_op_add) {
+      const struct removal* removal = find_removal(removals, num_removals, record.friend_id);
+      rows += (!removal || removal->seq < seq) && embedding_norm(embedding, wal->dim) > 0;
+    }
+  }
+
+  uint64_t ids_end = sizeof(struct friend_snapshot_header) + rows * sizeof(int32_t);
+
+  struct friend_snapshot_header header = {
+    .magic = FRIEND_SNAPSHOT_MAGIC,
+    .version = FRIEND_SNAPSHOT_VERSION,
+    .dim = (uint32_t) wal->dim,
+    .generation = base.generation + 1,
+    .rows = rows,
+    .vectors_offset = (ids_end + FRIEND_INDEX_ALIGN - 1) / FRIEND_INDEX_ALIGN * FRIEND_INDEX_ALIGN,
+    .watermark = watermark,
+  };
+
+  file = fopen(tmp_path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "failed to create %s: %s\n", tmp_path, strerror(errno));
+    goto done;
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+
+  if (write_rows(file, &base, buf, len, wal->dim, removals, num_removals, rows, header.vectors_offset)
+      || fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    fprintf(stderr, "failed to write %s\n", tmp_path);
+    goto done;
+  }
+
+  fclose(file);
+  file = NULL;
+
+  // Readers either map the old file or the new one, never a partial one
+  if (rename(tmp_path, path) < 0) {
+    fprintf(stderr, "failed to replace %s: %s\n", path, strerror(errno));
+    goto done;
+  }
+
+  // Make the rename itself durable
+  strcpy(tmp_path, path);
+  int dir_fd = open(dirname(tmp_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  *generation = header.generation;
+  status = 0;
+
+done:
+  if (file) {
+    fclose(file);
+    unlink(tmp_path);
+  }
+
+  friend_snapshot_close(&base);
+
+  memory_free(removals);
+  memory_free(buf);
+  memory_free(tmp_path);
+  return status;
+}
+
+int friend_snapshot_compact(const char* path, const struct friend_wal* wal, off_t to, uint64_t* generation) {
+  int lock_fd = lock_snapshot(path);
+  if (lock_fd < 0) {
+    return 1;
+  }
+
+  int status = compact_locked(path, wal, to, generation);
+
+  close(lock_fd);
+  return status;
+}
+
+/**
+ * Get the process ID in a log file name, if it is a default log of a snapshot.
+ *
+ * @param file_name The file name
+ * @param snapshot_name The snapshot file name
+ * @return The process ID in <snapshot_name>.<pid>.wal, or zero if the name does not match
+ */
+static pid_t wal_owner(const char* file_name, const char* snapshot_name) {
+  size_t len = strlen(snapshot_name);
+  if (strncmp(file_name, snapshot_name, len) != 0 || file_name[len] != '.') {
+    return 0;
+  }
+
+  const char* digits = file_name + len + 1;
+  if (*digits < '0' || *digits > '9') {
+    return 0;
+  }
+
+  char* end;
+  long pid = strtol(digits, &end, 10);
+  return strcmp(end, ".wal") == 0 && pid > 0 && pid == (pid_t) pid ? (pid_t) pid : 0;
+}
+
+int friend_snapshot_recover(const char* path, size_t dim) {
+  int lock_fd = lock_snapshot(path);
+  if (lock_fd < 0) {
+    return 1;
+  }
+
+  size_t path_len = strlen(path) + 32;
+  char* dir_buf = memory_strdup(memory_tag_friends, path);
+  char* name_buf = memory_strdup(memory_tag_friends, path);
+  char* wal_path = memory_alloc(memory_tag_friends, path_len);
+  if (dir_buf == NULL || name_buf == NULL || wal_path == NULL) {
+    memory_free(dir_buf);
+    memory_free(name_buf);
+    memory_free(wal_path);
+    close(lock_fd);
+    return 1;
+  }
+
+  const char* dir = dirname(dir_buf);
+  const char* name = basename(name_buf);
+
+  int status = 0;
+
+  // Logs are only deleted with the lock held, so the listing stays true while this runs
+  DIR* entries = opendir(dir);
+  if (entries == NULL) {
+    fprintf(stderr, "failed to list %s: %s\n", dir, strerror(errno));
+    status = 1;
+  }
+
+  struct dirent* entry;
+  while (entries && (entry = readdir(entries)) != NULL) {
+    pid_t pid = wal_owner(entry->d_name, name);
+
+    // A live process folds its own log (and a reused pid leaves the log for later)
+    if (pid == 0 || pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH) {
+      continue;
+    }
+
+    snprintf(wal_path, path_len, "%s.%d.wal", path, (int) pid);
+
+    // A log that can't be folded is left for a later try, rather than holding this process up
+    struct friend_wal wal;
+    if (friend_wal_open(&wal, wal_path, dim)) {
+      continue;
+    }
+
+    uint64_t generation;
+    off_t end = friend_wal_end(&wal);
+    if (end < 0 || (end > friend_wal_start() && compact_locked(path, &wal, end, &generation))) {
+      fprintf(stderr, "failed to fold log %s of exited process %d\n", wal_path, (int) pid);
+      friend_wal_close(&wal, 0);
+      continue;
+    }
+
+    friend_wal_close(&wal, 1);
+  }
+
+  if (entries) {
+    closedir(entries);
+  }
+
+  memory_free(dir_buf);
+  memory_free(name_buf);
+  memory_free(wal_path);
+  close(lock_fd);
+  return status;
+}
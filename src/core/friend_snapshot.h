@@ -0,0 +1,255 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_FRIEND_SNAPSHOT_H
+#define CORE_FRIEND_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "friend_index.h"
+
+/** The snapshot layout version. Bumped whenever the file layout changes. */
+#define FRIEND_SNAPSHOT_VERSION 2
+
+/**
+ * The snapshot file header.
+ *
+ * The friend IDs follow the header, then the unit-length embeddings starting
+ * at vectors_offset (aligned to FRIEND_INDEX_ALIGN).
+ */
+struct friend_snapshot_header {
+  /** The layout magic. */
+  uint64_t magic;
+
+  /** The layout version. */
+  uint32_t version;
+
+  /** The embedding dimension. */
+  uint32_t dim;
+
+  /** The generation, bumped by each compaction. */
+  uint64_t generation;
+
+  /** The number of rows. */
+  uint64_t rows;
+
+  /** The offset of the embeddings. */
+  uint64_t vectors_offset;
+
+  /** The SQL watermark: the last database change (friend_changes.seq) the rows reflect. */
+  uint64_t watermark;
+
+  /** Reserved. */
+  uint8_t reserved[16];
+};
+
+/**
+ * A snapshot of the friend embeddings, mapped read-only.
+ *
+ * The mapping is shared, so every process on the host that opens the same
+ * snapshot reads one copy of it through the page cache. Snapshots are never
+ * written in place: compaction writes a new file and renames it over the old
+ * one, so a process keeps reading the file it mapped until it refreshes.
+ */
+struct friend_snapshot {
+  /** The mapping, or NULL for an empty snapshot. */
+  void* map;
+
+  /** The mapping size. */
+  size_t size;
+
+  /** The generation (zero if there is no snapshot file yet). */
+  uint64_t generation;
+
+  /** The number of rows. */
+  size_t rows;
+
+  /** The SQL watermark (see friend_snapshot_header). */
+  uint64_t watermark;
+
+  /** The friend IDs. */
+  const int32_t* ids;
+
+  /** The unit-length embeddings. */
+  const float* vectors;
+};
+
+/**
+ * A per-process write-ahead log of changes not yet in the snapshot.
+ *
+ * The log starts with a small header, followed by records of an operation and
+ * a friend ID, plus the embedding for additions or the SQL watermark for
+ * watermarks. Records are applied by friend ID, so a log replays correctly
+ * onto any snapshot generation.
+ *
+ * By default each process logs to <snapshot>.<pid>.wal. A log left behind by
+ * a process that died is folded into the snapshot by the next process that
+ * opens it (see friend_snapshot_recover).
+ */
+struct friend_wal {
+  /** The file descriptor, or -1. */
+  int fd;
+
+  /** The file path. */
+  char* path;
+
+  /** The embedding dimension. */
+  size_t dim;
+};
+
+/**
+ * Open a snapshot. A missing file opens as an empty snapshot.
+ *
+ * @param snap The snapshot
+ * @param path The file path
+ * @param dim The expected embedding dimension
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+int friend_snapshot_open(struct friend_snapshot* snap, const char* path, size_t dim);
+
+/**
+ * Close a snapshot.
+ *
+ * @param snap The snapshot
+ */
+void friend_snapshot_close(struct friend_snapshot* snap);
+
+/**
+ * Fold the logs of dead processes into a snapshot.
+ *
+ * Logs at <path>.<pid>.wal whose process is gone (e.g. after a crash) are
+ * each compacted into a new snapshot generation and deleted, under the same
+ * lock as friend_snapshot_compact. The calling process's own log is left
+ * alone.
+ *
+ * @param path The snapshot path
+ * @param dim The embedding dimension
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+int friend_snapshot_recover(const char* path, size_t dim);
+
+/**
+ * Read the generation of the snapshot currently at a path.
+ *
+ * @param path The file path
+ * @param generation The generation (zero if there is no snapshot file)
+ * @return Zero on success, otherwise nonzero
+ */
+int friend_snapshot_peek(const char* path, uint64_t* generation);
+
+/**
+ * Open a write-ahead log, creating it if missing.
+ *
+ * A torn record at the end (e.g. after a crash) is cut off, so new records
+ * follow whole ones.
+ *
+ * @param wal The log
+ * @param path The file path
+ * @param dim The embedding dimension
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+int friend_wal_open(struct friend_wal* wal, const char* path, size_t dim);
+
+/**
+ * Close a write-ahead log.
+ *
+ * @param wal The log
+ * @param unlink_file Nonzero to delete the file too
+ */
+void friend_wal_close(struct friend_wal* wal, int unlink_file);
+
+/**
+ * Log an addition.
+ *
+ * @param wal The log
+ * @param friend_id The friend ID
+ * @param embedding The embedding
+ * @return Zero on success, otherwise nonzero
+ */
+int friend_wal_add(struct friend_wal* wal, int32_t friend_id, const float* embedding);
+
+/**
+ * Log a removal.
+ *
+ * @param wal The log
+ * @param friend_id The friend ID
+ * @return Zero on success, otherwise nonzero
+ */
+int friend_wal_remove(struct friend_wal* wal, int32_t friend_id);
+
+/**
+ * Log a SQL watermark: every database change up to it is in the log or the
+ * snapshot.
+ *
+ * @param wal The log
+ * @param watermark The watermark
+ * @return Zero on success, otherwise nonzero
+ */
+int friend_wal_watermark(struct friend_wal* wal, uint64_t watermark);
+
+/**
+ * Get the offset of the first record.
+ *
+ * @return The offset
+ */
+off_t friend_wal_start();
+
+/**
+ * Get the offset just past the last record.
+ *
+ * @param wal The log
+ * @return The offset, or -1 on failure
+ */
+off_t friend_wal_end(const struct friend_wal* wal);
+
+/**
+ * Apply logged records to an index.
+ *
+ * A torn record at the end (e.g. after a crash) is ignored.
+ *
+ * @param wal The log
+ * @param from The offset of the first record to apply
+ * @param to The offset to stop at
+ * @param idx The index
+ * @param watermark The SQL watermark, raised to any logged one
+ * @return Zero on success, otherwise nonzero
+ */
+int friend_wal_replay(const struct friend_wal* wal, off_t from, off_t to, struct friend_index* idx,
+    uint64_t* watermark);
+
+/**
+ * Drop the records before an offset, keeping the rest.
+ *
+ * The kept records are written to a new file renamed over the log, so a
+ * crash leaves either the old log or the new one.
+ *
+ * @param wal The log
+ * @param from The offset of the first record to keep
+ * @return Zero on success, otherwise nonzero
+ */
+int friend_wal_discard(struct friend_wal* wal, off_t from);
+
+/**
+ * Fold logged records into a new snapshot generation.
+ *
+ * The newest snapshot at the path is read (whichever process wrote it), the
+ * records are applied on top (its watermark raised to any logged one), and
+ * the result is written to a temporary file
+ * and renamed over the snapshot. Compactions of one snapshot are serialized
+ * across processes by a lock file beside it. Neither the caller's index nor
+ * its mapped snapshot is touched, so this may run without the GIL while
+ * searches and appends go on.
+ *
+ * @param path The snapshot path
+ * @param wal The log
+ * @param to The offset to stop reading records at
+ * @param generation The new generation
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+int friend_snapshot_compact(const char* path, const struct friend_wal* wal, off_t to, uint64_t* generation);
+
+#endif // #ifndef CORE_FRIEND_SNAPSHOT_H
@@ -0,0 +1,375 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handle_queue.h"
+#include "memory.h"
+
+/**
+ * Wake everyone sleeping on a futex word, after bumping it.
+ *
+ * @param word The futex word
+ */
+static void wake_all(uint32_t* word) {
+  __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Sleep on a futex word while it holds a value.
+ *
+ * @param word The futex word
+ * @param value The value seen
+ * @param deadline The deadline, or NULL to wait forever
+ * @return Zero if woken (or spuriously), otherwise nonzero once the deadline has passed
+ */
+static int sleep_on(uint32_t* word, uint32_t value, const struct timespec* deadline) {
+  struct timespec remaining;
+
+  if (deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    remaining.tv_sec = deadline->tv_sec - now.tv_sec;
+    remaining.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remaining.tv_nsec < 0) {
+      remaining.tv_sec -= 1;
+      remaining.tv_nsec += 1000000000L;
+    }
+
+    if (remaining.tv_sec < 0) {
+      return 1;
+    }
+  }
+
+  long r = syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, deadline ? &remaining : NULL, NULL, 0);
+  return r < 0 && errno == ETIMEDOUT;
+}
+
+/**
+ * Work out a deadline.
+ *
+ * @param timeout The timeout, in seconds (negative for none)
+ * @param deadline The deadline
+ * @return The deadline, or NULL for none
+ */
+static const struct timespec* make_deadline(double timeout, struct timespec* deadline) {
+  if (timeout < 0) {
+    return NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += (time_t) timeout;
+  deadline->tv_nsec += (long) ((timeout - (double) (time_t) timeout) * 1e9);
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec += 1;
+    deadline->tv_nsec -= 1000000000L;
+  }
+
+  return deadline;
+}
+
+int handle_queue_init(struct handle_queue* q, size_t capacity) {
+  memset(q, 0, sizeof(*q));
+  q->fd = -1;
+
+  if (capacity == 0 || capacity > HANDLE_QUEUE_MAX_CAPACITY) {
+    return 1;
+  }
+
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  if (memory_aligned_alloc(memory_tag_handles, (void**) &q->cells, HANDLE_QUEUE_CACHE_LINE, size * sizeof(*q->cells))) {
+    q->cells = NULL;
+    return 1;
+  }
+
+  // A cell is free for the push at position p when its sequence is p
+  for (size_t i = 0; i < size; ++i) {
+    q->cells[i].seq = i;
+  }
+
+  q->mask = size - 1;
+
+  // Non-blocking so a spurious clear never stalls the event loop
+  q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (q->fd < 0) {
+    memory_free(q->cells);
+    q->cells = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+void handle_queue_destroy(struct handle_queue* q) {
+  if (q->fd >= 0) {
+    close(q->fd);
+  }
+
+  memory_free(q->cells);
+  q->cells = NULL;
+  q->fd = -1;
+}
+
+size_t handle_queue_capacity(const struct handle_queue* q) {
+  return (size_t) q->mask + 1;
+}
+
+size_t handle_queue_size(const struct handle_queue* q) {
+  uint64_t pop = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+  uint64_t push = __atomic_load_n(&q->push_pos, __ATOMIC_RELAXED);
+  return push > pop ? (size_t) (push - pop) : 0;
+}
+
+/**
+ * Push one handle.
+ *
+ * @param q The queue
+ * @param handle The handle
+ * @return Nonzero if pushed, otherwise zero (full)
+ */
+static int push_one(struct handle_queue* q, uint64_t handle) {
+  uint64_t pos = __atomic_load_n(&q->push_pos, __ATOMIC_RELAXED);
+
+  while (1) {
+    struct handle_queue_cell* cell = &q->cells[pos & q->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) (seq - pos);
+
+    if (diff == 0) {
+      // The cell is free for this lap, so try to claim the position
+      if (__atomic_compare_exchange_n(&q->push_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->handle = handle;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      // The cell still holds the handle from a lap ago
+      return 0;
+    } else {
+      // Another producer got here first
+      pos = __atomic_load_n(&q->push_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Pop one handle.
+ *
+ * @param q The queue
+ * @param handle The handle
+ * @return Nonzero if popped, otherwise zero (empty)
+ */
+static int pop_one(struct handle_queue* q, uint64_t* handle) {
+  uint64_t pos = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+
+  while (1) {
+    struct handle_queue_cell* cell = &q->cells[pos & q->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t diff = (int64_t) (seq - (pos + 1));
+
+    if (diff == 0) {
+      // The cell is full for this lap, so try to claim the position
+      if (__atomic_compare_exchange_n(&q->pop_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *handle = cell->handle;
+
+        // Free the cell for the next lap
+        __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      // Nothing pushed here yet
+      return 0;
+    } else {
+      // Another consumer got here first
+      pos = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Tell sleepers and the event loop that handles were pushed.
+ *
+ * @param q The queue
+ */
+static void notify_pushed(struct handle_queue* q) {
+  // Pairs with the fence in the waiters, so either they see the handles or we see them waiting
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&q->pop_waiters, __ATOMIC_RELAXED)) {
+    wake_all(&q->pushed);
+  }
+
+  // Signal an armed event loop once, however many pushes race here
+  if (__atomic_load_n(&q->armed, __ATOMIC_RELAXED) && __atomic_exchange_n(&q->armed, 0, __ATOMIC_ACQ_REL)) {
+    uint64_t one = 1;
+    while (write(q->fd, &one, sizeof one) < 0 && errno == EINTR);
+  }
+}
+
+/**
+ * Tell sleeping producers that room was made.
+ *
+ * @param q The queue
+ */
+static void notify_popped(struct handle_queue* q) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&q->push_waiters, __ATOMIC_RELAXED)) {
+    wake_all(&q->popped);
+  }
+}
+
+size_t handle_queue_try_push(struct handle_queue* q, const uint64_t* handles, size_t n) {
+  if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+
+  size_t pushed = 0;
+  while (pushed < n && push_one(q, handles[pushed])) {
+    ++pushed;
+  }
+
+  // One notification covers the batch
+  if (pushed > 0) {
+    notify_pushed(q);
+  }
+
+  return pushed;
+}
+
+size_t handle_queue_try_pop(struct handle_queue* q, uint64_t* handles, size_t n) {
+  size_t popped = 0;
+  while (popped < n && pop_one(q, &handles[popped])) {
+    ++popped;
+  }
+
+  if (popped > 0) {
+    notify_popped(q);
+  }
+
+  return popped;
+}
+
+enum handle_queue_result handle_queue_push(struct handle_queue* q, const uint64_t* handles, size_t n, double timeout,
+    size_t* pushed) {
+  struct timespec deadline_storage;
+  const struct timespec* deadline = make_deadline(timeout, &deadline_storage);
+
+  *pushed = 0;
+
+  while (1) {
+    *pushed += handle_queue_try_push(q, handles + *pushed, n - *pushed);
+    if (*pushed == n) {
+      return handle_queue_ok;
+    }
+
+    if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+      return handle_queue_closed;
+    }
+
+    // Announce the wait, then look again before sleeping, so a pop in between can't be missed
+    uint32_t popped = __atomic_load_n(&q->popped, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    size_t more = handle_queue_try_push(q, handles + *pushed, n - *pushed);
+    int expired = 0;
+    if (more == 0 && !__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+      expired = sleep_on(&q->popped, popped, deadline);
+    }
+
+    __atomic_sub_fetch(&q->push_waiters, 1, __ATOMIC_SEQ_CST);
+    *pushed += more;
+
+    if (expired && *pushed < n) {
+      return handle_queue_timeout;
+    }
+  }
+}
+
+enum handle_queue_result handle_queue_pop(struct handle_queue* q, uint64_t* handles, size_t n, double timeout,
+    size_t* popped) {
+  struct timespec deadline_storage;
+  const struct timespec* deadline = make_deadline(timeout, &deadline_storage);
+
+  while (1) {
+    *popped = handle_queue_try_pop(q, handles, n);
+    if (*popped > 0) {
+      return handle_queue_ok;
+    }
+
+    if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+      // Closing may race with a last push, so drain once more
+      *popped = handle_queue_try_pop(q, handles, n);
+      return *popped > 0 ? handle_queue_ok : handle_queue_closed;
+    }
+
+    // Announce the wait, then look again before sleeping, so a push in between can't be missed
+    uint32_t pushed = __atomic_load_n(&q->pushed, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    *popped = handle_queue_try_pop(q, handles, n);
+    int expired = 0;
+    if (*popped == 0 && !__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+      expired = sleep_on(&q->pushed, pushed, deadline);
+    }
+
+    __atomic_sub_fetch(&q->pop_waiters, 1, __ATOMIC_SEQ_CST);
+
+    if (*popped > 0) {
+      return handle_queue_ok;
+    }
+
+    if (expired) {
+      return handle_queue_timeout;
+    }
+  }
+}
+
+int handle_queue_arm(struct handle_queue* q) {
+  __atomic_store_n(&q->armed, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&q->closed, __ATOMIC_ACQUIRE)) {
+    return 1;
+  }
+
+  // The cell at the pop position is full if a handle is ready
+  uint64_t pos = __atomic_load_n(&q->pop_pos, __ATOMIC_RELAXED);
+  uint64_t seq = __atomic_load_n(&q->cells[pos & q->mask].seq, __ATOMIC_ACQUIRE);
+  return seq == pos + 1;
+}
+
+void handle_queue_clear(struct handle_queue* q) {
+  uint64_t count;
+  while (read(q->fd, &count, sizeof count) < 0 && errno == EINTR);
+}
+
+void handle_queue_close(struct handle_queue* q) {
+  __atomic_store_n(&q->closed, 1, __ATOMIC_RELEASE);
+
+  wake_all(&q->pushed);
+  wake_all(&q->popped);
+
+  // An armed event loop must see the close too
+  __atomic_store_n(&q->armed, 0, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  while (write(q->fd, &one, sizeof one) < 0 && errno == EINTR);
+}
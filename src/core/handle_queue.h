@@ -0,0 +1,187 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_HANDLE_QUEUE_H
+#define CORE_HANDLE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The cache line size assumed for padding. */
+#define HANDLE_QUEUE_CACHE_LINE 64
+
+/** The largest queue capacity. */
+#define HANDLE_QUEUE_MAX_CAPACITY (1u << 24)
+
+/** A queue cell. */
+struct handle_queue_cell {
+  /** The sequence number, saying whether the cell is free or full for the current lap. */
+  uint64_t seq;
+
+  /** The handle. */
+  uint64_t handle;
+};
+
+/**
+ * A bounded multi-producer, multi-consumer queue of opaque 64-bit handles.
+ *
+ * Pushes and pops are lock-free (Vyukov's bounded queue): each side claims a
+ * position with one compare-and-swap, and the cell's sequence number says
+ * whether it is ready, so producers and consumers only meet on the cells
+ * themselves. Handles are whatever the two ends agree on (a pointer to a
+ * native frame, an index into a pool, ...), so nothing crossing the queue
+ * needs the GIL.
+ *
+ * Blocking waits sleep on futex words that are only bumped when someone is
+ * waiting. Separately, a consumer on an event loop can arm the eventfd, which
+ * the next push then signals once.
+ */
+struct handle_queue {
+  /** The cells. */
+  struct handle_queue_cell* cells;
+
+  /** The capacity minus one (capacity is a power of two). */
+  uint64_t mask;
+
+  /** The eventfd signalled for an armed consumer. */
+  int fd;
+
+  /** The next position to push (on its own cache line). */
+  _Alignas(HANDLE_QUEUE_CACHE_LINE) uint64_t push_pos;
+
+  /** The next position to pop (on its own cache line). */
+  _Alignas(HANDLE_QUEUE_CACHE_LINE) uint64_t pop_pos;
+
+  /** Bumped after pushes while consumers sleep. */
+  _Alignas(HANDLE_QUEUE_CACHE_LINE) uint32_t pushed;
+
+  /** Bumped after pops while producers sleep. */
+  uint32_t popped;
+
+  /** The number of consumers sleeping. */
+  uint32_t pop_waiters;
+
+  /** The number of producers sleeping. */
+  uint32_t push_waiters;
+
+  /** Nonzero while an event loop consumer waits for the eventfd. */
+  uint32_t armed;
+
+  /** Nonzero once closed. */
+  uint32_t closed;
+};
+
+/** The outcome of a blocking operation. */
+enum handle_queue_result {
+  handle_queue_ok = 0,
+  handle_queue_timeout,
+  handle_queue_closed,
+};
+
+/**
+ * Initialize a queue.
+ *
+ * @param q The queue
+ * @param capacity The capacity (rounded up to a power of two)
+ * @return Zero on success, otherwise nonzero
+ */
+int handle_queue_init(struct handle_queue* q, size_t capacity);
+
+/**
+ * Destroy a queue. Handles still queued are forgotten.
+ *
+ * @param q The queue
+ */
+void handle_queue_destroy(struct handle_queue* q);
+
+/**
+ * Get the capacity of a queue.
+ *
+ * @param q The queue
+ * @return The capacity
+ */
+size_t handle_queue_capacity(const struct handle_queue* q);
+
+/**
+ * Get the approximate number of queued handles.
+ *
+ * @param q The queue
+ * @return The count (exact only when no one else is using the queue)
+ */
+size_t handle_queue_size(const struct handle_queue* q);
+
+/**
+ * Push handles without blocking.
+ *
+ * @param q The queue
+ * @param handles The handles
+ * @param n The number of handles
+ * @return The number pushed, from the front (fewer than n if the queue filled up or is closed)
+ */
+size_t handle_queue_try_push(struct handle_queue* q, const uint64_t* handles, size_t n);
+
+/**
+ * Pop handles without blocking.
+ *
+ * @param q The queue
+ * @param handles The handles, oldest first
+ * @param n The most handles to pop
+ * @return The number popped
+ */
+size_t handle_queue_try_pop(struct handle_queue* q, uint64_t* handles, size_t n);
+
+/**
+ * Push handles, waiting for room as needed.
+ *
+ * @param q The queue
+ * @param handles The handles
+ * @param n The number of handles
+ * @param timeout The longest wait for room, in seconds (negative to wait forever)
+ * @param pushed The number pushed
+ * @return The outcome (handle_queue_ok once all are pushed)
+ */
+enum handle_queue_result handle_queue_push(struct handle_queue* q, const uint64_t* handles, size_t n, double timeout,
+    size_t* pushed);
+
+/**
+ * Pop at least one handle, waiting if the queue is empty.
+ *
+ * @param q The queue
+ * @param handles The handles, oldest first
+ * @param n The most handles to pop
+ * @param timeout The longest wait, in seconds (negative to wait forever)
+ * @param popped The number popped
+ * @return The outcome (handle_queue_closed only once the queue is also empty)
+ */
+enum handle_queue_result handle_queue_pop(struct handle_queue* q, uint64_t* handles, size_t n, double timeout,
+    size_t* popped);
+
+/**
+ * Ask for the eventfd to be signalled by the next push.
+ *
+ * Check for handles again if this says there may be some, since the push
+ * that would have signalled may already have happened.
+ *
+ * @param q The queue
+ * @return Nonzero if handles may be waiting (or the queue is closed), otherwise zero
+ */
+int handle_queue_arm(struct handle_queue* q);
+
+/**
+ * Clear the eventfd after it signalled.
+ *
+ * @param q The queue
+ */
+void handle_queue_clear(struct handle_queue* q);
+
+/**
+ * Close a queue. Pushes fail from now on, pops drain what is left, and every
+ * waiter wakes up.
+ *
+ * @param q The queue
+ */
+void handle_queue_close(struct handle_queue* q);
+
+#endif // #ifndef CORE_HANDLE_QUEUE_H
@@ -0,0 +1,245 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <string.h>
+
+#include "jpeg_decoder.h"
+
+/** The most rows handed to libjpeg per read. */
+#define JPEG_DECODER_ROWS_PER_READ 8
+
+/**
+ * Handle a fatal libjpeg error by jumping back into the decoder call.
+ *
+ * @param cinfo The libjpeg state
+ */
+static void on_error(j_common_ptr cinfo) {
+  struct jpeg_decoder* dec = cinfo->client_data;
+  (*cinfo->err->format_message)(cinfo, dec->message);
+  longjmp(dec->escape, 1);
+}
+
+/**
+ * Keep a libjpeg warning instead of printing it. Corrupt frames are routine
+ * on a wireless camera feed.
+ *
+ * @param cinfo The libjpeg state
+ */
+static void on_message(j_common_ptr cinfo) {
+  struct jpeg_decoder* dec = cinfo->client_data;
+  (*cinfo->err->format_message)(cinfo, dec->message);
+}
+
+/**
+ * Read a JPEG header and set up the output color.
+ *
+ * Must be called after setjmp on the decoder escape.
+ *
+ * @param dec The decoder
+ * @param data The JPEG data
+ * @param len The JPEG data length
+ * @param gray Nonzero for gray output, zero for RGB
+ */
+static void read_header(struct jpeg_decoder* dec, const void* data, size_t len, int gray) {
+  jpeg_mem_src(&dec->cinfo, (const unsigned char*) data, (unsigned long) len);
+  jpeg_read_header(&dec->cinfo, TRUE);
+
+  // Gray output comes straight from the luma plane, so chroma is never decoded
+  dec->cinfo.out_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+
+  // Detection and embedding are insensitive to the last bit of IDCT precision
+  dec->cinfo.dct_method = JDCT_IFAST;
+  dec->cinfo.do_fancy_upsampling = FALSE;
+  dec->cinfo.do_block_smoothing = FALSE;
+}
+
+void jpeg_decoder_init(struct jpeg_decoder* dec) {
+  memset(dec, 0, sizeof *dec);
+
+  dec->cinfo.err = jpeg_std_error(&dec->jerr);
+  dec->jerr.error_exit = &on_error;
+  dec->jerr.output_message = &on_message;
+
+  jpeg_create_decompress(&dec->cinfo);
+  dec->cinfo.client_data = dec;
+}
+
+void jpeg_decoder_destroy(struct jpeg_decoder* dec) {
+  jpeg_destroy_decompress(&dec->cinfo);
+}
+
+int jpeg_decoder_info(struct jpeg_decoder* dec, const void* data, size_t len, struct jpeg_image* image) {
+  jpeg_decoder_abort(dec);
+
+  if (setjmp(dec->escape)) {
+    jpeg_abort_decompress(&dec->cinfo);
+    return 1;
+  }
+
+  jpeg_mem_src(&dec->cinfo, (const unsigned char*) data, (unsigned long) len);
+  jpeg_read_header(&dec->cinfo, TRUE);
+
+  image->width = dec->cinfo.image_width;
+  image->height = dec->cinfo.image_height;
+  image->components = 3;
+
+  jpeg_abort_decompress(&dec->cinfo);
+  return 0;
+}
+
+int jpeg_decoder_begin(struct jpeg_decoder* dec, const void* data, size_t len, int scale, int gray,
+    struct jpeg_image* image) {
+  jpeg_decoder_abort(dec);
+
+  if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+    snprintf(dec->message, sizeof dec->message, "unsupported scale 1/%d", scale);
+    return 1;
+  }
+
+  if (setjmp(dec->escape)) {
+    jpeg_abort_decompress(&dec->cinfo);
+    return 1;
+  }
+
+  read_header(dec, data, len, gray);
+
+  // Scale in the DCT domain, e.g. 1/8 keeps only the DC coefficient of each block
+  dec->cinfo.scale_num = 1;
+  dec->cinfo.scale_denom = (unsigned int) scale;
+
+  jpeg_start_decompress(&dec->cinfo);
+
+  dec->crop_left = 0;
+  dec->crop_skip = 0;
+  dec->image.width = dec->cinfo.output_width;
+  dec->image.height = dec->cinfo.output_height;
+  dec->image.components = (uint32_t) dec->cinfo.output_components;
+  dec->active = 1;
+
+  *image = dec->image;
+  return 0;
+}
+
+int jpeg_decoder_begin_region(struct jpeg_decoder* dec, const void* data, size_t len, uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, int gray, struct jpeg_image* image) {
+  jpeg_decoder_abort(dec);
+
+  if (setjmp(dec->escape)) {
+    jpeg_abort_decompress(&dec->cinfo);
+    return 1;
+  }
+
+  read_header(dec, data, len, gray);
+
+  // Clip the region to the image
+  uint32_t image_width = dec->cinfo.image_width;
+  uint32_t image_height = dec->cinfo.image_height;
+  if (x >= image_width || y >= image_height || width == 0 || height == 0) {
+    snprintf(dec->message, sizeof dec->message, "region lies outside the %ux%u image", image_width, image_height);
+    jpeg_abort_decompress(&dec->cinfo);
+    return 1;
+  }
+
+  // Clip into new locals, as the arguments must not change after setjmp
+  uint32_t region_width = width > image_width - x ? image_width - x : width;
+  uint32_t region_height = height > image_height - y ? image_height - y : height;
+
+  jpeg_start_decompress(&dec->cinfo);
+
+  // Only decode the iMCU columns under the region
+  // libjpeg widens the crop out to iMCU boundaries, so remember where ours starts within it
+  JDIMENSION crop_x = x;
+  JDIMENSION crop_width = region_width;
+  jpeg_crop_scanline(&dec->cinfo, &crop_x, &crop_width);
+
+  dec->crop_left = x - crop_x;
+  dec->crop_skip = y;
+  dec->image.width = region_width;
+  dec->image.height = region_height;
+  dec->image.components = (uint32_t) dec->cinfo.output_components;
+  dec->active = 1;
+
+  *image = dec->image;
+  return 0;
+}
+
+int jpeg_decoder_finish(struct jpeg_decoder* dec, void* out, size_t cap) {
+  if (!dec->active) {
+    snprintf(dec->message, sizeof dec->message, "no decode in progress");
+    return 1;
+  }
+
+  size_t row_bytes = (size_t) dec->image.width * dec->image.components;
+  if (cap / row_bytes < dec->image.height) {
+    snprintf(dec->message, sizeof dec->message, "output too small for %ux%ux%u image", dec->image.width,
+      dec->image.height, dec->image.components);
+    jpeg_decoder_abort(dec);
+    return 1;
+  }
+
+  if (setjmp(dec->escape)) {
+    jpeg_abort_decompress(&dec->cinfo);
+    dec->active = 0;
+    return 1;
+  }
+
+  // Skip the rows above a region
+  // Skipped rows go through entropy decoding only
+  if (dec->crop_skip > 0) {
+    jpeg_skip_scanlines(&dec->cinfo, dec->crop_skip);
+  }
+
+  unsigned char* dst = out;
+
+  if (dec->crop_left == 0 && dec->cinfo.output_width == dec->image.width) {
+    // Rows come out exactly as wanted, so decode straight into the output
+    for (uint32_t row = 0; row < dec->image.height;) {
+      JSAMPROW rows[JPEG_DECODER_ROWS_PER_READ];
+
+      uint32_t n = dec->image.height - row;
+      if (n > JPEG_DECODER_ROWS_PER_READ) {
+        n = JPEG_DECODER_ROWS_PER_READ;
+      }
+
+      for (uint32_t i = 0; i < n; ++i) {
+        rows[i] = dst + (size_t) (row + i) * row_bytes;
+      }
+
+      JDIMENSION got = jpeg_read_scanlines(&dec->cinfo, rows, n);
+      if (got == 0) {
+        snprintf(dec->message, sizeof dec->message, "decoder stalled at row %u", row);
+        jpeg_abort_decompress(&dec->cinfo);
+        dec->active = 0;
+        return 1;
+      }
+
+      row += got;
+    }
+  } else {
+    // Rows are wider than the region, so go through a row buffer
+    // The buffer comes from the libjpeg image pool, which the abort below frees
+    JSAMPARRAY buffer = (*dec->cinfo.mem->alloc_sarray)((j_common_ptr) &dec->cinfo, JPOOL_IMAGE,
+      dec->cinfo.output_width * (JDIMENSION) dec->cinfo.output_components, 1);
+
+    size_t left_bytes = (size_t) dec->crop_left * dec->image.components;
+
+    for (uint32_t row = 0; row < dec->image.height; ++row) {
+      jpeg_read_scanlines(&dec->cinfo, buffer, 1);
+      memcpy(dst + (size_t) row * row_bytes, buffer[0] + left_bytes, row_bytes);
+    }
+  }
+
+  // Stop here, as regions leave rows unread below them
+  jpeg_abort_decompress(&dec->cinfo);
+  dec->active = 0;
+  return 0;
+}
+
+void jpeg_decoder_abort(struct jpeg_decoder* dec) {
+  if (dec->active) {
+    jpeg_abort_decompress(&dec->cinfo);
+    dec->active = 0;
+  }
+}
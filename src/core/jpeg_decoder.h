@@ -0,0 +1,147 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_JPEG_DECODER_H
+#define CORE_JPEG_DECODER_H
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+/** The longest decoder error message. */
+#define JPEG_DECODER_MESSAGE_MAX 200
+
+/** The shape of a decoded image. */
+struct jpeg_image {
+  /** The image width. */
+  uint32_t width;
+
+  /** The image height. */
+  uint32_t height;
+
+  /** The bytes per pixel (1 for gray, 3 for RGB). */
+  uint32_t components;
+};
+
+/**
+ * A reusable JPEG decoder on libjpeg-turbo.
+ *
+ * Decoding happens in two steps. A begin call parses the header and works
+ * out the output shape, so the caller can find room for it (e.g. a frame ring
+ * slot), and a finish call decodes into that room. Reusing one decoder across
+ * frames avoids setting up libjpeg state for each one.
+ *
+ * Two kinds of decode are offered. Scaled decodes shrink the image by 2, 4 or
+ * 8 in the DCT domain, which skips most of the inverse DCT, and gray output
+ * skips the chroma planes entirely. Region decodes produce full resolution
+ * but only for a crop, skipping the rows above it and the iMCU columns beside
+ * it, so full-resolution work is only paid for faces that need it.
+ */
+struct jpeg_decoder {
+  /** The libjpeg decompressor. */
+  struct jpeg_decompress_struct cinfo;
+
+  /** The libjpeg error manager. */
+  struct jpeg_error_mgr jerr;
+
+  /** Where libjpeg errors jump back to. */
+  jmp_buf escape;
+
+  /** The last error or warning message. */
+  char message[JPEG_DECODER_MESSAGE_MAX];
+
+  /** Nonzero between a successful begin and the matching finish or abort. */
+  int active;
+
+  /** The left edge of the crop within decoded rows (region decodes). */
+  uint32_t crop_left;
+
+  /** The rows left to skip before the crop (region decodes). */
+  uint32_t crop_skip;
+
+  /** The shape of the output. */
+  struct jpeg_image image;
+};
+
+/**
+ * Initialize a decoder.
+ *
+ * @param dec The decoder
+ */
+void jpeg_decoder_init(struct jpeg_decoder* dec);
+
+/**
+ * Destroy a decoder.
+ *
+ * @param dec The decoder
+ */
+void jpeg_decoder_destroy(struct jpeg_decoder* dec);
+
+/**
+ * Read the full-resolution size of a JPEG image.
+ *
+ * @param dec The decoder
+ * @param data The JPEG data
+ * @param len The JPEG data length
+ * @param [out] image The full-resolution shape (three components)
+ * @return Zero on success, otherwise nonzero (see dec->message)
+ */
+int jpeg_decoder_info(struct jpeg_decoder* dec, const void* data, size_t len, struct jpeg_image* image);
+
+/**
+ * Begin a whole-image decode, downscaled in the DCT domain.
+ *
+ * @param dec The decoder
+ * @param data The JPEG data (must stay put until finish)
+ * @param len The JPEG data length
+ * @param scale The scale denominator (1, 2, 4 or 8)
+ * @param gray Nonzero for gray output, zero for RGB
+ * @param [out] image The output shape
+ * @return Zero on success, otherwise nonzero (see dec->message)
+ */
+int jpeg_decoder_begin(struct jpeg_decoder* dec, const void* data, size_t len, int scale, int gray,
+    struct jpeg_image* image);
+
+/**
+ * Begin a full-resolution decode of a region.
+ *
+ * The region is clipped to the image.
+ *
+ * @param dec The decoder
+ * @param data The JPEG data (must stay put until finish)
+ * @param len The JPEG data length
+ * @param x The region left edge
+ * @param y The region top edge
+ * @param width The region width
+ * @param height The region height
+ * @param gray Nonzero for gray output, zero for RGB
+ * @param [out] image The output shape
+ * @return Zero on success, otherwise nonzero (see dec->message)
+ */
+int jpeg_decoder_begin_region(struct jpeg_decoder* dec, const void* data, size_t len, uint32_t x, uint32_t y,
+    uint32_t width, uint32_t height, int gray, struct jpeg_image* image);
+
+/**
+ * Finish a decode into caller memory. Rows are packed (the stride is the
+ * width times the components).
+ *
+ * @param dec The decoder
+ * @param out The output
+ * @param cap The output capacity
+ * @return Zero on success, otherwise nonzero (see dec->message)
+ */
+int jpeg_decoder_finish(struct jpeg_decoder* dec, void* out, size_t cap);
+
+/**
+ * Abandon a decode after begin.
+ *
+ * @param dec The decoder
+ */
+void jpeg_decoder_abort(struct jpeg_decoder* dec);
+
+#endif // #ifndef CORE_JPEG_DECODER_H
@@ -0,0 +1,297 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+
+/** The header in front of each heap allocation (kept at 16 bytes so malloc's alignment survives). */
+struct memory_header {
+  /** The size asked for. */
+  uint64_t size;
+
+  /** The tag. */
+  uint32_t tag;
+
+  /** The bytes from the start of the block to the header (nonzero only when aligned). */
+  uint32_t offset;
+};
+
+_Static_assert(sizeof(struct memory_header) == 16, "memory header must keep 16-byte alignment");
+
+/** The counters of each tag. */
+static struct memory_stats memory_counters[memory_tag_count];
+
+/** The hooks. */
+static struct memory_hooks memory_hooks;
+
+/** Whether hooks are set. */
+static int memory_hooked;
+
+/** The tag names. */
+static const char* const memory_tag_names[memory_tag_count] = {
+  [memory_tag_other] = "other",
+  [memory_tag_arena] = "arena",
+  [memory_tag_detections] = "detections",
+  [memory_tag_encounters] = "encounters",
+  [memory_tag_frames] = "frames",
+  [memory_tag_friends] = "friends",
+  [memory_tag_handles] = "handles",
+  [memory_tag_jpeg] = "jpeg",
+  [memory_tag_quality] = "quality",
+  [memory_tag_scheduler] = "scheduler",
+  [memory_tag_sql] = "sql",
+  [memory_tag_topology] = "topology",
+};
+
+/**
+ * Raise a high-water mark.
+ *
+ * @param peak The mark
+ * @param value The value now
+ */
+static void memory_raise_peak(uint64_t* peak, uint64_t value) {
+  uint64_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (value > seen && !__atomic_compare_exchange_n(peak, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+/**
+ * Reserve bytes against a tag's limit.
+ *
+ * @param tag The tag
+ * @param counter The counter to charge (heap or mapped bytes)
+ * @param peak The counter's high-water mark
+ * @param size The size
+ * @return Zero on success, otherwise nonzero with nothing charged
+ */
+static int memory_charge(enum memory_tag tag, uint64_t* counter, uint64_t* peak, size_t size) {
+  struct memory_stats* c = &memory_counters[tag];
+
+  uint64_t now = __atomic_add_fetch(counter, size, __ATOMIC_RELAXED);
+
+  uint64_t limit = __atomic_load_n(&c->limit, __ATOMIC_RELAXED);
+  if (limit) {
+    uint64_t* other = counter == &c->bytes ? &c->mapped : &c->bytes;
+    if (now + __atomic_load_n(other, __ATOMIC_RELAXED) > limit) {
+      __atomic_sub_fetch(counter, size, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&c->failures, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+
+  memory_raise_peak(peak, now);
+  return 0;
+}
+
+/**
+ * Finish a heap allocation.
+ *
+ * @param tag The tag
+ * @param block The block from malloc, or NULL on failure
+ * @param offset The bytes from the block to the header
+ * @param size The size asked for
+ * @return The memory after the header, or NULL
+ */
+static void* memory_finish(enum memory_tag tag, void* block, size_t offset, size_t size) {
+  struct memory_stats* c = &memory_counters[tag];
+
+  if (block == NULL) {
+    __atomic_sub_fetch(&c->bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->failures, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  struct memory_header* header = (struct memory_header*) ((char*) block + offset);
+  header->size = size;
+  header->tag = tag;
+  header->offset = (uint32_t) offset;
+
+  __atomic_add_fetch(&c->live, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+
+  void* ptr = header + 1;
+
+  if (__atomic_load_n(&memory_hooked, __ATOMIC_ACQUIRE)) {
+    memory_hooks.track(tag, ptr, size);
+  }
+
+  return ptr;
+}
+
+void* memory_alloc(enum memory_tag tag, size_t size) {
+  struct memory_stats* c = &memory_counters[tag];
+
+  if (size > SIZE_MAX - sizeof(struct memory_header) || memory_charge(tag, &c->bytes, &c->peak, size)) {
+    return NULL;
+  }
+
+  return memory_finish(tag, malloc(sizeof(struct memory_header) + size), 0, size);
+}
+
+void* memory_calloc(enum memory_tag tag, size_t n, size_t size) {
+  if (size && n > SIZE_MAX / size) {
+    __atomic_add_fetch(&memory_counters[tag].failures, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  struct memory_stats* c = &memory_counters[tag];
+
+  size_t total = n * size;
+  if (total > SIZE_MAX - sizeof(struct memory_header) || memory_charge(tag, &c->bytes, &c->peak, total)) {
+    return NULL;
+  }
+
+  return memory_finish(tag, calloc(1, sizeof(struct memory_header) + total), 0, total);
+}
+
+void* memory_realloc(enum memory_tag tag, void* ptr, size_t size) {
+  if (ptr == NULL) {
+    return memory_alloc(tag, size);
+  }
+
+  // The memory stays charged to the tag it was allocated under
+  struct memory_header* header = (struct memory_header*) ptr - 1;
+  tag = (enum memory_tag) header->tag;
+
+  struct memory_stats* c = &memory_counters[tag];
+
+  // An aligned block doesn't start at its header, and realloc wouldn't keep the alignment anyway
+  if (header->offset != 0) {
+    __atomic_add_fetch(&c->failures, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  size_t old = header->size;
+  if (size > SIZE_MAX - sizeof(struct memory_header)) {
+    __atomic_add_fetch(&c->failures, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  // Charge only growth, so shrinking always works even over the limit
+  if (size > old && memory_charge(tag, &c->bytes, &c->peak, size - old)) {
+    return NULL;
+  }
+
+  if (__atomic_load_n(&memory_hooked, __ATOMIC_ACQUIRE)) {
+    memory_hooks.untrack(tag, ptr);
+  }
+
+  struct memory_header* moved = realloc(header, sizeof(struct memory_header) + size);
+  if (moved == NULL) {
+    if (size > old) {
+      __atomic_sub_fetch(&c->bytes, size - old, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&c->failures, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&memory_hooked, __ATOMIC_ACQUIRE)) {
+      memory_hooks.track(tag, ptr, old);
+    }
+    return NULL;
+  }
+
+  if (size < old) {
+    __atomic_sub_fetch(&c->bytes, old - size, __ATOMIC_RELAXED);
+  }
+
+  moved->size = size;
+
+  if (__atomic_load_n(&memory_hooked, __ATOMIC_ACQUIRE)) {
+    memory_hooks.track(tag, moved + 1, size);
+  }
+
+  return moved + 1;
+}
+
+int memory_aligned_alloc(enum memory_tag tag, void** ptr, size_t align, size_t size) {
+  struct memory_stats* c = &memory_counters[tag];
+
+  if (align < sizeof(struct memory_header)) {
+    align = sizeof(struct memory_header);
+  }
+
+  // The header sits just before the aligned memory, in the first align bytes
+  if (align > UINT32_MAX || size > SIZE_MAX - align || memory_charge(tag, &c->bytes, &c->peak, size)) {
+    return 1;
+  }
+
+  void* block;
+  if (posix_memalign(&block, align, align + size)) {
+    block = NULL;
+  }
+
+  *ptr = memory_finish(tag, block, align - sizeof(struct memory_header), size);
+  return *ptr == NULL;
+}
+
+char* memory_strdup(enum memory_tag tag, const char* s) {
+  size_t size = strlen(s) + 1;
+
+  char* copy = memory_alloc(tag, size);
+  if (copy != NULL) {
+    memcpy(copy, s, size);
+  }
+
+  return copy;
+}
+
+void memory_free(void* ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  struct memory_header* header = (struct memory_header*) ptr - 1;
+  struct memory_stats* c = &memory_counters[header->tag];
+
+  if (__atomic_load_n(&memory_hooked, __ATOMIC_ACQUIRE)) {
+    memory_hooks.untrack(header->tag, ptr);
+  }
+
+  __atomic_sub_fetch(&c->bytes, header->size, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&c->live, 1, __ATOMIC_RELAXED);
+
+  free((char*) header - header->offset);
+}
+
+int memory_map(enum memory_tag tag, size_t size) {
+  struct memory_stats* c = &memory_counters[tag];
+  return memory_charge(tag, &c->mapped, &c->mapped_peak, size);
+}
+
+void memory_unmap(enum memory_tag tag, size_t size) {
+  __atomic_sub_fetch(&memory_counters[tag].mapped, size, __ATOMIC_RELAXED);
+}
+
+void memory_set_limit(enum memory_tag tag, uint64_t limit) {
+  __atomic_store_n(&memory_counters[tag].limit, limit, __ATOMIC_RELAXED);
+}
+
+void memory_set_hooks(const struct memory_hooks* hooks) {
+  // Turn hooks off before swapping them, so no thread calls a half-set pair
+  __atomic_store_n(&memory_hooked, 0, __ATOMIC_RELEASE);
+
+  if (hooks != NULL) {
+    memory_hooks = *hooks;
+    __atomic_store_n(&memory_hooked, 1, __ATOMIC_RELEASE);
+  }
+}
+
+const char* memory_tag_name(enum memory_tag tag) {
+  return tag < memory_tag_count ? memory_tag_names[tag] : "unknown";
+}
+
+void memory_stats(enum memory_tag tag, struct memory_stats* stats) {
+  struct memory_stats* c = &memory_counters[tag];
+
+  stats->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+  stats->peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+  stats->mapped = __atomic_load_n(&c->mapped, __ATOMIC_RELAXED);
+  stats->mapped_peak = __atomic_load_n(&c->mapped_peak, __ATOMIC_RELAXED);
+  stats->live = __atomic_load_n(&c->live, __ATOMIC_RELAXED);
+  stats->allocs = __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+  stats->failures = __atomic_load_n(&c->failures, __ATOMIC_RELAXED);
+  stats->limit = __atomic_load_n(&c->limit, __ATOMIC_RELAXED);
+}
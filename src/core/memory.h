@@ -0,0 +1,202 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_MEMORY_H
+#define CORE_MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The tracemalloc domain of the first tag. Each tag traces in its own domain after it. */
+#define MEMORY_TRACE_DOMAIN 0x436f7a00u
+
+/** The subsystem an allocation belongs to. */
+enum memory_tag {
+  /** Anything not covered below. */
+  memory_tag_other = 0,
+
+  /** Per-frame arenas. */
+  memory_tag_arena,
+
+  /** Detection tables. */
+  memory_tag_detections,
+
+  /** The encounter log. */
+  memory_tag_encounters,
+
+  /** Shared-memory frame rings. */
+  memory_tag_frames,
+
+  /** The friend index, its snapshot and searches. */
+  memory_tag_friends,
+
+  /** Handle queues. */
+  memory_tag_handles,
+
+  /** JPEG decodes. */
+  memory_tag_jpeg,
+
+  /** Face quality scoring. */
+  memory_tag_quality,
+
+  /** The task scheduler and its Python tasks. */
+  memory_tag_scheduler,
+
+  /** SQL requests and buffers. */
+  memory_tag_sql,
+
+  /** CPU topology tables. */
+  memory_tag_topology,
+
+  /** The number of tags. */
+  memory_tag_count,
+};
+
+/** Counters for one tag. */
+struct memory_stats {
+  /** The heap bytes in use. */
+  uint64_t bytes;
+
+  /** The most heap bytes ever in use. */
+  uint64_t peak;
+
+  /** The mapped bytes in use. */
+  uint64_t mapped;
+
+  /** The most mapped bytes ever in use. */
+  uint64_t mapped_peak;
+
+  /** The heap allocations live. */
+  uint64_t live;
+
+  /** The heap allocations made. */
+  uint64_t allocs;
+
+  /** The allocations refused (out of memory or over the limit). */
+  uint64_t failures;
+
+  /** The most heap and mapped bytes allowed together (zero for no limit). */
+  uint64_t limit;
+};
+
+/**
+ * Hooks told about every heap allocation, e.g. to trace them in tracemalloc.
+ * Called from whatever thread allocates, with no locks held.
+ */
+struct memory_hooks {
+  /** An allocation was made. */
+  void (* track)(enum memory_tag tag, void* ptr, size_t size);
+
+  /** An allocation is about to be freed. */
+  void (* untrack)(enum memory_tag tag, void* ptr);
+};
+
+/**
+ * Allocate memory.
+ *
+ * @param tag The tag
+ * @param size The size
+ * @return The memory, or NULL on failure (out of memory or over the tag's limit)
+ */
+void* memory_alloc(enum memory_tag tag, size_t size);
+
+/**
+ * Allocate zeroed memory.
+ *
+ * @param tag The tag
+ * @param n The number of elements
+ * @param size The element size
+ * @return The memory, or NULL on failure
+ */
+void* memory_calloc(enum memory_tag tag, size_t n, size_t size);
+
+/**
+ * Resize memory from memory_alloc or memory_calloc. Memory from
+ * memory_aligned_alloc can't be resized, and fails as if out of memory.
+ *
+ * @param tag The tag for a new allocation (resized memory keeps its original tag)
+ * @param ptr The memory, or NULL to allocate
+ * @param size The new size
+ * @return The memory, or NULL on failure (the original is left alone)
+ */
+void* memory_realloc(enum memory_tag tag, void* ptr, size_t size);
+
+/**
+ * Allocate aligned memory, like posix_memalign.
+ *
+ * @param tag The tag
+ * @param ptr The memory
+ * @param align The alignment (a power of two, at least the size of a pointer)
+ * @param size The size
+ * @return Zero on success, otherwise nonzero
+ */
+int memory_aligned_alloc(enum memory_tag tag, void** ptr, size_t align, size_t size);
+
+/**
+ * Duplicate a string.
+ *
+ * @param tag The tag
+ * @param s The string
+ * @return The copy, or NULL on failure
+ */
+char* memory_strdup(enum memory_tag tag, const char* s);
+
+/**
+ * Free memory from any of the above.
+ *
+ * @param ptr The memory, or NULL
+ */
+void memory_free(void* ptr);
+
+/**
+ * Count memory mapped outside the heap (e.g. with mmap).
+ *
+ * @param tag The tag
+ * @param size The size
+ * @return Zero on success, otherwise nonzero (the tag is over its limit, and nothing is counted)
+ */
+int memory_map(enum memory_tag tag, size_t size);
+
+/**
+ * Count memory unmapped.
+ *
+ * @param tag The tag
+ * @param size The size, as given to memory_map
+ */
+void memory_unmap(enum memory_tag tag, size_t size);
+
+/**
+ * Limit a tag's heap and mapped bytes together. Allocations that would go
+ * over are refused, which each subsystem already handles as out of memory.
+ *
+ * @param tag The tag
+ * @param limit The limit in bytes, or zero for none
+ */
+void memory_set_limit(enum memory_tag tag, uint64_t limit);
+
+/**
+ * Set the allocation hooks.
+ *
+ * @param hooks The hooks, or NULL for none
+ */
+void memory_set_hooks(const struct memory_hooks* hooks);
+
+/**
+ * Get a tag's name.
+ *
+ * @param tag The tag
+ * @return The name
+ */
+const char* memory_tag_name(enum memory_tag tag);
+
+/**
+ * Copy a tag's counters.
+ *
+ * @param tag The tag
+ * @param stats The counters
+ */
+void memory_stats(enum memory_tag tag, struct memory_stats* stats);
+
+#endif // #ifndef CORE_MEMORY_H
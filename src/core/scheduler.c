@@ -0,0 +1,639 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "scheduler.h"
+
+/** How long an idle worker sleeps before looking around again, in nanoseconds. */
+#define SCHEDULER_IDLE_NS 100000000L
+
+/** The worker running on this thread, if any. */
+static __thread struct scheduler_worker* t_worker;
+
+/** The outcome of a steal. */
+enum steal_result {
+  steal_empty = 0,
+  steal_ok,
+  steal_abort,
+};
+
+/**
+ * Get the monotonic time.
+ *
+ * @return The time, in nanoseconds
+ */
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Push onto the bottom of a deque. Owner only.
+ *
+ * @param d The deque
+ * @param task The task
+ * @return Zero on success, otherwise nonzero (the deque is full)
+ */
+static int deque_push(struct scheduler_deque* d, struct scheduler_task* task) {
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+  if (b - t >= SCHEDULER_DEQUE_SIZE) {
+    return 1;
+  }
+
+  __atomic_store_n(&d->slots[b & (SCHEDULER_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+
+  // Publish the slot with the new bottom
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Take from the bottom of a deque (the newest task). Owner only.
+ *
+ * @param d The deque
+ * @return The task, or NULL if the deque is empty (or a thief got the last one)
+ */
+static struct scheduler_task* deque_take(struct scheduler_deque* d) {
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+
+  // Thieves must see the lowered bottom before the top is read back
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+  if (t > b) {
+    // Empty
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  struct scheduler_task* task = __atomic_load_n(&d->slots[b & (SCHEDULER_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+
+  if (t == b) {
+    // The last task, which a thief may be after too
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      task = NULL;
+    }
+
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+
+  return task;
+}
+
+/**
+ * Steal from the top of a deque (the oldest task). Any thread.
+ *
+ * @param d The deque
+ * @param task The task
+ * @return The outcome (steal_abort if another thread got there first)
+ */
+static enum steal_result deque_steal(struct scheduler_deque* d, struct scheduler_task** task) {
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+  if (t >= b) {
+    return steal_empty;
+  }
+
+  *task = __atomic_load_n(&d->slots[t & (SCHEDULER_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+
+  if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return steal_abort;
+  }
+
+  return steal_ok;
+}
+
+/**
+ * Check whether a deque looks non-empty.
+ *
+ * @param d The deque
+ * @return Nonzero if so, otherwise zero
+ */
+static int deque_busy(struct scheduler_deque* d) {
+  return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) < __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Order two tasks for the shared queue.
+ *
+ * @param a The first task
+ * @param b The second task
+ * @return Nonzero if the first runs before the second, otherwise zero
+ */
+static int runs_before(const struct scheduler_task* a, const struct scheduler_task* b) {
+  if (a->priority != b->priority) {
+    return a->priority < b->priority;
+  }
+
+  return a->submitted < b->submitted;
+}
+
+/**
+ * Note the oldest priority in the shared queue. Lock held.
+ *
+ * @param sched The scheduler
+ */
+static void heap_note_oldest(struct scheduler* sched) {
+  double oldest = sched->heap_len ? sched->heap[0]->priority : INFINITY;
+  __atomic_store(&sched->heap_oldest, &oldest, __ATOMIC_RELEASE);
+}
+
+/**
+ * Add to the shared queue. Lock held.
+ *
+ * @param sched The scheduler
+ * @param task The task
+ * @return Zero on success, otherwise nonzero (out of memory)
+ */
+static int heap_push(struct scheduler* sched, struct scheduler_task* task) {
+  if (sched->heap_len == sched->heap_cap) {
+    size_t cap = sched->heap_cap ? sched->heap_cap * 2 : 256;
+    struct scheduler_task** heap = memory_realloc(memory_tag_scheduler, sched->heap, cap * sizeof(*heap));
+    if (heap == NULL) {
+      return 1;
+    }
+
+    sched->heap = heap;
+    sched->heap_cap = cap;
+  }
+
+  // Sift up
+  size_t i = sched->heap_len++;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!runs_before(task, sched->heap[parent])) {
+      break;
+    }
+
+    sched->heap[i] = sched->heap[parent];
+    i = parent;
+  }
+
+  sched->heap[i] = task;
+  heap_note_oldest(sched);
+  return 0;
+}
+
+/**
+ * Remove the oldest task from the shared queue. Lock held.
+ *
+ * @param sched The scheduler
+ * @return The task, or NULL if the queue is empty
+ */
+static struct scheduler_task* heap_pop(struct scheduler* sched) {
+  if (sched->heap_len == 0) {
+    return NULL;
+  }
+
+  struct scheduler_task* top = sched->heap[0];
+  struct scheduler_task* last = sched->heap[--sched->heap_len];
+
+  // Sift the last task down from the root
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= sched->heap_len) {
+      break;
+    }
+
+    if (child + 1 < sched->heap_len && runs_before(sched->heap[child + 1], sched->heap[child])) {
+      ++child;
+    }
+
+    if (!runs_before(sched->heap[child], last)) {
+      break;
+    }
+
+    sched->heap[i] = sched->heap[child];
+    i = child;
+  }
+
+  if (sched->heap_len > 0) {
+    sched->heap[i] = last;
+  }
+
+  heap_note_oldest(sched);
+  return top;
+}
+
+/**
+ * Get the oldest priority in the shared queue without the lock.
+ *
+ * @param sched The scheduler
+ * @return The priority (infinity if the queue looks empty)
+ */
+static double shared_oldest(struct scheduler* sched) {
+  double oldest;
+  __atomic_load(&sched->heap_oldest, &oldest, __ATOMIC_ACQUIRE);
+  return oldest;
+}
+
+/**
+ * Wake a sleeping worker, if any, after new work was queued.
+ *
+ * @param sched The scheduler
+ */
+static void wake_one(struct scheduler* sched) {
+  // Pairs with the sleeper count in worker_sleep: either the worker sees the work or we see the sleeper
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&sched->sleepers, __ATOMIC_RELAXED) > 0) {
+    __atomic_add_fetch(&sched->epoch, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &sched->epoch, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+/**
+ * Record a finished task.
+ *
+ * @param sched The scheduler
+ * @param kind The task kind
+ * @param wait The time spent queued
+ * @param run The time spent running
+ */
+static void record(struct scheduler* sched, int kind, uint64_t wait, uint64_t run) {
+  struct scheduler_kind_stats* k = &sched->kinds[kind];
+
+  __atomic_add_fetch(&k->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&k->wait_total, wait, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&k->run_total, run, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&k->wait_max, __ATOMIC_RELAXED);
+  while (wait > max && !__atomic_compare_exchange_n(&k->wait_max, &max, wait, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+
+  max = __atomic_load_n(&k->run_max, __ATOMIC_RELAXED);
+  while (run > max && !__atomic_compare_exchange_n(&k->run_max, &max, run, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+
+  // Bucket by the highest set bit of the latency in microseconds
+  uint64_t us = (wait + run) / 1000;
+  int bucket = us > 1 ? 63 - __builtin_clzll(us) : 0;
+  if (bucket >= SCHEDULER_HISTOGRAM_BUCKETS) {
+    bucket = SCHEDULER_HISTOGRAM_BUCKETS - 1;
+  }
+
+  __atomic_add_fetch(&k->histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Run a task and record its latency.
+ *
+ * @param sched The scheduler
+ * @param task The task
+ */
+static void run_task(struct scheduler* sched, struct scheduler_task* task) {
+  // The task may be gone once it has run
+  int kind = task->kind;
+  uint64_t submitted = task->submitted;
+
+  uint64_t start = now_ns();
+  task->run(task);
+  uint64_t end = now_ns();
+
+  record(sched, kind, start - submitted, end - start);
+}
+
+/**
+ * Find the next task for a worker.
+ *
+ * @param w The worker
+ * @return The task, or NULL if there is none anywhere
+ */
+static struct scheduler_task* worker_find(struct scheduler_worker* w) {
+  struct scheduler* sched = w->sched;
+
+  // Our own work first, unless the shared queue has something older
+  struct scheduler_task* task = deque_take(&w->deque);
+  if (task) {
+    if (shared_oldest(sched) >= task->priority) {
+      __atomic_add_fetch(&w->ran_local, 1, __ATOMIC_RELAXED);
+      return task;
+    }
+
+    // Trade places with the older task
+    pthread_mutex_lock(&sched->lock);
+    if (heap_push(sched, task) == 0) {
+      task = heap_pop(sched);
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    __atomic_add_fetch(&w->ran_shared, 1, __ATOMIC_RELAXED);
+    return task;
+  }
+
+  // Then the oldest submitted work
+  if (shared_oldest(sched) != INFINITY) {
+    pthread_mutex_lock(&sched->lock);
+    task = heap_pop(sched);
+    pthread_mutex_unlock(&sched->lock);
+
+    if (task) {
+      __atomic_add_fetch(&w->ran_shared, 1, __ATOMIC_RELAXED);
+      return task;
+    }
+  }
+
+  // Then someone else's, trying victims at random
+  int n = sched->num_workers;
+  for (int attempt = 0; attempt < 2 * n; ++attempt) {
+    // xorshift64
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+
+    int victim = (int) (w->rng % (uint64_t) n);
+    if (victim == w->index) {
+      continue;
+    }
+
+    switch (deque_steal(&sched->workers[victim]->deque, &task)) {
+      case steal_ok:
+        __atomic_add_fetch(&w->ran_stolen, 1, __ATOMIC_RELAXED);
+        return task;
+      case steal_abort:
+        __atomic_add_fetch(&w->steal_aborts, 1, __ATOMIC_RELAXED);
+        break;
+      case steal_empty:
+        break;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Check whether any work is queued.
+ *
+ * @param sched The scheduler
+ * @return Nonzero if so, otherwise zero
+ */
+static int any_work(struct scheduler* sched) {
+  if (shared_oldest(sched) != INFINITY) {
+    return 1;
+  }
+
+  for (int i = 0; i < sched->num_workers; ++i) {
+    if (deque_busy(&sched->workers[i]->deque)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Sleep until work may have arrived.
+ *
+ * @param sched The scheduler
+ */
+static void worker_sleep(struct scheduler* sched) {
+  uint32_t epoch = __atomic_load_n(&sched->epoch, __ATOMIC_ACQUIRE);
+  __atomic_add_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+
+  // Look again now that submitters can see us, so a submission in between is not missed
+  if (!any_work(sched) && !__atomic_load_n(&sched->stopping, __ATOMIC_ACQUIRE)) {
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = SCHEDULER_IDLE_NS};
+    syscall(SYS_futex, &sched->epoch, FUTEX_WAIT_PRIVATE, epoch, &timeout, NULL, 0);
+  }
+
+  __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Main function for worker threads.
+ *
+ * @param arg The worker
+ * @return Nothing
+ */
+static void* worker_main(void* arg) {
+  struct scheduler_worker* w = arg;
+  t_worker = w;
+
+  for (;;) {
+    struct scheduler_task* task = worker_find(w);
+    if (task) {
+      run_task(w->sched, task);
+      continue;
+    }
+
+    // Queued work is finished before leaving
+    if (__atomic_load_n(&w->sched->stopping, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+
+    worker_sleep(w->sched);
+  }
+
+  t_worker = NULL;
+  return NULL;
+}
+
+int scheduler_init(struct scheduler* sched, int workers) {
+  memset(sched, 0, sizeof(*sched));
+  sched->heap_oldest = INFINITY;
+
+  if (workers <= 0) {
+    cpu_set_t cpus;
+    workers = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+  }
+
+  if (workers > SCHEDULER_MAX_WORKERS) {
+    workers = SCHEDULER_MAX_WORKERS;
+  }
+
+  if (pthread_mutex_init(&sched->lock, NULL)) {
+    return 1;
+  }
+
+  // Kind zero catches everything unnamed
+  scheduler_kind(sched, "task");
+
+  sched->workers = memory_calloc(memory_tag_scheduler, (size_t) workers, sizeof(*sched->workers));
+  if (sched->workers == NULL) {
+    pthread_mutex_destroy(&sched->lock);
+    return 1;
+  }
+
+  // All workers exist before any starts, since they steal from each other
+  for (int i = 0; i < workers; ++i) {
+    struct scheduler_worker* w;
+    if (memory_aligned_alloc(memory_tag_scheduler, (void**) &w, SCHEDULER_CACHE_LINE, sizeof(*w))) {
+      for (int j = 0; j < i; ++j) {
+        memory_free(sched->workers[j]);
+      }
+
+      memory_free(sched->workers);
+      sched->workers = NULL;
+      pthread_mutex_destroy(&sched->lock);
+      return 1;
+    }
+
+    memset(w, 0, sizeof(*w));
+    w->sched = sched;
+    w->index = i;
+    w->rng = 0x9e3779b97f4a7c15ull * (uint64_t) (i + 1);
+    sched->workers[i] = w;
+  }
+
+  sched->num_workers = workers;
+
+  for (int i = 0; i < workers; ++i) {
+    if (pthread_create(&sched->workers[i]->thread, NULL, &worker_main, sched->workers[i])) {
+      fprintf(stderr, "scheduler: failed to start worker %d\n", i);
+      scheduler_destroy(sched);
+      return 1;
+    }
+
+    ++sched->started;
+  }
+
+  return 0;
+}
+
+void scheduler_destroy(struct scheduler* sched) {
+  if (sched->workers == NULL) {
+    return;
+  }
+
+  __atomic_store_n(&sched->stopping, 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&sched->epoch, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &sched->epoch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+
+  for (int i = 0; i < sched->started; ++i) {
+    pthread_join(sched->workers[i]->thread, NULL);
+  }
+
+  sched->started = 0;
+
+  // Run what was left in the deques of exited workers here
+  struct scheduler_task* task;
+  for (int i = 0; i < sched->num_workers; ++i) {
+    while (deque_steal(&sched->workers[i]->deque, &task) == steal_ok) {
+      run_task(sched, task);
+    }
+  }
+
+  // Then the shared queue, refusing submissions once it is empty
+  for (;;) {
+    pthread_mutex_lock(&sched->lock);
+    task = heap_pop(sched);
+    if (task == NULL) {
+      sched->closed = 1;
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    if (task == NULL) {
+      break;
+    }
+
+    run_task(sched, task);
+  }
+
+  for (int i = 0; i < sched->num_workers; ++i) {
+    memory_free(sched->workers[i]);
+  }
+
+  memory_free(sched->workers);
+  sched->workers = NULL;
+  sched->num_workers = 0;
+
+  memory_free(sched->heap);
+  sched->heap = NULL;
+  sched->heap_len = 0;
+  sched->heap_cap = 0;
+
+  pthread_mutex_destroy(&sched->lock);
+}
+
+int scheduler_kind(struct scheduler* sched, const char* name) {
+  int kind = 0;
+
+  pthread_mutex_lock(&sched->lock);
+
+  int found = 0;
+  for (int i = 0; i < sched->num_kinds; ++i) {
+    if (strncmp(sched->kinds[i].name, name, SCHEDULER_KIND_NAME_MAX - 1) == 0) {
+      kind = i;
+      found = 1;
+      break;
+    }
+  }
+
+  if (!found && sched->num_kinds < SCHEDULER_MAX_KINDS) {
+    kind = sched->num_kinds++;
+    snprintf(sched->kinds[kind].name, SCHEDULER_KIND_NAME_MAX, "%s", name);
+  }
+
+  pthread_mutex_unlock(&sched->lock);
+  return kind;
+}
+
+int scheduler_submit(struct scheduler* sched, struct scheduler_task* task) {
+  if (task->kind < 0 || task->kind >= SCHEDULER_MAX_KINDS) {
+    task->kind = 0;
+  }
+
+  task->submitted = now_ns();
+
+  // Spawned from a task: keep it on this core, where thieves can still get it
+  struct scheduler_worker* w = t_worker;
+  if (w && w->sched == sched && deque_push(&w->deque, task) == 0) {
+    wake_one(sched);
+    return 0;
+  }
+
+  pthread_mutex_lock(&sched->lock);
+  int err = sched->closed || heap_push(sched, task);
+  pthread_mutex_unlock(&sched->lock);
+
+  if (err) {
+    return 1;
+  }
+
+  wake_one(sched);
+  return 0;
+}
+
+int scheduler_current_worker(struct scheduler* sched) {
+  struct scheduler_worker* w = t_worker;
+  return w && w->sched == sched ? w->index : -1;
+}
+
+void scheduler_kind_stats(struct scheduler* sched, int kind, struct scheduler_kind_stats* stats) {
+  const struct scheduler_kind_stats* k = &sched->kinds[kind];
+
+  pthread_mutex_lock(&sched->lock);
+  memcpy(stats->name, k->name, sizeof(stats->name));
+  pthread_mutex_unlock(&sched->lock);
+
+  stats->count = __atomic_load_n(&k->count, __ATOMIC_RELAXED);
+  stats->wait_total = __atomic_load_n(&k->wait_total, __ATOMIC_RELAXED);
+  stats->wait_max = __atomic_load_n(&k->wait_max, __ATOMIC_RELAXED);
+  stats->run_total = __atomic_load_n(&k->run_total, __ATOMIC_RELAXED);
+  stats->run_max = __atomic_load_n(&k->run_max, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < SCHEDULER_HISTOGRAM_BUCKETS; ++i) {
+    stats->histogram[i] = __atomic_load_n(&k->histogram[i], __ATOMIC_RELAXED);
+  }
+}
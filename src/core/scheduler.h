@@ -0,0 +1,236 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_SCHEDULER_H
+#define CORE_SCHEDULER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The cache line size assumed for padding. */
+#define SCHEDULER_CACHE_LINE 64
+
+/** The most workers. */
+#define SCHEDULER_MAX_WORKERS 256
+
+/** The slots in each worker's deque (a power of two). Overflow goes to the shared queue. */
+#define SCHEDULER_DEQUE_SIZE 4096
+
+/** The most task kinds tracked. */
+#define SCHEDULER_MAX_KINDS 16
+
+/** The longest task kind name. */
+#define SCHEDULER_KIND_NAME_MAX 32
+
+/** The latency histogram buckets (powers of two of microseconds). */
+#define SCHEDULER_HISTOGRAM_BUCKETS 32
+
+/**
+ * A unit of work.
+ *
+ * Submitters embed this in their own structures. The scheduler only reads
+ * and writes the fields here, and never touches the task again once run has
+ * been called, so run may free it.
+ */
+struct scheduler_task {
+  /**
+   * Do the work. Called on a worker thread without the GIL.
+   */
+  void (* run)(struct scheduler_task* self);
+
+  /** The priority: lower runs first. Frame work uses the frame timestamp, so older frames win. */
+  double priority;
+
+  /** The task kind (from scheduler_kind) for latency stats. */
+  int kind;
+
+  /** When the task was submitted (monotonic nanoseconds, set by the scheduler). */
+  uint64_t submitted;
+};
+
+/**
+ * A Chase-Lev deque of tasks.
+ *
+ * The owning worker pushes and takes at the bottom (newest first), so a task
+ * and the tasks it spawns stay on one core. Thieves take from the top (oldest
+ * first) with one compare-and-swap.
+ */
+struct scheduler_deque {
+  /** The next slot to take from for thieves (on its own cache line). */
+  _Alignas(SCHEDULER_CACHE_LINE) int64_t top;
+
+  /** The next slot to push to for the owner (on its own cache line). */
+  _Alignas(SCHEDULER_CACHE_LINE) int64_t bottom;
+
+  /** The slots. */
+  struct scheduler_task* slots[SCHEDULER_DEQUE_SIZE];
+};
+
+/** A worker thread. */
+struct scheduler_worker {
+  /** The deque. */
+  struct scheduler_deque deque;
+
+  /** The scheduler. */
+  struct scheduler* sched;
+
+  /** The worker index. */
+  int index;
+
+  /** The thread. */
+  pthread_t thread;
+
+  /** The random state for picking victims. */
+  uint64_t rng;
+
+  /** Tasks run from the worker's own deque. */
+  uint64_t ran_local;
+
+  /** Tasks run from the shared queue. */
+  uint64_t ran_shared;
+
+  /** Tasks run after stealing them. */
+  uint64_t ran_stolen;
+
+  /** Steal attempts that lost a race. */
+  uint64_t steal_aborts;
+};
+
+/** Latency counters for one task kind. */
+struct scheduler_kind_stats {
+  /** The kind name. */
+  char name[SCHEDULER_KIND_NAME_MAX];
+
+  /** The tasks finished. */
+  uint64_t count;
+
+  /** The total time spent queued, in nanoseconds. */
+  uint64_t wait_total;
+
+  /** The longest time spent queued, in nanoseconds. */
+  uint64_t wait_max;
+
+  /** The total time spent running, in nanoseconds. */
+  uint64_t run_total;
+
+  /** The longest time spent running, in nanoseconds. */
+  uint64_t run_max;
+
+  /** Counts of submit-to-finish latencies, bucket i holding [2^i, 2^(i+1)) microseconds. */
+  uint64_t histogram[SCHEDULER_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * A work-stealing scheduler for per-frame pipeline work.
+ *
+ * Each worker runs tasks from its own deque first, then the oldest task in
+ * the shared priority queue, then steals from randomly chosen workers. Tasks
+ * submitted from outside go into the shared queue ordered by priority; tasks
+ * submitted from a worker go into its deque. A worker that finds the shared
+ * queue holding older work than its own next task puts its task back in the
+ * shared queue, so a crowd in a new frame never holds up an old one.
+ *
+ * Idle workers sleep on a futex word that submitters only bump when someone
+ * is asleep.
+ */
+struct scheduler {
+  /** The workers. */
+  struct scheduler_worker** workers;
+
+  /** The number of workers. */
+  int num_workers;
+
+  /** The number of worker threads started. */
+  int started;
+
+  /** The lock guarding the shared queue and kind names. */
+  pthread_mutex_t lock;
+
+  /** The shared queue (a binary min-heap by priority). */
+  struct scheduler_task** heap;
+
+  /** The tasks in the shared queue. */
+  size_t heap_len;
+
+  /** The shared queue capacity. */
+  size_t heap_cap;
+
+  /** The priority of the oldest task in the shared queue (infinity when empty). */
+  double heap_oldest;
+
+  /** The number of task kinds. */
+  int num_kinds;
+
+  /** The latency counters by kind. */
+  struct scheduler_kind_stats kinds[SCHEDULER_MAX_KINDS];
+
+  /** Bumped to wake sleeping workers. */
+  _Alignas(SCHEDULER_CACHE_LINE) uint32_t epoch;
+
+  /** The number of workers asleep. */
+  uint32_t sleepers;
+
+  /** Nonzero once workers should finish up and exit. */
+  uint32_t stopping;
+
+  /** Nonzero once submissions are refused. */
+  int closed;
+};
+
+/**
+ * Start a scheduler.
+ *
+ * @param sched The scheduler
+ * @param workers The number of worker threads (zero for one per CPU this process may use)
+ * @return Zero on success, otherwise nonzero
+ */
+int scheduler_init(struct scheduler* sched, int workers);
+
+/**
+ * Stop a scheduler. Queued tasks are run first, the leftovers on the calling
+ * thread once the workers have exited.
+ *
+ * @param sched The scheduler
+ */
+void scheduler_destroy(struct scheduler* sched);
+
+/**
+ * Look up or add a task kind.
+ *
+ * @param sched The scheduler
+ * @param name The kind name (truncated to fit)
+ * @return The kind, or zero (the catch-all kind) once the table is full
+ */
+int scheduler_kind(struct scheduler* sched, const char* name);
+
+/**
+ * Submit a task. From one of this scheduler's workers, the task goes on that
+ * worker's deque; otherwise it goes in the shared queue.
+ *
+ * @param sched The scheduler
+ * @param task The task
+ * @return Zero on success, otherwise nonzero (the scheduler is closed)
+ */
+int scheduler_submit(struct scheduler* sched, struct scheduler_task* task);
+
+/**
+ * Get the worker running the calling thread.
+ *
+ * @param sched The scheduler
+ * @return The worker index, or -1 if the caller is not one of its workers
+ */
+int scheduler_current_worker(struct scheduler* sched);
+
+/**
+ * Copy the latency counters of a task kind.
+ *
+ * @param sched The scheduler
+ * @param kind The kind
+ * @param stats The counters
+ */
+void scheduler_kind_stats(struct scheduler* sched, int kind, struct scheduler_kind_stats* stats);
+
+#endif // #ifndef CORE_SCHEDULER_H
@@ -0,0 +1,526 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errmsg.h>
+
+#include "memory.h"
+#include "sql.h"
+
+/** The default maximum number of statements per round trip. */
+#define SQL_CLIENT_MAX_BATCH 64
+
+/** Guards one-time library initialization. */
+static pthread_once_t g_sql_library_once = PTHREAD_ONCE_INIT;
+
+static void sql_library_init_once() {
+  mysql_library_init(0, NULL, NULL);
+}
+
+void sql_library_init() {
+  pthread_once(&g_sql_library_once, &sql_library_init_once);
+}
+
+MYSQL* sql_connect(const struct sql_params* params, unsigned long flags) {
+  sql_library_init();
+
+  MYSQL* conn = mysql_init(NULL);
+  if (conn == NULL) {
+    fprintf(stderr, "failed to allocate sql connection\n");
+    return NULL;
+  }
+
+  // Talk UTF-8 regardless of server defaults
+  mysql_options(conn, MYSQL_SET_CHARSET_NAME, "utf8mb4");
+
+  if (mysql_real_connect(conn, params->host, params->user, params->pass, params->db, params->port, NULL, flags) == NULL) {
+    fprintf(stderr, "failed to connect to sql server: %s\n", mysql_error(conn));
+    mysql_close(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+/**
+ * Make room in a buffer.
+ *
+ * @param buf The buffer
+ * @param extra The number of extra bytes needed (excluding terminator)
+ * @return Zero on success, otherwise nonzero
+ */
+static int sql_buf_reserve(struct sql_buf* buf, size_t extra) {
+  if (buf->len + extra + 1 <= buf->cap) {
+    return 0;
+  }
+
+  // Grow geometrically
+  size_t cap = buf->cap ? buf->cap : 256;
+  while (cap < buf->len + extra + 1) {
+    cap *= 2;
+  }
+
+  char* data = memory_realloc(memory_tag_sql, buf->data, cap);
+  if (data == NULL) {
+    return 1;
+  }
+
+  buf->data = data;
+  buf->cap = cap;
+  return 0;
+}
+
+int sql_buf_append(struct sql_buf* buf, const char* data, size_t len) {
+  if (sql_buf_reserve(buf, len)) {
+    return 1;
+  }
+
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+  return 0;
+}
+
+int sql_buf_appendf(struct sql_buf* buf, const char* fmt, ...) {
+  va_list ap;
+
+  // Measure first
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  if (n < 0 || sql_buf_reserve(buf, (size_t) n)) {
+    return 1;
+  }
+
+  va_start(ap, fmt);
+  vsnprintf(buf->data + buf->len, (size_t) n + 1, fmt, ap);
+  va_end(ap);
+
+  buf->len += n;
+  return 0;
+}
+
+int sql_buf_append_value(struct sql_buf* buf, MYSQL* conn, const struct sql_value* value) {
+  switch (value->type) {
+    case sql_value_null:
+      return sql_buf_append(buf, "NULL", 4);
+    case sql_value_int:
+      return sql_buf_appendf(buf, "%lld", value->i);
+    case sql_value_float:
+      return sql_buf_appendf(buf, "%.17g", value->f);
+    case sql_value_text:
+      // Escaping can at most double the length
+      if (sql_buf_reserve(buf, value->len * 2 + 2)) {
+        return 1;
+      }
+
+      buf->data[buf->len++] = '\'';
+      buf->len += mysql_real_escape_string(conn, buf->data + buf->len, value->data, value->len);
+      buf->data[buf->len++] = '\'';
+      buf->data[buf->len] = '\0';
+      return 0;
+    case sql_value_blob:
+      // Blobs go as hex literals, which sidestep escaping altogether
+      if (sql_buf_reserve(buf, value->len * 2 + 3)) {
+        return 1;
+      }
+
+      buf->data[buf->len++] = 'X';
+      buf->data[buf->len++] = '\'';
+      buf->len += mysql_hex_string(buf->data + buf->len, value->data, value->len);
+      buf->data[buf->len++] = '\'';
+      buf->data[buf->len] = '\0';
+      return 0;
+  }
+
+  return 1;
+}
+
+void sql_buf_release(struct sql_buf* buf) {
+  memory_free(buf->data);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
+
+int sql_format(struct sql_buf* buf, MYSQL* conn, const char* text, const struct sql_value* values, size_t num_values) {
+  // The quote character we're inside of, if any
+  char quote = 0;
+
+  // The next value to substitute
+  size_t value = 0;
+
+  // The start of the run of text not yet copied
+  const char* run = text;
+
+  for (const char* p = text; *p; ++p) {
+    if (quote) {
+      if (*p == '\\' && p[1]) {
+        // Skip the escaped character
+        ++p;
+      } else if (*p == quote) {
+        quote = 0;
+      }
+    } else if (*p == '\'' || *p == '"' || *p == '`') {
+      quote = *p;
+    } else if (*p == '?') {
+      if (value >= num_values) {
+        return 1;
+      }
+
+      // Flush the literal run, then the value in place of the placeholder
+      if (sql_buf_append(buf, run, p - run) || sql_buf_append_value(buf, conn, &values[value++])) {
+        return 1;
+      }
+
+      run = p + 1;
+    }
+  }
+
+  // Every value must have been used
+  if (value != num_values) {
+    return 1;
+  }
+
+  return sql_buf_append(buf, run, strlen(run));
+}
+
+void sql_values_release(struct sql_value* values, size_t num_values) {
+  for (size_t i = 0; i < num_values; ++i) {
+    memory_free(values[i].data);
+  }
+  memory_free(values);
+}
+
+void sql_request_release(struct sql_request* req) {
+  if (req->result) {
+    mysql_free_result(req->result);
+  }
+
+  sql_values_release(req->values, req->num_values);
+  memory_free(req->text);
+  memory_free(req->err_msg);
+}
+
+/**
+ * Record an error on a request.
+ *
+ * @param req The request
+ * @param err_no The error number
+ * @param err_msg The error message
+ */
+static void sql_request_fail(struct sql_request* req, unsigned int err_no, const char* err_msg) {
+  req->err_no = err_no ? err_no : 1;
+  memory_free(req->err_msg);
+  req->err_msg = memory_strdup(memory_tag_sql, err_msg);
+}
+
+/**
+ * Put requests back at the front of the pending queue.
+ *
+ * @param client The client
+ * @param head The first request
+ * @param tail The last request
+ */
+static void sql_client_requeue(struct sql_client* client, struct sql_request* head, struct sql_request* tail) {
+  pthread_mutex_lock(&client->lock);
+  tail->next_pending = client->pending_head;
+  client->pending_head = head;
+  if (client->pending_tail == NULL) {
+    client->pending_tail = tail;
+  }
+  pthread_mutex_unlock(&client->lock);
+}
+
+/**
+ * Execute one batch of requests as a single round trip.
+ *
+ * Every request in the batch is either completed or requeued.
+ *
+ * @param client The client
+ * @param batch The requests, linked through next_pending
+ * @param buf A scratch buffer
+ */
+static void sql_client_run_batch(struct sql_client* client, struct sql_request* batch, struct sql_buf* buf) {
+  // (Re)connect if needed
+  if (client->conn == NULL) {
+    client->conn = sql_connect(&client->params, CLIENT_MULTI_STATEMENTS | CLIENT_MULTI_RESULTS);
+  }
+
+  // Without a connection, fail everything rather than stall the caller
+  if (client->conn == NULL) {
+    while (batch) {
+      struct sql_request* next = batch->next_pending;
+      sql_request_fail(batch, CR_CONN_HOST_ERROR, "sql server unreachable");
+      completion_channel_post(client->channel, &batch->base);
+      batch = next;
+    }
+    return;
+  }
+
+  // Format every statement into one multi-statement query
+  // Requests that fail to format are completed right away and dropped from the batch
+  buf->len = 0;
+  struct sql_request* head = NULL;
+  struct sql_request* tail = NULL;
+  while (batch) {
+    struct sql_request* next = batch->next_pending;
+    size_t mark = buf->len;
+
+    if ((head && sql_buf_append(buf, ";\n", 2))
+        || sql_format(buf, client->conn, batch->text, batch->values, batch->num_values)) {
+      buf->len = mark;
+      sql_request_fail(batch, 1, "parameter count does not match placeholders");
+      completion_channel_post(client->channel, &batch->base);
+    } else {
+      batch->next_pending = NULL;
+      if (tail) {
+        tail->next_pending = batch;
+      } else {
+        head = batch;
+      }
+      tail = batch;
+    }
+
+    batch = next;
+  }
+
+  if (head == NULL) {
+    return;
+  }
+
+  // Send the lot
+  int status = mysql_real_query(client->conn, buf->data, buf->len);
+
+  // Walk the results in statement order
+  struct sql_request* req = head;
+  while (req) {
+    // Advance to this statement's result (the first comes with the query itself)
+    if (req != head && status == 0) {
+      status = mysql_next_result(client->conn);
+    }
+
+    if (status != 0) {
+      unsigned int err_no = mysql_errno(client->conn);
+
+      // The server stops at the first failing statement
+      sql_request_fail(req, err_no, mysql_error(client->conn));
+      struct sql_request* rest = req->next_pending;
+      completion_channel_post(client->channel, &req->base);
+
+      if (err_no == CR_SERVER_GONE_ERROR || err_no == CR_SERVER_LOST) {
+        // We can't tell what made it, so fail the rest and reconnect next time
+        while (rest) {
+          struct sql_request* next = rest->next_pending;
+          sql_request_fail(rest, err_no, "sql connection lost");
+          completion_channel_post(client->channel, &rest->base);
+          rest = next;
+        }
+
+        mysql_close(client->conn);
+        client->conn = NULL;
+      } else if (rest) {
+        // Statements after the failure never ran, so give them another go
+        sql_client_requeue(client, rest, tail);
+      }
+
+      return;
+    }
+
+    // Collect the outcome
+    if (mysql_field_count(client->conn) > 0) {
+      req->result = mysql_store_result(client->conn);
+      if (req->result == NULL) {
+        sql_request_fail(req, mysql_errno(client->conn), mysql_error(client->conn));
+      }
+    } else {
+      req->affected_rows = mysql_affected_rows(client->conn);
+      req->insert_id = mysql_insert_id(client->conn);
+    }
+
+    struct sql_request* next = req->next_pending;
+    completion_channel_post(client->channel, &req->base);
+    req = next;
+  }
+
+  // Discard stray results so the connection is ready for the next batch
+  while (mysql_more_results(client->conn) && mysql_next_result(client->conn) == 0) {
+    MYSQL_RES* stray = mysql_store_result(client->conn);
+    if (stray) {
+      mysql_free_result(stray);
+    }
+  }
+}
+
+/**
+ * The I/O thread main function.
+ *
+ * @param arg The client
+ * @return Nothing
+ */
+static void* sql_client_thread_main(void* arg) {
+  struct sql_client* client = arg;
+
+  mysql_thread_init();
+
+  // Scratch buffer for batches, reused across round trips
+  struct sql_buf buf = {0};
+
+  pthread_mutex_lock(&client->lock);
+  while (1) {
+    // Wait for work
+    while (client->pending_head == NULL && !client->stop) {
+      pthread_cond_wait(&client->cond, &client->lock);
+    }
+
+    if (client->stop) {
+      break;
+    }
+
+    // Take up to a batch worth of requests
+    struct sql_request* batch = client->pending_head;
+    struct sql_request* last = batch;
+    for (size_t n = 1; n < client->max_batch && last->next_pending; ++n) {
+      last = last->next_pending;
+    }
+    client->pending_head = last->next_pending;
+    if (client->pending_head == NULL) {
+      client->pending_tail = NULL;
+    }
+    last->next_pending = NULL;
+
+    // Do the round trip without holding the lock, so submitters never wait on the network
+    pthread_mutex_unlock(&client->lock);
+    sql_client_run_batch(client, batch, &buf);
+    pthread_mutex_lock(&client->lock);
+  }
+
+  // Fail whatever is left
+  struct sql_request* req = client->pending_head;
+  client->pending_head = NULL;
+  client->pending_tail = NULL;
+  pthread_mutex_unlock(&client->lock);
+
+  while (req) {
+    struct sql_request* next = req->next_pending;
+    sql_request_fail(req, 1, "sql client closed");
+    completion_channel_post(client->channel, &req->base);
+    req = next;
+  }
+
+  if (client->conn) {
+    mysql_close(client->conn);
+    client->conn = NULL;
+  }
+
+  sql_buf_release(&buf);
+  mysql_thread_end();
+  return NULL;
+}
+
+/**
+ * Free the connection parameters owned by a client.
+ *
+ * @param client The client
+ */
+static void sql_client_release_params(struct sql_client* client) {
+  memory_free((char*) client->params.host);
+  memory_free((char*) client->params.user);
+  memory_free((char*) client->params.pass);
+  memory_free((char*) client->params.db);
+  memset(&client->params, 0, sizeof client->params);
+}
+
+/**
+ * Duplicate a string that may be NULL.
+ *
+ * @param s The string
+ * @return The copy, or NULL
+ */
+static char* sql_strdup_opt(const char* s) {
+  return s ? memory_strdup(memory_tag_sql, s) : NULL;
+}
+
+int sql_client_start(struct sql_client* client, const struct sql_params* params, struct completion_channel* channel) {
+  sql_library_init();
+
+  client->params.host = sql_strdup_opt(params->host);
+  client->params.user = sql_strdup_opt(params->user);
+  client->params.pass = sql_strdup_opt(params->pass);
+  client->params.db = sql_strdup_opt(params->db);
+  client->params.port = params->port;
+  client->channel = channel;
+  client->pending_head = NULL;
+  client->pending_tail = NULL;
+  client->stop = 0;
+  client->running = 0;
+  client->max_batch = SQL_CLIENT_MAX_BATCH;
+  client->conn = NULL;
+
+  pthread_mutex_init(&client->lock, NULL);
+  pthread_cond_init(&client->cond, NULL);
+
+  if (pthread_create(&client->thread, NULL, &sql_client_thread_main, client)) {
+    pthread_cond_destroy(&client->cond);
+    pthread_mutex_destroy(&client->lock);
+    sql_client_release_params(client);
+    return 1;
+  }
+
+  client->running = 1;
+  return 0;
+}
+
+void sql_client_submit(struct sql_client* client, struct sql_request* req) {
+  req->next_pending = NULL;
+  req->result = NULL;
+  req->affected_rows = 0;
+  req->insert_id = 0;
+  req->err_no = 0;
+  req->err_msg = NULL;
+
+  pthread_mutex_lock(&client->lock);
+
+  // Refuse new work once stopping
+  if (client->stop || !client->running) {
+    pthread_mutex_unlock(&client->lock);
+    sql_request_fail(req, 1, "sql client closed");
+    completion_channel_post(client->channel, &req->base);
+    return;
+  }
+
+  if (client->pending_tail) {
+    client->pending_tail->next_pending = req;
+  } else {
+    client->pending_head = req;
+  }
+  client->pending_tail = req;
+
+  pthread_cond_signal(&client->cond);
+  pthread_mutex_unlock(&client->lock);
+}
+
+void sql_client_stop(struct sql_client* client) {
+  pthread_mutex_lock(&client->lock);
+  int running = client->running;
+  client->stop = 1;
+  client->running = 0;
+  pthread_cond_signal(&client->cond);
+  pthread_mutex_unlock(&client->lock);
+
+  if (running) {
+    pthread_join(client->thread, NULL);
+  }
+
+  pthread_cond_destroy(&client->cond);
+  pthread_mutex_destroy(&client->lock);
+
+  sql_client_release_params(client);
+}
@@ -0,0 +1,257 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_SQL_H
+#define CORE_SQL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <mysql.h>
+
+#include "completion.h"
+
+/** SQL server connection parameters. */
+struct sql_params {
+  /** The server hostname. */
+  const char* host;
+
+  /** The server username. */
+  const char* user;
+
+  /** The server password. */
+  const char* pass;
+
+  /** The database name. */
+  const char* db;
+
+  /** The server port (zero for default). */
+  unsigned int port;
+};
+
+/** A growable text buffer for building statements. */
+struct sql_buf {
+  /** The buffer data (always null-terminated when non-NULL). */
+  char* data;
+
+  /** The used length. */
+  size_t len;
+
+  /** The allocated capacity. */
+  size_t cap;
+};
+
+/** A statement parameter type. */
+enum sql_value_type {
+  sql_value_null = 0,
+  sql_value_int,
+  sql_value_float,
+  sql_value_text,
+  sql_value_blob,
+};
+
+/** A statement parameter value. */
+struct sql_value {
+  /** The value type. */
+  enum sql_value_type type;
+
+  /** The integer value. */
+  long long i;
+
+  /** The floating-point value. */
+  double f;
+
+  /** The text or blob data (owned). */
+  char* data;
+
+  /** The text or blob length. */
+  size_t len;
+};
+
+/**
+ * Initialize the client library. Safe to call from any thread, any number of
+ * times; only the first call does anything.
+ */
+void sql_library_init();
+
+/**
+ * Open a connection.
+ *
+ * @param params The connection parameters
+ * @param flags Extra client flags (e.g. CLIENT_MULTI_STATEMENTS)
+ * @return The connection, or NULL on failure (message printed to stderr)
+ */
+MYSQL* sql_connect(const struct sql_params* params, unsigned long flags);
+
+/**
+ * Append bytes to a buffer.
+ *
+ * @param buf The buffer
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return Zero on success, otherwise nonzero
+ */
+int sql_buf_append(struct sql_buf* buf, const char* data, size_t len);
+
+/**
+ * Append formatted text to a buffer.
+ *
+ * @param buf The buffer
+ * @param fmt The printf-style format
+ * @return Zero on success, otherwise nonzero
+ */
+int sql_buf_appendf(struct sql_buf* buf, const char* fmt, ...);
+
+/**
+ * Append a value as a SQL literal, quoting and escaping as needed.
+ *
+ * @param buf The buffer
+ * @param conn The connection (for character set aware escaping)
+ * @param value The value
+ * @return Zero on success, otherwise nonzero
+ */
+int sql_buf_append_value(struct sql_buf* buf, MYSQL* conn, const struct sql_value* value);
+
+/**
+ * Release a buffer's memory.
+ *
+ * @param buf The buffer
+ */
+void sql_buf_release(struct sql_buf* buf);
+
+/**
+ * Substitute parameters into a statement.
+ *
+ * Each `?` outside of a quoted string is replaced by the next value.
+ *
+ * @param buf The output buffer (appended to)
+ * @param conn The connection
+ * @param text The statement text
+ * @param values The parameter values
+ * @param num_values The number of parameter values
+ * @return Zero on success, otherwise nonzero (placeholder count mismatch)
+ */
+int sql_format(struct sql_buf* buf, MYSQL* conn, const char* text, const struct sql_value* values, size_t num_values);
+
+/**
+ * Free the data owned by parameter values.
+ *
+ * @param values The values
+ * @param num_values The number of values
+ */
+void sql_values_release(struct sql_value* values, size_t num_values);
+
+/** A statement queued on an asynchronous client. */
+struct sql_request {
+  /** The completion (must be first). */
+  struct completion base;
+
+  /** The next request in the pending queue. */
+  struct sql_request* next_pending;
+
+  /** The statement text (owned). */
+  char* text;
+
+  /** The parameter values (owned). */
+  struct sql_value* values;
+
+  /** The number of parameter values. */
+  size_t num_values;
+
+  /** The result set, if the statement produced one. */
+  MYSQL_RES* result;
+
+  /** The number of affected rows. */
+  unsigned long long affected_rows;
+
+  /** The last insert ID. */
+  unsigned long long insert_id;
+
+  /** The error number, or zero on success. */
+  unsigned int err_no;
+
+  /** The error message (owned), or NULL on success. */
+  char* err_msg;
+};
+
+/**
+ * An asynchronous SQL client.
+ *
+ * Statements are executed on a dedicated I/O thread that owns one connection.
+ * Whatever has queued up while the previous round trip was in flight is sent
+ * as a single multi-statement batch, so a burst of small queries costs one
+ * round trip rather than one each. Finished requests are posted to a
+ * completion channel.
+ */
+struct sql_client {
+  /** The connection parameters (strings owned). */
+  struct sql_params params;
+
+  /** The channel receiving completions. */
+  struct completion_channel* channel;
+
+  /** The I/O thread. */
+  pthread_t thread;
+
+  /** The lock guarding the pending queue. */
+  pthread_mutex_t lock;
+
+  /** Signalled when the pending queue grows or the client stops. */
+  pthread_cond_t cond;
+
+  /** The oldest pending request. */
+  struct sql_request* pending_head;
+
+  /** The newest pending request. */
+  struct sql_request* pending_tail;
+
+  /** Nonzero once the client is stopping. */
+  int stop;
+
+  /** Nonzero while the I/O thread is running. */
+  int running;
+
+  /** The maximum number of statements per round trip. */
+  size_t max_batch;
+
+  /** The connection. Only touched by the I/O thread. */
+  MYSQL* conn;
+};
+
+/**
+ * Start an asynchronous client.
+ *
+ * @param client The client
+ * @param params The connection parameters (copied)
+ * @param channel The completion channel
+ * @return Zero on success, otherwise nonzero
+ */
+int sql_client_start(struct sql_client* client, const struct sql_params* params, struct completion_channel* channel);
+
+/**
+ * Queue a request. Ownership passes to the client; it comes back through the
+ * completion channel. Never blocks on the database.
+ *
+ * @param client The client
+ * @param req The request, with text and values filled in
+ */
+void sql_client_submit(struct sql_client* client, struct sql_request* req);
+
+/**
+ * Stop an asynchronous client and wait for its I/O thread. Requests still
+ * queued are completed with an error.
+ *
+ * @param client The client
+ */
+void sql_client_stop(struct sql_client* client);
+
+/**
+ * Free the native resources of a request.
+ *
+ * @param req The request
+ */
+void sql_request_release(struct sql_request* req);
+
+#endif // #ifndef CORE_SQL_H
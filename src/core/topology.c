@@ -0,0 +1,494 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "topology.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+/** The most NUMA nodes a binding mask covers. */
+#define TOPOLOGY_MAX_NODES 1024
+
+/**
+ * Read a small sysfs file.
+ *
+ * @param buf The buffer
+ * @param size The buffer size
+ * @param fmt The path format
+ * @return Zero on success, otherwise nonzero
+ */
+__attribute__((format(printf, 3, 4)))
+static int read_sysfs(char* buf, size_t size, const char* fmt, ...) {
+  char path[PATH_MAX];
+
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(path, sizeof(path), fmt, args);
+  va_end(args);
+
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return 1;
+  }
+
+  char* line = fgets(buf, (int) size, file);
+  fclose(file);
+
+  if (line == NULL) {
+    return 1;
+  }
+
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+/**
+ * Read an integer sysfs file.
+ *
+ * @param value The value (left alone on failure)
+ * @param fmt The path format
+ */
+__attribute__((format(printf, 2, 3)))
+static void read_sysfs_int(int* value, const char* fmt, ...) {
+  char path[PATH_MAX];
+
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(path, sizeof(path), fmt, args);
+  va_end(args);
+
+  char buf[32];
+  if (read_sysfs(buf, sizeof(buf), "%s", path) == 0) {
+    *value = atoi(buf);
+  }
+}
+
+int topology_parse_cpulist(const char* text, cpu_set_t* set) {
+  CPU_ZERO(set);
+
+  const char* p = text;
+  while (*p) {
+    char* end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0 || first >= CPU_SETSIZE) {
+      return 1;
+    }
+
+    long last = first;
+    p = end;
+
+    if (*p == '-') {
+      ++p;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first || last >= CPU_SETSIZE) {
+        return 1;
+      }
+      p = end;
+    }
+
+    for (long cpu = first; cpu <= last; ++cpu) {
+      CPU_SET((int) cpu, set);
+    }
+
+    if (*p == ',') {
+      ++p;
+    } else if (*p != '\0') {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Find the L3 cache of a CPU.
+ *
+ * @param root The sysfs root
+ * @param cpu The CPU
+ * @return The lowest CPU sharing the L3, or -1 if there is none
+ */
+static int find_l3(const char* root, int cpu) {
+  for (int index = 0; index < 16; ++index) {
+    int level = -1;
+    read_sysfs_int(&level, "%s/cpu/cpu%d/cache/index%d/level", root, cpu, index);
+    if (level != 3) {
+      continue;
+    }
+
+    char buf[4096];
+    cpu_set_t shared;
+    if (read_sysfs(buf, sizeof(buf), "%s/cpu/cpu%d/cache/index%d/shared_cpu_list", root, cpu, index)
+        || topology_parse_cpulist(buf, &shared)) {
+      return -1;
+    }
+
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+      if (CPU_ISSET(i, &shared)) {
+        return i;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Find the NUMA node of a CPU from its nodeN link.
+ *
+ * @param root The sysfs root
+ * @param cpu The CPU
+ * @return The node (zero if not found)
+ */
+static int find_node(const char* root, int cpu) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/cpu/cpu%d", root, cpu);
+
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    return 0;
+  }
+
+  int node = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    char* end;
+    if (strncmp(entry->d_name, "node", 4) == 0) {
+      long n = strtol(entry->d_name + 4, &end, 10);
+      if (end != entry->d_name + 4 && *end == '\0' && n >= 0 && n < TOPOLOGY_MAX_NODES) {
+        node = (int) n;
+        break;
+      }
+    }
+  }
+
+  closedir(dir);
+  return node;
+}
+
+/** The topology being sorted (qsort has no context argument). */
+static const struct topology* g_sorting;
+
+/** Order CPUs by domain, then with one CPU per core before any hyperthread siblings. */
+static int compare_cpus(const void* a, const void* b) {
+  const struct topology_cpu* x = &g_sorting->cpus[*(const int*) a];
+  const struct topology_cpu* y = &g_sorting->cpus[*(const int*) b];
+
+  if (x->node != y->node) {
+    return x->node - y->node;
+  }
+
+  if (x->l3 != y->l3) {
+    return x->l3 - y->l3;
+  }
+
+  // The first CPU of each core has the lowest number among its siblings
+  int x_sibling = 0;
+  int y_sibling = 0;
+  for (size_t i = 0; i < g_sorting->num_cpus; ++i) {
+    const struct topology_cpu* c = &g_sorting->cpus[i];
+    if (c->package == x->package && c->core == x->core && c->cpu < x->cpu) {
+      x_sibling = 1;
+    }
+    if (c->package == y->package && c->core == y->core && c->cpu < y->cpu) {
+      y_sibling = 1;
+    }
+  }
+
+  if (x_sibling != y_sibling) {
+    return x_sibling - y_sibling;
+  }
+
+  return x->cpu - y->cpu;
+}
+
+int topology_load(struct topology* topo, const char* root) {
+  memset(topo, 0, sizeof(*topo));
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    perror("sched_getaffinity");
+    return 1;
+  }
+
+  topo->cpus = memory_calloc(memory_tag_topology, (size_t) CPU_COUNT(&allowed), sizeof(*topo->cpus));
+  if (topo->cpus == NULL) {
+    return 1;
+  }
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+
+    struct topology_cpu* c = &topo->cpus[topo->num_cpus++];
+    c->cpu = cpu;
+    c->core = cpu;
+    c->package = 0;
+
+    // Missing files (e.g. in some containers) leave flat defaults
+    read_sysfs_int(&c->core, "%s/cpu/cpu%d/topology/core_id", root, cpu);
+    read_sysfs_int(&c->package, "%s/cpu/cpu%d/topology/physical_package_id", root, cpu);
+    c->node = find_node(root, cpu);
+
+    // Without an L3 (or any cache information), the socket is the next best boundary
+    c->l3 = find_l3(root, cpu);
+    if (c->l3 < 0) {
+      c->l3 = INT_MAX - c->package;
+    }
+
+    if (c->node + 1 > topo->num_nodes) {
+      topo->num_nodes = c->node + 1;
+    }
+  }
+
+  // Sort CPU indexes into domain order
+  int* order = memory_alloc(memory_tag_topology, topo->num_cpus * sizeof(int));
+  topo->domains = memory_calloc(memory_tag_topology, topo->num_cpus, sizeof(*topo->domains));
+  if (order == NULL || topo->domains == NULL) {
+    memory_free(order);
+    topology_destroy(topo);
+    return 1;
+  }
+
+  for (size_t i = 0; i < topo->num_cpus; ++i) {
+    order[i] = (int) i;
+  }
+
+  g_sorting = topo;
+  qsort(order, topo->num_cpus, sizeof(int), compare_cpus);
+  g_sorting = NULL;
+
+  // Cut the sorted CPUs into runs sharing an L3
+  for (size_t i = 0; i < topo->num_cpus; ++i) {
+    const struct topology_cpu* c = &topo->cpus[order[i]];
+
+    struct topology_domain* d = topo->num_domains ? &topo->domains[topo->num_domains - 1] : NULL;
+    if (d == NULL || d->l3 != c->l3 || d->node != c->node) {
+      d = &topo->domains[topo->num_domains++];
+      d->l3 = c->l3;
+      d->node = c->node;
+      d->cpus = memory_alloc(memory_tag_topology, topo->num_cpus * sizeof(int));
+      if (d->cpus == NULL) {
+        memory_free(order);
+        topology_destroy(topo);
+        return 1;
+      }
+    }
+
+    d->cpus[d->num_cpus++] = c->cpu;
+  }
+
+  memory_free(order);
+  return 0;
+}
+
+void topology_destroy(struct topology* topo) {
+  for (size_t i = 0; i < topo->num_domains; ++i) {
+    memory_free(topo->domains[i].cpus);
+  }
+
+  memory_free(topo->domains);
+  memory_free(topo->cpus);
+  memset(topo, 0, sizeof(*topo));
+}
+
+int topology_parse_policy(const char* text, enum cpu_policy* policy, const char** manual) {
+  *manual = NULL;
+
+  if (text == NULL || strcmp(text, "none") == 0) {
+    *policy = cpu_policy_none;
+  } else if (strcmp(text, "compact") == 0) {
+    *policy = cpu_policy_compact;
+  } else if (strcmp(text, "spread") == 0) {
+    *policy = cpu_policy_spread;
+  } else if (strncmp(text, "manual:", 7) == 0 && text[7] != '\0') {
+    *policy = cpu_policy_manual;
+    *manual = text + 7;
+  } else {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Find the domain holding a CPU.
+ *
+ * @param topo The topology
+ * @param cpu The CPU
+ * @return The domain index, or -1 if the CPU is not in the topology
+ */
+static int find_domain(const struct topology* topo, int cpu) {
+  for (size_t d = 0; d < topo->num_domains; ++d) {
+    for (size_t i = 0; i < topo->domains[d].num_cpus; ++i) {
+      if (topo->domains[d].cpus[i] == cpu) {
+        return (int) d;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Place a robot from a manual list.
+ *
+ * @param topo The topology
+ * @param manual The per-robot CPU lists
+ * @param robot The robot's index
+ * @param placement The placement
+ * @return Zero on success, otherwise nonzero
+ */
+static int place_manual(const struct topology* topo, const char* manual, int robot, struct topology_placement* p) {
+  // Count the lists, then take this robot's, wrapping around
+  int lists = 1;
+  for (const char* c = manual; *c; ++c) {
+    lists += *c == ';';
+  }
+
+  const char* start = manual;
+  for (int i = 0; i < robot % lists; ++i) {
+    start = strchr(start, ';') + 1;
+  }
+
+  size_t len = strcspn(start, ";");
+  char list[1024];
+  if (len >= sizeof(list)) {
+    return 1;
+  }
+
+  memcpy(list, start, len);
+  list[len] = '\0';
+
+  if (topology_parse_cpulist(list, &p->cpus) || CPU_COUNT(&p->cpus) == 0) {
+    return 1;
+  }
+
+  p->num_cpus = CPU_COUNT(&p->cpus);
+
+  // Buffers go with the first CPU listed
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &p->cpus)) {
+      p->domain = find_domain(topo, cpu);
+      p->node = p->domain >= 0 ? topo->domains[p->domain].node : -1;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+int topology_place(const struct topology* topo, enum cpu_policy policy, const char* manual, int robot, int threads,
+    struct topology_placement* p) {
+  p->domain = -1;
+  p->node = -1;
+  p->num_cpus = 0;
+  CPU_ZERO(&p->cpus);
+
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  if (robot < 0 || topo->num_domains == 0) {
+    return 0;
+  }
+
+  switch (policy) {
+    case cpu_policy_none:
+      return 0;
+    case cpu_policy_manual:
+      return manual ? place_manual(topo, manual, robot, p) : 1;
+    case cpu_policy_spread:
+      // Round robin over domains, then let the kernel balance within the domain
+      p->domain = (int) ((size_t) robot % topo->num_domains);
+      break;
+    case cpu_policy_compact: {
+      // Each domain takes as many robots as it has room for their threads
+      size_t total = 0;
+      for (size_t d = 0; d < topo->num_domains; ++d) {
+        size_t slots = topo->domains[d].num_cpus / (size_t) threads;
+        total += slots ? slots : 1;
+      }
+
+      size_t slot = (size_t) robot % total;
+      for (size_t d = 0; d < topo->num_domains; ++d) {
+        size_t slots = topo->domains[d].num_cpus / (size_t) threads;
+        slots = slots ? slots : 1;
+
+        if (slot < slots) {
+          // The robot gets its own run of CPUs, whole cores first
+          const struct topology_domain* domain = &topo->domains[d];
+          size_t first = slot * (size_t) threads;
+          for (size_t i = first; i < first + (size_t) threads && i < domain->num_cpus; ++i) {
+            CPU_SET(domain->cpus[i], &p->cpus);
+          }
+
+          p->domain = (int) d;
+          p->node = domain->node;
+          p->num_cpus = CPU_COUNT(&p->cpus);
+          return 0;
+        }
+
+        slot -= slots;
+      }
+
+      return 0;
+    }
+  }
+
+  const struct topology_domain* domain = &topo->domains[p->domain];
+  for (size_t i = 0; i < domain->num_cpus; ++i) {
+    CPU_SET(domain->cpus[i], &p->cpus);
+  }
+
+  p->node = domain->node;
+  p->num_cpus = CPU_COUNT(&p->cpus);
+  return 0;
+}
+
+int topology_pin(const struct topology_placement* p) {
+  if (p->num_cpus == 0) {
+    return 0;
+  }
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(p->cpus), &p->cpus) != 0;
+}
+
+void* topology_alloc_local(size_t size, int node) {
+  void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+
+  if (node >= 0 && node < TOPOLOGY_MAX_NODES) {
+    unsigned long mask[TOPOLOGY_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    // Preferred rather than bound, so a full node spills over instead of failing
+    // Refusal (e.g. seccomp in a container) leaves first touch to decide
+    syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, mask, (unsigned long) TOPOLOGY_MAX_NODES, 0);
+  }
+
+  // Fault every page in now rather than on the frame path
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+void topology_free_local(void* ptr, size_t size) {
+  if (ptr) {
+    munmap(ptr, size);
+  }
+}
@@ -0,0 +1,185 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_TOPOLOGY_H
+#define CORE_TOPOLOGY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sched.h>
+#include <stddef.h>
+
+/** The default sysfs root. */
+#define TOPOLOGY_SYSFS_ROOT "/sys/devices/system"
+
+/** A logical CPU. */
+struct topology_cpu {
+  /** The CPU number. */
+  int cpu;
+
+  /** The core ID (shared by hyperthread siblings). */
+  int core;
+
+  /** The package (socket) ID. */
+  int package;
+
+  /** The NUMA node (zero if unknown). */
+  int node;
+
+  /** The L3 cache ID (the lowest CPU sharing it), or the package ID without an L3. */
+  int l3;
+};
+
+/** CPUs sharing an L3 cache. Threads placed here share their working set through it. */
+struct topology_domain {
+  /** The L3 cache ID. */
+  int l3;
+
+  /** The NUMA node. */
+  int node;
+
+  /** The CPUs, in core order (hyperthread siblings last). */
+  int* cpus;
+
+  /** The number of CPUs. */
+  size_t num_cpus;
+};
+
+/**
+ * The CPU topology this process may run on.
+ *
+ * Read from sysfs and limited to the CPUs in the process's affinity mask, so
+ * a process started under taskset or in a cpuset only places work on CPUs it
+ * owns.
+ */
+struct topology {
+  /** The CPUs, by number. */
+  struct topology_cpu* cpus;
+
+  /** The number of CPUs. */
+  size_t num_cpus;
+
+  /** The L3 domains, ordered by node and then L3 ID. */
+  struct topology_domain* domains;
+
+  /** The number of domains. */
+  size_t num_domains;
+
+  /** The number of NUMA nodes seen. */
+  int num_nodes;
+};
+
+/** How robots are placed onto CPUs. */
+enum cpu_policy {
+  /** Leave placement to the kernel. */
+  cpu_policy_none = 0,
+
+  /** Pack robots onto as few L3 domains as possible, each on its own CPUs. */
+  cpu_policy_compact,
+
+  /** Deal robots out across L3 domains, each free to use its whole domain. */
+  cpu_policy_spread,
+
+  /** Use CPU lists given per robot. */
+  cpu_policy_manual,
+};
+
+/** Where a robot's pipeline threads and buffers go. */
+struct topology_placement {
+  /** The L3 domain index, or -1 for none. */
+  int domain;
+
+  /** The NUMA node for the robot's buffers, or -1 for none. */
+  int node;
+
+  /** The CPUs for the robot's threads. */
+  cpu_set_t cpus;
+
+  /** The number of CPUs (zero for no pinning). */
+  int num_cpus;
+};
+
+/**
+ * Read the topology.
+ *
+ * @param topo The topology
+ * @param root The sysfs root (TOPOLOGY_SYSFS_ROOT, or a copy for testing)
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+int topology_load(struct topology* topo, const char* root);
+
+/**
+ * Free a topology.
+ *
+ * @param topo The topology
+ */
+void topology_destroy(struct topology* topo);
+
+/**
+ * Parse a CPU list such as "0-3,8,10-11".
+ *
+ * @param text The text
+ * @param set The CPUs
+ * @return Zero on success, otherwise nonzero
+ */
+int topology_parse_cpulist(const char* text, cpu_set_t* set);
+
+/**
+ * Parse a placement policy: "none", "compact", "spread", or "manual:" and one
+ * CPU list per robot separated by semicolons (e.g. "manual:0-3;4-7").
+ *
+ * @param text The text
+ * @param policy The policy
+ * @param manual The per-robot CPU lists (manual only), pointing into the text
+ * @return Zero on success, otherwise nonzero
+ */
+int topology_parse_policy(const char* text, enum cpu_policy* policy, const char** manual);
+
+/**
+ * Place a robot.
+ *
+ * @param topo The topology
+ * @param policy The policy
+ * @param manual The per-robot CPU lists (manual only); robots past the end wrap around
+ * @param robot The robot's index (in order of arrival, from zero)
+ * @param threads The pipeline threads per robot (e.g. capture, preprocess and detect)
+ * @param placement The placement
+ * @return Zero on success, otherwise nonzero (a bad manual list)
+ */
+int topology_place(const struct topology* topo, enum cpu_policy policy, const char* manual, int robot, int threads,
+    struct topology_placement* placement);
+
+/**
+ * Pin the calling thread.
+ *
+ * @param placement The placement (no pinning if it has no CPUs)
+ * @return Zero on success, otherwise nonzero
+ */
+int topology_pin(const struct topology_placement* placement);
+
+/**
+ * Allocate memory on a NUMA node, prefaulted.
+ *
+ * The range is bound to the node where the kernel allows it. Otherwise the
+ * pages land wherever the calling thread is running when they are touched,
+ * which is the same node if the caller is pinned there.
+ *
+ * @param size The size
+ * @param node The node (negative for no preference)
+ * @return The memory (page aligned), or NULL on failure
+ */
+void* topology_alloc_local(size_t size, int node);
+
+/**
+ * Free memory from topology_alloc_local.
+ *
+ * @param ptr The memory
+ * @param size The size
+ */
+void topology_free_local(void* ptr, size_t size);
+
+#endif // #ifndef CORE_TOPOLOGY_H
@@ -0,0 +1,188 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "types.h"
+
+void* arena_object_alloc(arena_object* self, size_t size, size_t align) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "arena not initialized");
+    return NULL;
+  }
+
+  void* p = arena_alloc(&self->arena, size, align);
+  if (p == NULL) {
+    PyErr_NoMemory();
+  }
+
+  return p;
+}
+
+int arena_object_check(arena_object* self, uint64_t generation) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "arena not initialized");
+    return 1;
+  }
+
+  if (self->arena.stats.resets != generation) {
+    PyErr_SetString(PyExc_ValueError, "arena memory was released by a reset");
+    return 1;
+  }
+
+  return 0;
+}
+
+static void type_arena_dealloc(arena_object* self) {
+  // Buffers hold a reference, so by now none are left
+  if (self->ready) {
+    arena_destroy(&self->arena);
+    self->ready = 0;
+  }
+
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_arena_init(arena_object* self, PyObject* args, PyObject* kwds) {
+  Py_ssize_t block_size = 64 * 1024;
+  int node = -1;
+  Py_ssize_t limit = 0;
+
+  static char* kwlist[] = {"block_size", "node", "limit", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nin", kwlist, &block_size, &node, &limit)) {
+    return -1;
+  }
+
+  if (block_size <= 0) {
+    PyErr_SetString(PyExc_ValueError, "block_size must be positive");
+    return -1;
+  }
+
+  if (limit < 0) {
+    PyErr_SetString(PyExc_ValueError, "limit must not be negative");
+    return -1;
+  }
+
+  if (self->ready) {
+    PyErr_SetString(PyExc_RuntimeError, "arena already initialized");
+    return -1;
+  }
+
+  arena_init(&self->arena, (size_t) block_size, node, (size_t) limit);
+  self->ready = 1;
+  return 0;
+}
+
+static PyObject* type_arena_alloc(arena_object* self, PyObject* args, PyObject* kwds) {
+  Py_ssize_t size;
+  Py_ssize_t align = 16;
+
+  static char* kwlist[] = {"size", "align", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|n", kwlist, &size, &align)) {
+    return NULL;
+  }
+
+  if (size < 0) {
+    PyErr_SetString(PyExc_ValueError, "size must not be negative");
+    return NULL;
+  }
+
+  if (align <= 0 || (align & (align - 1)) != 0) {
+    PyErr_SetString(PyExc_ValueError, "align must be a power of two");
+    return NULL;
+  }
+
+  void* data = arena_object_alloc(self, (size_t) size, (size_t) align);
+  if (data == NULL) {
+    return NULL;
+  }
+
+  arena_buffer_object* buffer = (arena_buffer_object*) type_arena_buffer.tp_alloc(&type_arena_buffer, 0);
+  if (buffer == NULL) {
+    return NULL;
+  }
+
+  Py_INCREF(self);
+  buffer->arena = self;
+  buffer->data = data;
+  buffer->len = size;
+  buffer->generation = self->arena.stats.resets;
+
+  return (PyObject*) buffer;
+}
+
+static PyObject* type_arena_reset(arena_object* self) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "arena not initialized");
+    return NULL;
+  }
+
+  // Memory still viewed from Python can't be handed out again
+  if (self->exports > 0) {
+    PyErr_Format(PyExc_BufferError, "cannot reset arena while %zd buffer views are exported", self->exports);
+    return NULL;
+  }
+
+  if (arena_reset(&self->arena)) {
+    return PyErr_NoMemory();
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_arena_stats(arena_object* self) {
+  struct arena_stats stats = {0};
+  if (self->ready) {
+    stats = self->arena.stats;
+  }
+
+  return Py_BuildValue("{s:n,s:n,s:n,s:n,s:K,s:K,s:n,s:i,s:n}",
+    "blocks", (Py_ssize_t) stats.blocks,
+    "capacity", (Py_ssize_t) stats.capacity,
+    "used", (Py_ssize_t) stats.used,
+    "peak", (Py_ssize_t) stats.peak,
+    "resets", (unsigned long long) stats.resets,
+    "mallocs", (unsigned long long) stats.mallocs,
+    "exports", self->exports,
+    "node", self->ready ? self->arena.node : -1,
+    "limit", (Py_ssize_t) (self->ready ? self->arena.limit : 0));
+}
+
+/** _core.Arena methods. */
+static PyMethodDef type_arena_methods[] = {
+  {
+    .ml_name = "alloc",
+    .ml_meth = (PyCFunction) type_arena_alloc,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Allocate a writable buffer that lives until the next reset",
+  },
+  {
+    .ml_name = "reset",
+    .ml_meth = (PyCFunction) type_arena_reset,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Release everything allocated at once (fails while buffer views are exported)",
+  },
+  {
+    .ml_name = "stats",
+    .ml_meth = (PyCFunction) type_arena_stats,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Return the arena counters as a dictionary",
+  },
+  {NULL},
+};
+
+/** _core.Arena type. */
+PyTypeObject type_arena = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.Arena",
+  .tp_basicsize = sizeof(arena_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_arena_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A per-frame bump allocator, reset wholesale when the frame retires.",
+  .tp_methods = type_arena_methods,
+  .tp_init = (initproc) type_arena_init,
+  .tp_new = PyType_GenericNew,
+};
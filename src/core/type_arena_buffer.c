@@ -0,0 +1,74 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "types.h"
+
+static void type_arena_buffer_dealloc(arena_buffer_object* self) {
+  Py_XDECREF(self->arena);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_arena_buffer_getbuffer(arena_buffer_object* self, Py_buffer* view, int flags) {
+  if (arena_object_check(self->arena, self->generation)) {
+    view->obj = NULL;
+    return -1;
+  }
+
+  if (PyBuffer_FillInfo(view, (PyObject*) self, self->data, self->len, 0, flags) < 0) {
+    return -1;
+  }
+
+  ++self->arena->exports;
+  return 0;
+}
+
+static void type_arena_buffer_releasebuffer(arena_buffer_object* self, Py_buffer* view) {
+  --self->arena->exports;
+}
+
+static Py_ssize_t type_arena_buffer_length(arena_buffer_object* self) {
+  return self->len;
+}
+
+static PyObject* type_arena_buffer_get_valid(arena_buffer_object* self, void* closure) {
+  return PyBool_FromLong(self->generation == self->arena->arena.stats.resets);
+}
+
+/** _core.ArenaBuffer buffer procedures. */
+static PyBufferProcs type_arena_buffer_as_buffer = {
+  .bf_getbuffer = (getbufferproc) type_arena_buffer_getbuffer,
+  .bf_releasebuffer = (releasebufferproc) type_arena_buffer_releasebuffer,
+};
+
+/** _core.ArenaBuffer sequence methods. */
+static PySequenceMethods type_arena_buffer_as_sequence = {
+  .sq_length = (lenfunc) type_arena_buffer_length,
+};
+
+/** _core.ArenaBuffer getters and setters. */
+static PyGetSetDef type_arena_buffer_getset[] = {
+  {
+    .name = "valid",
+    .get = (getter) type_arena_buffer_get_valid,
+    .set = NULL,
+    .doc = "whether the arena has not been reset since the allocation",
+    .closure = NULL,
+  },
+  {NULL},
+};
+
+/** _core.ArenaBuffer type. */
+PyTypeObject type_arena_buffer = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.ArenaBuffer",
+  .tp_basicsize = sizeof(arena_buffer_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_arena_buffer_dealloc,
+  .tp_as_sequence = &type_arena_buffer_as_sequence,
+  .tp_as_buffer = &type_arena_buffer_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Arena memory, viewable through the buffer protocol until the arena resets.",
+  .tp_getset = type_arena_buffer_getset,
+};
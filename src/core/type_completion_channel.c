@@ -0,0 +1,135 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "types.h"
+
+static void type_completion_channel_dealloc(completion_channel_object* self) {
+  if (self->ready) {
+    completion_channel_destroy(&self->channel);
+    self->ready = 0;
+  }
+
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_completion_channel_init(completion_channel_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist)) {
+    return -1;
+  }
+
+  if (self->ready) {
+    PyErr_SetString(PyExc_RuntimeError, "completion channel already initialized");
+    return -1;
+  }
+
+  if (completion_channel_init(&self->channel)) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    return -1;
+  }
+
+  self->ready = 1;
+  return 0;
+}
+
+static PyObject* type_completion_channel_fileno(completion_channel_object* self) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "completion channel not initialized");
+    return NULL;
+  }
+
+  return PyLong_FromLong(self->channel.fd);
+}
+
+static PyObject* type_completion_channel_drain(completion_channel_object* self) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "completion channel not initialized");
+    return NULL;
+  }
+
+  PyObject* list = PyList_New(0);
+  if (list == NULL) {
+    return NULL;
+  }
+
+  // Take everything in one go
+  struct completion* c = completion_channel_take(&self->channel);
+
+  while (c) {
+    struct completion* next = c->next;
+    uint64_t ticket = c->ticket;
+
+    // Resolve to either a value or an exception
+    int ok = 1;
+    PyObject* value = c->resolve(c);
+    if (value == NULL) {
+      ok = 0;
+
+      PyObject* type, * traceback;
+      PyErr_Fetch(&type, &value, &traceback);
+      PyErr_NormalizeException(&type, &value, &traceback);
+      if (traceback) {
+        PyException_SetTraceback(value, traceback);
+      }
+      Py_XDECREF(type);
+      Py_XDECREF(traceback);
+    }
+
+    c->destroy(c);
+
+    // Package it as (ticket, ok, value)
+    PyObject* item = Py_BuildValue("(KNN)", (unsigned long long) ticket, PyBool_FromLong(ok), value);
+    if (item == NULL || PyList_Append(list, item) < 0) {
+      Py_XDECREF(item);
+      Py_DECREF(list);
+
+      // Don't leak the rest
+      while (next) {
+        struct completion* after = next->next;
+        next->destroy(next);
+        next = after;
+      }
+
+      return NULL;
+    }
+
+    Py_DECREF(item);
+    c = next;
+  }
+
+  return list;
+}
+
+/** _core.CompletionChannel methods. */
+static PyMethodDef type_completion_channel_methods[] = {
+  {
+    .ml_name = "fileno",
+    .ml_meth = (PyCFunction) type_completion_channel_fileno,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Return the file descriptor that becomes readable when completions are ready",
+  },
+  {
+    .ml_name = "drain",
+    .ml_meth = (PyCFunction) type_completion_channel_drain,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Take all ready completions as a list of (ticket, ok, value) tuples",
+  },
+  {NULL},
+};
+
+/** _core.CompletionChannel type. */
+PyTypeObject type_completion_channel = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.CompletionChannel",
+  .tp_basicsize = sizeof(completion_channel_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_completion_channel_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A channel carrying finished native operations back to the event loop.",
+  .tp_methods = type_completion_channel_methods,
+  .tp_init = (initproc) type_completion_channel_init,
+  .tp_new = PyType_GenericNew,
+};
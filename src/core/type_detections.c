@@ -0,0 +1,557 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+
+/** _core.Detection fields. */
+static PyStructSequence_Field type_detection_fields[] = {
+  {"x", "box left edge"},
+  {"y", "box top edge"},
+  {"w", "box width"},
+  {"h", "box height"},
+  {"score", "detection score"},
+  {"landmarks", "five (x, y) landmark points, flattened"},
+  {"track_id", "track ID (-1 if untracked)"},
+  {"friend_id", "friend ID (-1 if unknown)"},
+  {NULL},
+};
+
+PyStructSequence_Desc type_detection_desc = {
+  .name = "_core.Detection",
+  .doc = "One row of a Detections, built on demand.",
+  .fields = type_detection_fields,
+  .n_in_sequence = 8,
+};
+
+PyTypeObject type_detection;
+
+int detections_object_check(detections_object* self) {
+  if (self->arena) {
+    return arena_object_check(self->arena, self->generation);
+  }
+
+  return 0;
+}
+
+/**
+ * Make room for more detections.
+ *
+ * Arena-backed columns move to fresh arena memory (the old memory is
+ * reclaimed at the next reset). Heap-backed columns move and the old memory
+ * is freed.
+ *
+ * @param self The detections
+ * @param cap The capacity needed
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int detections_object_reserve(detections_object* self, size_t cap) {
+  if (cap <= self->det.cap) {
+    return 0;
+  }
+
+  if (self->exports > 0) {
+    PyErr_SetString(PyExc_BufferError, "cannot grow detections while column views are exported");
+    return 1;
+  }
+
+  // Grow geometrically
+  size_t new_cap = self->det.cap * 2;
+  if (new_cap < cap) {
+    new_cap = cap;
+  }
+  if (new_cap < 8) {
+    new_cap = 8;
+  }
+
+  size_t size = detections_size(new_cap);
+  if (size == 0) {
+    PyErr_NoMemory();
+    return 1;
+  }
+
+  if (self->arena) {
+    void* mem = arena_object_alloc(self->arena, size, DETECTIONS_ALIGN);
+    if (mem == NULL) {
+      return 1;
+    }
+
+    detections_rebind(&self->det, mem, new_cap);
+  } else {
+    void* mem;
+    if (memory_aligned_alloc(memory_tag_detections, &mem, DETECTIONS_ALIGN, size) != 0) {
+      PyErr_NoMemory();
+      return 1;
+    }
+
+    detections_rebind(&self->det, mem, new_cap);
+    memory_free(self->mem);
+    self->mem = mem;
+  }
+
+  return 0;
+}
+
+/**
+ * Create empty detections backed by the same arena (or the heap) as others.
+ *
+ * @param like The detections to take the backing from
+ * @param cap The capacity
+ * @return A new reference, or NULL with an exception set
+ */
+static detections_object* detections_object_new_like(detections_object* like, size_t cap) {
+  detections_object* d = (detections_object*) type_detections.tp_alloc(&type_detections, 0);
+  if (d == NULL) {
+    return NULL;
+  }
+
+  if (like->arena) {
+    Py_INCREF(like->arena);
+    d->arena = like->arena;
+    d->generation = like->arena->arena.stats.resets;
+  }
+
+  if (detections_object_reserve(d, cap)) {
+    Py_DECREF(d);
+    return NULL;
+  }
+
+  return d;
+}
+
+static void type_detections_dealloc(detections_object* self) {
+  memory_free(self->mem);
+  Py_XDECREF(self->arena);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_detections_init(detections_object* self, PyObject* args, PyObject* kwds) {
+  Py_ssize_t capacity = 0;
+  PyObject* arena = Py_None;
+
+  static char* kwlist[] = {"capacity", "arena", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nO", kwlist, &capacity, &arena)) {
+    return -1;
+  }
+
+  if (capacity < 0) {
+    PyErr_SetString(PyExc_ValueError, "capacity must not be negative");
+    return -1;
+  }
+
+  if (self->det.cap > 0 || self->arena) {
+    PyErr_SetString(PyExc_RuntimeError, "detections already initialized");
+    return -1;
+  }
+
+  if (arena != Py_None) {
+    if (!PyObject_TypeCheck(arena, &type_arena)) {
+      PyErr_SetString(PyExc_TypeError, "arena must be an Arena");
+      return -1;
+    }
+
+    Py_INCREF(arena);
+    self->arena = (arena_object*) arena;
+    self->generation = self->arena->arena.stats.resets;
+  }
+
+  if (capacity > 0 && detections_object_reserve(self, (size_t) capacity)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static PyObject* type_detections_append(detections_object* self, PyObject* args, PyObject* kwds) {
+  float x;
+  float y;
+  float w;
+  float h;
+  float score;
+  PyObject* landmarks = Py_None;
+  long long track_id = -1;
+  int friend_id = -1;
+
+  static char* kwlist[] = {"x", "y", "w", "h", "score", "landmarks", "track_id", "friend_id", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "fffff|OLi", kwlist, &x, &y, &w, &h, &score, &landmarks, &track_id,
+      &friend_id)) {
+    return NULL;
+  }
+
+  if (detections_object_check(self)) {
+    return NULL;
+  }
+
+  // Read landmarks before growing, so a bad sequence leaves nothing half-done
+  float points[DETECTIONS_LANDMARKS] = {0};
+  if (landmarks != Py_None) {
+    PyObject* seq = PySequence_Fast(landmarks, "landmarks must be a sequence");
+    if (seq == NULL) {
+      return NULL;
+    }
+
+    if (PySequence_Fast_GET_SIZE(seq) != DETECTIONS_LANDMARKS) {
+      PyErr_Format(PyExc_ValueError, "landmarks must have %d values", DETECTIONS_LANDMARKS);
+      Py_DECREF(seq);
+      return NULL;
+    }
+
+    for (int i = 0; i < DETECTIONS_LANDMARKS; ++i) {
+      double v = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+      if (v == -1.0 && PyErr_Occurred()) {
+        Py_DECREF(seq);
+        return NULL;
+      }
+
+      points[i] = (float) v;
+    }
+
+    Py_DECREF(seq);
+  }
+
+  if (detections_object_reserve(self, self->det.len + 1)) {
+    return NULL;
+  }
+
+  struct detections* d = &self->det;
+  size_t row = d->len++;
+
+  d->x[row] = x;
+  d->y[row] = y;
+  d->w[row] = w;
+  d->h[row] = h;
+  d->score[row] = score;
+  memcpy(&d->landmarks[row * DETECTIONS_LANDMARKS], points, sizeof points);
+  d->track_id[row] = track_id;
+  d->friend_id[row] = friend_id;
+
+  Py_RETURN_NONE;
+}
+
+/**
+ * Read one integer from a buffer of any integer format.
+ *
+ * @param format The struct module format character
+ * @param p The item
+ * @param [out] value The value
+ * @return Zero on success, otherwise nonzero (not an integer format)
+ */
+static int read_index(char format, const void* p, long long* value) {
+  switch (format) {
+    case 'b':
+      *value = *(const signed char*) p;
+      return 0;
+    case 'B':
+      *value = *(const unsigned char*) p;
+      return 0;
+    case 'h':
+      *value = *(const short*) p;
+      return 0;
+    case 'H':
+      *value = *(const unsigned short*) p;
+      return 0;
+    case 'i':
+      *value = *(const int*) p;
+      return 0;
+    case 'I':
+      *value = *(const unsigned int*) p;
+      return 0;
+    case 'l':
+      *value = *(const long*) p;
+      return 0;
+    case 'L':
+      *value = (long long) *(const unsigned long*) p;
+      return 0;
+    case 'q':
+      *value = *(const long long*) p;
+      return 0;
+    case 'Q':
+      *value = (long long) *(const unsigned long long*) p;
+      return 0;
+    case 'n':
+      *value = *(const Py_ssize_t*) p;
+      return 0;
+    case 'N':
+      *value = (long long) *(const size_t*) p;
+      return 0;
+    default:
+      return 1;
+  }
+}
+
+static PyObject* type_detections_select(detections_object* self, PyObject* selector) {
+  if (detections_object_check(self)) {
+    return NULL;
+  }
+
+  Py_buffer view;
+  if (PyObject_GetBuffer(selector, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+    return NULL;
+  }
+
+  // Skip byte order marks (only native order is supported)
+  const char* format = view.format ? view.format : "B";
+  if (*format == '@' || *format == '=') {
+    ++format;
+  }
+
+  if (format[0] == '\0' || format[1] != '\0' || view.itemsize <= 0) {
+    PyErr_Format(PyExc_TypeError, "unsupported selector format: %s", view.format);
+    PyBuffer_Release(&view);
+    return NULL;
+  }
+
+  Py_ssize_t n = view.len / view.itemsize;
+  const char* items = view.buf;
+  size_t len = self->det.len;
+
+  detections_object* out;
+
+  if (*format == '?') {
+    // A boolean mask keeps rows in order
+    if ((size_t) n != len) {
+      PyErr_Format(PyExc_ValueError, "mask has %zd entries for %zu detections", n, len);
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+
+    size_t count = 0;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+      count += items[i] != 0;
+    }
+
+    out = detections_object_new_like(self, count);
+    if (out == NULL) {
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+      if (items[i]) {
+        detections_copy_row(&out->det, out->det.len++, &self->det, (size_t) i);
+      }
+    }
+  } else {
+    // Integer indices pick rows in the given order (e.g. from argsort)
+    long long probe;
+    if (read_index(*format, items, &probe)) {
+      PyErr_Format(PyExc_TypeError, "selector must be a boolean mask or integer indices, not format %s",
+        view.format);
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+
+    out = detections_object_new_like(self, (size_t) n);
+    if (out == NULL) {
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < n; ++i) {
+      long long index;
+      read_index(*format, items + i * view.itemsize, &index);
+
+      // Negative indices count from the end, as in Python
+      if (index < 0) {
+        index += (long long) len;
+      }
+
+      if (index < 0 || (size_t) index >= len) {
+        PyErr_Format(PyExc_IndexError, "detection index out of range: %lld", index);
+        Py_DECREF(out);
+        PyBuffer_Release(&view);
+        return NULL;
+      }
+
+      detections_copy_row(&out->det, out->det.len++, &self->det, (size_t) index);
+    }
+  }
+
+  PyBuffer_Release(&view);
+  return (PyObject*) out;
+}
+
+static Py_ssize_t type_detections_length(detections_object* self) {
+  return (Py_ssize_t) self->det.len;
+}
+
+static PyObject* type_detections_item(detections_object* self, Py_ssize_t i) {
+  if (detections_object_check(self)) {
+    return NULL;
+  }
+
+  if (i < 0 || (size_t) i >= self->det.len) {
+    PyErr_SetString(PyExc_IndexError, "detection index out of range");
+    return NULL;
+  }
+
+  const struct detections* d = &self->det;
+
+  PyObject* landmarks = PyTuple_New(DETECTIONS_LANDMARKS);
+  if (landmarks == NULL) {
+    return NULL;
+  }
+
+  for (int j = 0; j < DETECTIONS_LANDMARKS; ++j) {
+    PyObject* v = PyFloat_FromDouble(d->landmarks[i * DETECTIONS_LANDMARKS + j]);
+    if (v == NULL) {
+      Py_DECREF(landmarks);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(landmarks, j, v);
+  }
+
+  PyObject* row = PyStructSequence_New(&type_detection);
+  if (row == NULL) {
+    Py_DECREF(landmarks);
+    return NULL;
+  }
+
+  // Each constructor may fail, and the row cleans up whatever was set
+  PyObject* values[] = {
+    PyFloat_FromDouble(d->x[i]),
+    PyFloat_FromDouble(d->y[i]),
+    PyFloat_FromDouble(d->w[i]),
+    PyFloat_FromDouble(d->h[i]),
+    PyFloat_FromDouble(d->score[i]),
+    landmarks,
+    PyLong_FromLongLong(d->track_id[i]),
+    PyLong_FromLong(d->friend_id[i]),
+  };
+
+  int failed = 0;
+  for (int j = 0; j < 8; ++j) {
+    if (values[j] == NULL) {
+      failed = 1;
+    }
+
+    PyStructSequence_SET_ITEM(row, j, values[j]);
+  }
+
+  if (failed) {
+    Py_DECREF(row);
+    return NULL;
+  }
+
+  return row;
+}
+
+static PyObject* type_detections_get_column(detections_object* self, void* closure) {
+  if (detections_object_check(self)) {
+    return NULL;
+  }
+
+  detections_column_object* column = (detections_column_object*) type_detections_column.tp_alloc(
+    &type_detections_column, 0);
+  if (column == NULL) {
+    return NULL;
+  }
+
+  Py_INCREF(self);
+  column->owner = self;
+  column->column = (enum detections_column) (intptr_t) closure;
+
+  // The memoryview keeps the column (and so the detections) alive
+  PyObject* view = PyMemoryView_FromObject((PyObject*) column);
+  Py_DECREF(column);
+  return view;
+}
+
+/** _core.Detections sequence methods. */
+static PySequenceMethods type_detections_as_sequence = {
+  .sq_length = (lenfunc) type_detections_length,
+  .sq_item = (ssizeargfunc) type_detections_item,
+};
+
+/** _core.Detections getters and setters. */
+static PyGetSetDef type_detections_getset[] = {
+  {
+    .name = "x",
+    .get = (getter) type_detections_get_column,
+    .doc = "box left edges (float32 view)",
+    .closure = (void*) detections_column_x,
+  },
+  {
+    .name = "y",
+    .get = (getter) type_detections_get_column,
+    .doc = "box top edges (float32 view)",
+    .closure = (void*) detections_column_y,
+  },
+  {
+    .name = "w",
+    .get = (getter) type_detections_get_column,
+    .doc = "box widths (float32 view)",
+    .closure = (void*) detections_column_w,
+  },
+  {
+    .name = "h",
+    .get = (getter) type_detections_get_column,
+    .doc = "box heights (float32 view)",
+    .closure = (void*) detections_column_h,
+  },
+  {
+    .name = "score",
+    .get = (getter) type_detections_get_column,
+    .doc = "detection scores (float32 view)",
+    .closure = (void*) detections_column_score,
+  },
+  {
+    .name = "landmarks",
+    .get = (getter) type_detections_get_column,
+    .doc = "landmarks (float32 view, one row of ten per detection)",
+    .closure = (void*) detections_column_landmarks,
+  },
+  {
+    .name = "track_id",
+    .get = (getter) type_detections_get_column,
+    .doc = "track IDs (int64 view)",
+    .closure = (void*) detections_column_track_id,
+  },
+  {
+    .name = "friend_id",
+    .get = (getter) type_detections_get_column,
+    .doc = "friend IDs (int32 view)",
+    .closure = (void*) detections_column_friend_id,
+  },
+  {NULL},
+};
+
+/** _core.Detections methods. */
+static PyMethodDef type_detections_methods[] = {
+  {
+    .ml_name = "append",
+    .ml_meth = (PyCFunction) type_detections_append,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Add a detection",
+  },
+  {
+    .ml_name = "select",
+    .ml_meth = (PyCFunction) type_detections_select,
+    .ml_flags = METH_O,
+    .ml_doc = "Return the rows picked by a boolean mask or an array of indices, as new detections",
+  },
+  {NULL},
+};
+
+/** _core.Detections type. */
+PyTypeObject type_detections = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.Detections",
+  .tp_basicsize = sizeof(detections_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_detections_dealloc,
+  .tp_as_sequence = &type_detections_as_sequence,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Face detections stored as columns, each viewable as an array without a copy.",
+  .tp_methods = type_detections_methods,
+  .tp_getset = type_detections_getset,
+  .tp_init = (initproc) type_detections_init,
+  .tp_new = PyType_GenericNew,
+};
@@ -0,0 +1,87 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "types.h"
+
+/** The buffer format of each column. */
+static char* const COLUMN_FORMATS[detections_column_count] = {
+  [detections_column_x] = "f",
+  [detections_column_y] = "f",
+  [detections_column_w] = "f",
+  [detections_column_h] = "f",
+  [detections_column_score] = "f",
+  [detections_column_landmarks] = "f",
+  [detections_column_track_id] = "q",
+  [detections_column_friend_id] = "i",
+};
+
+static void type_detections_column_dealloc(detections_column_object* self) {
+  Py_XDECREF(self->owner);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_detections_column_getbuffer(detections_column_object* self, Py_buffer* view, int flags) {
+  detections_object* owner = self->owner;
+
+  if (detections_object_check(owner)) {
+    view->obj = NULL;
+    return -1;
+  }
+
+  size_t width;
+  size_t item = detections_column_item(self->column, &width);
+
+  // Landmarks come out as rows of ten, everything else as a flat column
+  self->shape[0] = (Py_ssize_t) owner->det.len;
+  self->shape[1] = (Py_ssize_t) width;
+  self->strides[0] = (Py_ssize_t) (item * width);
+  self->strides[1] = (Py_ssize_t) item;
+
+  view->obj = (PyObject*) self;
+  view->buf = detections_column_data(&owner->det, self->column);
+  view->len = (Py_ssize_t) (owner->det.len * item * width);
+  view->readonly = 0;
+  view->itemsize = (Py_ssize_t) item;
+  view->format = flags & PyBUF_FORMAT ? COLUMN_FORMATS[self->column] : NULL;
+  view->ndim = flags & PyBUF_ND && width > 1 ? 2 : 1;
+  view->shape = flags & PyBUF_ND ? self->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  Py_INCREF(self);
+
+  // Pin the columns, and the arena memory under them
+  ++owner->exports;
+  if (owner->arena) {
+    ++owner->arena->exports;
+  }
+
+  return 0;
+}
+
+static void type_detections_column_releasebuffer(detections_column_object* self, Py_buffer* view) {
+  --self->owner->exports;
+  if (self->owner->arena) {
+    --self->owner->arena->exports;
+  }
+}
+
+/** _core.DetectionsColumn buffer procedures. */
+static PyBufferProcs type_detections_column_as_buffer = {
+  .bf_getbuffer = (getbufferproc) type_detections_column_getbuffer,
+  .bf_releasebuffer = (releasebufferproc) type_detections_column_releasebuffer,
+};
+
+/** _core.DetectionsColumn type. */
+PyTypeObject type_detections_column = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.DetectionsColumn",
+  .tp_basicsize = sizeof(detections_column_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_detections_column_dealloc,
+  .tp_as_buffer = &type_detections_column_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "One column of a Detections, exported through the buffer protocol.",
+};
@@ -0,0 +1,189 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <time.h>
+
+#include "types.h"
+
+static void type_encounter_log_close_native(encounter_log_object* self) {
+  if (self->open) {
+    // The final flush may wait on the network
+    Py_BEGIN_ALLOW_THREADS
+    encounter_log_stop(&self->log);
+    Py_END_ALLOW_THREADS
+
+    self->open = 0;
+  }
+}
+
+static void type_encounter_log_dealloc(encounter_log_object* self) {
+  type_encounter_log_close_native(self);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_encounter_log_init(encounter_log_object* self, PyObject* args, PyObject* kwds) {
+  const char* host = NULL;
+  const char* user = NULL;
+  const char* password = NULL;
+  const char* database = NULL;
+  unsigned int port = 0;
+  const char* spill_path = "encounters.spill";
+  Py_ssize_t batch_size = 256;
+  double flush_interval = 1.0;
+  double dedup_window = 5.0;
+
+  static char* kwlist[] = {
+    "host", "user", "password", "database", "port", "spill_path", "batch_size", "flush_interval", "dedup_window", NULL,
+  };
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zzzzIsndd", kwlist, &host, &user, &password, &database, &port,
+      &spill_path, &batch_size, &flush_interval, &dedup_window)) {
+    return -1;
+  }
+
+  if (self->open) {
+    PyErr_SetString(PyExc_RuntimeError, "encounter log already open");
+    return -1;
+  }
+
+  if (batch_size <= 0) {
+    PyErr_SetString(PyExc_ValueError, "batch_size must be positive");
+    return -1;
+  }
+
+  struct sql_params params = {
+    .host = host,
+    .user = user,
+    .pass = password,
+    .db = database,
+    .port = port,
+  };
+
+  if (encounter_log_start(&self->log, &params, spill_path, (size_t) batch_size, flush_interval, dedup_window)) {
+    PyErr_SetString(PyExc_RuntimeError, "failed to start encounter log");
+    return -1;
+  }
+
+  self->open = 1;
+  return 0;
+}
+
+static PyObject* type_encounter_log_record(encounter_log_object* self, PyObject* args, PyObject* kwds) {
+  int friend_id;
+  int robot_id;
+  long long track_id;
+  float confidence;
+  PyObject* timestamp = Py_None;
+
+  static char* kwlist[] = {"friend_id", "robot_id", "track_id", "confidence", "timestamp", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iiLf|O", kwlist, &friend_id, &robot_id, &track_id, &confidence,
+      &timestamp)) {
+    return NULL;
+  }
+
+  if (!self->open) {
+    PyErr_SetString(PyExc_ValueError, "encounter log is closed");
+    return NULL;
+  }
+
+  struct encounter e = {
+    .friend_id = friend_id,
+    .robot_id = robot_id,
+    .track_id = track_id,
+    .confidence = confidence,
+  };
+
+  // Default to now
+  if (timestamp == Py_None) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    e.time = (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+  } else {
+    e.time = PyFloat_AsDouble(timestamp);
+    if (e.time == -1.0 && PyErr_Occurred()) {
+      return NULL;
+    }
+  }
+
+  if (encounter_log_record(&self->log, &e)) {
+    return PyErr_NoMemory();
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_encounter_log_flush(encounter_log_object* self) {
+  if (self->open) {
+    Py_BEGIN_ALLOW_THREADS
+    encounter_log_flush(&self->log);
+    Py_END_ALLOW_THREADS
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_encounter_log_stats(encounter_log_object* self) {
+  struct encounter_log_stats stats = {0};
+  if (self->open) {
+    encounter_log_get_stats(&self->log, &stats);
+  }
+
+  return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K}",
+    "recorded", stats.recorded,
+    "deduped", stats.deduped,
+    "inserted", stats.inserted,
+    "spilled", stats.spilled,
+    "replayed", stats.replayed,
+    "dropped", stats.dropped);
+}
+
+static PyObject* type_encounter_log_close(encounter_log_object* self) {
+  type_encounter_log_close_native(self);
+  Py_RETURN_NONE;
+}
+
+/** _core.EncounterLog methods. */
+static PyMethodDef type_encounter_log_methods[] = {
+  {
+    .ml_name = "record",
+    .ml_meth = (PyCFunction) type_encounter_log_record,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Record that a robot recognized a friend on a face track",
+  },
+  {
+    .ml_name = "flush",
+    .ml_meth = (PyCFunction) type_encounter_log_flush,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Write out everything pending and wait for it",
+  },
+  {
+    .ml_name = "stats",
+    .ml_meth = (PyCFunction) type_encounter_log_stats,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Return the log counters as a dictionary",
+  },
+  {
+    .ml_name = "close",
+    .ml_meth = (PyCFunction) type_encounter_log_close,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Flush and stop the log",
+  },
+  {NULL},
+};
+
+/** _core.EncounterLog type. */
+PyTypeObject type_encounter_log = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.EncounterLog",
+  .tp_basicsize = sizeof(encounter_log_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_encounter_log_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A write-behind log of friend encounters with batched inserts.",
+  .tp_methods = type_encounter_log_methods,
+  .tp_init = (initproc) type_encounter_log_init,
+  .tp_new = PyType_GenericNew,
+};
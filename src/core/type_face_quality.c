@@ -0,0 +1,486 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+
+/** _core.FaceScore fields. */
+static PyStructSequence_Field type_face_score_fields[] = {
+  {"score", "overall score, from 0 (useless) to 1"},
+  {"sharpness", "Laplacian variance of the crop"},
+  {"size", "face side in pixels"},
+  {"yaw", "rough yaw in degrees (0 without landmarks)"},
+  {"pitch", "rough pitch in degrees (0 without landmarks)"},
+  {"roll", "rough roll in degrees (0 without landmarks)"},
+  {NULL},
+};
+
+PyStructSequence_Desc type_face_score_desc = {
+  .name = "_core.FaceScore",
+  .doc = "A face quality verdict.",
+  .fields = type_face_score_fields,
+  .n_in_sequence = 6,
+};
+
+PyTypeObject type_face_score;
+
+/** A face crop to score, copied out so scoring can run without the GIL. */
+struct face_job {
+  /** The crop left edge. */
+  size_t x;
+
+  /** The crop top edge. */
+  size_t y;
+
+  /** The crop width (zero if the box misses the image). */
+  size_t width;
+
+  /** The crop height. */
+  size_t height;
+
+  /** The landmarks. */
+  float landmarks[DETECTIONS_LANDMARKS];
+
+  /** Nonzero if landmarks were given. */
+  int has_landmarks;
+
+  /** The verdict. */
+  struct face_quality quality;
+};
+
+static int type_face_quality_init(face_quality_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"min_size", "good_size", "good_sharpness", "max_yaw", "max_pitch", NULL};
+
+  face_quality_defaults(&self->params);
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|fffff", kwlist, &self->params.min_size, &self->params.good_size,
+    &self->params.good_sharpness, &self->params.max_yaw, &self->params.max_pitch)) {
+    return -1;
+  }
+
+  if (self->params.good_size <= self->params.min_size || self->params.good_sharpness <= 0
+    || self->params.max_yaw <= 0 || self->params.max_pitch <= 0) {
+    PyErr_SetString(PyExc_ValueError, "face quality thresholds out of range");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * View an image as rows of 8-bit gray pixels.
+ *
+ * @param image The image (e.g. a 2-D uint8 NumPy array)
+ * @param view The view
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int get_image(PyObject* image, Py_buffer* view) {
+  if (PyObject_GetBuffer(image, view, PyBUF_STRIDES | PyBUF_FORMAT) < 0) {
+    return 1;
+  }
+
+  const char* format = view->format ? view->format : "B";
+  if (view->ndim != 2 || view->itemsize != 1 || strcmp(format, "B") != 0 || view->strides[1] != 1
+    || view->strides[0] <= 0) {
+    PyErr_SetString(PyExc_TypeError, "image must be a 2-D array of uint8 with contiguous rows");
+    PyBuffer_Release(view);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Clip a box to an image.
+ *
+ * @param job The job to take the clipped box
+ * @param view The image
+ * @param x The box left edge
+ * @param y The box top edge
+ * @param w The box width
+ * @param h The box height
+ */
+static void clip_box(struct face_job* job, const Py_buffer* view, double x, double y, double w, double h) {
+  double right = x + w;
+  double bottom = y + h;
+
+  if (x < 0) {
+    x = 0;
+  }
+  if (y < 0) {
+    y = 0;
+  }
+  if (right > (double) view->shape[1]) {
+    right = (double) view->shape[1];
+  }
+  if (bottom > (double) view->shape[0]) {
+    bottom = (double) view->shape[0];
+  }
+
+  if (right <= x || bottom <= y) {
+    job->x = job->y = job->width = job->height = 0;
+    return;
+  }
+
+  job->x = (size_t) x;
+  job->y = (size_t) y;
+  job->width = (size_t) right - job->x;
+  job->height = (size_t) bottom - job->y;
+}
+
+/**
+ * Score jobs against an image.
+ *
+ * @param params The thresholds
+ * @param view The image
+ * @param jobs The jobs
+ * @param n The number of jobs
+ */
+static void run_jobs(const struct face_quality_params* params, const Py_buffer* view, struct face_job* jobs,
+    size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    struct face_job* job = &jobs[i];
+
+    if (job->width == 0) {
+      memset(&job->quality, 0, sizeof(job->quality));
+      continue;
+    }
+
+    const uint8_t* crop = (const uint8_t*) view->buf + job->y * view->strides[0] + job->x;
+    face_quality_score(params, crop, job->width, job->height, (size_t) view->strides[0],
+      job->has_landmarks ? job->landmarks : NULL, &job->quality);
+  }
+}
+
+/**
+ * Build a score for Python.
+ *
+ * @param quality The verdict
+ * @return A new FaceScore, or NULL with an exception set
+ */
+static PyObject* new_score(const struct face_quality* quality) {
+  PyObject* row = PyStructSequence_New(&type_face_score);
+  if (row == NULL) {
+    return NULL;
+  }
+
+  // Each constructor may fail, and the row cleans up whatever was set
+  PyObject* values[] = {
+    PyFloat_FromDouble(quality->score),
+    PyFloat_FromDouble(quality->sharpness),
+    PyFloat_FromDouble(quality->size),
+    PyFloat_FromDouble(quality->pose.yaw),
+    PyFloat_FromDouble(quality->pose.pitch),
+    PyFloat_FromDouble(quality->pose.roll),
+  };
+
+  int failed = 0;
+  for (int j = 0; j < 6; ++j) {
+    if (values[j] == NULL) {
+      failed = 1;
+    }
+
+    PyStructSequence_SET_ITEM(row, j, values[j]);
+  }
+
+  if (failed) {
+    Py_DECREF(row);
+    return NULL;
+  }
+
+  return row;
+}
+
+static PyObject* type_face_quality_score(face_quality_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"image", "x", "y", "width", "height", "landmarks", NULL};
+
+  PyObject* image;
+  double x = 0;
+  double y = 0;
+  double width = -1;
+  double height = -1;
+  PyObject* landmarks = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ddddO", kwlist, &image, &x, &y, &width, &height, &landmarks)) {
+    return NULL;
+  }
+
+  Py_buffer view;
+  if (get_image(image, &view)) {
+    return NULL;
+  }
+
+  struct face_job job = {0};
+
+  // The whole image by default
+  clip_box(&job, &view, x, y, width < 0 ? (double) view.shape[1] : width, height < 0 ? (double) view.shape[0] : height);
+
+  if (landmarks != Py_None) {
+    PyObject* seq = PySequence_Fast(landmarks, "landmarks must be a sequence");
+    if (seq == NULL) {
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+
+    if (PySequence_Fast_GET_SIZE(seq) != DETECTIONS_LANDMARKS) {
+      PyErr_Format(PyExc_ValueError, "expected %d landmark coordinates", DETECTIONS_LANDMARKS);
+      Py_DECREF(seq);
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+
+    for (int j = 0; j < DETECTIONS_LANDMARKS; ++j) {
+      job.landmarks[j] = (float) PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, j));
+    }
+
+    Py_DECREF(seq);
+
+    if (PyErr_Occurred()) {
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+
+    job.has_landmarks = 1;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  run_jobs(&self->params, &view, &job, 1);
+  Py_END_ALLOW_THREADS
+
+  PyBuffer_Release(&view);
+  return new_score(&job.quality);
+}
+
+/**
+ * Make a job per detection.
+ *
+ * Boxes are copied out, since the detections could grow under us once the
+ * GIL is dropped.
+ *
+ * @param view The image
+ * @param det The detections
+ * @return The jobs (det->len of them), or NULL with an exception set
+ */
+static struct face_job* make_jobs(const Py_buffer* view, const struct detections* det) {
+  size_t n = det->len;
+
+  struct face_job* jobs = memory_calloc(memory_tag_quality, n ? n : 1, sizeof(*jobs));
+  if (jobs == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    clip_box(&jobs[i], view, det->x[i], det->y[i], det->w[i], det->h[i]);
+    memcpy(jobs[i].landmarks, &det->landmarks[i * DETECTIONS_LANDMARKS], sizeof(jobs[i].landmarks));
+
+    // Rows appended without landmarks hold zeros, and are scored without pose
+    for (int j = 0; j < DETECTIONS_LANDMARKS; ++j) {
+      if (jobs[i].landmarks[j] != 0) {
+        jobs[i].has_landmarks = 1;
+        break;
+      }
+    }
+  }
+
+  return jobs;
+}
+
+/**
+ * Build a list of scores for Python.
+ *
+ * @param jobs The scored jobs
+ * @param n The number of jobs
+ * @return A new list of FaceScore, or NULL with an exception set
+ */
+static PyObject* jobs_to_list(const struct face_job* jobs, size_t n) {
+  PyObject* scores = PyList_New((Py_ssize_t) n);
+  if (scores == NULL) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    PyObject* score = new_score(&jobs[i].quality);
+    if (score == NULL) {
+      Py_DECREF(scores);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(scores, (Py_ssize_t) i, score);
+  }
+
+  return scores;
+}
+
+static PyObject* type_face_quality_score_detections(face_quality_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"image", "detections", NULL};
+
+  PyObject* image;
+  detections_object* detections;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO!", kwlist, &image, &type_detections, &detections)) {
+    return NULL;
+  }
+
+  if (detections_object_check(detections)) {
+    return NULL;
+  }
+
+  Py_buffer view;
+  if (get_image(image, &view)) {
+    return NULL;
+  }
+
+  size_t n = detections->det.len;
+  struct face_job* jobs = make_jobs(&view, &detections->det);
+  if (jobs == NULL) {
+    PyBuffer_Release(&view);
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  run_jobs(&self->params, &view, jobs, n);
+  Py_END_ALLOW_THREADS
+
+  PyBuffer_Release(&view);
+
+  PyObject* scores = jobs_to_list(jobs, n);
+  memory_free(jobs);
+  return scores;
+}
+
+/** Detections scored on a scheduler. */
+struct score_op {
+  /** The op (first). */
+  struct scheduler_op op;
+
+  /** The thresholds. */
+  struct face_quality_params params;
+
+  /** The image, held until the op is destroyed. */
+  Py_buffer view;
+
+  /** The jobs. */
+  struct face_job* jobs;
+
+  /** The number of jobs. */
+  size_t n;
+};
+
+/**
+ * Score detections on a worker.
+ *
+ * @param task The task
+ */
+static void score_op_run(struct scheduler_task* task) {
+  struct score_op* op = (struct score_op*) scheduler_op_of(task);
+  run_jobs(&op->params, &op->view, op->jobs, op->n);
+  scheduler_op_done(&op->op);
+}
+
+/**
+ * Resolve scored detections.
+ *
+ * @param c The completion
+ * @return A list of FaceScore, or NULL with an exception set
+ */
+static PyObject* score_op_resolve(struct completion* c) {
+  struct score_op* op = (struct score_op*) c;
+  return jobs_to_list(op->jobs, op->n);
+}
+
+/**
+ * Destroy scored detections.
+ *
+ * @param c The completion
+ */
+static void score_op_destroy(struct completion* c) {
+  struct score_op* op = (struct score_op*) c;
+  PyBuffer_Release(&op->view);
+  memory_free(op->jobs);
+  memory_free(op);
+}
+
+static PyObject* type_face_quality_score_detections_async(face_quality_object* self, PyObject* args,
+    PyObject* kwds) {
+  static char* kwlist[] = {"scheduler", "image", "detections", "priority", NULL};
+
+  scheduler_object* scheduler;
+  PyObject* image;
+  detections_object* detections;
+  PyObject* priority = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!OO!|O", kwlist, &type_scheduler, &scheduler, &image,
+      &type_detections, &detections, &priority)) {
+    return NULL;
+  }
+
+  if (detections_object_check(detections)) {
+    return NULL;
+  }
+
+  struct score_op* op = memory_calloc(memory_tag_quality, 1, sizeof *op);
+  if (op == NULL) {
+    return PyErr_NoMemory();
+  }
+
+  if (get_image(image, &op->view)) {
+    memory_free(op);
+    return NULL;
+  }
+
+  op->n = detections->det.len;
+  op->jobs = make_jobs(&op->view, &detections->det);
+  if (op->jobs == NULL) {
+    PyBuffer_Release(&op->view);
+    memory_free(op);
+    return NULL;
+  }
+
+  op->params = self->params;
+  op->op.base.resolve = &score_op_resolve;
+  op->op.base.destroy = &score_op_destroy;
+  op->op.task.run = &score_op_run;
+
+  return scheduler_object_submit(scheduler, &op->op, priority, "score");
+}
+
+/** _core.FaceQuality methods. */
+static PyMethodDef type_face_quality_methods[] = {
+  {
+    .ml_name = "score",
+    .ml_meth = (PyCFunction) type_face_quality_score,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Score the face in a box of a gray image, with optional landmarks (whole image by default)",
+  },
+  {
+    .ml_name = "score_detections",
+    .ml_meth = (PyCFunction) type_face_quality_score_detections,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Score every face in a Detections against the gray image it was detected in",
+  },
+  {
+    .ml_name = "score_detections_async",
+    .ml_meth = (PyCFunction) type_face_quality_score_detections_async,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Queue score_detections on a scheduler and return its completion ticket",
+  },
+  {NULL},
+};
+
+/** _core.FaceQuality type. */
+PyTypeObject type_face_quality = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.FaceQuality",
+  .tp_basicsize = sizeof(face_quality_object),
+  .tp_itemsize = 0,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A cheap face quality scorer (sharpness, size and pose), for choosing which crops to embed.",
+  .tp_methods = type_face_quality_methods,
+  .tp_init = (initproc) type_face_quality_init,
+  .tp_new = PyType_GenericNew,
+};
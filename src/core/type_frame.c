@@ -0,0 +1,120 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "types.h"
+
+#include <structmember.h>
+
+static void type_frame_dealloc(frame_object* self) {
+  Py_XDECREF(self->ring);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_frame_getbuffer(frame_object* self, Py_buffer* view, int flags) {
+  if (!self->ring->open) {
+    PyErr_SetString(PyExc_ValueError, "frame ring is closed");
+    view->obj = NULL;
+    return -1;
+  }
+
+  // Frames are read-only, as other consumers may be reading the same slot
+  if (PyBuffer_FillInfo(view, (PyObject*) self, (void*) self->view.data, (Py_ssize_t) self->view.info.len, 1,
+      flags) < 0) {
+    return -1;
+  }
+
+  ++self->ring->exports;
+  return 0;
+}
+
+static void type_frame_releasebuffer(frame_object* self, Py_buffer* view) {
+  --self->ring->exports;
+}
+
+static PyObject* type_frame_valid(frame_object* self) {
+  if (!self->ring->open) {
+    Py_RETURN_FALSE;
+  }
+
+  return PyBool_FromLong(frame_ring_validate(&self->view));
+}
+
+/** _core.Frame buffer procedures. */
+static PyBufferProcs type_frame_as_buffer = {
+  .bf_getbuffer = (getbufferproc) type_frame_getbuffer,
+  .bf_releasebuffer = (releasebufferproc) type_frame_releasebuffer,
+};
+
+/** _core.Frame members. */
+static PyMemberDef type_frame_members[] = {
+  {
+    .name = "number",
+    .type = T_ULONGLONG,
+    .offset = offsetof(frame_object, view.info.number),
+    .flags = READONLY,
+    .doc = "frame number",
+  },
+  {
+    .name = "timestamp",
+    .type = T_DOUBLE,
+    .offset = offsetof(frame_object, view.info.timestamp),
+    .flags = READONLY,
+    .doc = "capture time in seconds",
+  },
+  {
+    .name = "width",
+    .type = T_UINT,
+    .offset = offsetof(frame_object, view.info.width),
+    .flags = READONLY,
+    .doc = "image width",
+  },
+  {
+    .name = "height",
+    .type = T_UINT,
+    .offset = offsetof(frame_object, view.info.height),
+    .flags = READONLY,
+    .doc = "image height",
+  },
+  {
+    .name = "stride",
+    .type = T_UINT,
+    .offset = offsetof(frame_object, view.info.stride),
+    .flags = READONLY,
+    .doc = "bytes per row (zero if compressed)",
+  },
+  {
+    .name = "format",
+    .type = T_UINT,
+    .offset = offsetof(frame_object, view.info.format),
+    .flags = READONLY,
+    .doc = "pixel format (one of the FRAME_FORMAT_* constants)",
+  },
+  {NULL},
+};
+
+/** _core.Frame methods. */
+static PyMethodDef type_frame_methods[] = {
+  {
+    .ml_name = "valid",
+    .ml_meth = (PyCFunction) type_frame_valid,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Return whether the producer has yet to reuse the frame's slot",
+  },
+  {NULL},
+};
+
+/** _core.Frame type. */
+PyTypeObject type_frame = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.Frame",
+  .tp_basicsize = sizeof(frame_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_frame_dealloc,
+  .tp_as_buffer = &type_frame_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A frame sitting in a shared-memory frame ring. Its buffer is the frame data, without a copy.",
+  .tp_methods = type_frame_methods,
+  .tp_members = type_frame_members,
+};
@@ -0,0 +1,191 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "types.h"
+
+/**
+ * Detach a frame ring, if nothing still depends on the mapping.
+ *
+ * @param self The ring
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int type_frame_ring_close_native(frame_ring_object* self) {
+  if (!self->open) {
+    return 0;
+  }
+
+  if (self->exports > 0) {
+    PyErr_SetString(PyExc_BufferError, "cannot close frame ring while frame buffers are exported");
+    return 1;
+  }
+
+  if (self->waiting > 0) {
+    PyErr_SetString(PyExc_RuntimeError, "cannot close frame ring while waiting on it");
+    return 1;
+  }
+
+  frame_ring_detach(&self->ring);
+  self->open = 0;
+  return 0;
+}
+
+static void type_frame_ring_dealloc(frame_ring_object* self) {
+  // Frames hold a reference, so by now none are left
+  if (self->open) {
+    frame_ring_detach(&self->ring);
+    self->open = 0;
+  }
+
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_frame_ring_init(frame_ring_object* self, PyObject* args, PyObject* kwds) {
+  const char* name;
+
+  static char* kwlist[] = {"name", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name)) {
+    return -1;
+  }
+
+  if (self->open) {
+    PyErr_SetString(PyExc_RuntimeError, "frame ring already attached");
+    return -1;
+  }
+
+  if (frame_ring_attach(&self->ring, name)) {
+    PyErr_Format(PyExc_OSError, "failed to attach frame ring %s", name);
+    return -1;
+  }
+
+  self->open = 1;
+  self->next = 0;
+  self->dropped = 0;
+  return 0;
+}
+
+static PyObject* type_frame_ring_wait(frame_ring_object* self, PyObject* args, PyObject* kwds) {
+  PyObject* timeout_obj = Py_None;
+
+  static char* kwlist[] = {"timeout", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout_obj)) {
+    return NULL;
+  }
+
+  if (!self->open) {
+    PyErr_SetString(PyExc_ValueError, "frame ring is closed");
+    return NULL;
+  }
+
+  // None waits forever
+  double timeout = -1;
+  if (timeout_obj != Py_None) {
+    timeout = PyFloat_AsDouble(timeout_obj);
+    if (timeout == -1.0 && PyErr_Occurred()) {
+      return NULL;
+    }
+
+    if (timeout < 0) {
+      timeout = 0;
+    }
+  }
+
+  struct frame_view view;
+  enum frame_ring_wait_result result;
+
+  // Sleep on the futex without holding up other threads
+  ++self->waiting;
+  Py_BEGIN_ALLOW_THREADS
+  result = frame_ring_wait(&self->ring, self->next, timeout, &view);
+  Py_END_ALLOW_THREADS
+  --self->waiting;
+
+  switch (result) {
+    case frame_ring_wait_ok:
+      break;
+    case frame_ring_wait_timeout:
+      Py_RETURN_NONE;
+    case frame_ring_wait_closed:
+      PyErr_SetString(PyExc_EOFError, "frame ring producer has gone away");
+      return NULL;
+    default:
+      PyErr_SetString(PyExc_OSError, "failed to wait on frame ring");
+      return NULL;
+  }
+
+  // Count what we skipped to get to the newest frame
+  if (view.info.number > self->next) {
+    self->dropped += view.info.number - self->next;
+  }
+  self->next = view.info.number + 1;
+
+  frame_object* frame = (frame_object*) type_frame.tp_alloc(&type_frame, 0);
+  if (frame == NULL) {
+    return NULL;
+  }
+
+  Py_INCREF(self);
+  frame->ring = self;
+  frame->view = view;
+
+  return (PyObject*) frame;
+}
+
+static PyObject* type_frame_ring_close(frame_ring_object* self) {
+  if (type_frame_ring_close_native(self)) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_frame_ring_get_dropped(frame_ring_object* self, void* closure) {
+  return PyLong_FromUnsignedLongLong(self->dropped);
+}
+
+/** _core.FrameRing getters and setters. */
+static PyGetSetDef type_frame_ring_getset[] = {
+  {
+    .name = "dropped",
+    .get = (getter) type_frame_ring_get_dropped,
+    .set = NULL,
+    .doc = "frames skipped because newer ones were available",
+    .closure = NULL,
+  },
+  {NULL},
+};
+
+/** _core.FrameRing methods. */
+static PyMethodDef type_frame_ring_methods[] = {
+  {
+    .ml_name = "wait",
+    .ml_meth = (PyCFunction) type_frame_ring_wait,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Wait for the newest unseen frame, or return None on timeout",
+  },
+  {
+    .ml_name = "close",
+    .ml_meth = (PyCFunction) type_frame_ring_close,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Detach from the ring",
+  },
+  {NULL},
+};
+
+/** _core.FrameRing type. */
+PyTypeObject type_frame_ring = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.FrameRing",
+  .tp_basicsize = sizeof(frame_ring_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_frame_ring_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A consumer attached to a shared-memory frame ring by name.",
+  .tp_methods = type_frame_ring_methods,
+  .tp_getset = type_frame_ring_getset,
+  .tp_init = (initproc) type_frame_ring_init,
+  .tp_new = PyType_GenericNew,
+};
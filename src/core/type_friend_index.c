@@ -0,0 +1,998 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "types.h"
+
+#include <structmember.h>
+
+/** The most matches a search may ask for. */
+#define FRIEND_INDEX_MAX_K 1024
+
+/**
+ * Release everything an index holds.
+ *
+ * @param self The index
+ */
+static void type_friend_index_release(friend_index_object* self) {
+  if (self->ready) {
+    friend_index_destroy(&self->idx);
+    self->ready = 0;
+  }
+
+  if (self->persistent) {
+    // A log with nothing left unfolded is not worth keeping
+    int empty = friend_wal_end(&self->wal) == friend_wal_start();
+
+    friend_wal_close(&self->wal, empty);
+    friend_snapshot_close(&self->snapshot);
+    self->persistent = 0;
+  }
+
+  memory_free(self->snapshot_path);
+  self->snapshot_path = NULL;
+  self->watermark = 0;
+}
+
+static void type_friend_index_dealloc(friend_index_object* self) {
+  type_friend_index_release(self);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+/**
+ * Open the snapshot and write-ahead log of an index and replay the log.
+ *
+ * Logs left behind by processes that died are folded into the snapshot first.
+ *
+ * @param self The index (float, initialized)
+ * @param snapshot The snapshot path
+ * @param wal The log path
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int type_friend_index_open(friend_index_object* self, const char* snapshot, const char* wal) {
+  self->snapshot_path = memory_strdup(memory_tag_friends, snapshot);
+  if (self->snapshot_path == NULL) {
+    PyErr_NoMemory();
+    return 1;
+  }
+
+  if (friend_snapshot_recover(snapshot, (size_t) self->dim)) {
+    PyErr_Format(PyExc_OSError, "failed to recover friend logs of %s", snapshot);
+    return 1;
+  }
+
+  if (friend_snapshot_open(&self->snapshot, snapshot, (size_t) self->dim)) {
+    PyErr_Format(PyExc_OSError, "failed to open friend snapshot %s", snapshot);
+    return 1;
+  }
+
+  if (friend_wal_open(&self->wal, wal, (size_t) self->dim)) {
+    friend_snapshot_close(&self->snapshot);
+    PyErr_Format(PyExc_OSError, "failed to open friend log %s", wal);
+    return 1;
+  }
+
+  self->persistent = 1;
+
+  // Anything left in the log (e.g. from a crash) is applied over the snapshot
+  self->folded = friend_wal_start();
+  self->watermark = self->snapshot.watermark;
+  if (friend_index_attach(&self->idx, self->snapshot.vectors, self->snapshot.ids, self->snapshot.rows)
+      || friend_wal_replay(&self->wal, self->folded, friend_wal_end(&self->wal), &self->idx, &self->watermark)) {
+    PyErr_SetString(PyExc_OSError, "failed to load friend snapshot");
+    return 1;
+  }
+
+  return 0;
+}
+
+static int type_friend_index_init(friend_index_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"dim", "mode", "subquantizers", "rerank_file", "rerank", "snapshot", "wal", NULL};
+
+  Py_ssize_t dim;
+  const char* mode = "float";
+  Py_ssize_t subquantizers = 16;
+  const char* rerank_file = NULL;
+  Py_ssize_t rerank = 32;
+  const char* snapshot = NULL;
+  const char* wal = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|snznzz", kwlist, &dim, &mode, &subquantizers, &rerank_file,
+      &rerank, &snapshot, &wal)) {
+    return -1;
+  }
+
+  if (dim <= 0) {
+    PyErr_SetString(PyExc_ValueError, "dimension must be positive");
+    return -1;
+  }
+
+  struct friend_index_options options = {
+    .rerank_path = rerank_file,
+  };
+
+  if (strcmp(mode, "float") == 0) {
+    options.mode = friend_index_mode_float;
+  } else if (strcmp(mode, "sq8") == 0) {
+    options.mode = friend_index_mode_sq8;
+  } else if (strcmp(mode, "pq") == 0) {
+    options.mode = friend_index_mode_pq;
+  } else {
+    PyErr_Format(PyExc_ValueError, "unknown mode %s (expected float, sq8 or pq)", mode);
+    return -1;
+  }
+
+  if (options.mode == friend_index_mode_pq && (subquantizers <= 0 || dim % subquantizers != 0)) {
+    PyErr_SetString(PyExc_ValueError, "subquantizers must divide the dimension");
+    return -1;
+  }
+
+  if (rerank < 1 || rerank > FRIEND_INDEX_MAX_K) {
+    PyErr_Format(PyExc_ValueError, "rerank must be between 1 and %d", FRIEND_INDEX_MAX_K);
+    return -1;
+  }
+
+  options.subquantizers = (size_t) subquantizers;
+  options.rerank = (size_t) rerank;
+
+  // Snapshots hold full-precision embeddings searched in place
+  if (snapshot && options.mode != friend_index_mode_float) {
+    PyErr_SetString(PyExc_ValueError, "snapshots need float mode");
+    return -1;
+  }
+
+  if (self->busy || self->compacting || __atomic_load_n(&self->searches, __ATOMIC_ACQUIRE)) {
+    PyErr_SetString(PyExc_RuntimeError, "friend index is in use by another thread");
+    return -1;
+  }
+
+  type_friend_index_release(self);
+
+  if (friend_index_init(&self->idx, (size_t) dim, &options)) {
+    PyErr_SetString(PyExc_OSError, "failed to initialize friend index");
+    friend_index_destroy(&self->idx);
+    return -1;
+  }
+
+  self->dim = dim;
+  self->ready = 1;
+
+  if (snapshot) {
+    // Each process logs to its own file unless told otherwise
+    char default_wal[4096];
+    if (wal == NULL) {
+      snprintf(default_wal, sizeof(default_wal), "%s.%d.wal", snapshot, (int) getpid());
+      wal = default_wal;
+    }
+
+    if (type_friend_index_open(self, snapshot, wal)) {
+      type_friend_index_release(self);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Check that an index can be searched.
+ *
+ * @param self The index
+ * @return Zero if so, otherwise nonzero with an exception set
+ */
+static int type_friend_index_check_search(friend_index_object* self) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "friend index not initialized");
+    return 1;
+  }
+
+  // Training drops the GIL, so another thread could get in
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "friend index is in use by another thread");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Check that an index can take a call that changes it.
+ *
+ * @param self The index
+ * @return Zero if so, otherwise nonzero with an exception set
+ */
+static int type_friend_index_check(friend_index_object* self) {
+  if (type_friend_index_check_search(self)) {
+    return 1;
+  }
+
+  // Any number of searches can share the index, but nothing may change under them
+  if (__atomic_load_n(&self->searches, __ATOMIC_ACQUIRE)) {
+    PyErr_SetString(PyExc_RuntimeError, "friend index is being searched by another thread");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * View a buffer as rows of float32 embeddings.
+ *
+ * Float arrays (e.g. NumPy float32) and raw bytes (e.g. an embedding column
+ * fetched from SQL) are both accepted.
+ *
+ * @param self The index
+ * @param obj The buffer object
+ * @param view The view
+ * @param rows The number of rows
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int get_vectors(friend_index_object* self, PyObject* obj, Py_buffer* view, size_t* rows) {
+  if (PyObject_GetBuffer(obj, view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+    return 1;
+  }
+
+  const char* format = view->format ? view->format : "B";
+  if (*format == '<' || *format == '@' || *format == '=') {
+    ++format;
+  }
+
+  if (strcmp(format, "f") != 0 && strcmp(format, "B") != 0 && strcmp(format, "b") != 0) {
+    PyErr_Format(PyExc_TypeError, "embeddings must be float32 or raw bytes, not format %s", view->format);
+    PyBuffer_Release(view);
+    return 1;
+  }
+
+  size_t row_size = (size_t) self->dim * sizeof(float);
+  if (view->len == 0 || (size_t) view->len % row_size != 0) {
+    PyErr_Format(PyExc_ValueError, "expected a whole number of %zd-float embeddings, got %zd bytes", self->dim,
+      view->len);
+    PyBuffer_Release(view);
+    return 1;
+  }
+
+  *rows = (size_t) view->len / row_size;
+  return 0;
+}
+
+static PyObject* type_friend_index_append(friend_index_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"friend_id", "embedding", NULL};
+
+  int friend_id;
+  PyObject* embedding;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iO", kwlist, &friend_id, &embedding)) {
+    return NULL;
+  }
+
+  if (type_friend_index_check(self)) {
+    return NULL;
+  }
+
+  if (friend_id < 0) {
+    PyErr_SetString(PyExc_ValueError, "friend id must not be negative");
+    return NULL;
+  }
+
+  Py_buffer view;
+  size_t rows;
+  if (get_vectors(self, embedding, &view, &rows)) {
+    return NULL;
+  }
+
+  if (rows != 1) {
+    PyErr_SetString(PyExc_ValueError, "expected one embedding");
+    PyBuffer_Release(&view);
+    return NULL;
+  }
+
+  // The buffer may not be aligned for floats (e.g. a slice of bytes)
+  float* vector = memory_alloc(memory_tag_friends, (size_t) view.len);
+  if (vector == NULL) {
+    PyBuffer_Release(&view);
+    return PyErr_NoMemory();
+  }
+
+  memcpy(vector, view.buf, (size_t) view.len);
+  PyBuffer_Release(&view);
+
+  // Log first, so nothing reaches the index that a crash would lose
+  if (self->persistent && friend_wal_add(&self->wal, friend_id, vector)) {
+    memory_free(vector);
+    PyErr_SetString(PyExc_OSError, "failed to log embedding");
+    return NULL;
+  }
+
+  int failed = friend_index_append(&self->idx, friend_id, vector);
+  memory_free(vector);
+
+  if (failed) {
+    PyErr_SetString(PyExc_ValueError, "failed to append embedding (zero vector, untrained, out of memory, or "
+      "re-ranking file write failed)");
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_friend_index_train(friend_index_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"samples", NULL};
+
+  PyObject* samples;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &samples)) {
+    return NULL;
+  }
+
+  if (type_friend_index_check(self)) {
+    return NULL;
+  }
+
+  // Codes already stored would not match a new codebook
+  if (self->idx.len > 0) {
+    PyErr_SetString(PyExc_RuntimeError, "friend index must be trained before anything is appended");
+    return NULL;
+  }
+
+  Py_buffer view;
+  size_t rows;
+  if (get_vectors(self, samples, &view, &rows)) {
+    return NULL;
+  }
+
+  float* vectors = memory_alloc(memory_tag_friends, (size_t) view.len);
+  if (vectors == NULL) {
+    PyBuffer_Release(&view);
+    return PyErr_NoMemory();
+  }
+
+  memcpy(vectors, view.buf, (size_t) view.len);
+  PyBuffer_Release(&view);
+
+  // k-means over every sample takes a while
+  self->busy = 1;
+
+  int failed;
+  Py_BEGIN_ALLOW_THREADS
+  failed = friend_index_train(&self->idx, vectors, rows);
+  Py_END_ALLOW_THREADS
+
+  self->busy = 0;
+  memory_free(vectors);
+
+  if (failed) {
+    PyErr_SetString(PyExc_ValueError, "failed to train friend index (no usable samples or out of memory)");
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_friend_index_remove(friend_index_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"friend_id", NULL};
+
+  int friend_id;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "i", kwlist, &friend_id)) {
+    return NULL;
+  }
+
+  if (type_friend_index_check(self)) {
+    return NULL;
+  }
+
+  if (friend_id < 0) {
+    return PyLong_FromLong(0);
+  }
+
+  if (self->persistent && friend_wal_remove(&self->wal, friend_id)) {
+    PyErr_SetString(PyExc_OSError, "failed to log removal");
+    return NULL;
+  }
+
+  return PyLong_FromSize_t(friend_index_remove(&self->idx, friend_id));
+}
+
+static PyObject* type_friend_index_set_watermark(friend_index_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"watermark", NULL};
+
+  unsigned long long watermark;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "K", kwlist, &watermark)) {
+    return NULL;
+  }
+
+  if (type_friend_index_check(self)) {
+    return NULL;
+  }
+
+  // The watermark only moves forward
+  if (watermark <= self->watermark) {
+    Py_RETURN_NONE;
+  }
+
+  // Logged after the changes it covers, so a snapshot never claims changes it lacks
+  if (self->persistent && friend_wal_watermark(&self->wal, watermark)) {
+    PyErr_SetString(PyExc_OSError, "failed to log watermark");
+    return NULL;
+  }
+
+  self->watermark = watermark;
+  Py_RETURN_NONE;
+}
+
+/**
+ * Copy a search query out of its buffer, so the search can run without the GIL.
+ *
+ * @param self The index
+ * @param query The query embedding
+ * @param k The most matches
+ * @param [out] vector The query copy (free when done)
+ * @param [out] matches Room for k matches (free when done)
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int prepare_search(friend_index_object* self, PyObject* query, Py_ssize_t k, float** vector,
+    struct friend_match** matches) {
+  if (k < 1 || k > FRIEND_INDEX_MAX_K) {
+    PyErr_Format(PyExc_ValueError, "k must be between 1 and %d", FRIEND_INDEX_MAX_K);
+    return 1;
+  }
+
+  Py_buffer view;
+  size_t rows;
+  if (get_vectors(self, query, &view, &rows)) {
+    return 1;
+  }
+
+  if (rows != 1) {
+    PyErr_SetString(PyExc_ValueError, "expected one query embedding");
+    PyBuffer_Release(&view);
+    return 1;
+  }
+
+  *vector = memory_alloc(memory_tag_friends, (size_t) view.len);
+  *matches = memory_alloc(memory_tag_friends, (size_t) k * sizeof(**matches));
+  if (*vector == NULL || *matches == NULL) {
+    memory_free(*vector);
+    memory_free(*matches);
+    PyBuffer_Release(&view);
+    PyErr_NoMemory();
+    return 1;
+  }
+
+  memcpy(*vector, view.buf, (size_t) view.len);
+  PyBuffer_Release(&view);
+  return 0;
+}
+
+/**
+ * Convert search matches to a list of (friend_id, similarity) tuples.
+ *
+ * @param matches The matches
+ * @param found The number of matches
+ * @return A new reference, or NULL with an exception set
+ */
+static PyObject* matches_to_list(const struct friend_match* matches, size_t found) {
+  PyObject* result = PyList_New((Py_ssize_t) found);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < found; ++i) {
+    PyObject* match = Py_BuildValue("(id)", matches[i].friend_id, (double) matches[i].similarity);
+    if (match == NULL) {
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(result, (Py_ssize_t) i, match);
+  }
+
+  return result;
+}
+
+static PyObject* type_friend_index_search(friend_index_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"query", "k", NULL};
+
+  PyObject* query;
+  Py_ssize_t k = 1;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist, &query, &k)) {
+    return NULL;
+  }
+
+  if (type_friend_index_check_search(self)) {
+    return NULL;
+  }
+
+  float* vector;
+  struct friend_match* matches;
+  if (prepare_search(self, query, k, &vector, &matches)) {
+    return NULL;
+  }
+
+  // Scanning the whole index can take a while, so let other threads run
+  __atomic_add_fetch(&self->searches, 1, __ATOMIC_ACQ_REL);
+
+  size_t found;
+  Py_BEGIN_ALLOW_THREADS
+  found = friend_index_search(&self->idx, vector, (size_t) k, matches);
+  Py_END_ALLOW_THREADS
+
+  __atomic_sub_fetch(&self->searches, 1, __ATOMIC_ACQ_REL);
+  memory_free(vector);
+
+  PyObject* result = matches_to_list(matches, found);
+  memory_free(matches);
+  return result;
+}
+
+/** A search run on a scheduler. */
+struct search_op {
+  /** The op (first). */
+  struct scheduler_op op;
+
+  /** The index (strong reference). */
+  friend_index_object* index;
+
+  /** The query. */
+  float* vector;
+
+  /** The most matches. */
+  size_t k;
+
+  /** The matches. */
+  struct friend_match* matches;
+
+  /** The number of matches found. */
+  size_t found;
+
+  /** Nonzero once a worker has run the search. */
+  int ran;
+};
+
+/**
+ * Run a search on a worker.
+ *
+ * @param task The task
+ */
+static void search_op_run(struct scheduler_task* task) {
+  struct search_op* op = (struct search_op*) scheduler_op_of(task);
+
+  op->found = friend_index_search(&op->index->idx, op->vector, op->k, op->matches);
+  op->ran = 1;
+
+  // The index may change again from here
+  __atomic_sub_fetch(&op->index->searches, 1, __ATOMIC_ACQ_REL);
+
+  scheduler_op_done(&op->op);
+}
+
+/**
+ * Resolve a finished search.
+ *
+ * @param c The completion
+ * @return A list of (friend_id, similarity) tuples, or NULL with an exception set
+ */
+static PyObject* search_op_resolve(struct completion* c) {
+  struct search_op* op = (struct search_op*) c;
+  return matches_to_list(op->matches, op->found);
+}
+
+/**
+ * Destroy a search.
+ *
+ * @param c The completion
+ */
+static void search_op_destroy(struct completion* c) {
+  struct search_op* op = (struct search_op*) c;
+
+  // Never ran (the scheduler refused it)
+  if (!op->ran) {
+    __atomic_sub_fetch(&op->index->searches, 1, __ATOMIC_ACQ_REL);
+  }
+
+  Py_DECREF(op->index);
+  memory_free(op->vector);
+  memory_free(op->matches);
+  memory_free(op);
+}
+
+static PyObject* type_friend_index_search_async(friend_index_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"scheduler", "query", "k", "priority", NULL};
+
+  scheduler_object* scheduler;
+  PyObject* query;
+  Py_ssize_t k = 1;
+  PyObject* priority = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O|nO", kwlist, &type_scheduler, &scheduler, &query, &k,
+      &priority)) {
+    return NULL;
+  }
+
+  if (type_friend_index_check_search(self)) {
+    return NULL;
+  }
+
+  struct search_op* op = memory_calloc(memory_tag_friends, 1, sizeof *op);
+  if (op == NULL) {
+    return PyErr_NoMemory();
+  }
+
+  if (prepare_search(self, query, k, &op->vector, &op->matches)) {
+    memory_free(op);
+    return NULL;
+  }
+
+  // Counted from now, so nothing changes the index before the worker gets to it
+  __atomic_add_fetch(&self->searches, 1, __ATOMIC_ACQ_REL);
+
+  Py_INCREF(self);
+  op->index = self;
+  op->k = (size_t) k;
+  op->op.base.resolve = &search_op_resolve;
+  op->op.base.destroy = &search_op_destroy;
+  op->op.task.run = &search_op_run;
+
+  return scheduler_object_submit(scheduler, &op->op, priority, "search");
+}
+
+static PyObject* type_friend_index_template(friend_index_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"samples", "min_agreement", NULL};
+
+  PyObject* samples;
+  float min_agreement = 0.7f;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|f", kwlist, &samples, &min_agreement)) {
+    return NULL;
+  }
+
+  if (type_friend_index_check_search(self)) {
+    return NULL;
+  }
+
+  Py_buffer view;
+  size_t rows;
+  if (get_vectors(self, samples, &view, &rows)) {
+    return NULL;
+  }
+
+  float* vectors = memory_alloc(memory_tag_friends, (size_t) view.len);
+  if (vectors == NULL) {
+    PyBuffer_Release(&view);
+    return PyErr_NoMemory();
+  }
+
+  memcpy(vectors, view.buf, (size_t) view.len);
+  PyBuffer_Release(&view);
+
+  PyObject* out = PyBytes_FromStringAndSize(NULL, self->dim * (Py_ssize_t) sizeof(float));
+  if (out == NULL) {
+    memory_free(vectors);
+    return NULL;
+  }
+
+  size_t kept = friend_template(vectors, rows, (size_t) self->dim, min_agreement, (float*) PyBytes_AS_STRING(out));
+  memory_free(vectors);
+
+  // The samples did not agree on one face
+  if (kept == 0) {
+    Py_DECREF(out);
+    Py_RETURN_NONE;
+  }
+
+  return out;
+}
+
+static Py_ssize_t type_friend_index_len(friend_index_object* self) {
+  return (Py_ssize_t) self->idx.live;
+}
+
+/**
+ * Move an index onto the newest snapshot on disk.
+ *
+ * The log records not yet folded into a snapshot are replayed over it, and
+ * the folded ones are dropped from the log. The GIL is held throughout, and
+ * the replay only covers recent changes.
+ *
+ * @param self The index (persistent, not busy)
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int type_friend_index_rebase(friend_index_object* self) {
+  struct friend_snapshot snapshot;
+  if (friend_snapshot_open(&snapshot, self->snapshot_path, (size_t) self->dim)) {
+    PyErr_Format(PyExc_OSError, "failed to open friend snapshot %s", self->snapshot_path);
+    return 1;
+  }
+
+  struct friend_index idx;
+  friend_index_init(&idx, (size_t) self->dim, NULL);
+
+  uint64_t watermark = snapshot.watermark;
+  if (friend_index_attach(&idx, snapshot.vectors, snapshot.ids, snapshot.rows)
+      || friend_wal_replay(&self->wal, self->folded, friend_wal_end(&self->wal), &idx, &watermark)) {
+    friend_index_destroy(&idx);
+    friend_snapshot_close(&snapshot);
+    PyErr_SetString(PyExc_OSError, "failed to load friend snapshot");
+    return 1;
+  }
+
+  // The old mapping stays valid for other processes; this one just lets go of it
+  friend_index_destroy(&self->idx);
+  friend_snapshot_close(&self->snapshot);
+  self->idx = idx;
+  self->snapshot = snapshot;
+
+  if (watermark > self->watermark) {
+    self->watermark = watermark;
+  }
+
+  // If this fails the log keeps the folded records, and they are skipped again next time
+  if (self->folded > friend_wal_start() && friend_wal_discard(&self->wal, self->folded) == 0) {
+    self->folded = friend_wal_start();
+  }
+
+  return 0;
+}
+
+/**
+ * Check that an index can be compacted or refreshed.
+ *
+ * @param self The index
+ * @return Zero if so, otherwise nonzero with an exception set
+ */
+static int type_friend_index_check_persistent(friend_index_object* self) {
+  if (type_friend_index_check(self)) {
+    return 1;
+  }
+
+  if (!self->persistent) {
+    PyErr_SetString(PyExc_ValueError, "friend index has no snapshot");
+    return 1;
+  }
+
+  if (self->compacting) {
+    PyErr_SetString(PyExc_RuntimeError, "friend index is already compacting");
+    return 1;
+  }
+
+  return 0;
+}
+
+static PyObject* type_friend_index_compact(friend_index_object* self, PyObject* args) {
+  if (type_friend_index_check_persistent(self)) {
+    return NULL;
+  }
+
+  off_t to = friend_wal_end(&self->wal);
+  if (to < 0) {
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+
+  // Only files are touched, so searches and appends carry on meanwhile
+  self->compacting = 1;
+
+  int failed;
+  uint64_t generation = 0;
+  Py_BEGIN_ALLOW_THREADS
+  failed = friend_snapshot_compact(self->snapshot_path, &self->wal, to, &generation);
+  Py_END_ALLOW_THREADS
+
+  self->compacting = 0;
+
+  if (failed) {
+    PyErr_Format(PyExc_OSError, "failed to compact friend snapshot %s", self->snapshot_path);
+    return NULL;
+  }
+
+  self->folded = to;
+
+  // A search still running elsewhere holds the old mapping, so leave the swap to the next refresh
+  if (!self->busy && !__atomic_load_n(&self->searches, __ATOMIC_ACQUIRE) && type_friend_index_rebase(self)) {
+    return NULL;
+  }
+
+  return PyLong_FromUnsignedLongLong(generation);
+}
+
+static PyObject* type_friend_index_refresh(friend_index_object* self, PyObject* args) {
+  if (type_friend_index_check_persistent(self)) {
+    return NULL;
+  }
+
+  uint64_t generation;
+  if (friend_snapshot_peek(self->snapshot_path, &generation)) {
+    PyErr_Format(PyExc_OSError, "failed to read friend snapshot %s", self->snapshot_path);
+    return NULL;
+  }
+
+  if (generation == self->snapshot.generation && self->folded == friend_wal_start()) {
+    Py_RETURN_FALSE;
+  }
+
+  if (type_friend_index_rebase(self)) {
+    return NULL;
+  }
+
+  Py_RETURN_TRUE;
+}
+
+static PyObject* type_friend_index_get_generation(friend_index_object* self, void* closure) {
+  return PyLong_FromUnsignedLongLong(self->persistent ? self->snapshot.generation : 0);
+}
+
+static PyObject* type_friend_index_get_watermark(friend_index_object* self, void* closure) {
+  return PyLong_FromUnsignedLongLong(self->watermark);
+}
+
+static PyObject* type_friend_index_get_pending(friend_index_object* self, void* closure) {
+  if (!self->persistent) {
+    return PyLong_FromLong(0);
+  }
+
+  off_t end = friend_wal_end(&self->wal);
+  return PyLong_FromLongLong(end > self->folded ? (long long) (end - self->folded) : 0);
+}
+
+static PyObject* type_friend_index_get_searches(friend_index_object* self, void* closure) {
+  return PyLong_FromLong(__atomic_load_n(&self->searches, __ATOMIC_ACQUIRE));
+}
+
+static PyObject* type_friend_index_get_memory(friend_index_object* self, void* closure) {
+  if (!self->ready) {
+    return PyLong_FromLong(0);
+  }
+
+  return PyLong_FromSize_t(friend_index_memory(&self->idx));
+}
+
+static PyObject* type_friend_index_get_kernels(friend_index_object* self, void* closure) {
+  return PyUnicode_FromString(friend_index_kernels());
+}
+
+/** _core.FriendIndex methods. */
+static PyMethodDef type_friend_index_methods[] = {
+  {
+    .ml_name = "append",
+    .ml_meth = (PyCFunction) type_friend_index_append,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Add an embedding for a friend (constant time, nothing is rebuilt)",
+  },
+  {
+    .ml_name = "train",
+    .ml_meth = (PyCFunction) type_friend_index_train,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Train the product quantizer on sample embeddings (pq mode, before the first append)",
+  },
+  {
+    .ml_name = "remove",
+    .ml_meth = (PyCFunction) type_friend_index_remove,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Remove every embedding of a friend, returning how many there were",
+  },
+  {
+    .ml_name = "search",
+    .ml_meth = (PyCFunction) type_friend_index_search,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Find the k most similar embeddings as a list of (friend_id, similarity), best first",
+  },
+  {
+    .ml_name = "search_async",
+    .ml_meth = (PyCFunction) type_friend_index_search_async,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Queue a search on a scheduler and return its completion ticket",
+  },
+  {
+    .ml_name = "compact",
+    .ml_meth = (PyCFunction) type_friend_index_compact,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Fold logged changes into a new snapshot generation and switch to it, returning the generation",
+  },
+  {
+    .ml_name = "refresh",
+    .ml_meth = (PyCFunction) type_friend_index_refresh,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Switch to a newer snapshot if another process published one, returning whether anything changed",
+  },
+  {
+    .ml_name = "set_watermark",
+    .ml_meth = (PyCFunction) type_friend_index_set_watermark,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Record that the index holds every database change up to a friend_changes sequence number",
+  },
+  {
+    .ml_name = "template",
+    .ml_meth = (PyCFunction) type_friend_index_template,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Average several embeddings of one face into a template (bytes), or None if they disagree",
+  },
+  {NULL},
+};
+
+/** _core.FriendIndex members. */
+static PyMemberDef type_friend_index_members[] = {
+  {
+    .name = "dim",
+    .type = T_PYSSIZET,
+    .offset = offsetof(friend_index_object, dim),
+    .flags = READONLY,
+    .doc = "embedding dimension",
+  },
+  {NULL},
+};
+
+/** _core.FriendIndex getters and setters. */
+static PyGetSetDef type_friend_index_getset[] = {
+  {
+    .name = "memory",
+    .get = (getter) type_friend_index_get_memory,
+    .set = NULL,
+    .doc = "bytes held by embeddings, IDs and codebook",
+    .closure = NULL,
+  },
+  {
+    .name = "kernels",
+    .get = (getter) type_friend_index_get_kernels,
+    .set = NULL,
+    .doc = "the search kernels in use (avx2 or scalar)",
+    .closure = NULL,
+  },
+  {
+    .name = "generation",
+    .get = (getter) type_friend_index_get_generation,
+    .set = NULL,
+    .doc = "the snapshot generation in use (zero without a snapshot)",
+    .closure = NULL,
+  },
+  {
+    .name = "watermark",
+    .get = (getter) type_friend_index_get_watermark,
+    .set = NULL,
+    .doc = "the last database change (friend_changes sequence number) the index holds",
+    .closure = NULL,
+  },
+  {
+    .name = "pending",
+    .get = (getter) type_friend_index_get_pending,
+    .set = NULL,
+    .doc = "bytes of logged changes not yet in a snapshot on disk",
+    .closure = NULL,
+  },
+  {
+    .name = "searches",
+    .get = (getter) type_friend_index_get_searches,
+    .set = NULL,
+    .doc = "searches in flight on workers (the index can't change until they finish)",
+    .closure = NULL,
+  },
+  {NULL},
+};
+
+/** _core.FriendIndex sequence methods. */
+static PySequenceMethods type_friend_index_as_sequence = {
+  .sq_length = (lenfunc) type_friend_index_len,
+};
+
+/** _core.FriendIndex type. */
+PyTypeObject type_friend_index = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.FriendIndex",
+  .tp_basicsize = sizeof(friend_index_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_friend_index_dealloc,
+  .tp_as_sequence = &type_friend_index_as_sequence,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "An in-memory friend embedding index (float, int8 or product quantized) with brute-force cosine search.",
+  .tp_methods = type_friend_index_methods,
+  .tp_members = type_friend_index_members,
+  .tp_getset = type_friend_index_getset,
+  .tp_init = (initproc) type_friend_index_init,
+  .tp_new = PyType_GenericNew,
+};
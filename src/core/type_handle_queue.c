@@ -0,0 +1,466 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdlib.h>
+
+#include "types.h"
+
+static void type_handle_queue_dealloc(handle_queue_object* self) {
+  if (self->queue) {
+    handle_queue_destroy(self->queue);
+    memory_free(self->queue);
+    self->queue = NULL;
+  }
+
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_handle_queue_init(handle_queue_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"capacity", NULL};
+
+  Py_ssize_t capacity;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &capacity)) {
+    return -1;
+  }
+
+  if (self->queue) {
+    PyErr_SetString(PyExc_RuntimeError, "handle queue already initialized");
+    return -1;
+  }
+
+  if (capacity < 1 || capacity > HANDLE_QUEUE_MAX_CAPACITY) {
+    PyErr_Format(PyExc_ValueError, "capacity must be between 1 and %u", HANDLE_QUEUE_MAX_CAPACITY);
+    return -1;
+  }
+
+  struct handle_queue* queue;
+  if (memory_aligned_alloc(memory_tag_handles, (void**) &queue, HANDLE_QUEUE_CACHE_LINE, sizeof(*queue))) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  if (handle_queue_init(queue, (size_t) capacity)) {
+    memory_free(queue);
+    PyErr_SetFromErrno(PyExc_OSError);
+    return -1;
+  }
+
+  self->queue = queue;
+  return 0;
+}
+
+/**
+ * Check that a queue is initialized.
+ *
+ * @param self The queue
+ * @return Zero if so, otherwise nonzero with an exception set
+ */
+static int type_handle_queue_check(handle_queue_object* self) {
+  if (self->queue == NULL) {
+    PyErr_SetString(PyExc_ValueError, "handle queue not initialized");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Convert a timeout argument.
+ *
+ * @param obj The timeout (None waits forever, zero never waits)
+ * @param timeout The timeout, in seconds (negative to wait forever)
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int get_timeout(PyObject* obj, double* timeout) {
+  *timeout = -1;
+
+  if (obj == Py_None) {
+    return 0;
+  }
+
+  *timeout = PyFloat_AsDouble(obj);
+  if (*timeout == -1.0 && PyErr_Occurred()) {
+    return 1;
+  }
+
+  if (*timeout < 0) {
+    *timeout = 0;
+  }
+
+  return 0;
+}
+
+/**
+ * Push handles, sleeping without the GIL only when the call may block.
+ *
+ * @param self The queue
+ * @param handles The handles
+ * @param n The number of handles
+ * @param timeout The timeout, in seconds (negative to wait forever)
+ * @param pushed The number pushed
+ * @return The outcome
+ */
+static enum handle_queue_result push(handle_queue_object* self, const uint64_t* handles, size_t n, double timeout,
+    size_t* pushed) {
+  // Try first, which usually succeeds and keeps the GIL
+  *pushed = handle_queue_try_push(self->queue, handles, n);
+  if (*pushed == n) {
+    return handle_queue_ok;
+  }
+
+  if (self->queue->closed) {
+    return handle_queue_closed;
+  }
+
+  if (timeout == 0) {
+    return handle_queue_timeout;
+  }
+
+  size_t more;
+  enum handle_queue_result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = handle_queue_push(self->queue, handles + *pushed, n - *pushed, timeout, &more);
+  Py_END_ALLOW_THREADS
+
+  *pushed += more;
+  return result;
+}
+
+static PyObject* type_handle_queue_push(handle_queue_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"handle", "timeout", NULL};
+
+  unsigned long long handle;
+  PyObject* timeout_obj = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "K|O", kwlist, &handle, &timeout_obj)) {
+    return NULL;
+  }
+
+  double timeout;
+  if (type_handle_queue_check(self) || get_timeout(timeout_obj, &timeout)) {
+    return NULL;
+  }
+
+  uint64_t value = handle;
+  size_t pushed;
+  switch (push(self, &value, 1, timeout, &pushed)) {
+    case handle_queue_ok:
+      Py_RETURN_TRUE;
+    case handle_queue_timeout:
+      Py_RETURN_FALSE;
+    default:
+      PyErr_SetString(PyExc_EOFError, "handle queue is closed");
+      return NULL;
+  }
+}
+
+static PyObject* type_handle_queue_push_many(handle_queue_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"handles", "timeout", NULL};
+
+  PyObject* handles_obj;
+  PyObject* timeout_obj = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &handles_obj, &timeout_obj)) {
+    return NULL;
+  }
+
+  double timeout;
+  if (type_handle_queue_check(self) || get_timeout(timeout_obj, &timeout)) {
+    return NULL;
+  }
+
+  PyObject* seq = PySequence_Fast(handles_obj, "handles must be a sequence of integers");
+  if (seq == NULL) {
+    return NULL;
+  }
+
+  Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+  uint64_t* handles = memory_alloc(memory_tag_handles, (size_t) (n ? n : 1) * sizeof(*handles));
+  if (handles == NULL) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+
+  for (Py_ssize_t i = 0; i < n; ++i) {
+    handles[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+    if (handles[i] == (uint64_t) -1 && PyErr_Occurred()) {
+      memory_free(handles);
+      Py_DECREF(seq);
+      return NULL;
+    }
+  }
+
+  Py_DECREF(seq);
+
+  size_t pushed;
+  enum handle_queue_result result = push(self, handles, (size_t) n, timeout, &pushed);
+  memory_free(handles);
+
+  // Closing part way through still reports what got in
+  if (result == handle_queue_closed && pushed == 0) {
+    PyErr_SetString(PyExc_EOFError, "handle queue is closed");
+    return NULL;
+  }
+
+  return PyLong_FromSize_t(pushed);
+}
+
+/**
+ * Pop handles, sleeping without the GIL only when the call may block.
+ *
+ * @param self The queue
+ * @param handles The handles
+ * @param n The most handles to pop
+ * @param timeout The timeout, in seconds (negative to wait forever)
+ * @param popped The number popped
+ * @return The outcome
+ */
+static enum handle_queue_result pop(handle_queue_object* self, uint64_t* handles, size_t n, double timeout,
+    size_t* popped) {
+  *popped = handle_queue_try_pop(self->queue, handles, n);
+  if (*popped > 0) {
+    return handle_queue_ok;
+  }
+
+  if (timeout == 0) {
+    // The blocking pop sorts out closed from merely empty
+    return handle_queue_pop(self->queue, handles, n, 0, popped);
+  }
+
+  enum handle_queue_result result;
+  Py_BEGIN_ALLOW_THREADS
+  result = handle_queue_pop(self->queue, handles, n, timeout, popped);
+  Py_END_ALLOW_THREADS
+
+  return result;
+}
+
+static PyObject* type_handle_queue_pop(handle_queue_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"timeout", NULL};
+
+  PyObject* timeout_obj = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout_obj)) {
+    return NULL;
+  }
+
+  double timeout;
+  if (type_handle_queue_check(self) || get_timeout(timeout_obj, &timeout)) {
+    return NULL;
+  }
+
+  uint64_t handle;
+  size_t popped;
+  switch (pop(self, &handle, 1, timeout, &popped)) {
+    case handle_queue_ok:
+      return PyLong_FromUnsignedLongLong(handle);
+    case handle_queue_timeout:
+      Py_RETURN_NONE;
+    default:
+      PyErr_SetString(PyExc_EOFError, "handle queue is closed");
+      return NULL;
+  }
+}
+
+static PyObject* type_handle_queue_pop_many(handle_queue_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"max", "timeout", NULL};
+
+  Py_ssize_t max = 64;
+  PyObject* timeout_obj = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nO", kwlist, &max, &timeout_obj)) {
+    return NULL;
+  }
+
+  double timeout;
+  if (type_handle_queue_check(self) || get_timeout(timeout_obj, &timeout)) {
+    return NULL;
+  }
+
+  if (max < 1) {
+    PyErr_SetString(PyExc_ValueError, "max must be positive");
+    return NULL;
+  }
+
+  // Never more than the queue could hold
+  size_t n = (size_t) max;
+  if (n > handle_queue_capacity(self->queue)) {
+    n = handle_queue_capacity(self->queue);
+  }
+
+  uint64_t* handles = memory_alloc(memory_tag_handles, n * sizeof(*handles));
+  if (handles == NULL) {
+    return PyErr_NoMemory();
+  }
+
+  size_t popped;
+  enum handle_queue_result result = pop(self, handles, n, timeout, &popped);
+
+  if (result == handle_queue_closed) {
+    memory_free(handles);
+    PyErr_SetString(PyExc_EOFError, "handle queue is closed");
+    return NULL;
+  }
+
+  PyObject* list = PyList_New((Py_ssize_t) popped);
+  if (list == NULL) {
+    memory_free(handles);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < popped; ++i) {
+    PyObject* handle = PyLong_FromUnsignedLongLong(handles[i]);
+    if (handle == NULL) {
+      Py_DECREF(list);
+      memory_free(handles);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(list, (Py_ssize_t) i, handle);
+  }
+
+  memory_free(handles);
+  return list;
+}
+
+static PyObject* type_handle_queue_arm(handle_queue_object* self, PyObject* args) {
+  if (type_handle_queue_check(self)) {
+    return NULL;
+  }
+
+  return PyBool_FromLong(handle_queue_arm(self->queue));
+}
+
+static PyObject* type_handle_queue_clear(handle_queue_object* self, PyObject* args) {
+  if (type_handle_queue_check(self)) {
+    return NULL;
+  }
+
+  handle_queue_clear(self->queue);
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_handle_queue_fileno(handle_queue_object* self, PyObject* args) {
+  if (type_handle_queue_check(self)) {
+    return NULL;
+  }
+
+  return PyLong_FromLong(self->queue->fd);
+}
+
+static PyObject* type_handle_queue_close(handle_queue_object* self, PyObject* args) {
+  if (type_handle_queue_check(self)) {
+    return NULL;
+  }
+
+  handle_queue_close(self->queue);
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_handle_queue_get_capacity(handle_queue_object* self, void* closure) {
+  return PyLong_FromSize_t(self->queue ? handle_queue_capacity(self->queue) : 0);
+}
+
+static PyObject* type_handle_queue_get_closed(handle_queue_object* self, void* closure) {
+  return PyBool_FromLong(self->queue && __atomic_load_n(&self->queue->closed, __ATOMIC_ACQUIRE));
+}
+
+static Py_ssize_t type_handle_queue_len(handle_queue_object* self) {
+  return self->queue ? (Py_ssize_t) handle_queue_size(self->queue) : 0;
+}
+
+/** _core.HandleQueue methods. */
+static PyMethodDef type_handle_queue_methods[] = {
+  {
+    .ml_name = "push",
+    .ml_meth = (PyCFunction) type_handle_queue_push,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Push a handle, waiting up to timeout for room (None forever, 0 never); returns False on timeout",
+  },
+  {
+    .ml_name = "push_many",
+    .ml_meth = (PyCFunction) type_handle_queue_push_many,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Push a sequence of handles in order, returning how many got in before the timeout",
+  },
+  {
+    .ml_name = "pop",
+    .ml_meth = (PyCFunction) type_handle_queue_pop,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Pop the oldest handle, waiting up to timeout (None forever, 0 never); returns None on timeout",
+  },
+  {
+    .ml_name = "pop_many",
+    .ml_meth = (PyCFunction) type_handle_queue_pop_many,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Pop up to max handles once at least one is available, as a list (empty on timeout)",
+  },
+  {
+    .ml_name = "arm",
+    .ml_meth = (PyCFunction) type_handle_queue_arm,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Have the next push signal fileno(); returns True if handles may already be waiting",
+  },
+  {
+    .ml_name = "clear",
+    .ml_meth = (PyCFunction) type_handle_queue_clear,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Clear the fileno() signal",
+  },
+  {
+    .ml_name = "fileno",
+    .ml_meth = (PyCFunction) type_handle_queue_fileno,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Get the eventfd an armed queue signals",
+  },
+  {
+    .ml_name = "close",
+    .ml_meth = (PyCFunction) type_handle_queue_close,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Refuse further pushes and wake every waiter; pops drain what is left, then raise EOFError",
+  },
+  {NULL},
+};
+
+/** _core.HandleQueue getters and setters. */
+static PyGetSetDef type_handle_queue_getset[] = {
+  {
+    .name = "capacity",
+    .get = (getter) type_handle_queue_get_capacity,
+    .set = NULL,
+    .doc = "the most handles queued at once",
+    .closure = NULL,
+  },
+  {
+    .name = "closed",
+    .get = (getter) type_handle_queue_get_closed,
+    .set = NULL,
+    .doc = "whether the queue has been closed",
+    .closure = NULL,
+  },
+  {NULL},
+};
+
+/** _core.HandleQueue sequence methods. */
+static PySequenceMethods type_handle_queue_as_sequence = {
+  .sq_length = (lenfunc) type_handle_queue_len,
+};
+
+/** _core.HandleQueue type. */
+PyTypeObject type_handle_queue = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.HandleQueue",
+  .tp_basicsize = sizeof(handle_queue_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_handle_queue_dealloc,
+  .tp_as_sequence = &type_handle_queue_as_sequence,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A bounded lock-free queue of 64-bit native handles, shared by any number of threads.",
+  .tp_methods = type_handle_queue_methods,
+  .tp_getset = type_handle_queue_getset,
+  .tp_init = (initproc) type_handle_queue_init,
+  .tp_new = PyType_GenericNew,
+};
@@ -0,0 +1,385 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "types.h"
+
+static void type_jpeg_decoder_dealloc(jpeg_decoder_object* self) {
+  if (self->ready) {
+    jpeg_decoder_destroy(&self->dec);
+    self->ready = 0;
+  }
+
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_jpeg_decoder_init(jpeg_decoder_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist)) {
+    return -1;
+  }
+
+  if (!self->ready) {
+    jpeg_decoder_init(&self->dec);
+    self->ready = 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Check that a decoder can take a call.
+ *
+ * @param self The decoder
+ * @return Zero if so, otherwise nonzero with an exception set
+ */
+static int type_jpeg_decoder_check(jpeg_decoder_object* self) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "jpeg decoder not initialized");
+    return 1;
+  }
+
+  // Decodes drop the GIL, so another thread could get in (or a scheduler worker is finishing one)
+  if (__atomic_load_n(&self->busy, __ATOMIC_ACQUIRE)) {
+    PyErr_SetString(PyExc_RuntimeError, "jpeg decoder is in use by another thread");
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Finish a begun decode into a new bytes object or a caller buffer.
+ *
+ * @param self The decoder
+ * @param image The output shape from the begin call
+ * @param out The caller buffer, or NULL for new bytes
+ * @return A new (buffer, width, height) tuple, or NULL with an exception set
+ */
+static PyObject* type_jpeg_decoder_finish(jpeg_decoder_object* self, const struct jpeg_image* image, PyObject* out) {
+  size_t size = (size_t) image->width * image->height * image->components;
+
+  PyObject* result;
+  Py_buffer out_view = {0};
+  void* dst;
+  size_t cap;
+
+  if (out == NULL || out == Py_None) {
+    result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) size);
+    if (result == NULL) {
+      jpeg_decoder_abort(&self->dec);
+      return NULL;
+    }
+
+    dst = PyBytes_AS_STRING(result);
+    cap = size;
+  } else {
+    // Decode straight into the caller's memory (e.g. a frame ring slot)
+    if (PyObject_GetBuffer(out, &out_view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+      jpeg_decoder_abort(&self->dec);
+      return NULL;
+    }
+
+    Py_INCREF(out);
+    result = out;
+    dst = out_view.buf;
+    cap = (size_t) out_view.len;
+  }
+
+  int failed;
+
+  self->busy = 1;
+  Py_BEGIN_ALLOW_THREADS
+  failed = jpeg_decoder_finish(&self->dec, dst, cap);
+  Py_END_ALLOW_THREADS
+  self->busy = 0;
+
+  if (out_view.obj) {
+    PyBuffer_Release(&out_view);
+  }
+
+  if (failed) {
+    PyErr_SetString(PyExc_ValueError, self->dec.message);
+    Py_DECREF(result);
+    return NULL;
+  }
+
+  PyObject* tuple = Py_BuildValue("(OII)", result, image->width, image->height);
+  Py_DECREF(result);
+  return tuple;
+}
+
+static PyObject* type_jpeg_decoder_info(jpeg_decoder_object* self, PyObject* args, PyObject* kwds) {
+  Py_buffer data;
+
+  static char* kwlist[] = {"data", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*", kwlist, &data)) {
+    return NULL;
+  }
+
+  if (type_jpeg_decoder_check(self)) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  struct jpeg_image image;
+  int failed = jpeg_decoder_info(&self->dec, data.buf, (size_t) data.len, &image);
+  PyBuffer_Release(&data);
+
+  if (failed) {
+    PyErr_SetString(PyExc_ValueError, self->dec.message);
+    return NULL;
+  }
+
+  return Py_BuildValue("(II)", image.width, image.height);
+}
+
+static PyObject* type_jpeg_decoder_decode(jpeg_decoder_object* self, PyObject* args, PyObject* kwds) {
+  Py_buffer data;
+  int scale = 1;
+  int gray = 1;
+  PyObject* out = NULL;
+
+  static char* kwlist[] = {"data", "scale", "gray", "out", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|ipO", kwlist, &data, &scale, &gray, &out)) {
+    return NULL;
+  }
+
+  if (type_jpeg_decoder_check(self)) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  struct jpeg_image image;
+  if (jpeg_decoder_begin(&self->dec, data.buf, (size_t) data.len, scale, gray, &image)) {
+    PyErr_SetString(PyExc_ValueError, self->dec.message);
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  // The data buffer stays held until the decode finishes
+  PyObject* result = type_jpeg_decoder_finish(self, &image, out);
+  PyBuffer_Release(&data);
+  return result;
+}
+
+static PyObject* type_jpeg_decoder_decode_region(jpeg_decoder_object* self, PyObject* args, PyObject* kwds) {
+  Py_buffer data;
+  unsigned int x;
+  unsigned int y;
+  unsigned int width;
+  unsigned int height;
+  int gray = 0;
+  PyObject* out = NULL;
+
+  static char* kwlist[] = {"data", "x", "y", "width", "height", "gray", "out", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*IIII|pO", kwlist, &data, &x, &y, &width, &height, &gray,
+      &out)) {
+    return NULL;
+  }
+
+  if (type_jpeg_decoder_check(self)) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  struct jpeg_image image;
+  if (jpeg_decoder_begin_region(&self->dec, data.buf, (size_t) data.len, x, y, width, height, gray, &image)) {
+    PyErr_SetString(PyExc_ValueError, self->dec.message);
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  PyObject* result = type_jpeg_decoder_finish(self, &image, out);
+  PyBuffer_Release(&data);
+  return result;
+}
+
+/** A decode run on a scheduler. */
+struct decode_op {
+  /** The op (first). */
+  struct scheduler_op op;
+
+  /** The decoder (strong reference). */
+  jpeg_decoder_object* decoder;
+
+  /** The compressed data, held until the op is destroyed. */
+  Py_buffer data;
+
+  /** The output shape. */
+  struct jpeg_image image;
+
+  /** The output pixels. */
+  PyObject* pixels;
+
+  /** Nonzero once a worker has run the decode. */
+  int ran;
+
+  /** Nonzero if the decode failed. */
+  int failed;
+
+  /** The error message, copied before the decoder is free for the next decode. */
+  char message[JPEG_DECODER_MESSAGE_MAX];
+};
+
+/**
+ * Finish a decode on a worker.
+ *
+ * @param task The task
+ */
+static void decode_op_run(struct scheduler_task* task) {
+  struct decode_op* op = (struct decode_op*) scheduler_op_of(task);
+  struct jpeg_decoder* dec = &op->decoder->dec;
+
+  op->failed = jpeg_decoder_finish(dec, PyBytes_AS_STRING(op->pixels), (size_t) PyBytes_GET_SIZE(op->pixels));
+  if (op->failed) {
+    memcpy(op->message, dec->message, sizeof(op->message));
+  }
+
+  op->ran = 1;
+
+  // The decoder can take the next frame while this one waits for the loop
+  __atomic_store_n(&op->decoder->busy, 0, __ATOMIC_RELEASE);
+
+  scheduler_op_done(&op->op);
+}
+
+/**
+ * Resolve a finished decode.
+ *
+ * @param c The completion
+ * @return A (bytes, width, height) tuple, or NULL with an exception set
+ */
+static PyObject* decode_op_resolve(struct completion* c) {
+  struct decode_op* op = (struct decode_op*) c;
+
+  if (op->failed) {
+    PyErr_SetString(PyExc_ValueError, op->message);
+    return NULL;
+  }
+
+  return Py_BuildValue("(OII)", op->pixels, op->image.width, op->image.height);
+}
+
+/**
+ * Destroy a decode.
+ *
+ * @param c The completion
+ */
+static void decode_op_destroy(struct completion* c) {
+  struct decode_op* op = (struct decode_op*) c;
+
+  // Never ran (the scheduler refused it)
+  if (!op->ran) {
+    jpeg_decoder_abort(&op->decoder->dec);
+    __atomic_store_n(&op->decoder->busy, 0, __ATOMIC_RELEASE);
+  }
+
+  Py_XDECREF(op->pixels);
+  PyBuffer_Release(&op->data);
+  Py_DECREF(op->decoder);
+  memory_free(op);
+}
+
+static PyObject* type_jpeg_decoder_decode_async(jpeg_decoder_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"scheduler", "data", "scale", "gray", "priority", NULL};
+
+  scheduler_object* scheduler;
+  Py_buffer data;
+  int scale = 1;
+  int gray = 1;
+  PyObject* priority = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!y*|ipO", kwlist, &type_scheduler, &scheduler, &data, &scale,
+      &gray, &priority)) {
+    return NULL;
+  }
+
+  if (type_jpeg_decoder_check(self)) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  struct decode_op* op = memory_calloc(memory_tag_jpeg, 1, sizeof *op);
+  if (op == NULL) {
+    PyBuffer_Release(&data);
+    return PyErr_NoMemory();
+  }
+
+  // The header is cheap, so read it here and fail fast on garbage
+  if (jpeg_decoder_begin(&self->dec, data.buf, (size_t) data.len, scale, gray, &op->image)) {
+    PyErr_SetString(PyExc_ValueError, self->dec.message);
+    PyBuffer_Release(&data);
+    memory_free(op);
+    return NULL;
+  }
+
+  size_t size = (size_t) op->image.width * op->image.height * op->image.components;
+  op->pixels = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) size);
+  if (op->pixels == NULL) {
+    jpeg_decoder_abort(&self->dec);
+    PyBuffer_Release(&data);
+    memory_free(op);
+    return NULL;
+  }
+
+  // Busy from now until a worker finishes the decode
+  __atomic_store_n(&self->busy, 1, __ATOMIC_RELEASE);
+
+  Py_INCREF(self);
+  op->decoder = self;
+  op->data = data;
+  op->op.base.resolve = &decode_op_resolve;
+  op->op.base.destroy = &decode_op_destroy;
+  op->op.task.run = &decode_op_run;
+
+  return scheduler_object_submit(scheduler, &op->op, priority, "decode");
+}
+
+/** _core.JpegDecoder methods. */
+static PyMethodDef type_jpeg_decoder_methods[] = {
+  {
+    .ml_name = "info",
+    .ml_meth = (PyCFunction) type_jpeg_decoder_info,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Return the full-resolution (width, height) of a JPEG image",
+  },
+  {
+    .ml_name = "decode",
+    .ml_meth = (PyCFunction) type_jpeg_decoder_decode,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Decode a whole image at 1/scale size (scale 1, 2, 4 or 8), returning (buffer, width, height)",
+  },
+  {
+    .ml_name = "decode_region",
+    .ml_meth = (PyCFunction) type_jpeg_decoder_decode_region,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Decode a region at full resolution, returning (buffer, width, height)",
+  },
+  {
+    .ml_name = "decode_async",
+    .ml_meth = (PyCFunction) type_jpeg_decoder_decode_async,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Queue a decode on a scheduler and return its completion ticket",
+  },
+  {NULL},
+};
+
+/** _core.JpegDecoder type. */
+PyTypeObject type_jpeg_decoder = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.JpegDecoder",
+  .tp_basicsize = sizeof(jpeg_decoder_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_jpeg_decoder_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A reusable JPEG decoder with DCT-domain downscaling and region decodes.",
+  .tp_methods = type_jpeg_decoder_methods,
+  .tp_init = (initproc) type_jpeg_decoder_init,
+  .tp_new = PyType_GenericNew,
+};
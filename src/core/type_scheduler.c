@@ -0,0 +1,444 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "types.h"
+
+/** A Python callable run as a scheduler task. */
+struct py_task {
+  /** The op (first). */
+  struct scheduler_op op;
+
+  /** The callable. */
+  PyObject* fn;
+
+  /** The positional arguments (a tuple). */
+  PyObject* args;
+
+  /** The keyword arguments, or NULL. */
+  PyObject* kwargs;
+
+  /** The result, or NULL if the call raised. */
+  PyObject* result;
+
+  /** The exception type raised, or NULL. */
+  PyObject* exc_type;
+
+  /** The exception value raised, or NULL. */
+  PyObject* exc_value;
+
+  /** The exception traceback, or NULL. */
+  PyObject* exc_tb;
+};
+
+/**
+ * Run a Python task on a worker.
+ *
+ * The call itself needs the GIL, but native operations it makes release it
+ * again, so several workers can be in native code at once.
+ *
+ * @param t The task
+ */
+static void py_task_run(struct scheduler_task* t) {
+  struct py_task* task = (struct py_task*) scheduler_op_of(t);
+
+  PyGILState_STATE state = PyGILState_Ensure();
+
+  task->result = PyObject_Call(task->fn, task->args, task->kwargs);
+  if (task->result == NULL) {
+    PyErr_Fetch(&task->exc_type, &task->exc_value, &task->exc_tb);
+  }
+
+  // Let go of the call's references here rather than on the loop thread
+  Py_CLEAR(task->fn);
+  Py_CLEAR(task->args);
+  Py_CLEAR(task->kwargs);
+
+  PyGILState_Release(state);
+
+  scheduler_op_done(&task->op);
+}
+
+/**
+ * Resolve a finished Python task.
+ *
+ * @param c The completion
+ * @return The call's result, or NULL with its exception set
+ */
+static PyObject* py_task_resolve(struct completion* c) {
+  struct py_task* task = (struct py_task*) c;
+
+  if (task->result == NULL) {
+    PyErr_Restore(task->exc_type, task->exc_value, task->exc_tb);
+    task->exc_type = NULL;
+    task->exc_value = NULL;
+    task->exc_tb = NULL;
+    return NULL;
+  }
+
+  PyObject* result = task->result;
+  task->result = NULL;
+  return result;
+}
+
+/**
+ * Destroy a finished Python task.
+ *
+ * @param c The completion
+ */
+static void py_task_destroy(struct completion* c) {
+  struct py_task* task = (struct py_task*) c;
+
+  Py_XDECREF(task->fn);
+  Py_XDECREF(task->args);
+  Py_XDECREF(task->kwargs);
+  Py_XDECREF(task->result);
+  Py_XDECREF(task->exc_type);
+  Py_XDECREF(task->exc_value);
+  Py_XDECREF(task->exc_tb);
+  memory_free(task);
+}
+
+/**
+ * Stop the native scheduler.
+ *
+ * @param self The scheduler
+ * @return Zero on success, otherwise nonzero (called from one of its own workers)
+ */
+static int type_scheduler_close_native(scheduler_object* self) {
+  if (self->sched == NULL) {
+    return 0;
+  }
+
+  // A worker can't wait for itself to exit
+  if (scheduler_current_worker(self->sched) >= 0) {
+    return 1;
+  }
+
+  // Queued Python tasks still need the GIL to finish
+  Py_BEGIN_ALLOW_THREADS
+  scheduler_destroy(self->sched);
+  Py_END_ALLOW_THREADS
+
+  memory_free(self->sched);
+  self->sched = NULL;
+  return 0;
+}
+
+static void type_scheduler_dealloc(scheduler_object* self) {
+  if (type_scheduler_close_native(self)) {
+    // Dropped by one of its own tasks; the workers and their memory are left be
+    fprintf(stderr, "scheduler: dropped on its own worker, leaking it\n");
+  }
+
+  Py_XDECREF(self->channel);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_scheduler_init(scheduler_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"channel", "workers", NULL};
+
+  PyObject* channel;
+  int workers = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|i", kwlist, &type_completion_channel, &channel, &workers)) {
+    return -1;
+  }
+
+  if (self->sched) {
+    PyErr_SetString(PyExc_RuntimeError, "scheduler already started");
+    return -1;
+  }
+
+  if (!((completion_channel_object*) channel)->ready) {
+    PyErr_SetString(PyExc_ValueError, "completion channel not initialized");
+    return -1;
+  }
+
+  if (workers < 0 || workers > SCHEDULER_MAX_WORKERS) {
+    PyErr_Format(PyExc_ValueError, "workers must be between 0 and %d", SCHEDULER_MAX_WORKERS);
+    return -1;
+  }
+
+  struct scheduler* sched;
+  if (memory_aligned_alloc(memory_tag_scheduler, (void**) &sched, SCHEDULER_CACHE_LINE, sizeof(*sched))) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  if (scheduler_init(sched, workers)) {
+    memory_free(sched);
+    PyErr_SetString(PyExc_RuntimeError, "failed to start scheduler workers");
+    return -1;
+  }
+
+  Py_INCREF(channel);
+  Py_XSETREF(self->channel, (completion_channel_object*) channel);
+  self->sched = sched;
+  return 0;
+}
+
+/**
+ * Check that a scheduler is running.
+ *
+ * @param self The scheduler
+ * @return Zero if so, otherwise nonzero with an exception set
+ */
+static int check_open(scheduler_object* self) {
+  if (self->sched == NULL) {
+    PyErr_SetString(PyExc_ValueError, "scheduler is closed");
+    return 1;
+  }
+
+  return 0;
+}
+
+PyObject* scheduler_object_submit(scheduler_object* self, struct scheduler_op* op, PyObject* priority,
+    const char* kind) {
+  if (check_open(self)) {
+    op->base.destroy(&op->base);
+    return NULL;
+  }
+
+  // Without a frame timestamp, work ages from now, on the same clock as frames
+  double when;
+  if (priority == NULL || priority == Py_None) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    when = (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+  } else {
+    when = PyFloat_AsDouble(priority);
+    if (when == -1.0 && PyErr_Occurred()) {
+      op->base.destroy(&op->base);
+      return NULL;
+    }
+  }
+
+  op->base.ticket = completion_channel_ticket(&self->channel->channel);
+  op->task.priority = when;
+  op->task.kind = scheduler_kind(self->sched, kind ? kind : "task");
+  op->channel = &self->channel->channel;
+
+  uint64_t ticket = op->base.ticket;
+  if (scheduler_submit(self->sched, &op->task)) {
+    op->base.destroy(&op->base);
+    PyErr_SetString(PyExc_RuntimeError, "scheduler is shutting down");
+    return NULL;
+  }
+
+  return PyLong_FromUnsignedLongLong(ticket);
+}
+
+struct scheduler_op* scheduler_op_of(struct scheduler_task* task) {
+  return (struct scheduler_op*) ((char*) task - offsetof(struct scheduler_op, task));
+}
+
+void scheduler_op_done(struct scheduler_op* op) {
+  completion_channel_post(op->channel, &op->base);
+}
+
+static PyObject* type_scheduler_submit(scheduler_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"fn", "args", "kwargs", "priority", "kind", NULL};
+
+  PyObject* fn;
+  PyObject* call_args = NULL;
+  PyObject* call_kwargs = NULL;
+  PyObject* priority = Py_None;
+  const char* kind = "task";
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOOs", kwlist, &fn, &call_args, &call_kwargs, &priority, &kind)) {
+    return NULL;
+  }
+
+  if (check_open(self)) {
+    return NULL;
+  }
+
+  if (!PyCallable_Check(fn)) {
+    PyErr_SetString(PyExc_TypeError, "fn must be callable");
+    return NULL;
+  }
+
+  if (call_kwargs == Py_None) {
+    call_kwargs = NULL;
+  }
+
+  if (call_kwargs && !PyDict_Check(call_kwargs)) {
+    PyErr_SetString(PyExc_TypeError, "kwargs must be a dictionary");
+    return NULL;
+  }
+
+  PyObject* tuple = call_args && call_args != Py_None ? PySequence_Tuple(call_args) : PyTuple_New(0);
+  if (tuple == NULL) {
+    return NULL;
+  }
+
+  struct py_task* task = memory_calloc(memory_tag_scheduler, 1, sizeof *task);
+  if (task == NULL) {
+    Py_DECREF(tuple);
+    return PyErr_NoMemory();
+  }
+
+  Py_INCREF(fn);
+  Py_XINCREF(call_kwargs);
+
+  task->op.base.resolve = &py_task_resolve;
+  task->op.base.destroy = &py_task_destroy;
+  task->op.task.run = &py_task_run;
+  task->fn = fn;
+  task->args = tuple;
+  task->kwargs = call_kwargs;
+
+  return scheduler_object_submit(self, &task->op, priority, kind);
+}
+
+/**
+ * Estimate a latency percentile from a histogram.
+ *
+ * @param stats The counters
+ * @param q The quantile (0 to 1)
+ * @return The latency, in seconds (the upper edge of the bucket it falls in)
+ */
+static double histogram_quantile(const struct scheduler_kind_stats* stats, double q) {
+  uint64_t rank = (uint64_t) ((double) stats->count * q);
+  uint64_t seen = 0;
+
+  for (int i = 0; i < SCHEDULER_HISTOGRAM_BUCKETS; ++i) {
+    seen += stats->histogram[i];
+    if (seen > rank) {
+      return (double) (2ull << i) * 1e-6;
+    }
+  }
+
+  return 0;
+}
+
+static PyObject* type_scheduler_stats(scheduler_object* self) {
+  if (check_open(self)) {
+    return NULL;
+  }
+
+  struct scheduler* sched = self->sched;
+
+  uint64_t ran_local = 0;
+  uint64_t ran_shared = 0;
+  uint64_t ran_stolen = 0;
+  uint64_t steal_aborts = 0;
+  for (int i = 0; i < sched->num_workers; ++i) {
+    ran_local += __atomic_load_n(&sched->workers[i]->ran_local, __ATOMIC_RELAXED);
+    ran_shared += __atomic_load_n(&sched->workers[i]->ran_shared, __ATOMIC_RELAXED);
+    ran_stolen += __atomic_load_n(&sched->workers[i]->ran_stolen, __ATOMIC_RELAXED);
+    steal_aborts += __atomic_load_n(&sched->workers[i]->steal_aborts, __ATOMIC_RELAXED);
+  }
+
+  PyObject* kinds = PyDict_New();
+  if (kinds == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&sched->lock);
+  int num_kinds = sched->num_kinds;
+  pthread_mutex_unlock(&sched->lock);
+
+  for (int k = 0; k < num_kinds; ++k) {
+    struct scheduler_kind_stats stats;
+    scheduler_kind_stats(sched, k, &stats);
+
+    if (stats.count == 0) {
+      continue;
+    }
+
+    PyObject* item = Py_BuildValue("{s:K,s:d,s:d,s:d,s:d,s:d,s:d,s:d}",
+      "count", (unsigned long long) stats.count,
+      "wait_mean", (double) stats.wait_total / (double) stats.count * 1e-9,
+      "wait_max", (double) stats.wait_max * 1e-9,
+      "run_mean", (double) stats.run_total / (double) stats.count * 1e-9,
+      "run_max", (double) stats.run_max * 1e-9,
+      "p50", histogram_quantile(&stats, 0.5),
+      "p90", histogram_quantile(&stats, 0.9),
+      "p99", histogram_quantile(&stats, 0.99));
+    if (item == NULL || PyDict_SetItemString(kinds, stats.name, item) < 0) {
+      Py_XDECREF(item);
+      Py_DECREF(kinds);
+      return NULL;
+    }
+
+    Py_DECREF(item);
+  }
+
+  return Py_BuildValue("{s:i,s:K,s:K,s:K,s:K,s:N}",
+    "workers", sched->num_workers,
+    "ran_local", (unsigned long long) ran_local,
+    "ran_shared", (unsigned long long) ran_shared,
+    "ran_stolen", (unsigned long long) ran_stolen,
+    "steal_aborts", (unsigned long long) steal_aborts,
+    "kinds", kinds);
+}
+
+static PyObject* type_scheduler_close(scheduler_object* self) {
+  if (type_scheduler_close_native(self)) {
+    PyErr_SetString(PyExc_RuntimeError, "cannot close a scheduler from one of its own tasks");
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_scheduler_get_workers(scheduler_object* self, void* closure) {
+  return PyLong_FromLong(self->sched ? self->sched->num_workers : 0);
+}
+
+/** _core.Scheduler methods. */
+static PyMethodDef type_scheduler_methods[] = {
+  {
+    .ml_name = "submit",
+    .ml_meth = (PyCFunction) type_scheduler_submit,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Queue a call (oldest priority first) and return its completion ticket",
+  },
+  {
+    .ml_name = "stats",
+    .ml_meth = (PyCFunction) type_scheduler_stats,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Return the steal counters and per-kind task latencies as a dictionary",
+  },
+  {
+    .ml_name = "close",
+    .ml_meth = (PyCFunction) type_scheduler_close,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Finish queued tasks and stop the workers",
+  },
+  {NULL},
+};
+
+/** _core.Scheduler getters and setters. */
+static PyGetSetDef type_scheduler_getset[] = {
+  {
+    .name = "workers",
+    .get = (getter) type_scheduler_get_workers,
+    .set = NULL,
+    .doc = "the number of worker threads (zero once closed)",
+    .closure = NULL,
+  },
+  {NULL},
+};
+
+/** _core.Scheduler type. */
+PyTypeObject type_scheduler = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.Scheduler",
+  .tp_basicsize = sizeof(scheduler_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_scheduler_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A work-stealing pool running pipeline tasks from all robots, oldest frames first.",
+  .tp_methods = type_scheduler_methods,
+  .tp_getset = type_scheduler_getset,
+  .tp_init = (initproc) type_scheduler_init,
+  .tp_new = PyType_GenericNew,
+};
@@ -0,0 +1,375 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+
+/** The charset number MySQL uses for binary data. */
+#define SQL_CHARSET_BINARY 63
+
+PyObject* core_sql_error;
+
+/**
+ * Convert one column value of a result row.
+ *
+ * @param field The column metadata
+ * @param data The value text, or NULL for SQL NULL
+ * @param len The value length
+ * @return A new reference, or NULL on failure
+ */
+static PyObject* sql_column_to_python(const MYSQL_FIELD* field, const char* data, unsigned long len) {
+  if (data == NULL) {
+    Py_RETURN_NONE;
+  }
+
+  switch (field->type) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_YEAR: {
+      // Text protocol integers are always null-terminated digits
+      return PyLong_FromString((char*) data, NULL, 10);
+    }
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+      return PyFloat_FromDouble(strtod(data, NULL));
+    default:
+      break;
+  }
+
+  // Binary columns (e.g. embeddings) stay as bytes
+  if (field->charsetnr == SQL_CHARSET_BINARY) {
+    return PyBytes_FromStringAndSize(data, (Py_ssize_t) len);
+  }
+
+  return PyUnicode_DecodeUTF8(data, (Py_ssize_t) len, "replace");
+}
+
+/**
+ * Resolve a finished SQL request.
+ *
+ * Statements with a result set resolve to a list of row tuples. Others
+ * resolve to an (affected_rows, insert_id) tuple.
+ *
+ * @param c The completion
+ * @return A new reference, or NULL with an exception set
+ */
+static PyObject* sql_request_resolve(struct completion* c) {
+  struct sql_request* req = (struct sql_request*) c;
+
+  if (req->err_no) {
+    PyObject* message = PyUnicode_FromFormat("(%u) %s", req->err_no, req->err_msg ? req->err_msg : "unknown error");
+    if (message == NULL) {
+      return NULL;
+    }
+
+    PyObject* exc = PyObject_CallFunctionObjArgs(core_sql_error, message, NULL);
+    Py_DECREF(message);
+    if (exc == NULL) {
+      return NULL;
+    }
+
+    // The MySQL error code goes in errno, so callers needn't parse the message
+    PyObject* err_no = PyLong_FromUnsignedLong(req->err_no);
+    if (err_no == NULL || PyObject_SetAttrString(exc, "errno", err_no) < 0) {
+      Py_XDECREF(err_no);
+      Py_DECREF(exc);
+      return NULL;
+    }
+
+    Py_DECREF(err_no);
+    PyErr_SetObject(core_sql_error, exc);
+    Py_DECREF(exc);
+    return NULL;
+  }
+
+  if (req->result == NULL) {
+    return Py_BuildValue("(KK)", req->affected_rows, req->insert_id);
+  }
+
+  unsigned int num_fields = mysql_num_fields(req->result);
+  MYSQL_FIELD* fields = mysql_fetch_fields(req->result);
+
+  PyObject* rows = PyList_New(0);
+  if (rows == NULL) {
+    return NULL;
+  }
+
+  MYSQL_ROW row;
+  while ((row = mysql_fetch_row(req->result)) != NULL) {
+    unsigned long* lengths = mysql_fetch_lengths(req->result);
+
+    PyObject* tuple = PyTuple_New(num_fields);
+    if (tuple == NULL) {
+      Py_DECREF(rows);
+      return NULL;
+    }
+
+    for (unsigned int i = 0; i < num_fields; ++i) {
+      PyObject* value = sql_column_to_python(&fields[i], row[i], lengths[i]);
+      if (value == NULL) {
+        Py_DECREF(tuple);
+        Py_DECREF(rows);
+        return NULL;
+      }
+
+      // Steals the reference
+      PyTuple_SET_ITEM(tuple, i, value);
+    }
+
+    if (PyList_Append(rows, tuple) < 0) {
+      Py_DECREF(tuple);
+      Py_DECREF(rows);
+      return NULL;
+    }
+
+    Py_DECREF(tuple);
+  }
+
+  return rows;
+}
+
+/**
+ * Destroy a finished SQL request.
+ *
+ * @param c The completion
+ */
+static void sql_request_destroy(struct completion* c) {
+  struct sql_request* req = (struct sql_request*) c;
+  sql_request_release(req);
+  memory_free(req);
+}
+
+/**
+ * Convert a Python object to a statement parameter.
+ *
+ * @param obj The object
+ * @param [out] value The parameter
+ * @return Zero on success, otherwise nonzero with an exception set
+ */
+static int sql_value_from_python(PyObject* obj, struct sql_value* value) {
+  memset(value, 0, sizeof *value);
+
+  if (obj == Py_None) {
+    value->type = sql_value_null;
+    return 0;
+  }
+
+  if (PyLong_Check(obj)) {
+    value->type = sql_value_int;
+    value->i = PyLong_AsLongLong(obj);
+    return value->i == -1 && PyErr_Occurred() ? 1 : 0;
+  }
+
+  if (PyFloat_Check(obj)) {
+    value->type = sql_value_float;
+    value->f = PyFloat_AS_DOUBLE(obj);
+    return 0;
+  }
+
+  if (PyUnicode_Check(obj)) {
+    Py_ssize_t len;
+    const char* text = PyUnicode_AsUTF8AndSize(obj, &len);
+    if (text == NULL) {
+      return 1;
+    }
+
+    value->type = sql_value_text;
+    value->data = memory_alloc(memory_tag_sql, (size_t) len + 1);
+    if (value->data == NULL) {
+      PyErr_NoMemory();
+      return 1;
+    }
+    memcpy(value->data, text, (size_t) len + 1);
+    value->len = (size_t) len;
+    return 0;
+  }
+
+  if (PyObject_CheckBuffer(obj)) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(obj, &view, PyBUF_CONTIG_RO) < 0) {
+      return 1;
+    }
+
+    value->type = sql_value_blob;
+    value->data = memory_alloc(memory_tag_sql, view.len ? (size_t) view.len : 1);
+    if (value->data == NULL) {
+      PyBuffer_Release(&view);
+      PyErr_NoMemory();
+      return 1;
+    }
+    memcpy(value->data, view.buf, (size_t) view.len);
+    value->len = (size_t) view.len;
+
+    PyBuffer_Release(&view);
+    return 0;
+  }
+
+  PyErr_Format(PyExc_TypeError, "unsupported sql parameter type: %s", Py_TYPE(obj)->tp_name);
+  return 1;
+}
+
+static void type_sql_client_close_native(sql_client_object* self) {
+  if (self->open) {
+    // The I/O thread may be mid round trip, so don't hold the GIL while we wait
+    Py_BEGIN_ALLOW_THREADS
+    sql_client_stop(&self->client);
+    Py_END_ALLOW_THREADS
+
+    self->open = 0;
+  }
+}
+
+static void type_sql_client_dealloc(sql_client_object* self) {
+  type_sql_client_close_native(self);
+  Py_XDECREF(self->channel);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_sql_client_init(sql_client_object* self, PyObject* args, PyObject* kwds) {
+  PyObject* channel;
+  const char* host = NULL;
+  const char* user = NULL;
+  const char* password = NULL;
+  const char* database = NULL;
+  unsigned int port = 0;
+
+  static char* kwlist[] = {"channel", "host", "user", "password", "database", "port", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|zzzzI", kwlist, &type_completion_channel, &channel, &host, &user,
+      &password, &database, &port)) {
+    return -1;
+  }
+
+  if (self->open) {
+    PyErr_SetString(PyExc_RuntimeError, "sql client already open");
+    return -1;
+  }
+
+  if (!((completion_channel_object*) channel)->ready) {
+    PyErr_SetString(PyExc_ValueError, "completion channel not initialized");
+    return -1;
+  }
+
+  Py_INCREF(channel);
+  Py_XSETREF(self->channel, (completion_channel_object*) channel);
+
+  struct sql_params params = {
+    .host = host,
+    .user = user,
+    .pass = password,
+    .db = database,
+    .port = port,
+  };
+
+  if (sql_client_start(&self->client, &params, &self->channel->channel)) {
+    PyErr_SetString(PyExc_RuntimeError, "failed to start sql client thread");
+    return -1;
+  }
+
+  self->open = 1;
+  return 0;
+}
+
+static PyObject* type_sql_client_submit(sql_client_object* self, PyObject* args, PyObject* kwds) {
+  const char* sql;
+  PyObject* params = NULL;
+
+  static char* kwlist[] = {"sql", "params", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|O", kwlist, &sql, &params)) {
+    return NULL;
+  }
+
+  if (!self->open) {
+    PyErr_SetString(PyExc_ValueError, "sql client is closed");
+    return NULL;
+  }
+
+  // Snapshot the parameters into native values now, while we hold the GIL
+  PyObject* seq = params && params != Py_None
+    ? PySequence_Fast(params, "params must be a sequence")
+    : PyTuple_New(0);
+  if (seq == NULL) {
+    return NULL;
+  }
+
+  Py_ssize_t num_values = PySequence_Fast_GET_SIZE(seq);
+
+  struct sql_request* req = memory_calloc(memory_tag_sql, 1, sizeof *req);
+  struct sql_value* values = memory_calloc(memory_tag_sql, num_values ? (size_t) num_values : 1, sizeof *values);
+  char* text = memory_strdup(memory_tag_sql, sql);
+  if (req == NULL || values == NULL || text == NULL) {
+    memory_free(req);
+    memory_free(values);
+    memory_free(text);
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+
+  for (Py_ssize_t i = 0; i < num_values; ++i) {
+    if (sql_value_from_python(PySequence_Fast_GET_ITEM(seq, i), &values[i])) {
+      sql_values_release(values, (size_t) i + 1);
+      memory_free(req);
+      memory_free(text);
+      Py_DECREF(seq);
+      return NULL;
+    }
+  }
+
+  Py_DECREF(seq);
+
+  req->base.ticket = completion_channel_ticket(&self->channel->channel);
+  req->base.resolve = &sql_request_resolve;
+  req->base.destroy = &sql_request_destroy;
+  req->text = text;
+  req->values = values;
+  req->num_values = (size_t) num_values;
+
+  uint64_t ticket = req->base.ticket;
+  sql_client_submit(&self->client, req);
+
+  return PyLong_FromUnsignedLongLong(ticket);
+}
+
+static PyObject* type_sql_client_close(sql_client_object* self) {
+  type_sql_client_close_native(self);
+  Py_RETURN_NONE;
+}
+
+/** _core.SqlClient methods. */
+static PyMethodDef type_sql_client_methods[] = {
+  {
+    .ml_name = "submit",
+    .ml_meth = (PyCFunction) type_sql_client_submit,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Queue a statement and return its completion ticket",
+  },
+  {
+    .ml_name = "close",
+    .ml_meth = (PyCFunction) type_sql_client_close,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Stop the I/O thread, failing any statements still queued",
+  },
+  {NULL},
+};
+
+/** _core.SqlClient type. */
+PyTypeObject type_sql_client = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.SqlClient",
+  .tp_basicsize = sizeof(sql_client_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_sql_client_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "An asynchronous SQL client running on its own I/O thread.",
+  .tp_methods = type_sql_client_methods,
+  .tp_init = (initproc) type_sql_client_init,
+  .tp_new = PyType_GenericNew,
+};
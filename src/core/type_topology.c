@@ -0,0 +1,321 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+
+#include "types.h"
+
+/** _core.Placement fields. */
+static PyStructSequence_Field type_placement_fields[] = {
+  {"robot", "robot index, in order of arrival"},
+  {"domain", "L3 domain index (-1 for none)"},
+  {"node", "NUMA node for the robot's buffers (-1 for none)"},
+  {"cpus", "tuple of CPUs for the robot's threads (empty for no pinning)"},
+  {NULL},
+};
+
+PyStructSequence_Desc type_placement_desc = {
+  .name = "_core.Placement",
+  .doc = "Where a robot's pipeline threads and buffers go.",
+  .fields = type_placement_fields,
+  .n_in_sequence = 4,
+};
+
+PyTypeObject type_placement;
+
+/**
+ * Build a tuple of the CPUs in a set.
+ *
+ * @param set The CPUs
+ * @return The tuple, or NULL with an exception set
+ */
+static PyObject* cpus_to_tuple(const cpu_set_t* set) {
+  PyObject* cpus = PyTuple_New(CPU_COUNT(set));
+  if (cpus == NULL) {
+    return NULL;
+  }
+
+  Py_ssize_t i = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, set)) {
+      PyObject* item = PyLong_FromLong(cpu);
+      if (item == NULL) {
+        Py_DECREF(cpus);
+        return NULL;
+      }
+
+      PyTuple_SET_ITEM(cpus, i++, item);
+    }
+  }
+
+  return cpus;
+}
+
+static void type_topology_dealloc(topology_object* self) {
+  if (self->ready) {
+    topology_destroy(&self->topo);
+    self->ready = 0;
+  }
+
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_topology_init(topology_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"root", NULL};
+
+  const char* root = TOPOLOGY_SYSFS_ROOT;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s", kwlist, &root)) {
+    return -1;
+  }
+
+  if (self->ready) {
+    PyErr_SetString(PyExc_RuntimeError, "topology already loaded");
+    return -1;
+  }
+
+  if (topology_load(&self->topo, root)) {
+    PyErr_SetString(PyExc_OSError, "failed to read the CPU topology");
+    return -1;
+  }
+
+  self->ready = 1;
+  return 0;
+}
+
+/**
+ * Check that a topology is loaded.
+ *
+ * @param self The topology
+ * @return Zero if so, otherwise nonzero with an exception set
+ */
+static int check_ready(topology_object* self) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "topology not loaded");
+    return 1;
+  }
+
+  return 0;
+}
+
+static PyObject* type_topology_place(topology_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"robot", "policy", "threads", NULL};
+
+  int robot;
+  const char* text = "none";
+  int threads = 3;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|zi", kwlist, &robot, &text, &threads)) {
+    return NULL;
+  }
+
+  if (check_ready(self)) {
+    return NULL;
+  }
+
+  if (robot < 0) {
+    PyErr_SetString(PyExc_ValueError, "robot must not be negative");
+    return NULL;
+  }
+
+  enum cpu_policy policy;
+  const char* manual;
+  if (topology_parse_policy(text, &policy, &manual)) {
+    PyErr_Format(PyExc_ValueError, "unknown CPU policy: %s (expected none, compact, spread or manual:<cpus>;...)",
+      text);
+    return NULL;
+  }
+
+  struct topology_placement placement;
+  if (topology_place(&self->topo, policy, manual, robot, threads, &placement)) {
+    PyErr_Format(PyExc_ValueError, "bad CPU list in policy: %s", text);
+    return NULL;
+  }
+
+  PyObject* cpus = cpus_to_tuple(&placement.cpus);
+  if (cpus == NULL) {
+    return NULL;
+  }
+
+  PyObject* result = PyStructSequence_New(&type_placement);
+  if (result == NULL) {
+    Py_DECREF(cpus);
+    return NULL;
+  }
+
+  PyStructSequence_SET_ITEM(result, 0, PyLong_FromLong(robot));
+  PyStructSequence_SET_ITEM(result, 1, PyLong_FromLong(placement.domain));
+  PyStructSequence_SET_ITEM(result, 2, PyLong_FromLong(placement.node));
+  PyStructSequence_SET_ITEM(result, 3, cpus);
+
+  if (PyErr_Occurred()) {
+    Py_DECREF(result);
+    return NULL;
+  }
+
+  return result;
+}
+
+static PyObject* type_topology_pin(topology_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"cpus", NULL};
+
+  PyObject* cpus;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &cpus)) {
+    return NULL;
+  }
+
+  PyObject* seq = PySequence_Fast(cpus, "cpus must be a sequence of CPU numbers");
+  if (seq == NULL) {
+    return NULL;
+  }
+
+  struct topology_placement placement = {
+    .domain = -1,
+    .node = -1,
+    .num_cpus = 0,
+  };
+  CPU_ZERO(&placement.cpus);
+
+  for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i) {
+    long cpu = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+    if (cpu == -1 && PyErr_Occurred()) {
+      Py_DECREF(seq);
+      return NULL;
+    }
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      Py_DECREF(seq);
+      PyErr_Format(PyExc_ValueError, "CPU out of range: %ld", cpu);
+      return NULL;
+    }
+
+    CPU_SET((int) cpu, &placement.cpus);
+  }
+
+  Py_DECREF(seq);
+  placement.num_cpus = CPU_COUNT(&placement.cpus);
+
+  // The calling thread is whichever thread holds the GIL right now
+  int err = topology_pin(&placement);
+  if (err) {
+    errno = err;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_topology_get_num_cpus(topology_object* self, void* closure) {
+  return PyLong_FromSize_t(self->ready ? self->topo.num_cpus : 0);
+}
+
+static PyObject* type_topology_get_num_domains(topology_object* self, void* closure) {
+  return PyLong_FromSize_t(self->ready ? self->topo.num_domains : 0);
+}
+
+static PyObject* type_topology_get_num_nodes(topology_object* self, void* closure) {
+  return PyLong_FromLong(self->ready ? self->topo.num_nodes : 0);
+}
+
+static PyObject* type_topology_get_domains(topology_object* self, void* closure) {
+  if (check_ready(self)) {
+    return NULL;
+  }
+
+  PyObject* domains = PyList_New((Py_ssize_t) self->topo.num_domains);
+  if (domains == NULL) {
+    return NULL;
+  }
+
+  for (size_t d = 0; d < self->topo.num_domains; ++d) {
+    const struct topology_domain* domain = &self->topo.domains[d];
+
+    PyObject* cpus = PyTuple_New((Py_ssize_t) domain->num_cpus);
+    if (cpus == NULL) {
+      Py_DECREF(domains);
+      return NULL;
+    }
+
+    for (size_t i = 0; i < domain->num_cpus; ++i) {
+      PyTuple_SET_ITEM(cpus, i, PyLong_FromLong(domain->cpus[i]));
+    }
+
+    PyObject* item = Py_BuildValue("{s:i,s:N}", "node", domain->node, "cpus", cpus);
+    if (item == NULL) {
+      Py_DECREF(domains);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(domains, d, item);
+  }
+
+  return domains;
+}
+
+/** _core.Topology methods. */
+static PyMethodDef type_topology_methods[] = {
+  {
+    .ml_name = "place",
+    .ml_meth = (PyCFunction) type_topology_place,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Place the robot with the given index under a CPU policy",
+  },
+  {
+    .ml_name = "pin",
+    .ml_meth = (PyCFunction) type_topology_pin,
+    .ml_flags = METH_VARARGS | METH_KEYWORDS,
+    .ml_doc = "Pin the calling thread to the given CPUs (no change if empty)",
+  },
+  {NULL},
+};
+
+/** _core.Topology getters and setters. */
+static PyGetSetDef type_topology_getset[] = {
+  {
+    .name = "num_cpus",
+    .get = (getter) type_topology_get_num_cpus,
+    .set = NULL,
+    .doc = "the number of CPUs this process may run on",
+    .closure = NULL,
+  },
+  {
+    .name = "num_domains",
+    .get = (getter) type_topology_get_num_domains,
+    .set = NULL,
+    .doc = "the number of L3 domains",
+    .closure = NULL,
+  },
+  {
+    .name = "num_nodes",
+    .get = (getter) type_topology_get_num_nodes,
+    .set = NULL,
+    .doc = "the number of NUMA nodes",
+    .closure = NULL,
+  },
+  {
+    .name = "domains",
+    .get = (getter) type_topology_get_domains,
+    .set = NULL,
+    .doc = "the L3 domains, as dictionaries of node and CPUs",
+    .closure = NULL,
+  },
+  {NULL},
+};
+
+/** _core.Topology type. */
+PyTypeObject type_topology = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.Topology",
+  .tp_basicsize = sizeof(topology_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_topology_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "The CPU and cache layout this process may run on, for placing robot pipelines.",
+  .tp_methods = type_topology_methods,
+  .tp_getset = type_topology_getset,
+  .tp_init = (initproc) type_topology_init,
+  .tp_new = PyType_GenericNew,
+};
@@ -0,0 +1,312 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include "types.h"
+
+#if PY_VERSION_HEX >= 0x030B0000
+// Still exported (faulthandler uses it), but only declared in the internal headers from 3.11
+PyAPI_FUNC(void) _Py_DumpTraceback(int fd, PyThreadState* tstate);
+#endif
+
+/** _core.Stall fields. */
+static PyStructSequence_Field type_stall_fields[] = {
+  {"at", "when the stall began (wall-clock seconds)"},
+  {"duration", "how long the loop was late, in seconds"},
+  {"stack", "the loop thread's Python stack during the stall (empty if not captured)"},
+  {NULL},
+};
+
+PyStructSequence_Desc type_stall_desc = {
+  .name = "_core.Stall",
+  .doc = "An event loop stall.",
+  .fields = type_stall_fields,
+  .n_in_sequence = 3,
+};
+
+PyTypeObject type_stall;
+
+/**
+ * Dump the loop thread's Python stack.
+ *
+ * This runs on the watchdog thread without the GIL, which the loop thread is
+ * likely holding. Like faulthandler's watchdog, it walks the frames as they
+ * stand, and the dump is best effort if the loop moves on meanwhile.
+ *
+ * @param fd The file descriptor
+ * @param arg The watchdog object
+ */
+static void capture_python_stack(int fd, void* arg) {
+  watchdog_object* self = arg;
+
+  PyThreadState* tstate = __atomic_load_n(&self->tstate, __ATOMIC_ACQUIRE);
+  if (tstate != NULL) {
+    _Py_DumpTraceback(fd, tstate);
+  }
+}
+
+/**
+ * Stop the native watchdog.
+ *
+ * @param self The watchdog
+ */
+static void type_watchdog_close_native(watchdog_object* self) {
+  if (self->ready) {
+    watchdog_destroy(&self->wd);
+    self->ready = 0;
+  }
+
+  self->tstate = NULL;
+}
+
+static void type_watchdog_dealloc(watchdog_object* self) {
+  type_watchdog_close_native(self);
+  Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int type_watchdog_init(watchdog_object* self, PyObject* args, PyObject* kwds) {
+  static char* kwlist[] = {"interval", "threshold", NULL};
+
+  double interval = 0.01;
+  double threshold = 0.05;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dd", kwlist, &interval, &threshold)) {
+    return -1;
+  }
+
+  if (self->ready) {
+    PyErr_SetString(PyExc_RuntimeError, "watchdog already started");
+    return -1;
+  }
+
+  if (!(interval > 0) || !(threshold > 0)) {
+    PyErr_SetString(PyExc_ValueError, "interval and threshold must be positive");
+    return -1;
+  }
+
+  self->tstate = NULL;
+
+  if (watchdog_init(&self->wd, (uint64_t) (interval * 1e9), (uint64_t) (threshold * 1e9), &capture_python_stack,
+      self)) {
+    PyErr_SetString(PyExc_RuntimeError, "failed to start watchdog");
+    return -1;
+  }
+
+  self->ready = 1;
+  return 0;
+}
+
+/**
+ * Check that a watchdog is running.
+ *
+ * @param self The watchdog
+ * @return Zero if so, otherwise nonzero with an exception set
+ */
+static int check_open(watchdog_object* self) {
+  if (!self->ready) {
+    PyErr_SetString(PyExc_ValueError, "watchdog is closed");
+    return 1;
+  }
+
+  return 0;
+}
+
+static PyObject* type_watchdog_beat(watchdog_object* self) {
+  if (check_open(self)) {
+    return NULL;
+  }
+
+  // Whichever thread beats is the one watched
+  __atomic_store_n(&self->tstate, PyThreadState_Get(), __ATOMIC_RELEASE);
+
+  return PyBool_FromLong(watchdog_beat(&self->wd));
+}
+
+static PyObject* type_watchdog_unwatch(watchdog_object* self) {
+  // The thread that last beat may exit from here, so its state must not be walked again
+  __atomic_store_n(&self->tstate, NULL, __ATOMIC_RELEASE);
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_watchdog_stalls(watchdog_object* self) {
+  if (check_open(self)) {
+    return NULL;
+  }
+
+  struct watchdog_stall* stalls = PyMem_Malloc(WATCHDOG_RECENT * sizeof(*stalls));
+  if (stalls == NULL) {
+    return PyErr_NoMemory();
+  }
+
+  size_t n = watchdog_take(&self->wd, stalls, WATCHDOG_RECENT);
+
+  PyObject* result = PyList_New((Py_ssize_t) n);
+  if (result == NULL) {
+    PyMem_Free(stalls);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    PyObject* stall = PyStructSequence_New(&type_stall);
+    if (stall == NULL) {
+      Py_DECREF(result);
+      PyMem_Free(stalls);
+      return NULL;
+    }
+
+    PyStructSequence_SET_ITEM(stall, 0, PyFloat_FromDouble(stalls[i].at));
+    PyStructSequence_SET_ITEM(stall, 1, PyFloat_FromDouble((double) stalls[i].duration * 1e-9));
+    PyStructSequence_SET_ITEM(stall, 2, PyUnicode_DecodeUTF8(stalls[i].stack, strlen(stalls[i].stack), "replace"));
+
+    if (PyErr_Occurred()) {
+      Py_DECREF(stall);
+      Py_DECREF(result);
+      PyMem_Free(stalls);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(result, (Py_ssize_t) i, stall);
+  }
+
+  PyMem_Free(stalls);
+  return result;
+}
+
+/**
+ * Estimate a stall duration percentile from the histogram.
+ *
+ * @param stats The counters
+ * @param q The quantile (0 to 1)
+ * @return The duration, in seconds (the upper edge of the bucket it falls in)
+ */
+static double histogram_quantile(const struct watchdog_stats* stats, double q) {
+  uint64_t rank = (uint64_t) ((double) stats->stalls * q);
+  uint64_t seen = 0;
+
+  for (int i = 0; i < WATCHDOG_HISTOGRAM_BUCKETS; ++i) {
+    seen += stats->histogram[i];
+    if (seen > rank) {
+      return (double) (2ull << i) * 1e-3;
+    }
+  }
+
+  return 0;
+}
+
+static PyObject* type_watchdog_stats(watchdog_object* self) {
+  if (check_open(self)) {
+    return NULL;
+  }
+
+  struct watchdog_stats stats;
+  watchdog_stats(&self->wd, &stats);
+
+  // Bucket i counts stalls of [2^i, 2^(i+1)) milliseconds
+  PyObject* histogram = PyList_New(WATCHDOG_HISTOGRAM_BUCKETS);
+  if (histogram == NULL) {
+    return NULL;
+  }
+
+  for (int i = 0; i < WATCHDOG_HISTOGRAM_BUCKETS; ++i) {
+    PyObject* count = PyLong_FromUnsignedLongLong(stats.histogram[i]);
+    if (count == NULL) {
+      Py_DECREF(histogram);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(histogram, i, count);
+  }
+
+  return Py_BuildValue("{s:K,s:K,s:K,s:d,s:d,s:d,s:d,s:N}",
+    "beats", (unsigned long long) stats.beats,
+    "stalls", (unsigned long long) stats.stalls,
+    "dropped", (unsigned long long) stats.dropped,
+    "stall_mean", stats.stalls ? (double) stats.stall_total / (double) stats.stalls * 1e-9 : 0.0,
+    "stall_max", (double) stats.stall_max * 1e-9,
+    "p50", histogram_quantile(&stats, 0.5),
+    "p99", histogram_quantile(&stats, 0.99),
+    "histogram", histogram);
+}
+
+static PyObject* type_watchdog_close(watchdog_object* self) {
+  type_watchdog_close_native(self);
+  Py_RETURN_NONE;
+}
+
+static PyObject* type_watchdog_get_interval(watchdog_object* self, void* closure) {
+  return PyFloat_FromDouble((double) self->wd.interval * 1e-9);
+}
+
+static PyObject* type_watchdog_get_threshold(watchdog_object* self, void* closure) {
+  return PyFloat_FromDouble((double) self->wd.threshold * 1e-9);
+}
+
+/** _core.Watchdog methods. */
+static PyMethodDef type_watchdog_methods[] = {
+  {
+    .ml_name = "beat",
+    .ml_meth = (PyCFunction) type_watchdog_beat,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Beat from the loop thread once per interval, returning whether the beat ended a stall",
+  },
+  {
+    .ml_name = "unwatch",
+    .ml_meth = (PyCFunction) type_watchdog_unwatch,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Stop capturing the stack of the thread that last beat (call before it stops beating)",
+  },
+  {
+    .ml_name = "stalls",
+    .ml_meth = (PyCFunction) type_watchdog_stalls,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Take the stalls recorded since the last call, oldest first",
+  },
+  {
+    .ml_name = "stats",
+    .ml_meth = (PyCFunction) type_watchdog_stats,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Return the beat and stall counters and stall duration histogram as a dictionary",
+  },
+  {
+    .ml_name = "close",
+    .ml_meth = (PyCFunction) type_watchdog_close,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Stop the watchdog thread",
+  },
+  {NULL},
+};
+
+/** _core.Watchdog getters and setters. */
+static PyGetSetDef type_watchdog_getset[] = {
+  {
+    .name = "interval",
+    .get = (getter) type_watchdog_get_interval,
+    .set = NULL,
+    .doc = "the heartbeat interval, in seconds",
+    .closure = NULL,
+  },
+  {
+    .name = "threshold",
+    .get = (getter) type_watchdog_get_threshold,
+    .set = NULL,
+    .doc = "the lateness that counts as a stall, in seconds",
+    .closure = NULL,
+  },
+  {NULL},
+};
+
+/** _core.Watchdog type. */
+PyTypeObject type_watchdog = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_core.Watchdog",
+  .tp_basicsize = sizeof(watchdog_object),
+  .tp_itemsize = 0,
+  .tp_dealloc = (destructor) type_watchdog_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "A thread that catches event loop stalls and the Python stack behind them.",
+  .tp_methods = type_watchdog_methods,
+  .tp_getset = type_watchdog_getset,
+  .tp_init = (initproc) type_watchdog_init,
+  .tp_new = PyType_GenericNew,
+};
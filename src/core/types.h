@@ -0,0 +1,422 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_TYPES_H
+#define CORE_TYPES_H
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "arena.h"
+#include "completion.h"
+#include "detections.h"
+#include "encounter_log.h"
+#include "face_quality.h"
+#include "frame_ring.h"
+#include "friend_index.h"
+#include "friend_snapshot.h"
+#include "handle_queue.h"
+#include "jpeg_decoder.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "sql.h"
+#include "topology.h"
+#include "watchdog.h"
+
+/** _core.CompletionChannel instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native channel. */
+  struct completion_channel channel;
+
+  /** Nonzero if the native channel is initialized. */
+  int ready;
+} completion_channel_object;
+
+/** _core.CompletionChannel type. */
+extern PyTypeObject type_completion_channel;
+
+/** _core.SqlClient instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The completion channel (strong reference). */
+  completion_channel_object* channel;
+
+  /** The native client. */
+  struct sql_client client;
+
+  /** Nonzero while the native client is running. */
+  int open;
+} sql_client_object;
+
+/** _core.SqlClient type. */
+extern PyTypeObject type_sql_client;
+
+/** _core.EncounterLog instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native log. */
+  struct encounter_log log;
+
+  /** Nonzero while the native log is running. */
+  int open;
+} encounter_log_object;
+
+/** _core.EncounterLog type. */
+extern PyTypeObject type_encounter_log;
+
+/** _core.FrameRing instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native ring (attached as a consumer). */
+  struct frame_ring ring;
+
+  /** Nonzero while attached. */
+  int open;
+
+  /** The lowest frame number the next wait accepts. */
+  uint64_t next;
+
+  /** The number of frames skipped because newer ones were available. */
+  uint64_t dropped;
+
+  /** The number of waits in progress (with the GIL released). */
+  int waiting;
+
+  /** The number of frame buffers exported. The mapping must outlive them. */
+  Py_ssize_t exports;
+} frame_ring_object;
+
+/** _core.FrameRing type. */
+extern PyTypeObject type_frame_ring;
+
+/** _core.Frame instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The ring the frame lives in (strong reference). */
+  frame_ring_object* ring;
+
+  /** The native view. */
+  struct frame_view view;
+} frame_object;
+
+/** _core.Frame type. */
+extern PyTypeObject type_frame;
+
+/** _core.JpegDecoder instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native decoder. */
+  struct jpeg_decoder dec;
+
+  /** Nonzero if the native decoder is initialized. */
+  int ready;
+
+  /** Nonzero while a decode runs without the GIL. */
+  int busy;
+} jpeg_decoder_object;
+
+/** _core.JpegDecoder type. */
+extern PyTypeObject type_jpeg_decoder;
+
+/** _core.Arena instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native arena. */
+  struct arena arena;
+
+  /** Nonzero if the native arena is initialized. */
+  int ready;
+
+  /** The number of buffer views into the arena. A reset must wait for them. */
+  Py_ssize_t exports;
+} arena_object;
+
+/** _core.Arena type. */
+extern PyTypeObject type_arena;
+
+/** _core.ArenaBuffer instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The arena (strong reference). */
+  arena_object* arena;
+
+  /** The memory. */
+  void* data;
+
+  /** The memory length. */
+  Py_ssize_t len;
+
+  /** The arena reset count when the memory was allocated. */
+  uint64_t generation;
+} arena_buffer_object;
+
+/** _core.ArenaBuffer type. */
+extern PyTypeObject type_arena_buffer;
+
+/**
+ * Allocate from an arena for a Python-visible object.
+ *
+ * @param self The arena
+ * @param size The size
+ * @param align The alignment (a power of two)
+ * @return The memory, or NULL with an exception set
+ */
+void* arena_object_alloc(arena_object* self, size_t size, size_t align);
+
+/**
+ * Check that memory allocated from an arena is still live.
+ *
+ * @param self The arena
+ * @param generation The arena reset count when the memory was allocated
+ * @return Zero if live, otherwise nonzero with an exception set
+ */
+int arena_object_check(arena_object* self, uint64_t generation);
+
+/** _core.Detections instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native detections. */
+  struct detections det;
+
+  /** The heap memory behind the columns, or NULL if they live in an arena. */
+  void* mem;
+
+  /** The arena behind the columns (strong reference), or NULL. */
+  arena_object* arena;
+
+  /** The arena reset count when the columns were allocated. */
+  uint64_t generation;
+
+  /** The number of column views exported. The columns can't move while any exist. */
+  Py_ssize_t exports;
+} detections_object;
+
+/** _core.Detections type. */
+extern PyTypeObject type_detections;
+
+/** _core.DetectionsColumn instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The detections (strong reference). */
+  detections_object* owner;
+
+  /** The column. */
+  enum detections_column column;
+
+  /** The exported shape. */
+  Py_ssize_t shape[2];
+
+  /** The exported strides. */
+  Py_ssize_t strides[2];
+} detections_column_object;
+
+/** _core.DetectionsColumn type. */
+extern PyTypeObject type_detections_column;
+
+/** _core.Detection type (a struct sequence). */
+extern PyTypeObject type_detection;
+
+/** _core.Detection fields. */
+extern PyStructSequence_Desc type_detection_desc;
+
+/**
+ * Check that detections columns are still live (i.e. their arena has not
+ * been reset).
+ *
+ * @param self The detections
+ * @return Zero if live, otherwise nonzero with an exception set
+ */
+int detections_object_check(detections_object* self);
+
+/** _core.FaceQuality instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The thresholds. */
+  struct face_quality_params params;
+} face_quality_object;
+
+/** _core.FaceQuality type. */
+extern PyTypeObject type_face_quality;
+
+/** _core.FaceScore type (a struct sequence). */
+extern PyTypeObject type_face_score;
+
+/** _core.FaceScore fields. */
+extern PyStructSequence_Desc type_face_score_desc;
+
+/** _core.FriendIndex instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native index. */
+  struct friend_index idx;
+
+  /** The embedding dimension. */
+  Py_ssize_t dim;
+
+  /** Nonzero if the native index is initialized. */
+  int ready;
+
+  /** Nonzero while training runs without the GIL. */
+  int busy;
+
+  /** The searches running without the GIL (read and written atomically, since scheduler workers finish them). */
+  int searches;
+
+  /** Nonzero if backed by a snapshot file and a write-ahead log. */
+  int persistent;
+
+  /** Nonzero while a compaction runs without the GIL. */
+  int compacting;
+
+  /** The snapshot file path. */
+  char* snapshot_path;
+
+  /** The mapped snapshot. */
+  struct friend_snapshot snapshot;
+
+  /** This process's write-ahead log. */
+  struct friend_wal wal;
+
+  /** The log offset up to which records are in a snapshot on disk. */
+  off_t folded;
+
+  /** The SQL watermark: the last database change (friend_changes.seq) the index reflects. */
+  uint64_t watermark;
+} friend_index_object;
+
+/** _core.FriendIndex type. */
+extern PyTypeObject type_friend_index;
+
+/** _core.HandleQueue instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native queue (allocated apart, for its cache line alignment), or NULL. */
+  struct handle_queue* queue;
+} handle_queue_object;
+
+/** _core.HandleQueue type. */
+extern PyTypeObject type_handle_queue;
+
+/** _core.Scheduler instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The completion channel tasks report to (strong reference). */
+  completion_channel_object* channel;
+
+  /** The native scheduler (allocated apart, for its cache line alignment), or NULL once closed. */
+  struct scheduler* sched;
+} scheduler_object;
+
+/** _core.Scheduler type. */
+extern PyTypeObject type_scheduler;
+
+/**
+ * Native work run on a scheduler worker without the GIL, then resolved on the
+ * event loop through the scheduler's completion channel.
+ *
+ * Ops embed this at the head of their own structures. Run fills in the
+ * result and ends with scheduler_op_done; resolve and destroy then run with
+ * the GIL held, as for any completion.
+ */
+struct scheduler_op {
+  /** The completion (first, so the channel can cast back). */
+  struct completion base;
+
+  /** The task. */
+  struct scheduler_task task;
+
+  /** The channel to post to when done. */
+  struct completion_channel* channel;
+};
+
+/**
+ * Submit native work to a scheduler.
+ *
+ * @param self The scheduler
+ * @param op The op, with base.resolve, base.destroy and task.run set (destroyed on failure)
+ * @param priority The frame timestamp (older runs first), or None for now
+ * @param kind The task kind, for latency stats
+ * @return The completion ticket, or NULL with an exception set
+ */
+PyObject* scheduler_object_submit(scheduler_object* self, struct scheduler_op* op, PyObject* priority,
+    const char* kind);
+
+/**
+ * Get the op a task belongs to.
+ *
+ * @param task The task
+ * @return The op
+ */
+struct scheduler_op* scheduler_op_of(struct scheduler_task* task);
+
+/**
+ * Post a finished op to its channel. The op must not be touched afterward.
+ *
+ * @param op The op
+ */
+void scheduler_op_done(struct scheduler_op* op);
+
+/** _core.Topology instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native topology. */
+  struct topology topo;
+
+  /** Nonzero if the native topology is loaded. */
+  int ready;
+} topology_object;
+
+/** _core.Topology type. */
+extern PyTypeObject type_topology;
+
+/** _core.Placement type (a struct sequence). */
+extern PyTypeObject type_placement;
+
+/** _core.Placement fields. */
+extern PyStructSequence_Desc type_placement_desc;
+
+/** _core.Watchdog instance. */
+typedef struct {
+  PyObject_HEAD
+
+  /** The native watchdog. */
+  struct watchdog wd;
+
+  /** Nonzero if the native watchdog is running. */
+  int ready;
+
+  /** The thread state of the loop thread, set on each beat (read atomically by the watchdog thread). */
+  PyThreadState* tstate;
+} watchdog_object;
+
+/** _core.Watchdog type. */
+extern PyTypeObject type_watchdog;
+
+/** _core.Stall type (a struct sequence). */
+extern PyTypeObject type_stall;
+
+/** _core.Stall fields. */
+extern PyStructSequence_Desc type_stall_desc;
+
+/** _core.SqlError exception type. */
+extern PyObject* core_sql_error;
+
+#endif // #ifndef CORE_TYPES_H
@@ -0,0 +1,227 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "watchdog.h"
+
+/** The shortest time between checks, in nanoseconds. */
+#define WATCHDOG_MIN_PERIOD 1000000ull
+
+/**
+ * Get the monotonic time.
+ *
+ * @return The time, in nanoseconds
+ */
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Capture the watched thread's stack.
+ *
+ * @param wd The watchdog
+ * @param out The stack (WATCHDOG_STACK_MAX bytes)
+ */
+static void capture_stack(struct watchdog* wd, char* out) {
+  size_t len = 0;
+
+  if (ftruncate(wd->fd, 0) == 0 && lseek(wd->fd, 0, SEEK_SET) == 0) {
+    wd->capture(wd->fd, wd->capture_arg);
+
+    while (len < WATCHDOG_STACK_MAX - 1) {
+      ssize_t n = pread(wd->fd, out + len, WATCHDOG_STACK_MAX - 1 - len, (off_t) len);
+      if (n <= 0) {
+        break;
+      }
+
+      len += (size_t) n;
+    }
+  }
+
+  out[len] = '\0';
+}
+
+/**
+ * Watch for stalls.
+ *
+ * @param arg The watchdog
+ * @return NULL
+ */
+static void* watchdog_main(void* arg) {
+  struct watchdog* wd = arg;
+  char stack[WATCHDOG_STACK_MAX];
+
+  // Check in often enough to catch a stall soon after it crosses the threshold
+  uint64_t period = wd->threshold / 4;
+  if (period < WATCHDOG_MIN_PERIOD) {
+    period = WATCHDOG_MIN_PERIOD;
+  }
+
+  pthread_mutex_lock(&wd->lock);
+
+  while (!wd->stopping) {
+    uint64_t deadline = now_ns() + period;
+    struct timespec ts = {
+      .tv_sec = (time_t) (deadline / 1000000000ull),
+      .tv_nsec = (long) (deadline % 1000000000ull),
+    };
+    pthread_cond_timedwait(&wd->wake, &wd->lock, &ts);
+
+    if (wd->stopping) {
+      break;
+    }
+
+    uint64_t last = __atomic_load_n(&wd->last_beat, __ATOMIC_ACQUIRE);
+
+    // No beats yet, or this stall was already captured
+    if (last == 0 || last == wd->captured_beat) {
+      continue;
+    }
+
+    if (now_ns() - last <= wd->interval + wd->threshold) {
+      continue;
+    }
+
+    // The watched thread is stuck; a beat may come in meanwhile, so don't hold it up
+    pthread_mutex_unlock(&wd->lock);
+    capture_stack(wd, stack);
+    pthread_mutex_lock(&wd->lock);
+
+    // Keep the stack only if it belongs to the stall still going on
+    if (__atomic_load_n(&wd->last_beat, __ATOMIC_ACQUIRE) == last) {
+      memcpy(wd->pending, stack, sizeof(wd->pending));
+      wd->captured_beat = last;
+    }
+  }
+
+  pthread_mutex_unlock(&wd->lock);
+  return NULL;
+}
+
+int watchdog_init(struct watchdog* wd, uint64_t interval, uint64_t threshold, watchdog_capture_fn capture,
+    void* capture_arg) {
+  memset(wd, 0, sizeof(*wd));
+  wd->interval = interval;
+  wd->threshold = threshold;
+  wd->capture = capture;
+  wd->capture_arg = capture_arg;
+
+  // Stacks are written to a file descriptor, and this one never touches a disk
+  wd->fd = memfd_create("watchdog", MFD_CLOEXEC);
+  if (wd->fd < 0) {
+    perror("watchdog: memfd_create");
+    return 1;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wd->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&wd->lock, NULL);
+
+  if (pthread_create(&wd->thread, NULL, &watchdog_main, wd)) {
+    fprintf(stderr, "watchdog: failed to start thread\n");
+    pthread_cond_destroy(&wd->wake);
+    pthread_mutex_destroy(&wd->lock);
+    close(wd->fd);
+    return 1;
+  }
+
+  return 0;
+}
+
+void watchdog_destroy(struct watchdog* wd) {
+  pthread_mutex_lock(&wd->lock);
+  wd->stopping = 1;
+  pthread_cond_signal(&wd->wake);
+  pthread_mutex_unlock(&wd->lock);
+
+  pthread_join(wd->thread, NULL);
+
+  pthread_cond_destroy(&wd->wake);
+  pthread_mutex_destroy(&wd->lock);
+  close(wd->fd);
+}
+
+int watchdog_beat(struct watchdog* wd) {
+  uint64_t now = now_ns();
+  uint64_t prev = __atomic_exchange_n(&wd->last_beat, now, __ATOMIC_ACQ_REL);
+
+  __atomic_add_fetch(&wd->beats, 1, __ATOMIC_RELAXED);
+
+  if (prev == 0 || now - prev <= wd->interval + wd->threshold) {
+    return 0;
+  }
+
+  uint64_t lag = now - prev - wd->interval;
+
+  unsigned int bucket = 0;
+  for (uint64_t ms = lag / 1000000; ms >= 2 && bucket < WATCHDOG_HISTOGRAM_BUCKETS - 1; ms >>= 1) {
+    ++bucket;
+  }
+
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+
+  pthread_mutex_lock(&wd->lock);
+
+  wd->stats.stalls++;
+  wd->stats.stall_total += lag;
+  if (lag > wd->stats.stall_max) {
+    wd->stats.stall_max = lag;
+  }
+  wd->stats.histogram[bucket]++;
+
+  // Make room by dropping the oldest stall nobody took
+  if (wd->recent_head - wd->recent_tail == WATCHDOG_RECENT) {
+    wd->recent_tail++;
+    wd->stats.dropped++;
+  }
+
+  struct watchdog_stall* stall = &wd->recent[wd->recent_head % WATCHDOG_RECENT];
+  stall->at = (double) wall.tv_sec + (double) wall.tv_nsec * 1e-9 - (double) lag * 1e-9;
+  stall->duration = lag;
+
+  // The watchdog may not have got to this stall if it ended just past the threshold
+  if (wd->captured_beat == prev) {
+    memcpy(stall->stack, wd->pending, sizeof(stall->stack));
+  } else {
+    stall->stack[0] = '\0';
+  }
+
+  wd->recent_head++;
+
+  pthread_mutex_unlock(&wd->lock);
+  return 1;
+}
+
+size_t watchdog_take(struct watchdog* wd, struct watchdog_stall* out, size_t max) {
+  size_t n = 0;
+
+  pthread_mutex_lock(&wd->lock);
+
+  while (n < max && wd->recent_tail < wd->recent_head) {
+    out[n++] = wd->recent[wd->recent_tail++ % WATCHDOG_RECENT];
+  }
+
+  pthread_mutex_unlock(&wd->lock);
+  return n;
+}
+
+void watchdog_stats(struct watchdog* wd, struct watchdog_stats* stats) {
+  pthread_mutex_lock(&wd->lock);
+  *stats = wd->stats;
+  pthread_mutex_unlock(&wd->lock);
+
+  stats->beats = __atomic_load_n(&wd->beats, __ATOMIC_RELAXED);
+}
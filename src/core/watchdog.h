@@ -0,0 +1,169 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef CORE_WATCHDOG_H
+#define CORE_WATCHDOG_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The longest stack kept per stall. */
+#define WATCHDOG_STACK_MAX 4096
+
+/** The stalls kept until they are taken. Older ones are dropped. */
+#define WATCHDOG_RECENT 16
+
+/** The stall histogram buckets (powers of two of milliseconds). */
+#define WATCHDOG_HISTOGRAM_BUCKETS 16
+
+/**
+ * Write the stack of the watched thread to a file descriptor. Called on the
+ * watchdog thread while the watched thread is stalled, so it must not wait
+ * on anything the watched thread might hold.
+ */
+typedef void (* watchdog_capture_fn)(int fd, void* arg);
+
+/** A stall of the watched thread. */
+struct watchdog_stall {
+  /** When the stall began (wall-clock seconds). */
+  double at;
+
+  /** How long the stall lasted past the heartbeat interval, in nanoseconds. */
+  uint64_t duration;
+
+  /** The stack captured during the stall, or empty if it ended before it could be captured. */
+  char stack[WATCHDOG_STACK_MAX];
+};
+
+/** Watchdog counters. */
+struct watchdog_stats {
+  /** The heartbeats seen. */
+  uint64_t beats;
+
+  /** The stalls seen. */
+  uint64_t stalls;
+
+  /** The stalls dropped before they were taken. */
+  uint64_t dropped;
+
+  /** The total stall time, in nanoseconds. */
+  uint64_t stall_total;
+
+  /** The longest stall, in nanoseconds. */
+  uint64_t stall_max;
+
+  /** Counts of stall durations, bucket i holding [2^i, 2^(i+1)) milliseconds. */
+  uint64_t histogram[WATCHDOG_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * A watchdog for an event loop thread.
+ *
+ * The loop beats at a fixed interval. A beat arriving more than the threshold
+ * late ends a stall, which is counted and kept with the stack captured while
+ * it was going on. The stack comes from a thread of the watchdog's own, which
+ * checks in several times per threshold and captures once per stall.
+ */
+struct watchdog {
+  /** The heartbeat interval, in nanoseconds. */
+  uint64_t interval;
+
+  /** The lateness that counts as a stall, in nanoseconds. */
+  uint64_t threshold;
+
+  /** The stack capture function. */
+  watchdog_capture_fn capture;
+
+  /** The capture function argument. */
+  void* capture_arg;
+
+  /** The file the stack is captured into (in memory). */
+  int fd;
+
+  /** The thread. */
+  pthread_t thread;
+
+  /** The time of the last beat (monotonic nanoseconds, zero before the first, read without the lock). */
+  uint64_t last_beat;
+
+  /** The heartbeats seen (counted without the lock). */
+  uint64_t beats;
+
+  /** The lock guarding everything below. */
+  pthread_mutex_t lock;
+
+  /** Signaled to stop the thread. */
+  pthread_cond_t wake;
+
+  /** Nonzero once the thread should exit. */
+  int stopping;
+
+  /** The beat the pending stack was captured after (zero for none). */
+  uint64_t captured_beat;
+
+  /** The stack captured for the stall in progress. */
+  char pending[WATCHDOG_STACK_MAX];
+
+  /** The counters. */
+  struct watchdog_stats stats;
+
+  /** The stalls not yet taken (a ring). */
+  struct watchdog_stall recent[WATCHDOG_RECENT];
+
+  /** The stalls recorded. */
+  uint64_t recent_head;
+
+  /** The stalls taken or dropped. */
+  uint64_t recent_tail;
+};
+
+/**
+ * Start a watchdog.
+ *
+ * @param wd The watchdog
+ * @param interval The heartbeat interval, in nanoseconds
+ * @param threshold The lateness that counts as a stall, in nanoseconds
+ * @param capture The stack capture function
+ * @param capture_arg The capture function argument
+ * @return Zero on success, otherwise nonzero
+ */
+int watchdog_init(struct watchdog* wd, uint64_t interval, uint64_t threshold, watchdog_capture_fn capture,
+    void* capture_arg);
+
+/**
+ * Stop a watchdog.
+ *
+ * @param wd The watchdog
+ */
+void watchdog_destroy(struct watchdog* wd);
+
+/**
+ * Beat. Called from the watched thread once per interval.
+ *
+ * @param wd The watchdog
+ * @return Nonzero if the beat ended a stall, otherwise zero
+ */
+int watchdog_beat(struct watchdog* wd);
+
+/**
+ * Take the stalls recorded since the last take, oldest first.
+ *
+ * @param wd The watchdog
+ * @param out The stalls
+ * @param max The most stalls to take
+ * @return The number taken
+ */
+size_t watchdog_take(struct watchdog* wd, struct watchdog_stall* out, size_t max);
+
+/**
+ * Copy the counters.
+ *
+ * @param wd The watchdog
+ * @param stats The counters
+ */
+void watchdog_stats(struct watchdog* wd, struct watchdog_stats* stats);
+
+#endif // #ifndef CORE_WATCHDOG_H
@@ -0,0 +1,303 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "friend_csv.h"
+
+/** The base64 alphabet. */
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * Map a base64 character to its value.
+ *
+ * @param c The character
+ * @return The value, or -1 if not a base64 character
+ */
+static int base64_value(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  } else if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  } else if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  } else if (c == '+') {
+    return 62;
+  } else if (c == '/') {
+    return 63;
+  }
+
+  return -1;
+}
+
+size_t base64_decode_inplace(char* data, size_t len) {
+  // Ignore padding
+  while (len > 0 && data[len - 1] == '=') {
+    --len;
+  }
+
+  // A single leftover character can't encode anything
+  if (len % 4 == 1) {
+    return (size_t) -1;
+  }
+
+  // Output never overtakes input, so decoding in place is safe
+  size_t out = 0;
+  unsigned int acc = 0;
+  int bits = 0;
+  for (size_t i = 0; i < len; ++i) {
+    int v = base64_value(data[i]);
+    if (v < 0) {
+      return (size_t) -1;
+    }
+
+    acc = (acc << 6) | (unsigned int) v;
+    bits += 6;
+
+    if (bits >= 8) {
+      bits -= 8;
+      data[out++] = (char) (acc >> bits);
+      acc &= (1u << bits) - 1;
+    }
+  }
+
+  return out;
+}
+
+/**
+ * Write bytes as base64.
+ *
+ * @param w The writer
+ * @param data The bytes
+ * @param len The number of bytes
+ */
+static void base64_write(struct writer* w, const unsigned char* data, size_t len) {
+  // Encode in chunks that fit on the stack
+  char chunk[1024];
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i += 3) {
+    unsigned int v = (unsigned int) data[i] << 16;
+    if (i + 1 < len) {
+      v |= (unsigned int) data[i + 1] << 8;
+    }
+    if (i + 2 < len) {
+      v |= data[i + 2];
+    }
+
+    chunk[n++] = BASE64_ALPHABET[v >> 18 & 63];
+    chunk[n++] = BASE64_ALPHABET[v >> 12 & 63];
+    chunk[n++] = i + 1 < len ? BASE64_ALPHABET[v >> 6 & 63] : '=';
+    chunk[n++] = i + 2 < len ? BASE64_ALPHABET[v & 63] : '=';
+
+    if (n == sizeof chunk) {
+      writer_put(w, chunk, n);
+      n = 0;
+    }
+  }
+
+  writer_put(w, chunk, n);
+}
+
+void friend_csv_write_header(struct writer* w) {
+  writer_puts(w, "id,name,embedding\n");
+}
+
+void friend_csv_write(struct writer* w, long long id, const char* name, size_t name_len,
+    const unsigned char* embedding, size_t embedding_len) {
+  writer_put_int(w, id);
+  writer_putc(w, ',');
+
+  // Always quote names, doubling any quotes inside
+  writer_putc(w, '"');
+  size_t run = 0;
+  for (size_t i = 0; i < name_len; ++i) {
+    if (name[i] == '"') {
+      writer_put(w, name + run, i + 1 - run);
+      run = i;
+    }
+  }
+  writer_put(w, name + run, name_len - run);
+  writer_putc(w, '"');
+
+  writer_putc(w, ',');
+  base64_write(w, embedding, embedding_len);
+  writer_putc(w, '\n');
+}
+
+void friend_csv_reader_init(struct friend_csv_reader* r, FILE* file) {
+  memset(r, 0, sizeof *r);
+  r->file = file;
+  r->line = 1;
+}
+
+void friend_csv_reader_release(struct friend_csv_reader* r) {
+  free(r->name);
+  free(r->embedding);
+  r->name = NULL;
+  r->embedding = NULL;
+}
+
+/**
+ * Append a character to a growable field buffer.
+ *
+ * @param buf The buffer
+ * @param cap The buffer capacity
+ * @param len The field length
+ * @param c The character
+ * @return Zero on success, otherwise nonzero
+ */
+static int field_push(char** buf, size_t* cap, size_t* len, char c) {
+  if (*len + 1 >= *cap) {
+    size_t new_cap = *cap ? *cap * 2 : 256;
+    char* b = realloc(*buf, new_cap);
+    if (b == NULL) {
+      return 1;
+    }
+
+    *buf = b;
+    *cap = new_cap;
+  }
+
+  (*buf)[(*len)++] = c;
+  (*buf)[*len] = '\0';
+  return 0;
+}
+
+/**
+ * Skip to the start of the next line.
+ *
+ * @param r The reader
+ */
+static void skip_line(struct friend_csv_reader* r) {
+  int c;
+  while ((c = getc_unlocked(r->file)) != EOF && c != '\n');
+  ++r->line;
+}
+
+int friend_csv_read(struct friend_csv_reader* r, struct friend_record* rec) {
+  int c;
+
+  while (1) {
+    // Skip blank lines
+    c = getc_unlocked(r->file);
+    while (c == '\r' || c == '\n') {
+      if (c == '\n') {
+        ++r->line;
+      }
+      c = getc_unlocked(r->file);
+    }
+
+    if (c == EOF) {
+      return 0;
+    }
+
+    // The id field
+    if (c < '0' || c > '9') {
+      // Tolerate the header, but only as the first line
+      if (r->line == 1 && c == 'i') {
+        skip_line(r);
+        continue;
+      }
+
+      fprintf(stderr, "line %lld: malformed friend id\n", r->line);
+      return -1;
+    }
+
+    // IDs go in an INT UNSIGNED column but the friend index holds them as int32_t, so the latter bounds them
+    long long id = 0;
+    while (c >= '0' && c <= '9') {
+      id = id * 10 + (c - '0');
+      if (id > INT32_MAX) {
+        fprintf(stderr, "line %lld: friend id out of range (the most is %d)\n", r->line, INT32_MAX);
+        return -1;
+      }
+
+      c = getc_unlocked(r->file);
+    }
+
+    if (c != ',') {
+      fprintf(stderr, "line %lld: expected comma after friend id\n", r->line);
+      return -1;
+    }
+
+    // The name field
+    size_t name_len = 0;
+    if (field_push(&r->name, &r->name_cap, &name_len, '\0')) {
+      return -1;
+    }
+    name_len = 0;
+
+    c = getc_unlocked(r->file);
+    if (c == '"') {
+      // Quoted, with doubled quotes inside (may span lines)
+      while (1) {
+        c = getc_unlocked(r->file);
+        if (c == EOF) {
+          fprintf(stderr, "line %lld: unterminated friend name\n", r->line);
+          return -1;
+        }
+
+        if (c == '"') {
+          c = getc_unlocked(r->file);
+          if (c != '"') {
+            break;
+          }
+        } else if (c == '\n') {
+          ++r->line;
+        }
+
+        if (field_push(&r->name, &r->name_cap, &name_len, (char) c)) {
+          return -1;
+        }
+      }
+    } else {
+      // Bare
+      while (c != ',' && c != '\n' && c != EOF) {
+        if (field_push(&r->name, &r->name_cap, &name_len, (char) c)) {
+          return -1;
+        }
+        c = getc_unlocked(r->file);
+      }
+    }
+
+    if (c != ',') {
+      fprintf(stderr, "line %lld: expected comma after friend name\n", r->line);
+      return -1;
+    }
+
+    // The embedding field
+    size_t embedding_len = 0;
+    if (field_push(&r->embedding, &r->embedding_cap, &embedding_len, '\0')) {
+      return -1;
+    }
+    embedding_len = 0;
+
+    while ((c = getc_unlocked(r->file)) != EOF && c != '\n') {
+      if (c != '\r' && field_push(&r->embedding, &r->embedding_cap, &embedding_len, (char) c)) {
+        return -1;
+      }
+    }
+
+    embedding_len = base64_decode_inplace(r->embedding, embedding_len);
+    if (embedding_len == (size_t) -1) {
+      fprintf(stderr, "line %lld: malformed embedding\n", r->line);
+      return -1;
+    }
+
+    if (c == '\n') {
+      ++r->line;
+    }
+
+    rec->id = id;
+    rec->name = r->name;
+    rec->name_len = name_len;
+    rec->embedding = (const unsigned char*) r->embedding;
+    rec->embedding_len = embedding_len;
+    return 1;
+  }
+}
@@ -0,0 +1,117 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef FRIEND_CSV_H
+#define FRIEND_CSV_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "writer.h"
+
+/*
+ * The friend interchange format is CSV with a header line:
+ *
+ *   id,name,embedding
+ *   1,"Ada Lovelace",AAAgQAAAQEA...
+ *
+ * IDs run from 0 to INT32_MAX. Names are always quoted (quotes doubled).
+ * Embeddings are base64 of the raw little-endian float32 vector, as stored in
+ * the friends table, and may be empty.
+ */
+
+/** A friend record read from CSV. Pointers stay valid until the next read. */
+struct friend_record {
+  /** The friend ID. */
+  long long id;
+
+  /** The friend name (UTF-8, null-terminated). */
+  const char* name;
+
+  /** The friend name length. */
+  size_t name_len;
+
+  /** The embedding bytes. */
+  const unsigned char* embedding;
+
+  /** The embedding length in bytes. */
+  size_t embedding_len;
+};
+
+/** A streaming CSV reader for friend records. */
+struct friend_csv_reader {
+  /** The input file. */
+  FILE* file;
+
+  /** The current line number (for error messages). */
+  long long line;
+
+  /** The name field buffer. */
+  char* name;
+
+  /** The name field capacity. */
+  size_t name_cap;
+
+  /** The embedding field buffer (decoded in place). */
+  char* embedding;
+
+  /** The embedding field capacity. */
+  size_t embedding_cap;
+};
+
+/**
+ * Initialize a reader. Skips the header line if present.
+ *
+ * @param r The reader
+ * @param file The input file
+ */
+void friend_csv_reader_init(struct friend_csv_reader* r, FILE* file);
+
+/**
+ * Read the next record.
+ *
+ * @param r The reader
+ * @param [out] rec The record
+ * @return One if a record was read, zero at end of input, negative on error
+ */
+int friend_csv_read(struct friend_csv_reader* r, struct friend_record* rec);
+
+/**
+ * Release a reader's buffers (does not close the file).
+ *
+ * @param r The reader
+ */
+void friend_csv_reader_release(struct friend_csv_reader* r);
+
+/**
+ * Write the header line.
+ *
+ * @param w The writer
+ */
+void friend_csv_write_header(struct writer* w);
+
+/**
+ * Write one record.
+ *
+ * @param w The writer
+ * @param id The friend ID
+ * @param name The friend name
+ * @param name_len The friend name length
+ * @param embedding The embedding bytes
+ * @param embedding_len The embedding length
+ */
+void friend_csv_write(struct writer* w, long long id, const char* name, size_t name_len,
+    const unsigned char* embedding, size_t embedding_len);
+
+/**
+ * Decode base64 in place.
+ *
+ * @param data The base64 text, overwritten with the decoded bytes
+ * @param len The text length
+ * @return The decoded length, or (size_t) -1 if the text is malformed
+ */
+size_t base64_decode_inplace(char* data, size_t len);
+
+#endif // #ifndef FRIEND_CSV_H
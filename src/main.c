@@ -3,220 +3,28 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "op/batch.h"
+#include "op/friend_add.h"
+#include "op/friend_export.h"
+#include "op/friend_import.h"
 #include "op/friend_list.h"
 #include "op/friend_remove.h"
 #include "op/interact.h"
+#include "op/stats_memory.h"
 
+#include "command.h"
+#include "command_tree.h"
 #include "global.h"
+#include "sampling_profile.h"
+#include "startup_profile.h"
 #include "version.h"
 
-/** A program operation. */
-enum operation {
-  op_nop = 0,
-  op_friend_list,
-  op_friend_remove,
-  op_interact,
-};
-
-/** A command-line option. */
-struct option {
-  /** The number of aliases. */
-  size_t num_aliases;
-
-  /** The option aliases. */
-  const char** aliases;
-
-  /** The option description. */
-  const char* description;
-
-  /** Whether the option is a flag. A flag has no data. */
-  int is_flag;
-
-  /** The option data storage. */
-  const char** data;
-};
-
-/** A command-line subcommand. */
-struct subcommand {
-  /** The command canonical name. */
-  const char* canon_name;
-
-  /** The command description. */
-  const char* description;
-
-  /** The number of aliases. */
-  size_t num_aliases;
-
-  /** The command aliases. */
-  const char** aliases;
-
-  /** The command operation. */
-  enum operation operation;
-
-  /** The number of subcommands. */
-  size_t num_subcommands;
-
-  /** The command subcommands. */
-  const struct subcommand* subcommands;
-
-  /** The number of options. */
-  size_t num_options;
-
-  /** The command options. */
-  const struct option* options;
-};
-
-/** Option data for help flag. */
-static const char* g_opt_data_help;
-
-/** Option data for legal flag. */
-static const char* g_opt_data_legal;
-
-/** Option data for version flag. */
-static const char* g_opt_data_version;
-
-/** Option data for SQL hostname. */
-static const char* g_opt_data_sql_host;
-
-/** Option data for SQL server username. */
-static const char* g_opt_data_sql_user;
-
-/** Option data for SQL server password. */
-static const char* g_opt_data_sql_pass;
-
-/** Option data for SQL database name. */
-static const char* g_opt_data_sql_db;
-
-/** Option data for friend IDs. */
-static const char* g_opt_data_friend_id;
-
-/** The subcommand layout. */
-static const struct subcommand g_subcommand_root = {
-  .canon_name = NULL,
-  .description = NULL,
-  .num_aliases = 0,
-  .aliases = NULL,
-  .operation = op_nop,
-  .num_subcommands = 2,
-  .subcommands = (struct subcommand[]) {
-    {
-      .canon_name = "friend",
-      .description = "friend management kit",
-      .num_aliases = 2,
-      .aliases = (const char* []) {"friend", "fr"},
-      .operation = op_nop,
-      .num_subcommands = 2,
-      .subcommands = (struct subcommand[]) {
-        {
-          .canon_name = "friend list",
-          .description = "list friend details",
-          .num_aliases = 2,
-          .aliases = (const char* []) {"list", "ls"},
-          .operation = op_friend_list,
-          .num_subcommands = 0,
-          .subcommands = NULL,
-          .num_options = 1,
-          .options = (struct option[]) {
-            {
-              .num_aliases = 2,
-              .aliases = (const char* []) {"-f", "--friend"},
-              .description = "the friend id",
-              .is_flag = 0,
-              .data = &g_opt_data_friend_id,
-            },
-          },
-        },
-        {
-          .canon_name = "friend remove",
-          .description = "remove friends from memory",
-          .num_aliases = 2,
-          .aliases = (const char* []) {"remove", "rm"},
-          .operation = op_friend_remove,
-          .num_subcommands = 0,
-          .subcommands = NULL,
-          .num_options = 1,
-          .options = (struct option[]) {
-            {
-              .num_aliases = 2,
-              .aliases = (const char* []) {"-f", "--friend"},
-              .description = "the friend id",
-              .is_flag = 0,
-              .data = &g_opt_data_friend_id,
-            },
-          },
-        },
-      },
-    },
-    {
-      .canon_name = "go",
-      .description = "start interactive session",
-      .num_aliases = 1,
-      .aliases = (const char* []) {"go"},
-      .operation = op_interact,
-      .num_subcommands = 0,
-      .subcommands = NULL,
-      .num_options = 0,
-      .options = NULL,
-    },
-  },
-  .num_options = 7,
-  .options = (struct option[]) {
-    {
-      .num_aliases = 2,
-      .aliases = (const char* []) {"-h", "--help"},
-      .description = "show help information",
-      .is_flag = 1,
-      .data = &g_opt_data_help,
-    },
-    {
-      .num_aliases = 1,
-      .aliases = (const char* []) {"--legal"},
-      .description = "show legal information",
-      .is_flag = 1,
-      .data = &g_opt_data_legal,
-    },
-    {
-      .num_aliases = 1,
-      .aliases = (const char* []) {"--version"},
-      .description = "show version information",
-      .is_flag = 1,
-      .data = &g_opt_data_version,
-    },
-    {
-      .num_aliases = 1,
-      .aliases = (const char* []) {"--sql-host"},
-      .description = "set hostname for sql server",
-      .is_flag = 0,
-      .data = &g_opt_data_sql_host,
-    },
-    {
-      .num_aliases = 1,
-      .aliases = (const char* []) {"--sql-user"},
-      .description = "set username for sql server",
-      .is_flag = 0,
-      .data = &g_opt_data_sql_user,
-    },
-    {
-      .num_aliases = 1,
-      .aliases = (const char* []) {"--sql-pass"},
-      .description = "set password for sql server",
-      .is_flag = 0,
-      .data = &g_opt_data_sql_pass,
-    },
-    {
-      .num_aliases = 1,
-      .aliases = (const char* []) {"--sql-db"},
-      .description = "set database for sql server",
-      .is_flag = 0,
-      .data = &g_opt_data_sql_db,
-    },
-  },
-};
-
 /**
  * Print header text for a subcommand.
  *
@@ -244,16 +52,24 @@ static void print_help(const struct subcommand* cmd) {
   print_header(cmd);
 
   // If command has neither subcommands nor options
-  if (cmd->num_subcommands == 0 && cmd->num_options == 0) {
+  if (cmd->num_subcommands == 0 && cmd->num_options == 0 && cmd->positional_name == NULL) {
     printf("\nno subcommands or options\n");
   }
 
+  // If command has a positional argument
+  if (cmd->positional_name) {
+    printf("\narguments:\n");
+
+    // Pad the space between name and description to line up with the rest
+    printf("  %-20s%s\n", cmd->positional_name, cmd->positional_description);
+  }
+
   // If command has subcommands
   if (cmd->num_subcommands > 0) {
     printf("\nsubcommands:\n");
 
     // The target padding between aliases and description
-    int target_pad = 16;
+    int target_pad = 20;
 
     // Loop through sub-subcommands for subcommand
     for (int i = 0; i < cmd->num_subcommands; ++i) {
@@ -294,7 +110,7 @@ static void print_help(const struct subcommand* cmd) {
     printf("\noptions:\n");
 
     // The target padding between aliases and description
-    int target_pad = 16;
+    int target_pad = 20;
 
     // Loop through options for subcommand
     for (int i = 0; i < cmd->num_options; ++i) {
@@ -359,276 +175,80 @@ static void print_version() {
   printf("vcs " VERSION_VCS_HASH " (" VERSION_VCS_BRANCH ")\n");
 }
 
+/** The parser over the command tree. */
+static struct command_parser g_parser;
+
 /**
- * Try to match a command-line argument to a subcommand option.
+ * Read command-line arguments.
  *
- * @param chain The subcommand chain
- * @param chain_len The length of the subcommand chain
- * @param arg The raw argument text
- * @return The option or NULL on failure
+ * No parameter outputs are modified unless this function indicates success by
+ * returning zero.
+ *
+ * @param argc The argument count (including the program name)
+ * @param argv The argument vector (including the program name)
+ * @param [out] op The computed program operation
+ * @param [out] out_chain The command chain
+ * @return Zero on success, otherwise nonzero
  */
-static const struct option* match_option(const struct subcommand** chain, size_t chain_len, const char* arg) {
-  // Walk in reverse up the command chain
-  // This simulates inheritance (allowing, e.g., friend subcommands to inherit the --help option)
-  for (ssize_t i = chain_len - 1; i >= 0; --i) {
-    // The subcommand under consideration
-    const struct subcommand* c = chain[i];
-
-    // Loop through options on command
-    for (int j = 0; j < c->num_options; ++j) {
-      // The option under consideration
-      const struct option* o = &c->options[j];
-
-      // Loop through aliases on option
-      for (int k = 0; k < o->num_aliases; ++k) {
-        // The alias under consideration
-        const char* a = o->aliases[k];
-
-        // If this alias matches the argument
-        if (!strcmp(arg, a)) {
-          // Return the option
-          return o;
-        }
-      }
-    }
+static int read_arguments(int argc, const char** argv, enum operation* op, struct command_chain* out_chain) {
+  // The command tree is static, so it only needs indexing once
+  if (g_parser.root == NULL && command_parser_init(&g_parser, &g_subcommand_root)) {
+    return 1;
   }
 
-  // Control fell out somewhere without an option
-  return NULL;
-}
-
-/**
- * Try to match a command-line argument to a subcommand.
- *
- * @param chain The subcommand chain
- * @param chain_len The length of the subcommand chain
- * @param arg The raw argument text
- * @return The subcommand or NULL on failure
- */
-static const struct subcommand* match_subcommand(const struct subcommand** chain, size_t chain_len, const char* arg) {
-  // We do not walk the subcommand chain when matching subcommands
-  // Only the topmost subcommand on the chain can influence the next subcommand
-  const struct subcommand* cmd_back = chain[chain_len - 1];
-
-  // Loop through subcommands on subcommand
-  for (int i = 0; i < cmd_back->num_subcommands; ++i) {
-    // The subcommand under consideration
-    const struct subcommand* c = &cmd_back->subcommands[i];
-
-    // Loop through aliases on subcommand
-    for (int j = 0; j < c->num_aliases; ++j) {
-      // The alias under consideration
-      const char* a = c->aliases[j];
-
-      // If this alias matches the argument
-      if (!strcmp(arg, a)) {
-        // Return the subcommand
-        return c;
-      }
-    }
+  struct command_chain chain;
+  if (command_parse(&g_parser, argc, argv, &chain)) {
+    return 1;
   }
 
-  // Control fell out somewhere without a subcommand
-  return NULL;
+  *op = chain.cmds[chain.len - 1]->operation;
+  *out_chain = chain;
+  return 0;
 }
 
 /**
- * Read command-line arguments.
+ * Read a non-negative integer option.
  *
- * Most data is passed out via parameters. No parameter outputs are modified
- * unless this function indicates success by returning zero.
- *
- * @param [out] op The computed program operation
- * @param [out] out_cmd_chain The command chain
- * @param [out] out_cmd_chain_len The length of the command chain
+ * @param name The option name (for error messages)
+ * @param text The option data
+ * @param [out] value The integer
  * @return Zero on success, otherwise nonzero
  */
-static int read_arguments(enum operation* op, const struct subcommand*** out_cmd_chain, size_t* out_cmd_chain_len) {
-  // The command chain (initialized to root)
-  // This will grow as subcommands are encountered
-  // It's job is to act like a running filter for matching subcommands and options
-  const struct subcommand** cmd_chain = malloc(sizeof *cmd_chain);
-  cmd_chain[0] = &g_subcommand_root;
-
-  // The current command chain length
-  size_t cmd_chain_len = 1;
-
-  // Loop through user-given command-line arguments
-  // We skip the first argument, as libc sets it to the process path
-  for (int i = 1; i < g->argc; ++i) {
-    // The argument under consideration
-    const char* arg = g->argv[i];
-    size_t arg_len = strlen(arg);
-
-    // Try to classify the argument as either an option or a subcommand
-    if (arg_len > 2 && arg[0] == '-' && arg[1] == '-') {
-      // Argument starts with two dashes, so treat it like a long (GNU-style) option
-
-      // The option name (not null-terminated)
-      const char* opt_name = &arg[2];
-
-      // Length of option name
-      size_t opt_name_len = arg_len - 2;
-
-      // The option data payload (null-terminated)
-      const char* opt_data = NULL;
-
-      // Search the argument for the first equal sign
-      // Long options can contain data in the form --key=value
-      const char* equal_sign = strchr(opt_name, '=');
-
-      // If there is an equal sign
-      if (equal_sign) {
-        // Truncate the name, as it erroneously contains the data payload
-        opt_name_len = equal_sign - opt_name;
-
-        // Create a view of the data payload
-        // This is safe, as we will always hit the null terminator
-        opt_data = equal_sign + 1;
-      }
-
-      // Make a string buffer framing the double-dash-prefixed name component as an independent argument
-      // This is necessary to guarantee that the string is followed by a null terminator
-      char* opt_arg = strndup(arg, opt_name_len + 2);
-
-      // Try to match option
-      const struct option* opt;
-      if ((opt = match_option(cmd_chain, cmd_chain_len, opt_arg)) != NULL) {
-        // If option is a flag
-        if (opt->is_flag) {
-          // Set flag data
-          *opt->data = "true";
-        } else {
-          // Option is not a flag, so it has a data requirement
-          // Long options can get data either from their data payloads or from more arguments
-
-          // If data payload is non-empty
-          if (opt_data) {
-            // Map data payload directly
-            *opt->data = opt_data;
-          } else {
-            // Data payload is empty
-
-            // Read data from next argument
-            // This advances the argument iterator above (variable i)
-            if (++i >= g->argc) {
-              fprintf(stderr, "no data given to long option: %s\n", opt_arg);
-
-              free(opt_arg);
-              free(cmd_chain);
-              return 1;
-            }
-
-            // Map next argument as this argument's data
-            *opt->data = g->argv[i];
-          }
-        }
-
-        // Go to next argument
-        free(opt_arg);
-        continue;
-      }
-
-      fprintf(stderr, "no such long option: %s\n", arg);
-      free(opt_arg);
-      free(cmd_chain);
-      return 1;
-    } else if (arg_len > 1 && arg[0] == '-') {
-      // Argument starts with one dash and is not a long option, so treat it like a short (POSIX-style) option(s)
-
-      // Loop through characters in argument
-      // For short options, compounding can occur (e.g. -abc means -a -b -c)
-      // So, we treat each character as its own individual short option
-      for (int j = 1; j < arg_len; ++j) {
-        // The character under consideration
-        char c = arg[j];
-
-        // Make a small string buffer framing the character as an independent argument
-        const char* c_arg = (char[]) {'-', c, 0};
-
-        // Try to match option
-        const struct option* opt;
-        if ((opt = match_option(cmd_chain, cmd_chain_len, c_arg)) != NULL) {
-          // If option is a flag
-          if (opt->is_flag) {
-            // Set flag data
-            *opt->data = "true";
-          } else {
-            // Option is not a flag, so it has a data requirement
-            // Short options can only get data from more arguments
-
-            // Read data from next argument
-            // This advances the argument iterator above (variable i)
-            if (++i >= g->argc) {
-              fprintf(stderr, "no data given to short option: -%c\n", c);
-
-              free(cmd_chain);
-              return 1;
-            }
-
-            // Map next argument as this argument's data
-            *opt->data = g->argv[i];
-          }
-
-          // Go to next short option
-          // This jumps back into the character iteration
-          continue;
-        }
-
-        fprintf(stderr, "no such short option: -%c\n", c);
-
-        free(cmd_chain);
-        return 1;
-      }
-    } else {
-      // Argument is not an option, so treat it like a subcommand
-
-      // Try to match subcommand
-      const struct subcommand* cmd;
-      if ((cmd = match_subcommand(cmd_chain, cmd_chain_len, arg)) != NULL) {
-        // Append to the subcommand chain
-        cmd_chain = realloc(cmd_chain, ++cmd_chain_len);
-        cmd_chain[cmd_chain_len - 1] = cmd;
-
-        // Go to next argument
-        continue;
-      }
-
-      fprintf(stderr, "no such subcommand: %s\n", arg);
+static int read_count_option(const char* name, const char* text, long long* value) {
+  char* error;
+  long long v = strtoll(text, &error, 10);
+  if (*text == '\0' || *error != '\0') {
+    fprintf(stderr, "malformed %s: %s\n", name, text);
+    return 1;
+  }
 
-      free(cmd_chain);
-      return 1;
-    }
+  // Enforce range
+  if (v < 0) {
+    fprintf(stderr, "%s out of range: %s\n", name, text);
+    return 1;
   }
 
-  // Compute operation and return it with the command chain
-  *op = cmd_chain[cmd_chain_len - 1]->operation;
-  *out_cmd_chain = cmd_chain;
-  *out_cmd_chain_len = cmd_chain_len;
+  *value = v;
   return 0;
 }
 
-int main(int argc, char* argv[]) {
-  g_mut->argc = argc;
-  g_mut->argv = (const char**) argv;
-
-  enum operation op;
-  const struct subcommand** cmd_chain;
-  size_t cmd_chain_len;
+/** The option data given alongside batch. Every batched line starts from it. */
+static struct option_state g_batch_state;
 
-  // Try to read command-line arguments
-  if (read_arguments(&op, &cmd_chain, &cmd_chain_len)) {
-    printf("\n");
-
-    // Show usage for root command
-    print_usage(&g_subcommand_root);
-    return 1;
-  }
+static int run_batch_line(int argc, const char** argv);
 
+/**
+ * Carry out a parsed command line.
+ *
+ * @param op The program operation
+ * @param chain The command chain
+ * @return The exit status
+ */
+static int dispatch(enum operation op, const struct command_chain* chain) {
   // If help flag provided
   if (g_opt_data_help) {
     // Show help for topmost command
-    print_help(cmd_chain[cmd_chain_len - 1]);
+    print_help(chain->cmds[chain->len - 1]);
     return 0;
   }
 
@@ -649,12 +269,95 @@ int main(int argc, char* argv[]) {
   // If no operation was computed
   if (op == op_nop) {
     // Show usage for topmost command
-    print_usage(cmd_chain[cmd_chain_len - 1]);
+    print_usage(chain->cmds[chain->len - 1]);
     return 0;
   }
 
+  // If startup profile flag provided
+  if (g_opt_data_profile_startup) {
+    // Record phases from here on, reported when the interpreter comes down
+    startup_profile_enable();
+    startup_profile_mark("arguments");
+  }
+
+  // If sampling profile file provided
+  if (g_opt_data_profile) {
+    long long hz = SAMPLING_PROFILE_DEFAULT_HZ;
+    if (g_opt_data_profile_hz && read_count_option("profile rate", g_opt_data_profile_hz, &hz)) {
+      return 1;
+    }
+
+    // Enforce range
+    if (hz < 1 || hz > SAMPLING_PROFILE_MAX_HZ) {
+      fprintf(stderr, "profile rate out of range: %s\n", g_opt_data_profile_hz);
+      return 1;
+    }
+
+    // Sample until the program exits (a batch keeps sampling across lines)
+    if (sampling_profile_start(g_opt_data_profile, (int) hz)) {
+      return 1;
+    }
+  }
+
   // Dispatch the computed operation
   switch (op) {
+    case op_batch: {
+      // Remember the options given to batch itself (e.g. --sql-host) for every line
+      g_batch_state.len = 0;
+      if (option_state_save(&g_subcommand_root, &g_batch_state)) {
+        fprintf(stderr, "too many option slots (raise OPTION_STATE_MAX)\n");
+        return 1;
+      }
+
+      // Call batch operation
+      return op_batch_main(&(struct op_batch_args) {
+        .path = g_pos_data_script,
+        .program = g->argv[0],
+        .run = &run_batch_line,
+      });
+    }
+    case op_friend_add: {
+      // Name is required
+      if (g_opt_data_name == NULL || *g_opt_data_name == '\0') {
+        fprintf(stderr, "name is required\n");
+        return 1;
+      }
+
+      // File is required
+      if (g_pos_data_file == NULL) {
+        fprintf(stderr, "file is required\n");
+        return 1;
+      }
+
+      // If optional friend ID was given
+      int friend_id = -1;
+      if (g_opt_data_friend_id) {
+        // Convert friend ID to an integer
+        char* friend_id_error;
+        friend_id = (int) strtol(g_opt_data_friend_id, &friend_id_error, 10);
+        if (friend_id_error != g_opt_data_friend_id + strlen(g_opt_data_friend_id)) {
+          fprintf(stderr, "malformed friend id: %s\n", g_opt_data_friend_id);
+          return 1;
+        }
+
+        // Enforce range
+        if (friend_id <= 0) {
+          fprintf(stderr, "friend id out of range: %s\n", g_opt_data_friend_id);
+          return 1;
+        }
+      }
+
+      // Call friend add operation
+      return op_friend_add_main(&(struct op_friend_add_args) {
+        .name = g_opt_data_name,
+        .friend_id = friend_id,
+        .path = g_pos_data_file,
+        .sql_host = g_opt_data_sql_host,
+        .sql_user = g_opt_data_sql_user,
+        .sql_pass = g_opt_data_sql_pass,
+        .sql_db = g_opt_data_sql_db,
+      });
+    }
     case op_friend_list: {
       // If optional friend ID was given
       int friend_id = -1;
@@ -674,9 +377,41 @@ int main(int argc, char* argv[]) {
         }
       }
 
+      // If optional limit was given
+      long long limit = -1;
+      if (g_opt_data_limit && read_count_option("limit", g_opt_data_limit, &limit)) {
+        return 1;
+      }
+
+      // If optional offset was given
+      long long offset = 0;
+      if (g_opt_data_offset && read_count_option("offset", g_opt_data_offset, &offset)) {
+        return 1;
+      }
+
+      // If optional format was given
+      enum op_friend_list_format format = op_friend_list_format_tsv;
+      if (g_opt_data_format) {
+        if (!strcmp(g_opt_data_format, "tsv")) {
+          format = op_friend_list_format_tsv;
+        } else if (!strcmp(g_opt_data_format, "json-lines")) {
+          format = op_friend_list_format_json_lines;
+        } else {
+          fprintf(stderr, "unknown format: %s\n", g_opt_data_format);
+          return 1;
+        }
+      }
+
       // Call friend list operation
       return op_friend_list_main(&(struct op_friend_list_args) {
         .friend_id = friend_id,
+        .limit = limit,
+        .offset = offset,
+        .format = format,
+        .sql_host = g_opt_data_sql_host,
+        .sql_user = g_opt_data_sql_user,
+        .sql_pass = g_opt_data_sql_pass,
+        .sql_db = g_opt_data_sql_db,
       });
     }
     case op_friend_remove: {
@@ -707,9 +442,158 @@ int main(int argc, char* argv[]) {
         .friend_id = friend_id,
       });
     }
+    case op_friend_import: {
+      // File is required
+      if (g_pos_data_file == NULL) {
+        fprintf(stderr, "file is required\n");
+        return 1;
+      }
+
+      // If optional job count was given
+      long long jobs = 4;
+      if (g_opt_data_jobs && read_count_option("job count", g_opt_data_jobs, &jobs)) {
+        return 1;
+      }
+
+      // Call friend import operation
+      return op_friend_import_main(&(struct op_friend_import_args) {
+        .path = g_pos_data_file,
+        .jobs = (int) jobs,
+        .sql_host = g_opt_data_sql_host,
+        .sql_user = g_opt_data_sql_user,
+        .sql_pass = g_opt_data_sql_pass,
+        .sql_db = g_opt_data_sql_db,
+      });
+    }
+    case op_friend_export: {
+      // File is required
+      if (g_pos_data_file == NULL) {
+        fprintf(stderr, "file is required\n");
+        return 1;
+      }
+
+      // Call friend export operation
+      return op_friend_export_main(&(struct op_friend_export_args) {
+        .path = g_pos_data_file,
+        .sql_host = g_opt_data_sql_host,
+        .sql_user = g_opt_data_sql_user,
+        .sql_pass = g_opt_data_sql_pass,
+        .sql_db = g_opt_data_sql_db,
+      });
+    }
     case op_interact: {
       // Call interaction operation
-      return op_interact_main(&(struct op_interact_args) {});
+      return op_interact_main(&(struct op_interact_args) {
+        .sql_host = g_opt_data_sql_host,
+        .sql_user = g_opt_data_sql_user,
+        .sql_pass = g_opt_data_sql_pass,
+        .sql_db = g_opt_data_sql_db,
+        .frame_ring = g_opt_data_frame_ring,
+        .replay = g_opt_data_replay,
+        .metrics = g_opt_data_metrics,
+        .baseline = g_opt_data_baseline,
+        .friend_snapshot = g_opt_data_friend_snapshot,
+        .cpu_policy = g_opt_data_cpu_policy,
+        .memory_budget = g_opt_data_memory_budget,
+      });
     }
+    case op_stats_memory: {
+      // If optional format was given
+      enum op_stats_memory_format format = op_stats_memory_format_text;
+      if (g_opt_data_format) {
+        if (!strcmp(g_opt_data_format, "text")) {
+          format = op_stats_memory_format_text;
+        } else if (!strcmp(g_opt_data_format, "json")) {
+          format = op_stats_memory_format_json;
+        } else {
+          fprintf(stderr, "unknown format: %s\n", g_opt_data_format);
+          return 1;
+        }
+      }
+
+      // If optional limit was given
+      long long limit = 10;
+      if (g_opt_data_limit && read_count_option("limit", g_opt_data_limit, &limit)) {
+        return 1;
+      }
+
+      // If optional process ID was given
+      long long pid = 0;
+      if (g_opt_data_pid && read_count_option("pid", g_opt_data_pid, &pid)) {
+        return 1;
+      }
+
+      if (pid > INT_MAX) {
+        fprintf(stderr, "pid out of range: %s\n", g_opt_data_pid);
+        return 1;
+      }
+
+      // Call memory statistics operation
+      return op_stats_memory_main(&(struct op_stats_memory_args) {
+        .format = format,
+        .limit = limit > INT_MAX ? INT_MAX : (int) limit,
+        .pid = (int) pid,
+      });
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Run one command line from a batch script.
+ *
+ * @param argc The argument count (including the program name)
+ * @param argv The argument vector (including the program name)
+ * @return The exit status
+ */
+static int run_batch_line(int argc, const char** argv) {
+  // Start over from the options given to batch
+  option_state_restore(&g_batch_state);
+
+  enum operation op;
+  struct command_chain cmd_chain;
+
+  // Errors are already on stderr, and usage text would only clutter the status stream
+  if (read_arguments(argc, argv, &op, &cmd_chain)) {
+    return 1;
+  }
+
+  if (op == op_batch) {
+    fprintf(stderr, "batch cannot be nested\n");
+    return 1;
   }
+
+  return dispatch(op, &cmd_chain);
+}
+
+int main(int argc, char* argv[]) {
+  startup_profile_begin();
+
+  g_mut->argc = argc;
+  g_mut->argv = (const char**) argv;
+
+  enum operation op;
+  struct command_chain cmd_chain;
+
+  // Try to read command-line arguments
+  if (read_arguments(g->argc, g->argv, &op, &cmd_chain)) {
+    printf("\n");
+
+    // Show usage for root command
+    print_usage(&g_subcommand_root);
+    return 1;
+  }
+
+  int status = dispatch(op, &cmd_chain);
+
+  // Report startup phases, if profiled, however the operation ended
+  startup_profile_report(stderr);
+
+  // Write the sampled stacks, if profiled
+  if (sampling_profile_stop()) {
+    status = 1;
+  }
+
+  return status;
 }
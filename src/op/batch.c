@@ -0,0 +1,221 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "writer.h"
+
+#include "batch.h"
+
+/** The most arguments on one command line (including the program name). */
+#define BATCH_ARGS_MAX 64
+
+/**
+ * Split a command line into arguments.
+ *
+ * Arguments are separated by blanks. Single quotes keep their contents
+ * literally, double quotes honor backslash escapes, and a backslash outside
+ * quotes escapes the next character. A # at the start of an argument comments
+ * out the rest of the line.
+ *
+ * @param line The command line
+ * @param len The command line length
+ * @param words Storage for the argument text (at least len + 1 bytes)
+ * @param [out] argv The arguments, starting at index 1
+ * @param [out] argc The argument count, including the unset index 0
+ * @return Zero on success, otherwise nonzero
+ */
+static int split_line(const char* line, size_t len, char* words, const char** argv, int* argc) {
+  int n = 1;
+  size_t i = 0;
+
+  while (1) {
+    // Skip blanks between arguments
+    while (i < len && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')) {
+      ++i;
+    }
+
+    // Stop at the end of the line or a comment
+    if (i == len || line[i] == '#') {
+      break;
+    }
+
+    if (n == BATCH_ARGS_MAX) {
+      fprintf(stderr, "too many arguments (at most %d)\n", BATCH_ARGS_MAX - 1);
+      return 1;
+    }
+
+    argv[n++] = words;
+
+    // Copy the argument, dropping quotes and escapes
+    char quote = 0;
+    for (; i < len; ++i) {
+      char c = line[i];
+
+      if (quote == '\'') {
+        if (c == '\'') {
+          quote = 0;
+        } else {
+          *words++ = c;
+        }
+      } else if (quote == '"') {
+        if (c == '"') {
+          quote = 0;
+        } else if (c == '\\' && i + 1 < len && (line[i + 1] == '"' || line[i + 1] == '\\')) {
+          *words++ = line[++i];
+        } else {
+          *words++ = c;
+        }
+      } else if (c == '\'' || c == '"') {
+        quote = c;
+      } else if (c == '\\' && i + 1 < len) {
+        *words++ = line[++i];
+      } else if (c == ' ' || c == '\t' || c == '\r') {
+        break;
+      } else {
+        *words++ = c;
+      }
+    }
+
+    if (quote) {
+      fprintf(stderr, "unterminated quote\n");
+      return 1;
+    }
+
+    *words++ = '\0';
+  }
+
+  *argc = n;
+  return 0;
+}
+
+/**
+ * Write the status line for a command.
+ *
+ * @param w The writer
+ * @param line_number The script line number
+ * @param line The command line
+ * @param len The command line length
+ * @param status The command exit status
+ */
+static void write_status(struct writer* w, long long line_number, const char* line, size_t len, int status) {
+  // Trim trailing blanks so the echo matches what was parsed
+  while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r')) {
+    --len;
+  }
+
+  writer_puts(w, "{\"line\":");
+  writer_put_int(w, line_number);
+  writer_puts(w, ",\"command\":");
+  writer_put_json_string(w, line, len);
+  writer_puts(w, ",\"status\":");
+  writer_put_int(w, status);
+  writer_puts(w, "}\n");
+}
+
+int op_batch_main(struct op_batch_args* args) {
+  // Open the script
+  FILE* file = stdin;
+  if (args->path && strcmp(args->path, "-") != 0) {
+    file = fopen(args->path, "r");
+    if (file == NULL) {
+      fprintf(stderr, "failed to open %s: %s\n", args->path, strerror(errno));
+      return 1;
+    }
+  }
+
+  // Keep the interpreter up between commands
+  // It comes up lazily, the first time a command needs it
+  op_common_hold();
+
+  static struct writer out;
+  writer_init(&out, STDOUT_FILENO);
+
+  // The line buffer (grown by getline)
+  char* line = NULL;
+  size_t line_cap = 0;
+
+  // The argument text buffer (reused across lines)
+  char* words = NULL;
+  size_t words_cap = 0;
+
+  const char* argv[BATCH_ARGS_MAX];
+  argv[0] = args->program;
+
+  long long line_number = 0;
+  int failed = 0;
+
+  ssize_t line_len;
+  while ((line_len = getline(&line, &line_cap, file)) >= 0) {
+    ++line_number;
+
+    // Drop the newline
+    size_t len = (size_t) line_len;
+    if (len > 0 && line[len - 1] == '\n') {
+      --len;
+    }
+
+    if (words_cap < len + 1) {
+      char* bigger = realloc(words, len + 1);
+      if (bigger == NULL) {
+        fprintf(stderr, "out of memory\n");
+        failed = 1;
+        break;
+      }
+
+      words = bigger;
+      words_cap = len + 1;
+    }
+
+    int argc;
+    int status;
+    if (split_line(line, len, words, argv, &argc)) {
+      status = 1;
+    } else if (argc == 1) {
+      // Blank line or comment
+      continue;
+    } else {
+      status = args->run(argc, argv);
+    }
+
+    if (status != 0) {
+      failed = 1;
+    }
+
+    // Whatever the command printed through stdio goes out ahead of its status
+    fflush(stdout);
+
+    write_status(&out, line_number, line, len, status);
+    if (writer_flush(&out)) {
+      fprintf(stderr, "failed to write status\n");
+      failed = 1;
+      break;
+    }
+  }
+
+  if (ferror(file)) {
+    fprintf(stderr, "failed to read script: %s\n", strerror(errno));
+    failed = 1;
+  }
+
+  free(words);
+  free(line);
+
+  if (file != stdin) {
+    fclose(file);
+  }
+
+  // Bring the interpreter down if any command brought it up
+  if (op_common_release()) {
+    return 1;
+  }
+
+  return failed;
+}
@@ -0,0 +1,42 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef OP_BATCH_H
+#define OP_BATCH_H
+
+/**
+ * Run one batched command line.
+ *
+ * @param argc The argument count (including the program name)
+ * @param argv The argument vector (including the program name)
+ * @return The command exit status
+ */
+typedef int (* op_batch_run_fn)(int argc, const char** argv);
+
+/** Arguments for batch execution. */
+struct op_batch_args {
+  /** The script path ("-" or NULL for stdin). */
+  const char* path;
+
+  /** The program name passed as the first argument of every line. */
+  const char* program;
+
+  /** Runs one parsed command line. */
+  op_batch_run_fn run;
+};
+
+/**
+ * Main function for batch execution.
+ *
+ * Reads newline-delimited command lines and runs each in turn, writing one
+ * JSON status line per command to standard output. Every command shares one
+ * interpreter lifetime.
+ *
+ * @param args The operation arguments
+ * @return Zero if every command succeeded, otherwise nonzero
+ */
+int op_batch_main(struct op_batch_args* args);
+
+#endif // #ifndef OP_BATCH_H
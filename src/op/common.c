@@ -3,10 +3,17 @@
  * Copyright 2019 The Cozmonaut Contributors
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <structmember.h>
 
+#include "core/types.h"
+
+#include "startup_profile.h"
+
 #include "common.h"
 
 typedef struct {
@@ -168,7 +175,6 @@ static PyTypeObject type_server = {
   .tp_basicsize = sizeof(server),
   .tp_itemsize = 0,
   .tp_dealloc = (destructor) type_server_dealloc,
-  .tp_print = NULL,
   .tp_getattr = NULL,
   .tp_setattr = NULL,
   .tp_as_async = NULL,
@@ -203,13 +209,125 @@ static PyTypeObject type_server = {
   .tp_new = type_server_new,
 };
 
+static PyObject* module_core_startup_mark(PyObject* self, PyObject* args) {
+  const char* phase;
+
+  if (!PyArg_ParseTuple(args, "s", &phase)) {
+    return NULL;
+  }
+
+  startup_profile_mark(phase);
+  Py_RETURN_NONE;
+}
+
+static PyObject* module_core_memory_stats(PyObject* self) {
+  PyObject* result = PyDict_New();
+  if (result == NULL) {
+    return NULL;
+  }
+
+  for (int tag = 0; tag < memory_tag_count; ++tag) {
+    struct memory_stats stats;
+    memory_stats(tag, &stats);
+
+    PyObject* entry = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+      "bytes", (unsigned long long) stats.bytes,
+      "peak", (unsigned long long) stats.peak,
+      "mapped", (unsigned long long) stats.mapped,
+      "mapped_peak", (unsigned long long) stats.mapped_peak,
+      "live", (unsigned long long) stats.live,
+      "allocs", (unsigned long long) stats.allocs,
+      "failures", (unsigned long long) stats.failures,
+      "limit", (unsigned long long) stats.limit);
+    if (entry == NULL || PyDict_SetItemString(result, memory_tag_name(tag), entry) < 0) {
+      Py_XDECREF(entry);
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    Py_DECREF(entry);
+  }
+
+  return result;
+}
+
+static PyObject* module_core_memory_limit(PyObject* self, PyObject* args) {
+  const char* name;
+  unsigned long long limit;
+
+  if (!PyArg_ParseTuple(args, "sK", &name, &limit)) {
+    return NULL;
+  }
+
+  for (int tag = 0; tag < memory_tag_count; ++tag) {
+    if (strcmp(name, memory_tag_name(tag)) == 0) {
+      memory_set_limit(tag, limit);
+      Py_RETURN_NONE;
+    }
+  }
+
+  PyErr_Format(PyExc_ValueError, "unknown memory tag: %s", name);
+  return NULL;
+}
+
+/**
+ * Trace a native allocation in tracemalloc, under its tag's domain.
+ *
+ * Tracking takes the GIL for the Python traceback, so only threads already
+ * holding it are traced. Workers allocate under their own locks, and taking
+ * the GIL there could deadlock against a Python thread waiting on those locks;
+ * their allocations are still counted natively.
+ */
+static void memory_trace_track(enum memory_tag tag, void* ptr, size_t size) {
+  if (PyGILState_Check()) {
+    PyTraceMalloc_Track(MEMORY_TRACE_DOMAIN + tag, (uintptr_t) ptr, size);
+  }
+}
+
+/**
+ * Stop tracing a native allocation. Untracking needs no GIL, so memory traced
+ * under it and freed without it (e.g. in a GIL-free close) leaves no stale trace.
+ */
+static void memory_trace_untrack(enum memory_tag tag, void* ptr) {
+  PyTraceMalloc_Untrack(MEMORY_TRACE_DOMAIN + tag, (uintptr_t) ptr);
+}
+
+/** Hooks that mirror native allocations into tracemalloc. */
+static const struct memory_hooks memory_trace_hooks = {
+  .track = &memory_trace_track,
+  .untrack = &memory_trace_untrack,
+};
+
+/** _core module functions. */
+static PyMethodDef module_core_methods[] = {
+  {
+    .ml_name = "startup_mark",
+    .ml_meth = (PyCFunction) module_core_startup_mark,
+    .ml_flags = METH_VARARGS,
+    .ml_doc = "Mark the end of a startup phase (recorded only under --profile-startup)",
+  },
+  {
+    .ml_name = "memory_stats",
+    .ml_meth = (PyCFunction) module_core_memory_stats,
+    .ml_flags = METH_NOARGS,
+    .ml_doc = "Return the native memory counters of each tag as a dictionary",
+  },
+  {
+    .ml_name = "memory_limit",
+    .ml_meth = (PyCFunction) module_core_memory_limit,
+    .ml_flags = METH_VARARGS,
+    .ml_doc = "Limit a tag's native heap and mapped bytes (zero for no limit)",
+  },
+  {NULL},
+};
+
 /** _core extension module. */
 static PyModuleDef module_core = {
   PyModuleDef_HEAD_INIT,
   .m_name = "_core",
   .m_doc = "The cozmonaut core module.",
   .m_size = -1,
-  .m_methods = NULL,
+  .m_methods = module_core_methods,
   .m_slots = NULL,
   .m_traverse = NULL,
   .m_clear = NULL,
@@ -222,6 +340,86 @@ PyMODINIT_FUNC PyInit_core() {
     return NULL;
   }
 
+  if (PyType_Ready(&type_arena) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_arena_buffer) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_completion_channel) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_sql_client) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_detections) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_detections_column) < 0) {
+    return NULL;
+  }
+
+  if (PyStructSequence_InitType2(&type_detection, &type_detection_desc) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_encounter_log) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_face_quality) < 0) {
+    return NULL;
+  }
+
+  if (PyStructSequence_InitType2(&type_face_score, &type_face_score_desc) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_frame) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_frame_ring) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_friend_index) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_handle_queue) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_jpeg_decoder) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_scheduler) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_topology) < 0) {
+    return NULL;
+  }
+
+  if (PyStructSequence_InitType2(&type_placement, &type_placement_desc) < 0) {
+    return NULL;
+  }
+
+  if (PyType_Ready(&type_watchdog) < 0) {
+    return NULL;
+  }
+
+  if (PyStructSequence_InitType2(&type_stall, &type_stall_desc) < 0) {
+    return NULL;
+  }
+
   PyObject* m__core = PyModule_Create(&module_core);
   if (m__core == NULL) {
     return NULL;
@@ -230,15 +428,120 @@ PyMODINIT_FUNC PyInit_core() {
   Py_INCREF(&type_server);
   PyModule_AddObject(m__core, "Server", (PyObject*) &type_server);
 
+  Py_INCREF(&type_arena);
+  PyModule_AddObject(m__core, "Arena", (PyObject*) &type_arena);
+
+  Py_INCREF(&type_arena_buffer);
+  PyModule_AddObject(m__core, "ArenaBuffer", (PyObject*) &type_arena_buffer);
+
+  Py_INCREF(&type_completion_channel);
+  PyModule_AddObject(m__core, "CompletionChannel", (PyObject*) &type_completion_channel);
+
+  Py_INCREF(&type_sql_client);
+  PyModule_AddObject(m__core, "SqlClient", (PyObject*) &type_sql_client);
+
+  Py_INCREF(&type_detections);
+  PyModule_AddObject(m__core, "Detections", (PyObject*) &type_detections);
+
+  Py_INCREF(&type_detection);
+  PyModule_AddObject(m__core, "Detection", (PyObject*) &type_detection);
+
+  Py_INCREF(&type_encounter_log);
+  PyModule_AddObject(m__core, "EncounterLog", (PyObject*) &type_encounter_log);
+
+  Py_INCREF(&type_face_quality);
+  PyModule_AddObject(m__core, "FaceQuality", (PyObject*) &type_face_quality);
+
+  Py_INCREF(&type_face_score);
+  PyModule_AddObject(m__core, "FaceScore", (PyObject*) &type_face_score);
+
+  Py_INCREF(&type_frame);
+  PyModule_AddObject(m__core, "Frame", (PyObject*) &type_frame);
+
+  Py_INCREF(&type_frame_ring);
+  PyModule_AddObject(m__core, "FrameRing", (PyObject*) &type_frame_ring);
+
+  Py_INCREF(&type_friend_index);
+  PyModule_AddObject(m__core, "FriendIndex", (PyObject*) &type_friend_index);
+
+  Py_INCREF(&type_handle_queue);
+  PyModule_AddObject(m__core, "HandleQueue", (PyObject*) &type_handle_queue);
+
+  Py_INCREF(&type_jpeg_decoder);
+  PyModule_AddObject(m__core, "JpegDecoder", (PyObject*) &type_jpeg_decoder);
+
+  Py_INCREF(&type_scheduler);
+  PyModule_AddObject(m__core, "Scheduler", (PyObject*) &type_scheduler);
+
+  Py_INCREF(&type_topology);
+  PyModule_AddObject(m__core, "Topology", (PyObject*) &type_topology);
+
+  Py_INCREF(&type_placement);
+  PyModule_AddObject(m__core, "Placement", (PyObject*) &type_placement);
+
+  Py_INCREF(&type_watchdog);
+  PyModule_AddObject(m__core, "Watchdog", (PyObject*) &type_watchdog);
+
+  Py_INCREF(&type_stall);
+  PyModule_AddObject(m__core, "Stall", (PyObject*) &type_stall);
+
+  // Frame formats, matching the producer library
+  PyModule_AddIntConstant(m__core, "FRAME_FORMAT_UNKNOWN", frame_format_unknown);
+  PyModule_AddIntConstant(m__core, "FRAME_FORMAT_GRAY8", frame_format_gray8);
+  PyModule_AddIntConstant(m__core, "FRAME_FORMAT_RGB24", frame_format_rgb24);
+  PyModule_AddIntConstant(m__core, "FRAME_FORMAT_JPEG", frame_format_jpeg);
+
+  // The tracemalloc domain of the first memory tag (tags follow in order)
+  PyModule_AddIntConstant(m__core, "MEMORY_TRACE_DOMAIN", MEMORY_TRACE_DOMAIN);
+
+  // Exception raised for failed statements, with the MySQL error code in errno (None if not from the server)
+  PyObject* sql_error_dict = Py_BuildValue("{sO}", "errno", Py_None);
+  if (sql_error_dict == NULL) {
+    Py_DECREF(m__core);
+    return NULL;
+  }
+
+  core_sql_error = PyErr_NewException("_core.SqlError", NULL, sql_error_dict);
+  Py_DECREF(sql_error_dict);
+  if (core_sql_error == NULL) {
+    Py_DECREF(m__core);
+    return NULL;
+  }
+
+  Py_INCREF(core_sql_error);
+  PyModule_AddObject(m__core, "SqlError", core_sql_error);
+
+  // Native allocations show up in tracemalloc snapshots while it is tracing
+  memory_set_hooks(&memory_trace_hooks);
+
   return m__core;
 }
 
+/** Nonzero while the interpreter is up. */
+static int g_initialized;
+
+/** Nonzero while finalization is deferred to op_common_release. */
+static int g_held;
+
 int op_common_initialize() {
+  // The interpreter may already be up from an earlier operation in this process
+  if (g_initialized) {
+    return 0;
+  }
+
   // Make _core module available for importing
   PyImport_AppendInittab("_core", &PyInit_core);
 
+  // Have the interpreter report every import and its cumulative time on stderr
+  if (startup_profile_enabled()) {
+    setenv("PYTHONPROFILEIMPORTTIME", "1", 1);
+  }
+
   // Spin up the Python VM
   Py_Initialize();
+  g_initialized = 1;
+
+  startup_profile_mark("Py_Initialize");
 
   // Import "sys" module
   PyObject* m_sys = PyImport_ImportModule("sys");
@@ -285,15 +588,98 @@ int op_common_initialize() {
   Py_DECREF(directory_name);
   Py_DECREF(m_sys_path);
   Py_DECREF(m_sys);
+
+  startup_profile_mark("sys.path setup");
   return 0;
 }
 
 int op_common_finalize() {
+  // Leave the interpreter up for the next operation if held
+  if (g_held || !g_initialized) {
+    return 0;
+  }
+
+  g_initialized = 0;
+
   // Wind down the interpreter
-  if (Py_FinalizeEx() < 0) {
+  int failed = Py_FinalizeEx() < 0;
+
+  // Native memory outlives the interpreter (e.g. in static state), and there's no tracemalloc left
+  memory_set_hooks(NULL);
+
+  if (failed) {
     fprintf(stderr, "failed to safely bring down the interpreter\n");
     return 1;
   }
 
   return 0;
 }
+
+int op_common_run(const char* code, PyObject* py_args) {
+  if (py_args == NULL) {
+    PyErr_Print();
+    PyErr_Clear();
+    return 1;
+  }
+
+  // Look up the __main__ module (borrowed)
+  // We'll execute under this context
+  PyObject* py_module = PyImport_AddModule("__main__");
+  if (py_module == NULL) {
+    PyErr_Print();
+    PyErr_Clear();
+
+    Py_DECREF(py_args);
+    return 1;
+  }
+
+  // Grab the dictionary from the main module (borrowed)
+  PyObject* py_module_dict = PyModule_GetDict(py_module);
+
+  // Add argument dictionary to module
+  // This will let us access it from the operation code
+  int failed = PyDict_SetItemString(py_module_dict, "args", py_args) < 0;
+  Py_DECREF(py_args);
+
+  if (failed) {
+    PyErr_Print();
+    PyErr_Clear();
+    return 1;
+  }
+
+  // Run the operation code
+  PyObject* py_result = PyRun_String(code, Py_file_input, py_module_dict, py_module_dict);
+  if (py_result == NULL) {
+    PyErr_Print();
+    PyErr_Clear();
+  }
+
+  Py_XDECREF(py_result);
+
+  // Pass on the status returned by the entry point (borrowed)
+  int status = py_result == NULL;
+  PyObject* py_status = PyDict_GetItemString(py_module_dict, "status");
+  if (py_result != NULL && py_status != NULL && PyLong_Check(py_status)) {
+    status = (int) PyLong_AsLong(py_status);
+  }
+
+  // Drop this operation's globals (missing ones are fine)
+  if (PyDict_DelItemString(py_module_dict, "args") < 0) {
+    PyErr_Clear();
+  }
+
+  if (PyDict_DelItemString(py_module_dict, "status") < 0) {
+    PyErr_Clear();
+  }
+
+  return status;
+}
+
+void op_common_hold() {
+  g_held = 1;
+}
+
+int op_common_release() {
+  g_held = 0;
+  return op_common_finalize();
+}
@@ -6,6 +6,9 @@
 #ifndef OP_COMMON_H
 #define OP_COMMON_H
 
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
 /**
  * Initialize common operation.
  *
@@ -16,8 +19,39 @@ int op_common_initialize();
 /**
  * Finalize common operation.
  *
+ * Does nothing while a hold is in place.
+ *
  * @return Zero on success, otherwise nonzero
  */
 int op_common_finalize();
 
+/**
+ * Run operation code in the __main__ module.
+ *
+ * The code sees its arguments as the global "args", and may set an integer
+ * global "status" to exit with. Both are removed afterward, so operations in
+ * one batch neither see each other's state nor keep it alive.
+ *
+ * @param code The Python code
+ * @param py_args The argument dictionary (stolen), or NULL with an exception set
+ * @return The status set by the code, or nonzero if the code raised
+ */
+int op_common_run(const char* code, PyObject* py_args);
+
+/**
+ * Keep the interpreter up across operations until op_common_release.
+ *
+ * PyImport_AppendInittab only works before the first Py_Initialize, and
+ * re-initializing after Py_FinalizeEx is unreliable for extension modules, so
+ * several operations in one process must share one interpreter.
+ */
+void op_common_hold();
+
+/**
+ * Drop the hold and finalize the interpreter if it is up.
+ *
+ * @return Zero on success, otherwise nonzero
+ */
+int op_common_release();
+
 #endif // #ifndef OP_COMMON_H
@@ -0,0 +1,239 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mysqld_error.h>
+
+#include "core/friend_index.h"
+#include "core/sql.h"
+#include "friend_csv.h"
+
+#include "friend_add.h"
+
+/** The least cosine similarity to the average an embedding needs to count toward the template. */
+#define ADD_MIN_AGREEMENT 0.7f
+
+/** The most tries at taking the next free ID when another client takes it first. */
+#define ADD_MAX_TRIES 8
+
+/**
+ * Read base64 embeddings, one per line.
+ *
+ * @param path The file path ("-" for stdin)
+ * @param samples The embeddings (caller frees)
+ * @param n The number of embeddings
+ * @param dim The embedding dimension
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+static int read_samples(const char* path, float** samples, size_t* n, size_t* dim) {
+  FILE* file = stdin;
+  if (strcmp(path, "-") != 0) {
+    file = fopen(path, "r");
+    if (file == NULL) {
+      fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+      return 1;
+    }
+  }
+
+  char* line = NULL;
+  size_t line_cap = 0;
+  ssize_t line_len;
+  long long line_number = 0;
+
+  size_t cap = 0;
+  int status = 0;
+
+  *samples = NULL;
+  *n = 0;
+  *dim = 0;
+
+  while ((line_len = getline(&line, &line_cap, file)) >= 0) {
+    ++line_number;
+
+    // Trim the line ending and skip blank lines
+    while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+      --line_len;
+    }
+    if (line_len == 0) {
+      continue;
+    }
+
+    size_t len = base64_decode_inplace(line, (size_t) line_len);
+    if (len == (size_t) -1 || len == 0 || len % sizeof(float) != 0) {
+      fprintf(stderr, "%s:%lld: malformed embedding\n", path, line_number);
+      status = 1;
+      break;
+    }
+
+    // Every embedding must match the first
+    if (*dim == 0) {
+      *dim = len / sizeof(float);
+    } else if (len / sizeof(float) != *dim) {
+      fprintf(stderr, "%s:%lld: embedding has %zu floats, expected %zu\n", path, line_number, len / sizeof(float),
+        *dim);
+      status = 1;
+      break;
+    }
+
+    if (*n == cap) {
+      cap = cap ? cap * 2 : 8;
+
+      float* grown = realloc(*samples, cap * *dim * sizeof(float));
+      if (grown == NULL) {
+        fprintf(stderr, "out of memory\n");
+        status = 1;
+        break;
+      }
+
+      *samples = grown;
+    }
+
+    memcpy(&(*samples)[*n * *dim], line, len);
+    ++*n;
+  }
+
+  if (status == 0 && ferror(file)) {
+    fprintf(stderr, "failed to read %s\n", path);
+    status = 1;
+  }
+
+  if (status == 0 && *n == 0) {
+    fprintf(stderr, "no embeddings in %s\n", path);
+    status = 1;
+  }
+
+  free(line);
+  if (file != stdin) {
+    fclose(file);
+  }
+
+  if (status) {
+    free(*samples);
+    *samples = NULL;
+  }
+
+  return status;
+}
+
+/**
+ * Look up the next free friend ID.
+ *
+ * @param conn The connection
+ * @param friend_id The friend ID
+ * @return Zero on success, otherwise nonzero (message printed to stderr)
+ */
+static int next_friend_id(MYSQL* conn, int* friend_id) {
+  static const char QUERY[] = "SELECT COALESCE(MAX(id), 0) + 1 FROM friends";
+
+  MYSQL_RES* result;
+  if (mysql_real_query(conn, QUERY, sizeof QUERY - 1) || (result = mysql_store_result(conn)) == NULL) {
+    fprintf(stderr, "failed to query friends: %s\n", mysql_error(conn));
+    return 1;
+  }
+
+  MYSQL_ROW row = mysql_fetch_row(result);
+  *friend_id = row && row[0] ? (int) strtol(row[0], NULL, 10) : 1;
+
+  mysql_free_result(result);
+  return 0;
+}
+
+int op_friend_add_main(struct op_friend_add_args* args) {
+  float* samples;
+  size_t n;
+  size_t dim;
+
+  if (read_samples(args->path, &samples, &n, &dim)) {
+    return 1;
+  }
+
+  // Average the samples into one template, leaving out any that disagree
+  float* template = malloc(dim * sizeof(float));
+  if (template == NULL) {
+    fprintf(stderr, "out of memory\n");
+    free(samples);
+    return 1;
+  }
+
+  size_t kept = friend_template(samples, n, dim, ADD_MIN_AGREEMENT, template);
+  free(samples);
+
+  if (kept == 0) {
+    fprintf(stderr, "embeddings do not agree on one face\n");
+    free(template);
+    return 1;
+  }
+
+  struct sql_params params = {
+    .host = args->sql_host,
+    .user = args->sql_user,
+    .pass = args->sql_pass,
+    .db = args->sql_db,
+  };
+
+  // Connect to the database
+  MYSQL* conn = sql_connect(&params, 0);
+  if (conn == NULL) {
+    free(template);
+    return 1;
+  }
+
+  struct sql_value values[] = {
+    {.type = sql_value_int},
+    {.type = sql_value_text, .data = (char*) args->name, .len = strlen(args->name)},
+    {.type = sql_value_blob, .data = (char*) template, .len = dim * sizeof(float)},
+  };
+
+  struct sql_buf stmt = {0};
+  int friend_id = args->friend_id;
+  int status = 1;
+
+  for (int tries = 0; tries < ADD_MAX_TRIES; ++tries) {
+    if (args->friend_id < 0 && next_friend_id(conn, &friend_id)) {
+      break;
+    }
+
+    values[0].i = friend_id;
+
+    stmt.len = 0;
+    if (sql_format(&stmt, conn, "INSERT INTO friends (id, name, embedding) VALUES (?, ?, ?)", values, 3)
+      || stmt.data == NULL) {
+      fprintf(stderr, "failed to build statement\n");
+      break;
+    }
+
+    if (mysql_real_query(conn, stmt.data, stmt.len) == 0) {
+      status = 0;
+      break;
+    }
+
+    if (mysql_errno(conn) != ER_DUP_ENTRY) {
+      fprintf(stderr, "failed to add friend: %s\n", mysql_error(conn));
+      break;
+    }
+
+    // A given ID is taken for good, but the next free one may just have been taken by another client
+    if (args->friend_id >= 0) {
+      fprintf(stderr, "friend id already exists: %d\n", friend_id);
+      break;
+    }
+  }
+
+  if (status == 0) {
+    printf("%d\n", friend_id);
+    fprintf(stderr, "added friend %d from %zu of %zu embeddings\n", friend_id, kept, n);
+  } else if (args->friend_id < 0 && mysql_errno(conn) == ER_DUP_ENTRY) {
+    fprintf(stderr, "failed to take a free friend id\n");
+  }
+
+  sql_buf_release(&stmt);
+  mysql_close(conn);
+  free(template);
+  return status;
+}
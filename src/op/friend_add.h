@@ -0,0 +1,41 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef OP_FRIEND_ADD_H
+#define OP_FRIEND_ADD_H
+
+/** Arguments for adding a friend. */
+struct op_friend_add_args {
+  /** The friend name. */
+  const char* name;
+
+  /** The friend ID, or -1 to take the next free one. */
+  int friend_id;
+
+  /** The embeddings file path ("-" for stdin), one base64 embedding per line. */
+  const char* path;
+
+  /** The SQL server hostname. */
+  const char* sql_host;
+
+  /** The SQL server username. */
+  const char* sql_user;
+
+  /** The SQL server password. */
+  const char* sql_pass;
+
+  /** The SQL database name. */
+  const char* sql_db;
+};
+
+/**
+ * Main function for adding a friend.
+ *
+ * @param args The operation arguments
+ * @return Zero on success, otherwise nonzero
+ */
+int op_friend_add_main(struct op_friend_add_args* args);
+
+#endif // #ifndef OP_FRIEND_ADD_H
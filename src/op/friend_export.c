@@ -0,0 +1,97 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "core/sql.h"
+#include "friend_csv.h"
+#include "writer.h"
+
+#include "friend_export.h"
+
+/** The export query. Streamed in one pass, so no paging is needed. */
+static const char EXPORT_QUERY[] = "SELECT id, name, embedding FROM friends ORDER BY id";
+
+int op_friend_export_main(struct op_friend_export_args* args) {
+  // Open the output file
+  int fd = STDOUT_FILENO;
+  if (strcmp(args->path, "-") != 0) {
+    fd = open(args->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "failed to open %s: %s\n", args->path, strerror(errno));
+      return 1;
+    }
+  }
+
+  struct sql_params params = {
+    .host = args->sql_host,
+    .user = args->sql_user,
+    .pass = args->sql_pass,
+    .db = args->sql_db,
+  };
+
+  // Connect to the database
+  MYSQL* conn = sql_connect(&params, 0);
+  if (conn == NULL) {
+    if (fd != STDOUT_FILENO) {
+      close(fd);
+    }
+    return 1;
+  }
+
+  static struct writer out;
+  writer_init(&out, fd);
+  friend_csv_write_header(&out);
+
+  int status = 0;
+  long long count = 0;
+
+  // Stream rows off the wire straight into the file
+  MYSQL_RES* result = NULL;
+  if (mysql_real_query(conn, EXPORT_QUERY, sizeof EXPORT_QUERY - 1) || (result = mysql_use_result(conn)) == NULL) {
+    fprintf(stderr, "failed to query friends: %s\n", mysql_error(conn));
+    status = 1;
+  } else {
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(result)) != NULL && !out.error) {
+      unsigned long* lengths = mysql_fetch_lengths(result);
+
+      friend_csv_write(&out, strtoll(row[0], NULL, 10), row[1] ? row[1] : "", row[1] ? lengths[1] : 0,
+        (const unsigned char*) row[2], row[2] ? lengths[2] : 0);
+      ++count;
+    }
+
+    // A null row can also mean the stream broke
+    if (mysql_errno(conn)) {
+      fprintf(stderr, "failed to read friends: %s\n", mysql_error(conn));
+      status = 1;
+    }
+
+    mysql_free_result(result);
+  }
+
+  if (writer_flush(&out)) {
+    fprintf(stderr, "failed to write %s\n", args->path);
+    status = 1;
+  }
+
+  if (fd != STDOUT_FILENO && close(fd) < 0) {
+    fprintf(stderr, "failed to write %s: %s\n", args->path, strerror(errno));
+    status = 1;
+  }
+
+  mysql_close(conn);
+
+  if (status == 0) {
+    fprintf(stderr, "exported %lld friends\n", count);
+  }
+
+  return status;
+}
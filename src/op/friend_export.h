@@ -0,0 +1,35 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef OP_FRIEND_EXPORT_H
+#define OP_FRIEND_EXPORT_H
+
+/** Arguments for friend export. */
+struct op_friend_export_args {
+  /** The output file path ("-" for stdout). */
+  const char* path;
+
+  /** The SQL server hostname. */
+  const char* sql_host;
+
+  /** The SQL server username. */
+  const char* sql_user;
+
+  /** The SQL server password. */
+  const char* sql_pass;
+
+  /** The SQL database name. */
+  const char* sql_db;
+};
+
+/**
+ * Main function for friend export.
+ *
+ * @param args The operation arguments
+ * @return Zero on success, otherwise nonzero
+ */
+int op_friend_export_main(struct op_friend_export_args* args);
+
+#endif // #ifndef OP_FRIEND_EXPORT_H
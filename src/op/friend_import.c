@@ -0,0 +1,471 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <mysqld_error.h>
+
+#include "core/sql.h"
+#include "friend_csv.h"
+
+#include "friend_import.h"
+
+/** The most rows per INSERT statement. */
+#define IMPORT_BATCH_ROWS 1000
+
+/** The most bytes per INSERT statement (well under the default max_allowed_packet). */
+#define IMPORT_BATCH_BYTES (4 << 20)
+
+/** The number of statements that may wait for a loader per loader. */
+#define IMPORT_QUEUE_DEPTH 2
+
+/** The most loader connections. */
+#define IMPORT_MAX_JOBS 64
+
+/** The most times a batch is retried after losing a lock conflict. */
+#define IMPORT_LOCK_RETRIES 5
+
+/** The wait before the first retry, in milliseconds (doubled for each one after). */
+#define IMPORT_LOCK_BACKOFF_MS 50
+
+/** The head of every INSERT statement. */
+static const char IMPORT_INSERT_HEAD[] = "INSERT INTO friends (id, name, embedding) VALUES ";
+
+/** The tail of every INSERT statement. Importing over existing friends replaces them. */
+static const char IMPORT_INSERT_TAIL[] =
+  " ON DUPLICATE KEY UPDATE name = VALUES(name), embedding = VALUES(embedding)";
+
+/** A ready-to-send multi-row INSERT. */
+struct import_batch {
+  /** The statement. */
+  struct sql_buf sql;
+
+  /** The number of rows in the statement. */
+  long long rows;
+};
+
+/** A bounded queue of batches from the reader to the loaders. */
+struct import_queue {
+  /** The lock guarding the queue. */
+  pthread_mutex_t lock;
+
+  /** Signalled when a batch is added or the queue closes. */
+  pthread_cond_t not_empty;
+
+  /** Signalled when a batch is removed or a loader fails. */
+  pthread_cond_t not_full;
+
+  /** The batches (circular). */
+  struct import_batch* items[IMPORT_MAX_JOBS * IMPORT_QUEUE_DEPTH];
+
+  /** The queue capacity. */
+  size_t cap;
+
+  /** The index of the oldest batch. */
+  size_t head;
+
+  /** The number of batches. */
+  size_t count;
+
+  /** Nonzero once the reader is done. */
+  int closed;
+
+  /** Nonzero once a loader has failed. */
+  int failed;
+};
+
+/** A loader thread with its own connection. */
+struct import_loader {
+  /** The thread. */
+  pthread_t thread;
+
+  /** The queue. */
+  struct import_queue* queue;
+
+  /** The connection parameters. */
+  const struct sql_params* params;
+
+  /** The number of rows loaded. */
+  long long rows;
+
+  /** Zero on success, otherwise nonzero. */
+  int status;
+};
+
+/**
+ * Push a batch, waiting for room.
+ *
+ * @param q The queue
+ * @param batch The batch
+ * @return Zero on success, nonzero if a loader failed (batch not taken)
+ */
+static int import_queue_push(struct import_queue* q, struct import_batch* batch) {
+  pthread_mutex_lock(&q->lock);
+
+  while (q->count == q->cap && !q->failed) {
+    pthread_cond_wait(&q->not_full, &q->lock);
+  }
+
+  if (q->failed) {
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+  }
+
+  q->items[(q->head + q->count++) % q->cap] = batch;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+/**
+ * Pop a batch, waiting for one.
+ *
+ * @param q The queue
+ * @return The batch, or NULL once the queue is closed and empty (or failed)
+ */
+static struct import_batch* import_queue_pop(struct import_queue* q) {
+  pthread_mutex_lock(&q->lock);
+
+  while (q->count == 0 && !q->closed && !q->failed) {
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  }
+
+  struct import_batch* batch = NULL;
+  if (q->count > 0 && !q->failed) {
+    batch = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    --q->count;
+    pthread_cond_signal(&q->not_full);
+  }
+
+  pthread_mutex_unlock(&q->lock);
+  return batch;
+}
+
+/**
+ * Mark the queue failed, waking everyone.
+ *
+ * @param q The queue
+ */
+static void import_queue_fail(struct import_queue* q) {
+  pthread_mutex_lock(&q->lock);
+  q->failed = 1;
+  pthread_cond_broadcast(&q->not_empty);
+  pthread_cond_broadcast(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Free a batch.
+ *
+ * @param batch The batch
+ */
+static void import_batch_free(struct import_batch* batch) {
+  sql_buf_release(&batch->sql);
+  free(batch);
+}
+
+/**
+ * Load a batch, retrying if it loses a lock conflict.
+ *
+ * Loaders upsert into the same table at once, so now and then the server
+ * picks one as a deadlock victim or it times out waiting for a row lock.
+ * Either way the batch is rolled back whole and can simply be sent again.
+ *
+ * @param conn The connection
+ * @param batch The batch
+ * @return Zero on success, otherwise nonzero (the error is left on the connection)
+ */
+static int import_batch_load(MYSQL* conn, const struct import_batch* batch) {
+  long backoff_ms = IMPORT_LOCK_BACKOFF_MS;
+
+  for (int attempt = 0;; ++attempt) {
+    if (!mysql_real_query(conn, batch->sql.data, batch->sql.len) && !mysql_commit(conn)) {
+      return 0;
+    }
+
+    unsigned int err_no = mysql_errno(conn);
+    if ((err_no != ER_LOCK_DEADLOCK && err_no != ER_LOCK_WAIT_TIMEOUT) || attempt == IMPORT_LOCK_RETRIES) {
+      return 1;
+    }
+
+    // A lock wait timeout only rolls back the statement, so end the transaction either way
+    mysql_rollback(conn);
+
+    struct timespec ts = {
+      .tv_sec = backoff_ms / 1000,
+      .tv_nsec = backoff_ms % 1000 * 1000000,
+    };
+    nanosleep(&ts, NULL);
+    backoff_ms *= 2;
+  }
+}
+
+/**
+ * The loader thread main function.
+ *
+ * @param arg The loader
+ * @return Nothing
+ */
+static void* import_loader_main(void* arg) {
+  struct import_loader* loader = arg;
+
+  mysql_thread_init();
+
+  MYSQL* conn = sql_connect(loader->params, 0);
+  if (conn == NULL) {
+    loader->status = 1;
+    import_queue_fail(loader->queue);
+    mysql_thread_end();
+    return NULL;
+  }
+
+  // Bulk load session settings: skip secondary unique checks, commit per statement
+  static const char SESSION_SETUP[] = "SET SESSION unique_checks = 0";
+  if (mysql_real_query(conn, SESSION_SETUP, sizeof SESSION_SETUP - 1)) {
+    fprintf(stderr, "warning: failed to tune loader session: %s\n", mysql_error(conn));
+  }
+  mysql_autocommit(conn, 0);
+
+  struct import_batch* batch;
+  while ((batch = import_queue_pop(loader->queue)) != NULL) {
+    if (import_batch_load(conn, batch)) {
+      fprintf(stderr, "failed to load friends: %s\n", mysql_error(conn));
+      import_batch_free(batch);
+      loader->status = 1;
+      import_queue_fail(loader->queue);
+      break;
+    }
+
+    loader->rows += batch->rows;
+    import_batch_free(batch);
+  }
+
+  mysql_close(conn);
+  mysql_thread_end();
+  return NULL;
+}
+
+/**
+ * Append a row to a batch statement.
+ *
+ * Strings go in as hex literals, which needs no connection to escape and so
+ * can be done here on the reader thread.
+ *
+ * @param batch The batch
+ * @param rec The record
+ * @return Zero on success, otherwise nonzero
+ */
+static int import_batch_append(struct import_batch* batch, const struct friend_record* rec) {
+  struct sql_buf* sql = &batch->sql;
+
+  if (sql_buf_appendf(sql, "%s(%lld,", batch->rows ? "," : "", rec->id)) {
+    return 1;
+  }
+
+  struct sql_value name = {
+    .type = sql_value_blob,
+    .data = (char*) rec->name,
+    .len = rec->name_len,
+  };
+
+  struct sql_value embedding = {
+    .type = rec->embedding_len ? sql_value_blob : sql_value_null,
+    .data = (char*) rec->embedding,
+    .len = rec->embedding_len,
+  };
+
+  if (sql_buf_append_value(sql, NULL, &name) || sql_buf_append(sql, ",", 1)
+      || sql_buf_append_value(sql, NULL, &embedding) || sql_buf_append(sql, ")", 1)) {
+    return 1;
+  }
+
+  ++batch->rows;
+  return 0;
+}
+
+/**
+ * Start a new batch statement.
+ *
+ * @return The batch, or NULL on failure
+ */
+static struct import_batch* import_batch_new() {
+  struct import_batch* batch = calloc(1, sizeof *batch);
+  if (batch == NULL) {
+    return NULL;
+  }
+
+  if (sql_buf_append(&batch->sql, IMPORT_INSERT_HEAD, sizeof IMPORT_INSERT_HEAD - 1)) {
+    free(batch);
+    return NULL;
+  }
+
+  return batch;
+}
+
+/**
+ * Get a monotonic time in seconds.
+ *
+ * @return The time
+ */
+static double import_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+int op_friend_import_main(struct op_friend_import_args* args) {
+  int jobs = args->jobs;
+  if (jobs < 1) {
+    jobs = 1;
+  } else if (jobs > IMPORT_MAX_JOBS) {
+    jobs = IMPORT_MAX_JOBS;
+  }
+
+  // Open the input file
+  FILE* file = stdin;
+  if (strcmp(args->path, "-") != 0) {
+    file = fopen(args->path, "rb");
+    if (file == NULL) {
+      fprintf(stderr, "failed to open %s: %s\n", args->path, strerror(errno));
+      return 1;
+    }
+  }
+
+  // Read in large chunks
+  setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+  struct sql_params params = {
+    .host = args->sql_host,
+    .user = args->sql_user,
+    .pass = args->sql_pass,
+    .db = args->sql_db,
+  };
+
+  sql_library_init();
+
+  // Fresh state every call, since a batch script may import more than once
+  struct import_queue queue = {0};
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.not_empty, NULL);
+  pthread_cond_init(&queue.not_full, NULL);
+  queue.cap = (size_t) jobs * IMPORT_QUEUE_DEPTH;
+
+  // Spin up the loaders
+  struct import_loader loaders[IMPORT_MAX_JOBS] = {{0}};
+  int num_loaders = 0;
+  for (; num_loaders < jobs; ++num_loaders) {
+    loaders[num_loaders].queue = &queue;
+    loaders[num_loaders].params = &params;
+
+    if (pthread_create(&loaders[num_loaders].thread, NULL, &import_loader_main, &loaders[num_loaders])) {
+      fprintf(stderr, "failed to start loader thread\n");
+      import_queue_fail(&queue);
+      break;
+    }
+  }
+
+  double start = import_now();
+  int status = 0;
+
+  // Parse on this thread while the loaders talk to the server
+  struct friend_csv_reader reader;
+  friend_csv_reader_init(&reader, file);
+
+  struct import_batch* batch = NULL;
+  struct friend_record rec;
+  int r;
+  while ((r = friend_csv_read(&reader, &rec)) > 0) {
+    if (batch == NULL && (batch = import_batch_new()) == NULL) {
+      status = 1;
+      break;
+    }
+
+    if (import_batch_append(batch, &rec)) {
+      status = 1;
+      break;
+    }
+
+    // Hand off full batches
+    if (batch->rows == IMPORT_BATCH_ROWS || batch->sql.len >= IMPORT_BATCH_BYTES) {
+      if (sql_buf_append(&batch->sql, IMPORT_INSERT_TAIL, sizeof IMPORT_INSERT_TAIL - 1)
+          || import_queue_push(&queue, batch)) {
+        status = 1;
+        break;
+      }
+
+      batch = NULL;
+    }
+  }
+
+  if (r < 0) {
+    status = 1;
+  }
+
+  // Hand off the last partial batch
+  if (status == 0 && batch && batch->rows > 0) {
+    if (sql_buf_append(&batch->sql, IMPORT_INSERT_TAIL, sizeof IMPORT_INSERT_TAIL - 1)
+        || import_queue_push(&queue, batch)) {
+      status = 1;
+    } else {
+      batch = NULL;
+    }
+  }
+
+  if (batch) {
+    import_batch_free(batch);
+  }
+
+  // Stop the loaders (on failure, abandon what's queued)
+  if (status) {
+    import_queue_fail(&queue);
+  }
+
+  pthread_mutex_lock(&queue.lock);
+  queue.closed = 1;
+  pthread_cond_broadcast(&queue.not_empty);
+  pthread_mutex_unlock(&queue.lock);
+
+  long long rows = 0;
+  for (int i = 0; i < num_loaders; ++i) {
+    pthread_join(loaders[i].thread, NULL);
+    rows += loaders[i].rows;
+    status |= loaders[i].status;
+  }
+
+  // Free anything abandoned in the queue
+  while (queue.count > 0) {
+    import_batch_free(queue.items[queue.head]);
+    queue.head = (queue.head + 1) % queue.cap;
+    --queue.count;
+  }
+
+  pthread_cond_destroy(&queue.not_full);
+  pthread_cond_destroy(&queue.not_empty);
+  pthread_mutex_destroy(&queue.lock);
+
+  friend_csv_reader_release(&reader);
+  if (file != stdin) {
+    fclose(file);
+  }
+
+  double elapsed = import_now() - start;
+
+  // Batches already committed stay, so say how far it got (importing again replaces them)
+  if (status) {
+    fprintf(stderr, "import aborted: %lld friends were committed before the failure\n", rows);
+    return status;
+  }
+
+  fprintf(stderr, "imported %lld friends in %.1f s (%.0f/s) over %d connections\n", rows, elapsed,
+    elapsed > 0 ? (double) rows / elapsed : 0.0, num_loaders);
+
+  return status;
+}
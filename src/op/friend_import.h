@@ -0,0 +1,38 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef OP_FRIEND_IMPORT_H
+#define OP_FRIEND_IMPORT_H
+
+/** Arguments for friend import. */
+struct op_friend_import_args {
+  /** The input file path ("-" for stdin). */
+  const char* path;
+
+  /** The number of loader connections. */
+  int jobs;
+
+  /** The SQL server hostname. */
+  const char* sql_host;
+
+  /** The SQL server username. */
+  const char* sql_user;
+
+  /** The SQL server password. */
+  const char* sql_pass;
+
+  /** The SQL database name. */
+  const char* sql_db;
+};
+
+/**
+ * Main function for friend import.
+ *
+ * @param args The operation arguments
+ * @return Zero on success, otherwise nonzero
+ */
+int op_friend_import_main(struct op_friend_import_args* args);
+
+#endif // #ifndef OP_FRIEND_IMPORT_H
@@ -4,120 +4,138 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
-#define PY_SSIZE_T_CLEAN
-#include <Python.h>
+#include "core/sql.h"
+#include "writer.h"
 
-#include "common.h"
 #include "friend_list.h"
 
-/** The Python code for this operation. */
-static const char OPERATION_CODE[] =
-  "from _core import Server\n"
-  "from cozmonaut.client import Client\n"
-  "server = Server()\n"
-  "client = Client(server)\n"
-  "result = client.entry_friend_list(args['friend_id'])\n";
-
-int op_friend_list_main(struct op_friend_list_args* args) {
-  // Initialize the operation
-  if (op_common_initialize()) {
-    fprintf(stderr, "failed to initialize operation\n");
-    return 1;
-  }
-
-  // Look up the __main__ module
-  // We'll execute under this context
-  PyObject* py_module = PyImport_AddModule("__main__");
-  if (py_module == NULL) {
-    PyErr_Print();
-    PyErr_Clear();
-    return 1;
-  }
-
-  // Grab the dictionary from the main module
-  PyObject* py_module_dict = PyModule_GetDict(py_module);
-  if (py_module_dict == NULL) {
-    PyErr_Print();
-    PyErr_Clear();
-
-    Py_DECREF(py_module);
-    return 1;
-  }
-
-  // Create a dictionary for operation arguments
-  PyObject* py_args = PyDict_New();
-  if (py_args == NULL) {
-    PyErr_Print();
-    PyErr_Clear();
-
-    Py_DECREF(py_module_dict);
-    Py_DECREF(py_module);
-    return 1;
-  }
-
-  // Add argument dictionary to module
-  // This will let us access it from the operation code
-  if (PyDict_SetItemString(py_module_dict, "args", py_args) < 0) {
-    PyErr_Print();
-    PyErr_Clear();
-
-    Py_DECREF(py_args);
-    Py_DECREF(py_module_dict);
-    Py_DECREF(py_module);
-    return 1;
-  }
-
-  // The friend_id argument
-  PyObject* py_args_friend_id = PyLong_FromLong(args->friend_id);
-  if (py_args_friend_id == NULL) {
-    PyErr_Print();
-    PyErr_Clear();
-
-    Py_DECREF(py_args);
-    Py_DECREF(py_module_dict);
-    Py_DECREF(py_module);
-    return 1;
+/**
+ * The number of friends fetched per round trip.
+ *
+ * Each page is streamed off the wire as it arrives (nothing is buffered
+ * client-side), and the next page picks up after the last ID seen. Bounding
+ * the page keeps each server-side read short on very large tables.
+ */
+#define FRIEND_LIST_PAGE_SIZE 10000
+
+/**
+ * Write one friend.
+ *
+ * @param w The writer
+ * @param format The output format
+ * @param id The friend ID
+ * @param name The friend name
+ * @param name_len The friend name length
+ */
+static void write_friend(struct writer* w, enum op_friend_list_format format, long long id, const char* name,
+    size_t name_len) {
+  switch (format) {
+    case op_friend_list_format_tsv:
+      writer_put_int(w, id);
+      writer_putc(w, '\t');
+      writer_put_tsv_field(w, name, name_len);
+      writer_putc(w, '\n');
+      break;
+    case op_friend_list_format_json_lines:
+      writer_puts(w, "{\"id\":");
+      writer_put_int(w, id);
+      writer_puts(w, ",\"name\":");
+      writer_put_json_string(w, name, name_len);
+      writer_puts(w, "}\n");
+      break;
   }
+}
 
-  // Map friend_id argument to argument dictionary
-  if (PyDict_SetItemString(py_args, "friend_id", py_args_friend_id) < 0) {
-    PyErr_Print();
-    PyErr_Clear();
-
-    Py_DECREF(py_args_friend_id);
-    Py_DECREF(py_args);
-    Py_DECREF(py_module_dict);
-    Py_DECREF(py_module);
+int op_friend_list_main(struct op_friend_list_args* args) {
+  struct sql_params params = {
+    .host = args->sql_host,
+    .user = args->sql_user,
+    .pass = args->sql_pass,
+    .db = args->sql_db,
+  };
+
+  // Connect to the database
+  MYSQL* conn = sql_connect(&params, 0);
+  if (conn == NULL) {
     return 1;
   }
 
-  // Run the operation code
-  // This will call into our main Python code
-  PyObject* py_result = PyRun_String(OPERATION_CODE, Py_file_input, py_module_dict, py_module_dict);
-  if (py_result == NULL) {
-    PyErr_Print();
-    PyErr_Clear();
-
-    Py_DECREF(py_args_friend_id);
-    Py_DECREF(py_args);
-    Py_DECREF(py_module_dict);
-    Py_DECREF(py_module);
-    return 1;
+  // Output goes straight to stdout in large chunks
+  static struct writer out;
+  writer_init(&out, STDOUT_FILENO);
+
+  // The last ID written (pages resume after it)
+  long long after = args->offset;
+
+  // The number of friends still wanted (negative for unlimited)
+  long long left = args->limit;
+
+  struct sql_buf query = {0};
+  int status = 0;
+
+  while (left != 0 && !out.error) {
+    long long page = FRIEND_LIST_PAGE_SIZE;
+    if (left > 0 && left < page) {
+      page = left;
+    }
+
+    // Build the query for this page
+    query.len = 0;
+    if (args->friend_id > 0) {
+      sql_buf_appendf(&query, "SELECT id, name FROM friends WHERE id = %d", args->friend_id);
+    } else {
+      sql_buf_appendf(&query, "SELECT id, name FROM friends WHERE id > %lld ORDER BY id LIMIT %lld", after, page);
+    }
+
+    if (query.data == NULL || mysql_real_query(conn, query.data, query.len)) {
+      fprintf(stderr, "failed to query friends: %s\n", mysql_error(conn));
+      status = 1;
+      break;
+    }
+
+    // Stream rows as they come in rather than storing the result
+    MYSQL_RES* result = mysql_use_result(conn);
+    if (result == NULL) {
+      fprintf(stderr, "failed to read friends: %s\n", mysql_error(conn));
+      status = 1;
+      break;
+    }
+
+    long long rows = 0;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(result)) != NULL) {
+      unsigned long* lengths = mysql_fetch_lengths(result);
+
+      after = strtoll(row[0], NULL, 10);
+      write_friend(&out, args->format, after, row[1] ? row[1] : "", row[1] ? lengths[1] : 0);
+      ++rows;
+    }
+
+    // A null row can also mean the stream broke
+    if (mysql_errno(conn)) {
+      fprintf(stderr, "failed to read friends: %s\n", mysql_error(conn));
+      status = 1;
+    }
+
+    mysql_free_result(result);
+
+    if (status || args->friend_id > 0 || rows < page) {
+      break;
+    }
+
+    if (left > 0) {
+      left -= rows;
+    }
   }
 
-  // Clean up on success
-  Py_DECREF(py_result);
-  Py_DECREF(py_args_friend_id);
-  Py_DECREF(py_args);
-  Py_DECREF(py_module_dict);
-  Py_DECREF(py_module);
-
-  // Finalize the operation
-  if (op_common_finalize()) {
-    fprintf(stderr, "failed to finalize operation\n");
-    return 1;
+  if (writer_flush(&out)) {
+    status = 1;
   }
 
-  return 0;
+  sql_buf_release(&query);
+  mysql_close(conn);
+  return status;
 }
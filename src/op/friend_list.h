@@ -6,10 +6,40 @@
 #ifndef OP_FRIEND_LIST_H
 #define OP_FRIEND_LIST_H
 
+/** Output formats for friend listing. */
+enum op_friend_list_format {
+  /** Tab-separated id and name, one friend per line. */
+  op_friend_list_format_tsv = 0,
+
+  /** One JSON object per line. */
+  op_friend_list_format_json_lines,
+};
+
 /** Arguments for friend listing. */
 struct op_friend_list_args {
-  /** The target friend ID. */
+  /** The target friend ID, or -1 for all friends. */
   int friend_id;
+
+  /** The most friends to list, or -1 for no limit. */
+  long long limit;
+
+  /** List only friends with IDs greater than this (keyset offset). */
+  long long offset;
+
+  /** The output format. */
+  enum op_friend_list_format format;
+
+  /** The SQL server hostname. */
+  const char* sql_host;
+
+  /** The SQL server username. */
+  const char* sql_user;
+
+  /** The SQL server password. */
+  const char* sql_pass;
+
+  /** The SQL database name. */
+  const char* sql_db;
 };
 
 /**
@@ -14,7 +14,7 @@
 /** The Python code for this operation. */
 static const char OPERATION_CODE[] =
   "from cozmonaut.entry_point.interact import EntryPointInteract\n"
-  "EntryPointInteract().main()\n";
+  "status = EntryPointInteract(args).main()\n";
 
 int op_interact_main(struct op_interact_args* args) {
   // Initialize the operation
@@ -23,8 +23,21 @@ int op_interact_main(struct op_interact_args* args) {
     return 1;
   }
 
-  // Run the operation code
-  PyRun_SimpleString(OPERATION_CODE);
+  // Run the operation code with its arguments
+  // Missing options map to None
+  // A failed replay baseline check, for instance, must fail the process
+  int status = op_common_run(OPERATION_CODE, Py_BuildValue("{s:z,s:z,s:z,s:z,s:z,s:z,s:z,s:z,s:z,s:z,s:z}",
+    "sql_host", args->sql_host,
+    "sql_user", args->sql_user,
+    "sql_pass", args->sql_pass,
+    "sql_db", args->sql_db,
+    "frame_ring", args->frame_ring,
+    "replay", args->replay,
+    "metrics", args->metrics,
+    "baseline", args->baseline,
+    "friend_snapshot", args->friend_snapshot,
+    "cpu_policy", args->cpu_policy,
+    "memory_budget", args->memory_budget));
 
   // Finalize the operation
   if (op_common_finalize()) {
@@ -32,5 +45,5 @@ int op_interact_main(struct op_interact_args* args) {
     return 1;
   }
 
-  return 0;
+  return status;
 }
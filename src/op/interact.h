@@ -8,7 +8,38 @@
 
 /** Arguments for interaction. */
 struct op_interact_args {
-  int __not_empty;
+  /** The SQL server hostname. */
+  const char* sql_host;
+
+  /** The SQL server username. */
+  const char* sql_user;
+
+  /** The SQL server password. */
+  const char* sql_pass;
+
+  /** The SQL database name. */
+  const char* sql_db;
+
+  /** The frame ring to consume frames from, or NULL to capture locally. */
+  const char* frame_ring;
+
+  /** A directory of JPEG frames to replay headless, or NULL. */
+  const char* replay;
+
+  /** The file to write replay metrics to (JSON), or NULL for stdout. */
+  const char* metrics;
+
+  /** The baseline file to check replay metrics against (JSON), or NULL. */
+  const char* baseline;
+
+  /** The friend snapshot file shared by processes on this host, or NULL. */
+  const char* friend_snapshot;
+
+  /** The CPU placement policy for robot pipelines, or NULL to leave it to the kernel. */
+  const char* cpu_policy;
+
+  /** The native memory budgets ("tag=mib,..."), or NULL for none. */
+  const char* memory_budget;
 };
 
 /**
@@ -0,0 +1,39 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <stdio.h>
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "common.h"
+#include "stats_memory.h"
+
+/** The Python code for this operation. */
+static const char OPERATION_CODE[] =
+  "from cozmonaut.memory import print_report\n"
+  "status = print_report(args['format'], args['limit'], args['pid'])\n";
+
+int op_stats_memory_main(struct op_stats_memory_args* args) {
+  // Initialize the operation
+  if (op_common_initialize()) {
+    fprintf(stderr, "failed to initialize operation\n");
+    return 1;
+  }
+
+  // Run the operation code with its arguments
+  int status = op_common_run(OPERATION_CODE, Py_BuildValue("{s:s,s:i,s:i}",
+    "format", args->format == op_stats_memory_format_json ? "json" : "text",
+    "limit", args->limit,
+    "pid", args->pid));
+
+  // Finalize the operation
+  if (op_common_finalize()) {
+    fprintf(stderr, "failed to finalize operation\n");
+    return 1;
+  }
+
+  return status;
+}
@@ -0,0 +1,45 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef OP_STATS_MEMORY_H
+#define OP_STATS_MEMORY_H
+
+/** Output formats for memory statistics. */
+enum op_stats_memory_format {
+  /** A table for people. */
+  op_stats_memory_format_text = 0,
+
+  /** One JSON object. */
+  op_stats_memory_format_json,
+};
+
+/** Arguments for memory statistics. */
+struct op_stats_memory_args {
+  /** The output format. */
+  enum op_stats_memory_format format;
+
+  /** The most allocation sites to show per tracemalloc domain. */
+  int limit;
+
+  /** The running interact process to report on, or zero for this process. */
+  int pid;
+};
+
+/**
+ * Main function for memory statistics.
+ *
+ * Reports native memory by subsystem tag with high-water marks, the process
+ * RSS, and (while tracemalloc is tracing, e.g. under PYTHONTRACEMALLOC) the
+ * Python lines behind the most Python and native memory. With a process ID,
+ * the report comes from that running `cozmo go' process (which writes it when
+ * signalled) and includes each robot's share; otherwise it covers this
+ * process, which is most useful late in a batch script.
+ *
+ * @param args The operation arguments
+ * @return Zero on success, otherwise nonzero
+ */
+int op_stats_memory_main(struct op_stats_memory_args* args);
+
+#endif // #ifndef OP_STATS_MEMORY_H
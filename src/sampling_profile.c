@@ -0,0 +1,885 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <frameobject.h>
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "sampling_profile.h"
+
+/** The most native frames kept per sample. */
+#define MAX_NATIVE 64
+
+/** The most Python frames kept per sample. */
+#define MAX_PYTHON 48
+
+/** The longest Python function name kept. */
+#define FUNCTION_MAX 64
+
+/** The longest Python file name kept (the tail end of longer ones). */
+#define FILE_MAX 96
+
+/** The sample slots between the signal handler and the background thread. */
+#define SLOTS 1024
+
+/** The slots a signal handler tries before dropping its sample. */
+#define PROBES 8
+
+/** How often the background thread folds samples and looks for new threads, in nanoseconds. */
+#define DRAIN_NS 50000000L
+
+/** The longest collapsed stack. */
+#define STACK_TEXT_MAX 16384
+
+/**
+ * Nonzero if the interpreter's frame layout is public, so a signal handler can
+ * walk it without allocating. From Python 3.11 frames live in private
+ * structures, so samples there hold native frames only.
+ */
+#define SAMPLE_PYTHON_FRAMES (PY_VERSION_HEX < 0x030B0000)
+
+/** The interpreter function that runs one Python frame. */
+#define EVAL_FUNCTION "_PyEval_EvalFrameDefault"
+
+/** A sample slot state. */
+enum slot_state {
+  slot_free = 0,
+  slot_writing,
+  slot_ready,
+};
+
+/** A Python frame in a sample. */
+struct python_frame {
+  /** The line number. */
+  int line;
+
+  /** The function name. */
+  char function[FUNCTION_MAX];
+
+  /** The file name. */
+  char file[FILE_MAX];
+};
+
+/** A sample, filled in by the signal handler. */
+struct sample {
+  /** The slot state. */
+  int state;
+
+  /** The thread name. */
+  char thread[16];
+
+  /** The number of native frames. */
+  int num_native;
+
+  /** The number of Python frames. */
+  int num_python;
+
+  /** The native frames, innermost first, starting at the interrupted instruction. */
+  void* native[MAX_NATIVE];
+
+  /** The Python frames, innermost first. */
+  struct python_frame python[MAX_PYTHON];
+};
+
+/** A thread's sampling timer. */
+struct thread_timer {
+  /** The thread ID. */
+  pid_t tid;
+
+  /** The timer. */
+  timer_t timer;
+
+  /** Nonzero if the thread turned up in the last scan. */
+  int seen;
+};
+
+/** A resolved native frame. */
+struct symbol {
+  /** The address looked up (NULL for an empty table entry). */
+  const void* addr;
+
+  /** The symbol name, or the object file and offset. */
+  char* name;
+
+  /** The base address of the object file. */
+  const void* base;
+
+  /** Nonzero if this is the interpreter running a Python frame. */
+  int eval;
+};
+
+/** A distinct stack and its sample count. */
+struct stack_count {
+  /** The collapsed stack (NULL for an empty table entry). */
+  char* text;
+
+  /** The samples. */
+  uint64_t count;
+};
+
+/** Nonzero while the signal handler takes samples. */
+static int g_active;
+
+/** The signal handlers in progress. */
+static int g_in_handler;
+
+/** Nonzero once started (main thread only). */
+static int g_running;
+
+/** Nonzero once the background thread should exit. */
+static int g_stopping;
+
+/** The sample slots. */
+static struct sample* g_slots;
+
+/** The next slot to try. */
+static unsigned int g_next_slot;
+
+/** The samples taken. */
+static uint64_t g_samples;
+
+/** The samples dropped for want of a free slot. */
+static uint64_t g_dropped;
+
+/** The output file. */
+static FILE* g_file;
+
+/** The output file path. */
+static char* g_path;
+
+/** The sampling period, in nanoseconds of thread CPU time. */
+static long g_period;
+
+/** The background thread. */
+static pthread_t g_thread;
+
+/** The background thread's ID (not sampled). */
+static pid_t g_thread_tid;
+
+/** The base address of this program, to tell whether the interpreter is linked in. */
+static const void* g_self_base;
+
+/** The sampling timers. */
+static struct thread_timer* g_timers;
+
+/** The number of sampling timers. */
+static size_t g_num_timers;
+
+/** The distinct threads sampled. */
+static size_t g_num_threads;
+
+/** The resolved native frames (an open-addressed table). */
+static struct symbol* g_symbols;
+
+/** The number of resolved native frames. */
+static size_t g_num_symbols;
+
+/** The resolved native frame table capacity (a power of two). */
+static size_t g_cap_symbols;
+
+/** The distinct stacks (an open-addressed table). */
+static struct stack_count* g_stacks;
+
+/** The number of distinct stacks. */
+static size_t g_num_stacks;
+
+/** The distinct stack table capacity (a power of two). */
+static size_t g_cap_stacks;
+
+/**
+ * Get the instruction a signal interrupted.
+ *
+ * @param context The signal context
+ * @return The instruction address, or NULL if unknown on this architecture
+ */
+static void* context_pc(void* context) {
+  ucontext_t* uc = context;
+#if defined(__x86_64__)
+  return (void*) uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+  return (void*) uc->uc_mcontext.pc;
+#else
+  (void) uc;
+  return NULL;
+#endif
+}
+
+#if SAMPLE_PYTHON_FRAMES
+
+/**
+ * Copy a Python string without allocating. Async-signal-safe.
+ *
+ * Only one-byte strings are read, and anything outside ASCII (or a stack
+ * separator) is replaced, which covers identifiers and paths in practice.
+ *
+ * @param out The output
+ * @param max The output size
+ * @param text The string
+ * @param tail Nonzero to keep the end of a string too long to fit, otherwise the start
+ */
+static void copy_ascii(char* out, size_t max, PyObject* text, int tail) {
+  size_t n = 0;
+
+  if (text != NULL && PyUnicode_Check(text) && PyUnicode_IS_READY(text)
+      && PyUnicode_KIND(text) == PyUnicode_1BYTE_KIND) {
+    const unsigned char* data = PyUnicode_1BYTE_DATA(text);
+    size_t len = (size_t) PyUnicode_GET_LENGTH(text);
+    size_t i = tail && len > max - 1 ? len - (max - 1) : 0;
+
+    for (; i < len && n < max - 1; ++i) {
+      unsigned char c = data[i];
+      out[n++] = c >= 0x20 && c < 0x7f && c != ';' ? (char) c : '?';
+    }
+  } else {
+    out[n++] = '?';
+  }
+
+  out[n] = '\0';
+}
+
+#endif // #if SAMPLE_PYTHON_FRAMES
+
+/**
+ * Take a sample of the calling thread. Async-signal-safe.
+ *
+ * The Python frames are read on the thread that owns them, so the chain is
+ * never changing underneath the walk.
+ *
+ * @param context The signal context
+ */
+static void take_sample(void* context) {
+  unsigned int start = __atomic_fetch_add(&g_next_slot, 1, __ATOMIC_RELAXED);
+
+  struct sample* s = NULL;
+  for (unsigned int i = 0; i < PROBES; ++i) {
+    struct sample* candidate = &g_slots[(start + i) % SLOTS];
+    int expected = slot_free;
+    if (__atomic_compare_exchange_n(&candidate->state, &expected, slot_writing, 0, __ATOMIC_ACQUIRE,
+        __ATOMIC_RELAXED)) {
+      s = candidate;
+      break;
+    }
+  }
+
+  if (s == NULL) {
+    __atomic_add_fetch(&g_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  prctl(PR_GET_NAME, s->thread);
+
+  int n = backtrace(s->native, MAX_NATIVE);
+
+  // Start at the interrupted instruction, dropping this handler and the signal trampoline
+  void* pc = context_pc(context);
+  int skip = n < 2 ? n : 2;
+  for (int i = 0; i < n; ++i) {
+    if (s->native[i] == pc) {
+      skip = i;
+      break;
+    }
+  }
+
+  memmove(s->native, s->native + skip, (size_t) (n - skip) * sizeof(void*));
+  s->num_native = n - skip;
+  s->num_python = 0;
+
+#if SAMPLE_PYTHON_FRAMES
+  if (Py_IsInitialized() && !_Py_IsFinalizing()) {
+    PyThreadState* tstate = PyGILState_GetThisThreadState();
+
+    for (PyFrameObject* f = tstate ? tstate->frame : NULL; f != NULL && s->num_python < MAX_PYTHON; f = f->f_back) {
+      struct python_frame* frame = &s->python[s->num_python++];
+#if PY_VERSION_HEX >= 0x030A0000
+      // The last instruction is counted in code units from 3.10
+      frame->line = PyCode_Addr2Line(f->f_code, f->f_lasti * (int) sizeof(_Py_CODEUNIT));
+#else
+      frame->line = PyCode_Addr2Line(f->f_code, f->f_lasti);
+#endif
+      copy_ascii(frame->function, sizeof(frame->function), f->f_code->co_name, 0);
+      copy_ascii(frame->file, sizeof(frame->file), f->f_code->co_filename, 1);
+    }
+  }
+#endif // #if SAMPLE_PYTHON_FRAMES
+
+  __atomic_add_fetch(&g_samples, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->state, slot_ready, __ATOMIC_RELEASE);
+}
+
+/**
+ * Handle SIGPROF.
+ *
+ * The handler stays installed after sampling stops, doing nothing, so a
+ * signal still in flight never takes the default action (exit).
+ *
+ * @param sig The signal
+ * @param info The signal info
+ * @param context The signal context
+ */
+static void on_sigprof(int sig, siginfo_t* info, void* context) {
+  int saved_errno = errno;
+
+  __atomic_add_fetch(&g_in_handler, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&g_active, __ATOMIC_SEQ_CST)) {
+    take_sample(context);
+  }
+  __atomic_sub_fetch(&g_in_handler, 1, __ATOMIC_SEQ_CST);
+
+  errno = saved_errno;
+}
+
+/**
+ * Hash an address.
+ *
+ * @param addr The address
+ * @return The hash
+ */
+static size_t hash_addr(const void* addr) {
+  uint64_t h = (uint64_t) (uintptr_t) addr * 0x9e3779b97f4a7c15ull;
+  return (size_t) (h ^ (h >> 29));
+}
+
+/**
+ * Hash a string (FNV-1a).
+ *
+ * @param text The string
+ * @return The hash
+ */
+static size_t hash_text(const char* text) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (; *text; ++text) {
+    h = (h ^ (unsigned char) *text) * 0x100000001b3ull;
+  }
+  return (size_t) h;
+}
+
+/**
+ * Resolve a native frame, caching the result.
+ *
+ * @param addr The address (already moved back into the call for return addresses)
+ * @return The symbol, or NULL if out of memory
+ */
+static const struct symbol* resolve(const void* addr) {
+  // Grow at three quarters full
+  if ((g_num_symbols + 1) * 4 > g_cap_symbols * 3) {
+    size_t cap = g_cap_symbols ? g_cap_symbols * 2 : 1024;
+    struct symbol* table = calloc(cap, sizeof(*table));
+    if (table == NULL) {
+      return NULL;
+    }
+
+    for (size_t i = 0; i < g_cap_symbols; ++i) {
+      if (g_symbols[i].addr) {
+        size_t j = hash_addr(g_symbols[i].addr) & (cap - 1);
+        while (table[j].addr) {
+          j = (j + 1) & (cap - 1);
+        }
+        table[j] = g_symbols[i];
+      }
+    }
+
+    free(g_symbols);
+    g_symbols = table;
+    g_cap_symbols = cap;
+  }
+
+  size_t i = hash_addr(addr) & (g_cap_symbols - 1);
+  while (g_symbols[i].addr) {
+    if (g_symbols[i].addr == addr) {
+      return &g_symbols[i];
+    }
+    i = (i + 1) & (g_cap_symbols - 1);
+  }
+
+  Dl_info info;
+  char name[256];
+  const void* base = NULL;
+  int eval = 0;
+
+  if (dladdr(addr, &info) && info.dli_sname) {
+    snprintf(name, sizeof(name), "%s", info.dli_sname);
+    base = info.dli_fbase;
+    eval = !strcmp(info.dli_sname, EVAL_FUNCTION);
+  } else if (dladdr(addr, &info) && info.dli_fname) {
+    // Not exported, so give the object file and offset for addr2line
+    const char* file = strrchr(info.dli_fname, '/');
+    snprintf(name, sizeof(name), "[%s+0x%lx]", file ? file + 1 : info.dli_fname,
+      (unsigned long) ((const char*) addr - (const char*) info.dli_fbase));
+    base = info.dli_fbase;
+  } else {
+    snprintf(name, sizeof(name), "[unknown]");
+  }
+
+  char* copy = strdup(name);
+  if (copy == NULL) {
+    return NULL;
+  }
+
+  g_symbols[i] = (struct symbol) {
+    .addr = addr,
+    .name = copy,
+    .base = base,
+    .eval = eval,
+  };
+  g_num_symbols++;
+  return &g_symbols[i];
+}
+
+/**
+ * Count a stack.
+ *
+ * @param text The collapsed stack
+ * @return Zero on success, otherwise nonzero (out of memory)
+ */
+static int count_stack(const char* text) {
+  // Grow at three quarters full
+  if ((g_num_stacks + 1) * 4 > g_cap_stacks * 3) {
+    size_t cap = g_cap_stacks ? g_cap_stacks * 2 : 1024;
+    struct stack_count* table = calloc(cap, sizeof(*table));
+    if (table == NULL) {
+      return 1;
+    }
+
+    for (size_t i = 0; i < g_cap_stacks; ++i) {
+      if (g_stacks[i].text) {
+        size_t j = hash_text(g_stacks[i].text) & (cap - 1);
+        while (table[j].text) {
+          j = (j + 1) & (cap - 1);
+        }
+        table[j] = g_stacks[i];
+      }
+    }
+
+    free(g_stacks);
+    g_stacks = table;
+    g_cap_stacks = cap;
+  }
+
+  size_t i = hash_text(text) & (g_cap_stacks - 1);
+  while (g_stacks[i].text) {
+    if (!strcmp(g_stacks[i].text, text)) {
+      g_stacks[i].count++;
+      return 0;
+    }
+    i = (i + 1) & (g_cap_stacks - 1);
+  }
+
+  g_stacks[i].text = strdup(text);
+  if (g_stacks[i].text == NULL) {
+    return 1;
+  }
+
+  g_stacks[i].count = 1;
+  g_num_stacks++;
+  return 0;
+}
+
+/**
+ * Append a frame to a collapsed stack.
+ *
+ * @param text The stack
+ * @param len The stack length
+ * @param frame The frame
+ */
+static void append_frame(char* text, size_t* len, const char* frame) {
+  if (*len > 0 && *len < STACK_TEXT_MAX - 1) {
+    text[(*len)++] = ';';
+  }
+
+  for (; *frame && *len < STACK_TEXT_MAX - 1; ++frame) {
+    text[(*len)++] = *frame == ';' ? ':' : *frame;
+  }
+
+  text[*len] = '\0';
+}
+
+/**
+ * Append a Python frame to a collapsed stack.
+ *
+ * @param text The stack
+ * @param len The stack length
+ * @param frame The frame
+ */
+static void append_python_frame(char* text, size_t* len, const struct python_frame* frame) {
+  char buf[FUNCTION_MAX + FILE_MAX + 32];
+  snprintf(buf, sizeof(buf), "%s (%s:%d)", frame->function, frame->file, frame->line);
+  append_frame(text, len, buf);
+}
+
+/**
+ * Collapse a sample into one line, root first.
+ *
+ * Each interpreter frame on the native stack is swapped for the Python frame
+ * it was running, outermost first. The interpreter's own call machinery
+ * between a Python frame and whatever it calls next is left out, unless the
+ * interpreter is linked into this program, where it can't be told apart.
+ *
+ * @param s The sample
+ * @param text The stack (STACK_TEXT_MAX bytes)
+ */
+static void collapse(const struct sample* s, char* text) {
+  size_t len = 0;
+  text[0] = '\0';
+
+  append_frame(text, &len, s->thread);
+
+  const struct symbol* symbols[MAX_NATIVE];
+  const void* eval_base = NULL;
+
+  for (int i = 0; i < s->num_native; ++i) {
+    // Return addresses point past the call, so look up the call itself
+    const char* addr = (const char*) s->native[i] - (i > 0 ? 1 : 0);
+    symbols[i] = resolve(addr);
+
+    if (symbols[i] && symbols[i]->eval) {
+      eval_base = symbols[i]->base;
+    }
+  }
+
+  int drop_glue = eval_base != NULL && eval_base != g_self_base;
+  int p = s->num_python - 1;
+  int in_python = 0;
+  int pending = 0;
+  size_t mark = 0;
+
+  for (int i = s->num_native - 1; i >= 0; --i) {
+    const struct symbol* sym = symbols[i];
+    if (sym == NULL) {
+      continue;
+    }
+
+    if (sym->eval) {
+      if (p >= 0) {
+        if (pending) {
+          len = mark;
+          text[len] = '\0';
+          pending = 0;
+        }
+
+        append_python_frame(text, &len, &s->python[p--]);
+        in_python = 1;
+      }
+      continue;
+    }
+
+    // Interpreter frames after a Python frame are glue until shown otherwise
+    if (in_python && drop_glue && sym->base == eval_base) {
+      if (!pending) {
+        mark = len;
+        pending = 1;
+      }
+
+      append_frame(text, &len, sym->name);
+      continue;
+    }
+
+    // The glue led into native code elsewhere (e.g. an extension method)
+    if (pending) {
+      len = mark;
+      text[len] = '\0';
+      pending = 0;
+    }
+
+    append_frame(text, &len, sym->name);
+  }
+
+  // Python frames the native stack lost track of go on top
+  while (p >= 0) {
+    append_python_frame(text, &len, &s->python[p--]);
+  }
+}
+
+/**
+ * Fold the ready samples into the stack counts.
+ */
+static void drain() {
+  static char text[STACK_TEXT_MAX];
+
+  for (size_t i = 0; i < SLOTS; ++i) {
+    struct sample* s = &g_slots[i];
+    if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != slot_ready) {
+      continue;
+    }
+
+    collapse(s, text);
+    if (count_stack(text)) {
+      fprintf(stderr, "profile: out of memory, sample lost\n");
+    }
+
+    __atomic_store_n(&s->state, slot_free, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * Start sampling a thread.
+ *
+ * @param tid The thread ID
+ * @param timer The timer
+ * @return Zero on success, otherwise nonzero (e.g. the thread has exited)
+ */
+static int arm_thread(pid_t tid, timer_t* timer) {
+  // The thread's CPU clock (MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED) in the kernel)
+  clockid_t clock = (clockid_t) ((~(unsigned int) tid << 3) | 6);
+
+  // Signal the thread itself, so it samples its own stack
+  struct sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event._sigev_un._tid = tid;
+
+  if (timer_create(clock, &event, timer)) {
+    return 1;
+  }
+
+  struct itimerspec spec = {
+    .it_interval = {.tv_sec = g_period / 1000000000L, .tv_nsec = g_period % 1000000000L},
+    .it_value = {.tv_sec = g_period / 1000000000L, .tv_nsec = g_period % 1000000000L},
+  };
+
+  if (timer_settime(*timer, 0, &spec, NULL)) {
+    timer_delete(*timer);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Arm timers for new threads and let go of timers for threads that exited.
+ */
+static void scan_threads() {
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < g_num_timers; ++i) {
+    g_timers[i].seen = 0;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    pid_t tid = (pid_t) atoi(entry->d_name);
+    if (tid <= 0 || tid == g_thread_tid) {
+      continue;
+    }
+
+    size_t i = 0;
+    while (i < g_num_timers && g_timers[i].tid != tid) {
+      ++i;
+    }
+
+    if (i < g_num_timers) {
+      g_timers[i].seen = 1;
+      continue;
+    }
+
+    struct thread_timer* timers = realloc(g_timers, (g_num_timers + 1) * sizeof(*timers));
+    if (timers == NULL) {
+      break;
+    }
+    g_timers = timers;
+
+    if (arm_thread(tid, &g_timers[g_num_timers].timer) == 0) {
+      g_timers[g_num_timers].tid = tid;
+      g_timers[g_num_timers].seen = 1;
+      g_num_timers++;
+      g_num_threads++;
+    }
+  }
+
+  closedir(dir);
+
+  for (size_t i = 0; i < g_num_timers;) {
+    if (g_timers[i].seen) {
+      ++i;
+      continue;
+    }
+
+    timer_delete(g_timers[i].timer);
+    g_timers[i] = g_timers[--g_num_timers];
+  }
+}
+
+/**
+ * Arm timers and fold samples until stopped.
+ *
+ * @param arg Unused
+ * @return NULL
+ */
+static void* sampling_profile_main(void* arg) {
+  g_thread_tid = (pid_t) syscall(SYS_gettid);
+
+  while (!__atomic_load_n(&g_stopping, __ATOMIC_ACQUIRE)) {
+    scan_threads();
+    drain();
+
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = DRAIN_NS};
+    nanosleep(&delay, NULL);
+  }
+
+  for (size_t i = 0; i < g_num_timers; ++i) {
+    timer_delete(g_timers[i].timer);
+  }
+
+  free(g_timers);
+  g_timers = NULL;
+  g_num_timers = 0;
+  return NULL;
+}
+
+int sampling_profile_start(const char* path, int hz) {
+  if (g_running) {
+    return 0;
+  }
+
+  if (hz <= 0 || hz > SAMPLING_PROFILE_MAX_HZ) {
+    fprintf(stderr, "profile rate out of range: %d\n", hz);
+    return 1;
+  }
+
+  // Fail on a bad path now rather than after the run
+  g_file = fopen(path, "w");
+  if (g_file == NULL) {
+    perror("profile: fopen");
+    return 1;
+  }
+
+  g_slots = mmap(NULL, SLOTS * sizeof(struct sample), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (g_slots == MAP_FAILED) {
+    perror("profile: mmap");
+    fclose(g_file);
+    return 1;
+  }
+
+  g_path = strdup(path);
+  g_period = 1000000000L / hz;
+
+  // The first backtrace loads the unwinder, which isn't safe from a signal handler
+  void* warm[4];
+  backtrace(warm, 4);
+
+  Dl_info info;
+  g_self_base = dladdr((void*) &sampling_profile_start, &info) ? info.dli_fbase : NULL;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = &on_sigprof;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+
+  __atomic_store_n(&g_active, 1, __ATOMIC_SEQ_CST);
+
+  if (pthread_create(&g_thread, NULL, &sampling_profile_main, NULL)) {
+    fprintf(stderr, "profile: failed to start thread\n");
+    __atomic_store_n(&g_active, 0, __ATOMIC_SEQ_CST);
+    munmap(g_slots, SLOTS * sizeof(struct sample));
+    fclose(g_file);
+    free(g_path);
+    return 1;
+  }
+
+  g_running = 1;
+  return 0;
+}
+
+/**
+ * Order stack counts busiest first.
+ */
+static int compare_counts(const void* a, const void* b) {
+  uint64_t x = ((const struct stack_count*) a)->count;
+  uint64_t y = ((const struct stack_count*) b)->count;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int sampling_profile_stop() {
+  if (!g_running) {
+    return 0;
+  }
+
+  g_running = 0;
+
+  // The background thread deletes the timers on its way out
+  __atomic_store_n(&g_stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(g_thread, NULL);
+
+  // Wait out any handler that got in before sampling stopped
+  __atomic_store_n(&g_active, 0, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&g_in_handler, __ATOMIC_SEQ_CST)) {
+    sched_yield();
+  }
+
+  drain();
+
+  // Pack the table down and write it out busiest first
+  size_t n = 0;
+  for (size_t i = 0; i < g_cap_stacks; ++i) {
+    if (g_stacks[i].text) {
+      g_stacks[n++] = g_stacks[i];
+    }
+  }
+
+  if (n > 0) {
+    qsort(g_stacks, n, sizeof(*g_stacks), &compare_counts);
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    fprintf(g_file, "%s %llu\n", g_stacks[i].text, (unsigned long long) g_stacks[i].count);
+  }
+
+  int err = fclose(g_file) != 0;
+  if (err) {
+    perror("profile: fclose");
+  }
+
+  fprintf(stderr, "profile: %llu samples (%llu dropped) from %zu threads written to %s\n",
+    (unsigned long long) g_samples, (unsigned long long) g_dropped, g_num_threads, g_path);
+
+  for (size_t i = 0; i < n; ++i) {
+    free(g_stacks[i].text);
+  }
+  free(g_stacks);
+  g_stacks = NULL;
+  g_num_stacks = 0;
+  g_cap_stacks = 0;
+
+  for (size_t i = 0; i < g_cap_symbols; ++i) {
+    free(g_symbols[i].name);
+  }
+  free(g_symbols);
+  g_symbols = NULL;
+  g_num_symbols = 0;
+  g_cap_symbols = 0;
+
+  munmap(g_slots, SLOTS * sizeof(struct sample));
+  g_slots = NULL;
+  free(g_path);
+  g_path = NULL;
+  g_file = NULL;
+  g_samples = 0;
+  g_dropped = 0;
+  g_num_threads = 0;
+  g_stopping = 0;
+  return err;
+}
@@ -0,0 +1,42 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef SAMPLING_PROFILE_H
+#define SAMPLING_PROFILE_H
+
+/** The default sampling rate, per second of each thread's CPU time (off the timer tick, so no lockstep). */
+#define SAMPLING_PROFILE_DEFAULT_HZ 99
+
+/** The highest sampling rate. */
+#define SAMPLING_PROFILE_MAX_HZ 10000
+
+/**
+ * Start sampling every thread in the process.
+ *
+ * Each thread gets a timer on its own CPU clock that sends it SIGPROF, so
+ * threads are sampled in proportion to the CPU they use and idle threads cost
+ * nothing. A sample is the native stack with the thread's Python frames (if
+ * any) spliced in where the interpreter evaluates them. A background thread
+ * arms timers for new threads and folds samples into collapsed stacks, which
+ * are written out by sampling_profile_stop. From Python 3.11 the frame layout
+ * is private, and samples hold native frames only.
+ *
+ * Does nothing if already sampling.
+ *
+ * @param path The output file for collapsed stacks
+ * @param hz The samples per second of CPU time per thread
+ * @return Zero on success, otherwise nonzero
+ */
+int sampling_profile_start(const char* path, int hz);
+
+/**
+ * Stop sampling and write the collapsed stacks, one "frame;frame;... count"
+ * line per distinct stack, busiest first. Does nothing if not sampling.
+ *
+ * @return Zero on success, otherwise nonzero
+ */
+int sampling_profile_stop();
+
+#endif // #ifndef SAMPLING_PROFILE_H
@@ -0,0 +1,86 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "startup_profile.h"
+
+/** A recorded phase. */
+struct mark {
+  /** The phase name. */
+  char name[STARTUP_PROFILE_MAX_NAME];
+
+  /** The time the phase ended (seconds since startup_profile_begin). */
+  double time;
+};
+
+/** Nonzero while recording. */
+static int g_enabled;
+
+/** The program start time (monotonic seconds). */
+static double g_start;
+
+/** The number of recorded marks. */
+static int g_num_marks;
+
+/** The recorded marks. */
+static struct mark g_marks[STARTUP_PROFILE_MAX_MARKS];
+
+/** Get the monotonic time in seconds. */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+void startup_profile_begin() {
+  g_start = now();
+}
+
+void startup_profile_enable() {
+  g_enabled = 1;
+}
+
+int startup_profile_enabled() {
+  return g_enabled;
+}
+
+void startup_profile_mark(const char* phase) {
+  if (!g_enabled || g_num_marks == STARTUP_PROFILE_MAX_MARKS) {
+    return;
+  }
+
+  double time = now() - g_start;
+
+  // Keep only the first time a phase ends
+  for (int i = 0; i < g_num_marks; ++i) {
+    if (!strncmp(g_marks[i].name, phase, STARTUP_PROFILE_MAX_NAME - 1)) {
+      return;
+    }
+  }
+
+  struct mark* mark = &g_marks[g_num_marks++];
+  strncpy(mark->name, phase, STARTUP_PROFILE_MAX_NAME - 1);
+  mark->name[STARTUP_PROFILE_MAX_NAME - 1] = '\0';
+  mark->time = time;
+}
+
+void startup_profile_report(FILE* file) {
+  if (!g_enabled || g_num_marks == 0) {
+    return;
+  }
+
+  fprintf(file, "startup profile (ms since start, ms in phase):\n");
+
+  double last = 0;
+  for (int i = 0; i < g_num_marks; ++i) {
+    fprintf(file, "  %-*s %10.3f %10.3f\n", STARTUP_PROFILE_MAX_NAME, g_marks[i].name, g_marks[i].time * 1e3,
+      (g_marks[i].time - last) * 1e3);
+    last = g_marks[i].time;
+  }
+
+  fflush(file);
+}
@@ -0,0 +1,52 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef STARTUP_PROFILE_H
+#define STARTUP_PROFILE_H
+
+#include <stdio.h>
+
+/** The most phases recorded. Later marks are ignored. */
+#define STARTUP_PROFILE_MAX_MARKS 32
+
+/** The longest phase name kept. Longer names are truncated. */
+#define STARTUP_PROFILE_MAX_NAME 48
+
+/**
+ * Note the time the program started.
+ *
+ * Call this first thing in main. Every mark is reported relative to it.
+ */
+void startup_profile_begin();
+
+/** Start recording marks. Until then, marks are ignored. */
+void startup_profile_enable();
+
+/**
+ * Check whether marks are being recorded.
+ *
+ * @return Nonzero if so, otherwise zero
+ */
+int startup_profile_enabled();
+
+/**
+ * Mark the end of a startup phase.
+ *
+ * A phase already marked is not marked again, so marks may sit on paths that
+ * run more than once (e.g. per frame). Not thread-safe; marks from Python are
+ * serialized by the GIL.
+ *
+ * @param phase The phase name
+ */
+void startup_profile_mark(const char* phase);
+
+/**
+ * Print the recorded phases, if any.
+ *
+ * @param file The output file
+ */
+void startup_profile_report(FILE* file);
+
+#endif // #ifndef STARTUP_PROFILE_H
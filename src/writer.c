@@ -0,0 +1,162 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+void writer_init(struct writer* w, int fd) {
+  w->fd = fd;
+  w->error = 0;
+  w->len = 0;
+}
+
+int writer_flush(struct writer* w) {
+  size_t off = 0;
+
+  while (off < w->len && !w->error) {
+    ssize_t n = write(w->fd, w->buf + off, w->len - off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // Typically the reader went away (e.g. piped into head)
+      w->error = 1;
+      break;
+    }
+
+    off += (size_t) n;
+  }
+
+  w->len = 0;
+  return w->error;
+}
+
+int writer_put(struct writer* w, const char* data, size_t len) {
+  // Make room if needed
+  if (w->len + len > sizeof w->buf && writer_flush(w)) {
+    return 1;
+  }
+
+  // Oversized chunks bypass the buffer entirely
+  if (len > sizeof w->buf) {
+    size_t off = 0;
+    while (off < len) {
+      ssize_t n = write(w->fd, data + off, len - off);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        w->error = 1;
+        break;
+      }
+
+      off += (size_t) n;
+    }
+
+    return w->error;
+  }
+
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+  return w->error;
+}
+
+int writer_puts(struct writer* w, const char* s) {
+  return writer_put(w, s, strlen(s));
+}
+
+int writer_putc(struct writer* w, char c) {
+  if (w->len == sizeof w->buf && writer_flush(w)) {
+    return 1;
+  }
+
+  w->buf[w->len++] = c;
+  return w->error;
+}
+
+int writer_put_int(struct writer* w, long long value) {
+  // Format right to left; enough room for any 64-bit value and a sign
+  char digits[24];
+  char* p = digits + sizeof digits;
+
+  unsigned long long u = value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value;
+  do {
+    *--p = (char) ('0' + u % 10);
+    u /= 10;
+  } while (u);
+
+  if (value < 0) {
+    *--p = '-';
+  }
+
+  return writer_put(w, p, (size_t) (digits + sizeof digits - p));
+}
+
+int writer_put_json_string(struct writer* w, const char* data, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+
+  writer_putc(w, '"');
+
+  // Copy runs of plain characters in one go
+  size_t run = 0;
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = (unsigned char) data[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+
+    writer_put(w, data + run, i - run);
+    run = i + 1;
+
+    switch (c) {
+      case '"':
+        writer_put(w, "\\\"", 2);
+        break;
+      case '\\':
+        writer_put(w, "\\\\", 2);
+        break;
+      case '\n':
+        writer_put(w, "\\n", 2);
+        break;
+      case '\r':
+        writer_put(w, "\\r", 2);
+        break;
+      case '\t':
+        writer_put(w, "\\t", 2);
+        break;
+      default: {
+        char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+        writer_put(w, esc, sizeof esc);
+        break;
+      }
+    }
+  }
+
+  writer_put(w, data + run, len - run);
+  return writer_putc(w, '"');
+}
+
+int writer_put_tsv_field(struct writer* w, const char* data, size_t len) {
+  size_t run = 0;
+  for (size_t i = 0; i < len; ++i) {
+    char c = data[i];
+    if (c != '\t' && c != '\n' && c != '\r' && c != '\\') {
+      continue;
+    }
+
+    writer_put(w, data + run, i - run);
+    run = i + 1;
+
+    writer_putc(w, '\\');
+    writer_putc(w, c == '\t' ? 't' : c == '\n' ? 'n' : c == '\r' ? 'r' : '\\');
+  }
+
+  return writer_put(w, data + run, len - run);
+}
@@ -0,0 +1,108 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+
+/** The writer buffer size. */
+#define WRITER_BUFFER_SIZE 65536
+
+/**
+ * A buffered writer over a file descriptor.
+ *
+ * Output accumulates in a fixed buffer and goes out in large writes, so
+ * streaming millions of small records costs a syscall per 64 KiB rather than
+ * one per record. Memory use is constant.
+ */
+struct writer {
+  /** The file descriptor. */
+  int fd;
+
+  /** Nonzero once a write has failed. Further output is discarded. */
+  int error;
+
+  /** The buffered length. */
+  size_t len;
+
+  /** The buffer. */
+  char buf[WRITER_BUFFER_SIZE];
+};
+
+/**
+ * Initialize a writer.
+ *
+ * @param w The writer
+ * @param fd The file descriptor
+ */
+void writer_init(struct writer* w, int fd);
+
+/**
+ * Write bytes.
+ *
+ * @param w The writer
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return Zero on success, otherwise nonzero
+ */
+int writer_put(struct writer* w, const char* data, size_t len);
+
+/**
+ * Write a null-terminated string.
+ *
+ * @param w The writer
+ * @param s The string
+ * @return Zero on success, otherwise nonzero
+ */
+int writer_puts(struct writer* w, const char* s);
+
+/**
+ * Write one character.
+ *
+ * @param w The writer
+ * @param c The character
+ * @return Zero on success, otherwise nonzero
+ */
+int writer_putc(struct writer* w, char c);
+
+/**
+ * Write a signed integer in decimal.
+ *
+ * @param w The writer
+ * @param value The integer
+ * @return Zero on success, otherwise nonzero
+ */
+int writer_put_int(struct writer* w, long long value);
+
+/**
+ * Write bytes as a quoted JSON string.
+ *
+ * @param w The writer
+ * @param data The bytes (UTF-8)
+ * @param len The number of bytes
+ * @return Zero on success, otherwise nonzero
+ */
+int writer_put_json_string(struct writer* w, const char* data, size_t len);
+
+/**
+ * Write bytes as a TSV field, escaping tabs, newlines and backslashes.
+ *
+ * @param w The writer
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return Zero on success, otherwise nonzero
+ */
+int writer_put_tsv_field(struct writer* w, const char* data, size_t len);
+
+/**
+ * Write out everything buffered.
+ *
+ * @param w The writer
+ * @return Zero on success, otherwise nonzero
+ */
+int writer_flush(struct writer* w);
+
+#endif // #ifndef WRITER_H
@@ -0,0 +1,26 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+/*
+ * A check macro for the native tests. A failed check prints where it failed
+ * and exits nonzero, which fails the test under CTest.
+ */
+
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/** Fail the test unless a condition holds. */
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1); \
+    } \
+  } while (0)
+
+#endif // #ifndef TESTS_CHECK_H
@@ -0,0 +1,198 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+/*
+ * Frame ring tests.
+ *
+ * Covers wraparound: frame numbers keep counting as slots are reused, a
+ * consumer gets the newest frame rather than a stale one, and a view goes
+ * invalid exactly when the producer comes back around to its slot. Then a
+ * producer thread laps a consumer many times, and every frame the consumer
+ * validates must hold the data written for it.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "core/frame_ring.h"
+#include "check.h"
+
+/** The slots in each ring. */
+#define SLOTS 4
+
+/** The data capacity of each slot. */
+#define SLOT_SIZE 256
+
+/** The frames published by the producer thread. */
+#define LAP_FRAMES 200000
+
+/**
+ * Fill frame data with a pattern unique to its frame number.
+ *
+ * @param number The frame number
+ * @param data The data
+ * @param len The length
+ */
+static void fill(uint64_t number, uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    data[i] = (uint8_t) (number * 31 + i);
+  }
+}
+
+/**
+ * Check that frame data holds the pattern of a frame number.
+ *
+ * @param number The frame number
+ * @param data The data
+ * @param len The length
+ * @return Nonzero if so, otherwise zero
+ */
+static int holds(uint64_t number, const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (data[i] != (uint8_t) (number * 31 + i)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Publish a patterned frame.
+ *
+ * @param ring The ring (producer)
+ * @return The frame number
+ */
+static uint64_t publish(struct frame_ring* ring) {
+  size_t capacity;
+  uint8_t* data = frame_ring_acquire(ring, &capacity);
+  CHECK(capacity >= SLOT_SIZE);
+
+  struct frame_info info = {
+    .width = SLOT_SIZE,
+    .height = 1,
+    .stride = SLOT_SIZE,
+    .format = frame_format_gray8,
+    .len = SLOT_SIZE,
+  };
+
+  // The number is assigned on commit, but it is always the next one
+  fill(ring->writing, data, SLOT_SIZE);
+  return frame_ring_commit(ring, &info);
+}
+
+/** Slots are reused in turn while frame numbers keep counting. */
+static void test_wraparound() {
+  char name[FRAME_RING_NAME_MAX];
+  snprintf(name, sizeof(name), "/cozmo-ring-test-%d", (int) getpid());
+
+  struct frame_ring producer;
+  struct frame_ring consumer;
+  CHECK(frame_ring_create(&producer, name, SLOTS, SLOT_SIZE) == 0);
+  CHECK(frame_ring_attach(&consumer, name) == 0);
+
+  struct frame_view view;
+  CHECK(frame_ring_wait(&consumer, 0, 0, &view) == frame_ring_wait_timeout);
+
+  // Two and a half laps: the consumer skips to the newest frame
+  for (uint64_t n = 0; n < 2 * SLOTS + 2; ++n) {
+    CHECK(publish(&producer) == n);
+  }
+
+  CHECK(frame_ring_wait(&consumer, 0, 0, &view) == frame_ring_wait_ok);
+  CHECK(view.info.number == 2 * SLOTS + 1);
+  CHECK(holds(view.info.number, view.data, view.info.len));
+  CHECK(frame_ring_validate(&view));
+
+  // Nothing newer yet
+  struct frame_view next;
+  CHECK(frame_ring_wait(&consumer, view.info.number + 1, 0.01, &next) == frame_ring_wait_timeout);
+
+  // The view holds until the producer comes back around to its slot
+  for (int i = 0; i < SLOTS - 1; ++i) {
+    publish(&producer);
+    CHECK(frame_ring_validate(&view));
+  }
+
+  publish(&producer);
+  CHECK(!frame_ring_validate(&view));
+
+  // Many laps on, numbers and data still line up
+  for (int i = 0; i < 1000; ++i) {
+    publish(&producer);
+  }
+
+  CHECK(frame_ring_wait(&consumer, view.info.number + 1, 0, &next) == frame_ring_wait_ok);
+  CHECK(next.info.number == 2 * SLOTS + 2 + SLOTS + 1000 - 1);
+  CHECK(holds(next.info.number, next.data, next.info.len) && frame_ring_validate(&next));
+
+  // The producer leaving closes the ring for the consumer
+  frame_ring_detach(&producer);
+  CHECK(frame_ring_wait(&consumer, next.info.number + 1, 0, &next) == frame_ring_wait_closed);
+  frame_ring_detach(&consumer);
+}
+
+static void* producer_main(void* arg) {
+  struct frame_ring* ring = arg;
+
+  for (int i = 0; i < LAP_FRAMES; ++i) {
+    publish(ring);
+  }
+
+  frame_ring_detach(ring);
+  return NULL;
+}
+
+/** A producer lapping a consumer never hands it a frame that validates with the wrong data. */
+static void test_laps() {
+  char name[FRAME_RING_NAME_MAX];
+  snprintf(name, sizeof(name), "/cozmo-ring-laps-%d", (int) getpid());
+
+  struct frame_ring producer;
+  struct frame_ring consumer;
+  CHECK(frame_ring_create(&producer, name, SLOTS, SLOT_SIZE) == 0);
+  CHECK(frame_ring_attach(&consumer, name) == 0);
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, &producer_main, &producer) == 0);
+
+  uint8_t copy[SLOT_SIZE];
+  uint64_t after = 0;
+  uint64_t valid = 0;
+  uint64_t torn = 0;
+
+  struct frame_view view;
+  while (frame_ring_wait(&consumer, after, 5, &view) == frame_ring_wait_ok) {
+    CHECK(view.info.number >= after);
+    CHECK(view.info.len == SLOT_SIZE);
+
+    memcpy(copy, view.data, SLOT_SIZE);
+
+    // Only a copy that validates afterwards is trusted
+    if (frame_ring_validate(&view)) {
+      CHECK(holds(view.info.number, copy, SLOT_SIZE));
+      ++valid;
+    } else {
+      ++torn;
+    }
+
+    after = view.info.number + 1;
+  }
+
+  pthread_join(thread, NULL);
+  frame_ring_detach(&consumer);
+
+  CHECK(valid > 0);
+  printf("laps: %d frames, %llu read, %llu lapped mid-read\n", LAP_FRAMES, (unsigned long long) valid,
+    (unsigned long long) torn);
+}
+
+int main() {
+  test_wraparound();
+  test_laps();
+  return 0;
+}
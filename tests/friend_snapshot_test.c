@@ -0,0 +1,301 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+/*
+ * Friend snapshot and write-ahead log tests.
+ *
+ * Covers compaction ordering (a friend removed and then re-added keeps only
+ * the re-added embedding), replay of a log with a torn tail, and recovery of
+ * a log left behind by a process that died. Files go in a fresh directory
+ * under the working directory, removed at the end.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "core/friend_snapshot.h"
+#include "check.h"
+
+/** The embedding dimension. */
+#define DIM 8
+
+/** The size of a logged addition. */
+#define ADD_RECORD_SIZE (8 + DIM * sizeof(float))
+
+/** The test directory. */
+static char g_dir[] = "friend_snapshot_test.XXXXXX";
+
+/**
+ * Make a deterministic embedding.
+ *
+ * @param seed The seed
+ * @param out The embedding
+ */
+static void embedding(int seed, float* out) {
+  for (int i = 0; i < DIM; ++i) {
+    out[i] = (float) sin(seed * 7.3 + i * 1.9) + (i == seed % DIM ? 2.0f : 0.0f);
+  }
+}
+
+/**
+ * Get a path in the test directory.
+ *
+ * @param name The file name
+ * @return The path (static storage, overwritten by the next call)
+ */
+static const char* test_path(const char* name) {
+  static char path[256];
+  snprintf(path, sizeof(path), "%s/%s", g_dir, name);
+  return path;
+}
+
+/**
+ * Find the snapshot row of a friend.
+ *
+ * @param snap The snapshot
+ * @param friend_id The friend ID
+ * @param rows The number of rows the friend has
+ * @return The last row of the friend, or -1
+ */
+static long find_row(const struct friend_snapshot* snap, int32_t friend_id, int* rows) {
+  long row = -1;
+  *rows = 0;
+
+  for (size_t i = 0; i < snap->rows; ++i) {
+    if (snap->ids[i] == friend_id) {
+      row = (long) i;
+      ++*rows;
+    }
+  }
+
+  return row;
+}
+
+/**
+ * Check that a snapshot row holds an embedding (unit length).
+ *
+ * @param snap The snapshot
+ * @param row The row
+ * @param seed The embedding seed
+ * @return Nonzero if so, otherwise zero
+ */
+static int row_matches(const struct friend_snapshot* snap, long row, int seed) {
+  float e[DIM];
+  embedding(seed, e);
+
+  double norm = 0;
+  for (int i = 0; i < DIM; ++i) {
+    norm += (double) e[i] * e[i];
+  }
+
+  for (int i = 0; i < DIM; ++i) {
+    if (fabs(snap->vectors[row * DIM + i] - e[i] / sqrt(norm)) > 1e-5) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Check whether an index finds a friend by one of its embeddings.
+ *
+ * @param idx The index
+ * @param friend_id The friend ID
+ * @param seed The embedding seed
+ * @return Nonzero if the friend is the best match, otherwise zero
+ */
+static int index_has(struct friend_index* idx, int32_t friend_id, int seed) {
+  float e[DIM];
+  embedding(seed, e);
+
+  struct friend_match match;
+  return friend_index_search(idx, e, 1, &match) == 1 && match.friend_id == friend_id && match.similarity > 0.999f;
+}
+
+/** A friend removed and re-added keeps the re-added embedding, and nothing else. */
+static void test_compaction_order() {
+  const char* snap_path = strdup(test_path("order.snap"));
+  float e[DIM];
+  uint64_t generation;
+
+  // Generation 1 holds friend 1
+  struct friend_wal wal;
+  CHECK(friend_wal_open(&wal, test_path("order-1.log"), DIM) == 0);
+  embedding(1, e);
+  CHECK(friend_wal_add(&wal, 1, e) == 0);
+  CHECK(friend_snapshot_compact(snap_path, &wal, friend_wal_end(&wal), &generation) == 0);
+  CHECK(generation == 1);
+  friend_wal_close(&wal, 1);
+
+  CHECK(friend_wal_open(&wal, test_path("order-2.log"), DIM) == 0);
+
+  // Friend 1: in the base snapshot, removed, then re-added with another embedding
+  CHECK(friend_wal_remove(&wal, 1) == 0);
+  embedding(11, e);
+  CHECK(friend_wal_add(&wal, 1, e) == 0);
+
+  // Friend 2: added, then removed
+  embedding(2, e);
+  CHECK(friend_wal_add(&wal, 2, e) == 0);
+  CHECK(friend_wal_remove(&wal, 2) == 0);
+
+  // Friend 3: added, removed, re-added
+  embedding(3, e);
+  CHECK(friend_wal_add(&wal, 3, e) == 0);
+  CHECK(friend_wal_remove(&wal, 3) == 0);
+  embedding(13, e);
+  CHECK(friend_wal_add(&wal, 3, e) == 0);
+
+  CHECK(friend_wal_watermark(&wal, 7) == 0);
+  CHECK(friend_snapshot_compact(snap_path, &wal, friend_wal_end(&wal), &generation) == 0);
+  CHECK(generation == 2);
+  friend_wal_close(&wal, 1);
+
+  struct friend_snapshot snap;
+  CHECK(friend_snapshot_open(&snap, snap_path, DIM) == 0);
+  CHECK(snap.generation == 2);
+  CHECK(snap.rows == 2);
+  CHECK(snap.watermark == 7);
+
+  int rows;
+  long row = find_row(&snap, 1, &rows);
+  CHECK(rows == 1 && row_matches(&snap, row, 11));
+
+  find_row(&snap, 2, &rows);
+  CHECK(rows == 0);
+
+  row = find_row(&snap, 3, &rows);
+  CHECK(rows == 1 && row_matches(&snap, row, 13));
+
+  friend_snapshot_close(&snap);
+
+  // A lower watermark never moves the snapshot's back
+  CHECK(friend_wal_open(&wal, test_path("order-3.log"), DIM) == 0);
+  CHECK(friend_wal_watermark(&wal, 3) == 0);
+  CHECK(friend_snapshot_compact(snap_path, &wal, friend_wal_end(&wal), &generation) == 0);
+  friend_wal_close(&wal, 1);
+
+  CHECK(friend_snapshot_open(&snap, snap_path, DIM) == 0);
+  CHECK(snap.generation == 3 && snap.rows == 2 && snap.watermark == 7);
+  friend_snapshot_close(&snap);
+
+  free((void*) snap_path);
+}
+
+/** A torn record at the end of a log is ignored on replay and cut off on open. */
+static void test_torn_tail() {
+  const char* log_path = strdup(test_path("torn.log"));
+  float e[DIM];
+
+  struct friend_wal wal;
+  CHECK(friend_wal_open(&wal, log_path, DIM) == 0);
+  embedding(1, e);
+  CHECK(friend_wal_add(&wal, 1, e) == 0);
+  embedding(2, e);
+  CHECK(friend_wal_add(&wal, 2, e) == 0);
+  CHECK(friend_wal_remove(&wal, 1) == 0);
+  CHECK(friend_wal_watermark(&wal, 5) == 0);
+  embedding(3, e);
+  CHECK(friend_wal_add(&wal, 3, e) == 0);
+
+  // Tear the last addition, as a crash in the middle of its write would
+  off_t end = friend_wal_end(&wal);
+  CHECK(ftruncate(wal.fd, end - 5) == 0);
+
+  // Replay stops at the tear
+  struct friend_index idx;
+  uint64_t watermark = 0;
+  CHECK(friend_index_init(&idx, DIM, NULL) == 0);
+  CHECK(friend_wal_replay(&wal, friend_wal_start(), friend_wal_end(&wal), &idx, &watermark) == 0);
+  CHECK(idx.live == 1 && index_has(&idx, 2, 2));
+  CHECK(watermark == 5);
+  friend_index_destroy(&idx);
+  friend_wal_close(&wal, 0);
+
+  // Reopening cuts the tear off, so the next record lands whole
+  CHECK(friend_wal_open(&wal, log_path, DIM) == 0);
+  CHECK(friend_wal_end(&wal) == end - (off_t) ADD_RECORD_SIZE);
+  embedding(4, e);
+  CHECK(friend_wal_add(&wal, 4, e) == 0);
+
+  // A few stray bytes are cut off the same way
+  CHECK(write(wal.fd, "\x01\x00\x00", 3) == 3);
+  friend_wal_close(&wal, 0);
+
+  CHECK(friend_wal_open(&wal, log_path, DIM) == 0);
+  CHECK(friend_wal_end(&wal) == end);
+
+  watermark = 0;
+  CHECK(friend_index_init(&idx, DIM, NULL) == 0);
+  CHECK(friend_wal_replay(&wal, friend_wal_start(), friend_wal_end(&wal), &idx, &watermark) == 0);
+  CHECK(idx.live == 2 && index_has(&idx, 2, 2) && index_has(&idx, 4, 4));
+  friend_index_destroy(&idx);
+  friend_wal_close(&wal, 1);
+
+  free((void*) log_path);
+}
+
+/** The log of a process that died is folded into the snapshot and deleted; a live process's log is left. */
+static void test_recover() {
+  const char* snap_path = strdup(test_path("recover.snap"));
+  char dead_path[256];
+  char live_path[256];
+  float e[DIM];
+
+  // A child that has exited and been reaped leaves a pid with no process
+  pid_t dead = fork();
+  CHECK(dead >= 0);
+  if (dead == 0) {
+    _exit(0);
+  }
+  CHECK(waitpid(dead, NULL, 0) == dead);
+
+  snprintf(dead_path, sizeof(dead_path), "%s.%d.wal", snap_path, (int) dead);
+  snprintf(live_path, sizeof(live_path), "%s.%d.wal", snap_path, (int) getppid());
+
+  struct friend_wal wal;
+  CHECK(friend_wal_open(&wal, dead_path, DIM) == 0);
+  embedding(9, e);
+  CHECK(friend_wal_add(&wal, 9, e) == 0);
+  CHECK(friend_wal_watermark(&wal, 42) == 0);
+  friend_wal_close(&wal, 0);
+
+  CHECK(friend_wal_open(&wal, live_path, DIM) == 0);
+  embedding(10, e);
+  CHECK(friend_wal_add(&wal, 10, e) == 0);
+  friend_wal_close(&wal, 0);
+
+  CHECK(friend_snapshot_recover(snap_path, DIM) == 0);
+  CHECK(access(dead_path, F_OK) != 0);
+  CHECK(access(live_path, F_OK) == 0);
+
+  struct friend_snapshot snap;
+  CHECK(friend_snapshot_open(&snap, snap_path, DIM) == 0);
+  CHECK(snap.generation == 1 && snap.rows == 1 && snap.ids[0] == 9 && snap.watermark == 42);
+  friend_snapshot_close(&snap);
+
+  unlink(live_path);
+  free((void*) snap_path);
+}
+
+int main() {
+  if (mkdtemp(g_dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  test_compaction_order();
+  test_torn_tail();
+  test_recover();
+
+  char cmd[64];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", g_dir);
+  return system(cmd) != 0;
+}
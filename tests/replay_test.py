@@ -0,0 +1,83 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+"""
+End-to-end replay regression test.
+
+Starts the SQL stand-in with a seeded friend set, then runs the real cozmo
+binary headless over a frame directory:
+
+  cozmo --sql-host 127.0.0.1 ... go --replay <frames> --metrics <out> --baseline <baseline>
+
+cozmo itself fails the run if fps, p99 latency or memory miss the baseline.
+This also checks that every frame was replayed and the friends were loaded
+from the stand-in, so a run that quietly did less work does not pass.
+
+Usage: replay_test.py --cozmo COZMO --frames DIR --baseline FILE --metrics FILE [--friends N]
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+# The embedding dimension of the live friend index
+EMBEDDING_DIM = 128
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Replay frames through cozmo and check the metrics')
+    parser.add_argument('--cozmo', required=True, help='the cozmo binary')
+    parser.add_argument('--frames', required=True, help='the frame directory')
+    parser.add_argument('--baseline', required=True, help='the baseline to hold the metrics to')
+    parser.add_argument('--metrics', required=True, help='where to write the metrics')
+    parser.add_argument('--friends', type=int, default=1000, help='the number of friends to seed')
+    parser.add_argument('--timeout', type=float, default=120, help='the most seconds the replay may take')
+    args = parser.parse_args()
+
+    standin = subprocess.Popen([sys.executable, os.path.join(os.path.dirname(__file__), 'sql_standin.py'),
+                                '--friends', str(args.friends), '--dim', str(EMBEDDING_DIM)],
+                               stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    try:
+        port = int(standin.stdout.readline())
+
+        # The client library takes the port from the environment when none is given
+        env = dict(os.environ, MYSQL_TCP_PORT=str(port))
+
+        if os.path.exists(args.metrics):
+            os.remove(args.metrics)
+
+        status = subprocess.call([args.cozmo, '--sql-host', '127.0.0.1', '--sql-user', 'cozmo', '--sql-db', 'cozmo',
+                                  'go', '--replay', args.frames, '--metrics', args.metrics, '--baseline',
+                                  args.baseline], env=env, timeout=args.timeout)
+    finally:
+        standin.stdin.close()
+        standin.wait()
+
+    if not os.path.exists(args.metrics):
+        print('replay wrote no metrics (status {})'.format(status), file=sys.stderr)
+        return 1
+
+    with open(args.metrics) as file:
+        metrics = json.load(file)
+
+    failed = status != 0
+
+    frames = len([name for name in os.listdir(args.frames) if name.lower().endswith(('.jpg', '.jpeg'))])
+    if metrics['frames'] != frames:
+        print('replayed {} of {} frames'.format(metrics['frames'], frames), file=sys.stderr)
+        failed = True
+
+    if args.friends > 0 and not metrics['memory']['native_peak_mb'].get('friends'):
+        print('no friends were loaded from the sql stand-in', file=sys.stderr)
+        failed = True
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
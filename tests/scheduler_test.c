@@ -0,0 +1,194 @@
+/*
+ * Cozmonaut
+ * Copyright 2019 The Cozmonaut Contributors
+ */
+
+/*
+ * Work-stealing scheduler tests.
+ *
+ * The Chase-Lev deque is tested directly (the scheduler source is included
+ * for its static functions): an owner pushes and takes while thieves steal,
+ * keeping the deque short so owner and thieves often race for the last task,
+ * and every task must be claimed exactly once. Then a task spawning many
+ * children through the public API must see each child run exactly once.
+ */
+
+#include <pthread.h>
+
+#include "core/scheduler.c"
+#include "check.h"
+
+/** The tasks pushed through the deque. */
+#define DEQUE_TASKS (1 << 20)
+
+/** The thieves. */
+#define DEQUE_THIEVES 3
+
+/** The children spawned through the scheduler. */
+#define SPAWN_TASKS 100000
+
+/** The deque under test. */
+static struct scheduler_deque g_deque;
+
+/** The tasks. */
+static struct scheduler_task g_tasks[DEQUE_TASKS];
+
+/** How often each task was claimed. */
+static uint8_t g_claimed[DEQUE_TASKS];
+
+/** Tasks claimed by thieves. */
+static uint64_t g_stolen;
+
+/** Nonzero once the owner has pushed and taken everything it will. */
+static int g_owner_done;
+
+/**
+ * Claim a task, counting claims per task.
+ *
+ * @param task The task
+ */
+static void claim(struct scheduler_task* task) {
+  CHECK(task >= g_tasks && task < g_tasks + DEQUE_TASKS);
+  __atomic_add_fetch(&g_claimed[task - g_tasks], 1, __ATOMIC_RELAXED);
+}
+
+static void* owner_main(void* arg) {
+  uint64_t rng = 0x2545f4914f6cdd1dull;
+  size_t next = 0;
+
+  while (next < DEQUE_TASKS) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    // Short bursts, mostly taken straight back, keep the deque near empty, where take and steal race for the
+    // last task (now and then a burst is left for the thieves, so they see some depth too)
+    size_t burst = 1 + rng % 2;
+    for (size_t i = 0; i < burst && next < DEQUE_TASKS; ++i) {
+      if (deque_push(&g_deque, &g_tasks[next]) == 0) {
+        ++next;
+      }
+    }
+
+    size_t takes = (rng >> 8) % 16 == 0 ? 0 : burst;
+    for (size_t i = 0; i < takes; ++i) {
+      struct scheduler_task* task = deque_take(&g_deque);
+      if (task) {
+        claim(task);
+      }
+    }
+  }
+
+  for (struct scheduler_task* task; (task = deque_take(&g_deque)) != NULL;) {
+    claim(task);
+  }
+
+  __atomic_store_n(&g_owner_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void* thief_main(void* arg) {
+  for (;;) {
+    struct scheduler_task* task;
+    enum steal_result result = deque_steal(&g_deque, &task);
+
+    if (result == steal_ok) {
+      claim(task);
+      __atomic_add_fetch(&g_stolen, 1, __ATOMIC_RELAXED);
+    } else if (result == steal_empty && __atomic_load_n(&g_owner_done, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+  }
+}
+
+/** Owner and thieves racing on one deque claim every task exactly once. */
+static void test_deque_races() {
+  pthread_t owner;
+  pthread_t thieves[DEQUE_THIEVES];
+
+  for (int i = 0; i < DEQUE_THIEVES; ++i) {
+    CHECK(pthread_create(&thieves[i], NULL, &thief_main, NULL) == 0);
+  }
+
+  CHECK(pthread_create(&owner, NULL, &owner_main, NULL) == 0);
+  pthread_join(owner, NULL);
+
+  for (int i = 0; i < DEQUE_THIEVES; ++i) {
+    pthread_join(thieves[i], NULL);
+  }
+
+  for (size_t i = 0; i < DEQUE_TASKS; ++i) {
+    CHECK(g_claimed[i] == 1);
+  }
+
+  printf("deque: %d tasks, %llu stolen\n", DEQUE_TASKS, (unsigned long long) g_stolen);
+}
+
+/** A child task spawned from a worker. */
+struct child_task {
+  /** The task. */
+  struct scheduler_task base;
+
+  /** How often the child ran. */
+  int runs;
+};
+
+/** The children. */
+static struct child_task g_children[SPAWN_TASKS];
+
+/** The children finished. */
+static int g_children_done;
+
+/** The scheduler the children run on. */
+static struct scheduler g_sched;
+
+static void run_child(struct scheduler_task* self) {
+  struct child_task* child = (struct child_task*) self;
+  __atomic_add_fetch(&child->runs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_children_done, 1, __ATOMIC_RELEASE);
+}
+
+static void run_parent(struct scheduler_task* self) {
+  // Spawned from a worker, so each child goes on this worker's deque (or the shared queue when full)
+  for (int i = 0; i < SPAWN_TASKS; ++i) {
+    g_children[i].base.run = &run_child;
+    CHECK(scheduler_submit(&g_sched, &g_children[i].base) == 0);
+  }
+}
+
+/** Children spawned from a task run exactly once, wherever they end up. */
+static void test_spawn() {
+  CHECK(scheduler_init(&g_sched, 4) == 0);
+
+  struct scheduler_task parent = {
+    .run = &run_parent,
+  };
+
+  CHECK(scheduler_submit(&g_sched, &parent) == 0);
+
+  // Give up after ten seconds
+  for (int i = 0; i < 10000 && __atomic_load_n(&g_children_done, __ATOMIC_ACQUIRE) < SPAWN_TASKS; ++i) {
+    usleep(1000);
+  }
+
+  CHECK(__atomic_load_n(&g_children_done, __ATOMIC_ACQUIRE) == SPAWN_TASKS);
+
+  uint64_t stolen = 0;
+  for (int i = 0; i < g_sched.num_workers; ++i) {
+    stolen += __atomic_load_n(&g_sched.workers[i]->ran_stolen, __ATOMIC_RELAXED);
+  }
+
+  scheduler_destroy(&g_sched);
+
+  for (int i = 0; i < SPAWN_TASKS; ++i) {
+    CHECK(g_children[i].runs == 1);
+  }
+
+  printf("spawn: %d children, %llu stolen\n", SPAWN_TASKS, (unsigned long long) stolen);
+}
+
+int main() {
+  test_deque_races();
+  test_spawn();
+  return 0;
+}
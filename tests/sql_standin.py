@@ -0,0 +1,428 @@
+#
+# Cozmonaut
+# Copyright 2019 The Cozmonaut Contributors
+#
+
+"""
+A stand-in for the MySQL server, for tests.
+
+It speaks just enough of the MySQL client/server protocol (handshake, text
+queries, multiple statements, ping and quit) for cozmo's SQL clients, and
+runs every statement against an in-memory SQLite database laid out like
+sql/schema.sql. Statements are translated where the two dialects differ
+(INSERT IGNORE, no-op ON DUPLICATE KEY UPDATE and backslash escapes in
+string literals). Any password is
+accepted.
+
+It can seed the friends table with deterministic random embeddings, so a
+test gets a reproducible friend set without a database server.
+
+Usage: sql_standin.py [--port PORT] [--friends N] [--dim DIM] [--seed SEED]
+
+It prints the port it listens on, then serves until stdin closes or it is
+terminated.
+"""
+
+import argparse
+import random
+import re
+import socketserver
+import sqlite3
+import struct
+import sys
+import threading
+
+# Capability flags
+CLIENT_LONG_PASSWORD = 0x00000001
+CLIENT_FOUND_ROWS = 0x00000002
+CLIENT_LONG_FLAG = 0x00000004
+CLIENT_CONNECT_WITH_DB = 0x00000008
+CLIENT_PROTOCOL_41 = 0x00000200
+CLIENT_TRANSACTIONS = 0x00002000
+CLIENT_SECURE_CONNECTION = 0x00008000
+CLIENT_MULTI_STATEMENTS = 0x00010000
+CLIENT_MULTI_RESULTS = 0x00020000
+CLIENT_PLUGIN_AUTH = 0x00080000
+CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA = 0x00200000
+
+# The capabilities served (no SSL, so clients that prefer it go without)
+CAPABILITIES = (CLIENT_LONG_PASSWORD | CLIENT_FOUND_ROWS | CLIENT_LONG_FLAG | CLIENT_CONNECT_WITH_DB
+                | CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION | CLIENT_MULTI_STATEMENTS
+                | CLIENT_MULTI_RESULTS | CLIENT_PLUGIN_AUTH)
+
+# Status flags
+SERVER_STATUS_AUTOCOMMIT = 0x0002
+SERVER_MORE_RESULTS_EXISTS = 0x0008
+
+# Commands
+COM_QUIT = 0x01
+COM_INIT_DB = 0x02
+COM_QUERY = 0x03
+COM_PING = 0x0e
+COM_SET_OPTION = 0x1b
+
+# Column types and character sets
+MYSQL_TYPE_DOUBLE = 5
+MYSQL_TYPE_LONGLONG = 8
+MYSQL_TYPE_VAR_STRING = 253
+MYSQL_TYPE_BLOB = 252
+CHARSET_UTF8MB4 = 45
+CHARSET_BINARY = 63
+
+# Error codes
+ER_DUP_ENTRY = 1062
+ER_PARSE_ERROR = 1064
+ER_UNKNOWN_COM_ERROR = 1047
+
+AUTH_PLUGIN = b'mysql_native_password'
+
+# An update that changes nothing, used to make an insert idempotent
+NOOP_UPSERT = re.compile(r'\s+ON\s+DUPLICATE\s+KEY\s+UPDATE\s+(\w+)\s*=\s*\1\s*$', re.IGNORECASE)
+
+# The schema, as SQLite understands sql/schema.sql
+SCHEMA = """
+CREATE TABLE friends (
+  id INTEGER NOT NULL PRIMARY KEY,
+  name TEXT NOT NULL,
+  embedding BLOB
+);
+
+CREATE TABLE friend_changes (
+  seq INTEGER PRIMARY KEY AUTOINCREMENT,
+  friend_id INTEGER NOT NULL
+);
+
+CREATE TRIGGER friends_inserted AFTER INSERT ON friends
+  BEGIN INSERT INTO friend_changes (friend_id) VALUES (NEW.id); END;
+
+CREATE TRIGGER friends_updated AFTER UPDATE ON friends
+  BEGIN INSERT INTO friend_changes (friend_id) VALUES (OLD.id), (NEW.id); END;
+
+CREATE TRIGGER friends_deleted AFTER DELETE ON friends
+  BEGIN INSERT INTO friend_changes (friend_id) VALUES (OLD.id); END;
+
+CREATE TABLE encounters (
+  id INTEGER PRIMARY KEY AUTOINCREMENT,
+  friend_id INTEGER NOT NULL,
+  robot_id INTEGER NOT NULL,
+  track_id INTEGER NOT NULL,
+  time TEXT NOT NULL,
+  confidence REAL NOT NULL,
+  UNIQUE (robot_id, track_id, friend_id, time)
+);
+"""
+
+# MySQL escape sequences in string literals
+_ESCAPES = {'0': '\0', "'": "'", '"': '"', 'b': '\b', 'n': '\n', 'r': '\r', 't': '\t', 'Z': '\x1a', '\\': '\\'}
+
+
+def split_statements(sql: str):
+    """
+    Split MySQL text into SQLite statements.
+
+    Statements are split on semicolons outside string literals, and string
+    literals are rewritten from backslash escapes to SQLite's doubled quotes.
+
+    :param sql: The statement text
+    :return: The translated statements
+    """
+
+    statements = []
+    out = []
+    i = 0
+
+    while i < len(sql):
+        c = sql[i]
+
+        if c in '\'"':
+            # Read the literal up to its closing quote
+            value = []
+            i += 1
+            while i < len(sql):
+                if sql[i] == '\\' and i + 1 < len(sql):
+                    value.append(_ESCAPES.get(sql[i + 1], sql[i + 1]))
+                    i += 2
+                elif sql[i] == c and sql[i + 1:i + 2] == c:
+                    value.append(c)
+                    i += 2
+                elif sql[i] == c:
+                    i += 1
+                    break
+                else:
+                    value.append(sql[i])
+                    i += 1
+
+            out.append("'" + ''.join(value).replace("'", "''") + "'")
+        elif c == ';':
+            statements.append(''.join(out))
+            out = []
+            i += 1
+        else:
+            out.append(c)
+            i += 1
+
+    statements.append(''.join(out))
+
+    translated = []
+    for statement in statements:
+        statement = statement.strip()
+        if not statement:
+            continue
+
+        if statement[:13].upper() == 'INSERT IGNORE':
+            statement = 'INSERT OR IGNORE' + statement[13:]
+
+        # A no-op update on a duplicate key leaves the row alone
+        statement = NOOP_UPSERT.sub(' ON CONFLICT DO NOTHING', statement)
+
+        translated.append(statement)
+
+    return translated
+
+
+def lenenc_int(value: int) -> bytes:
+    if value < 251:
+        return bytes([value])
+    if value < 1 << 16:
+        return b'\xfc' + struct.pack('<H', value)
+    if value < 1 << 24:
+        return b'\xfd' + struct.pack('<I', value)[:3]
+    return b'\xfe' + struct.pack('<Q', value)
+
+
+def lenenc_str(value: bytes) -> bytes:
+    return lenenc_int(len(value)) + value
+
+
+class Connection(socketserver.BaseRequestHandler):
+    """
+    Serves one client connection.
+    """
+
+    def setup(self):
+        self.seq = 0
+        self.reader = self.request.makefile('rb')
+
+    def read_packet(self) -> bytes:
+        payload = b''
+        while True:
+            header = self.reader.read(4)
+            if len(header) < 4:
+                raise EOFError()
+
+            length = header[0] | header[1] << 8 | header[2] << 16
+            self.seq = (header[3] + 1) & 0xff
+            payload += self.reader.read(length)
+
+            # A full-size packet continues in the next one
+            if length < 0xffffff:
+                return payload
+
+    def write_packet(self, payload: bytes):
+        while True:
+            chunk, payload = payload[:0xffffff], payload[0xffffff:]
+            self.request.sendall(struct.pack('<I', len(chunk))[:3] + bytes([self.seq]) + chunk)
+            self.seq = (self.seq + 1) & 0xff
+            if len(chunk) < 0xffffff:
+                return
+
+    def write_ok(self, affected: int = 0, insert_id: int = 0, status: int = SERVER_STATUS_AUTOCOMMIT):
+        self.write_packet(b'\x00' + lenenc_int(affected) + lenenc_int(insert_id) + struct.pack('<HH', status, 0))
+
+    def write_eof(self, status: int = SERVER_STATUS_AUTOCOMMIT):
+        self.write_packet(b'\xfe' + struct.pack('<HH', 0, status))
+
+    def write_error(self, code: int, message: str, state: str = 'HY000'):
+        self.write_packet(b'\xff' + struct.pack('<H', code) + b'#' + state.encode() + message.encode())
+
+    def handshake(self):
+        scramble = bytes(random.randrange(1, 128) for _ in range(20))
+
+        self.seq = 0
+        self.write_packet(b'\x0a' + b'5.7.99-cozmo-standin\x00' + struct.pack('<I', threading.get_ident() & 0xffffffff)
+                          + scramble[:8] + b'\x00' + struct.pack('<H', CAPABILITIES & 0xffff)
+                          + bytes([CHARSET_UTF8MB4]) + struct.pack('<HH', SERVER_STATUS_AUTOCOMMIT, CAPABILITIES >> 16)
+                          + bytes([len(scramble) + 1]) + bytes(10) + scramble[8:] + b'\x00' + AUTH_PLUGIN + b'\x00')
+
+        response = self.read_packet()
+        flags, = struct.unpack_from('<I', response)
+
+        # Skip the fixed fields and the user name to find the auth plugin the client answered with
+        pos = response.index(b'\x00', 32) + 1
+        if flags & CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA:
+            length = response[pos]
+            pos += 1
+            if length >= 251:
+                size = {0xfc: 2, 0xfd: 3, 0xfe: 8}[length]
+                length = int.from_bytes(response[pos:pos + size], 'little')
+                pos += size
+            pos += length
+        elif flags & CLIENT_SECURE_CONNECTION:
+            pos += 1 + response[pos]
+        else:
+            pos = response.index(b'\x00', pos) + 1
+        if flags & CLIENT_CONNECT_WITH_DB:
+            pos = response.index(b'\x00', pos) + 1
+
+        plugin = AUTH_PLUGIN
+        if flags & CLIENT_PLUGIN_AUTH and pos < len(response):
+            plugin = response[pos:].split(b'\x00')[0]
+
+        # A client that led with another plugin is switched to ours
+        if plugin != AUTH_PLUGIN:
+            self.write_packet(b'\xfe' + AUTH_PLUGIN + b'\x00' + scramble + b'\x00')
+            self.read_packet()
+
+        self.write_ok()
+
+    def handle(self):
+        try:
+            self.handshake()
+
+            while True:
+                packet = self.read_packet()
+                command = packet[0] if packet else None
+
+                if command == COM_QUIT:
+                    return
+                elif command in (COM_PING, COM_INIT_DB):
+                    self.write_ok()
+                elif command == COM_SET_OPTION:
+                    self.write_eof()
+                elif command == COM_QUERY:
+                    self.query(packet[1:].decode('utf-8', 'replace'))
+                else:
+                    self.write_error(ER_UNKNOWN_COM_ERROR, 'unknown command', '08S01')
+        except (EOFError, ConnectionError):
+            pass
+
+    def query(self, text: str):
+        statements = split_statements(text)
+        if not statements:
+            self.write_error(ER_PARSE_ERROR, 'empty query', '42000')
+            return
+
+        for i, statement in enumerate(statements):
+            more = SERVER_MORE_RESULTS_EXISTS if i + 1 < len(statements) else 0
+
+            # Session settings have nothing to set here
+            if statement[:4].upper() == 'SET ':
+                self.write_ok(status=SERVER_STATUS_AUTOCOMMIT | more)
+                continue
+
+            try:
+                with self.server.lock:
+                    cursor = self.server.db.execute(statement)
+                    rows = cursor.fetchall()
+                    columns = cursor.description
+                    affected = cursor.rowcount if cursor.rowcount > 0 else 0
+                    insert_id = cursor.lastrowid or 0
+            except sqlite3.IntegrityError as e:
+                # An error ends the statement list, as in MySQL
+                self.write_error(ER_DUP_ENTRY, 'Duplicate entry: {}'.format(e), '23000')
+                return
+            except sqlite3.Error as e:
+                self.write_error(ER_PARSE_ERROR, str(e), '42000')
+                return
+
+            if columns is None:
+                self.write_ok(affected, insert_id, SERVER_STATUS_AUTOCOMMIT | more)
+            else:
+                self.write_result(columns, rows, more)
+
+    def write_result(self, columns, rows, more: int):
+        self.write_packet(lenenc_int(len(columns)))
+
+        for i, column in enumerate(columns):
+            # SQLite has no column types to speak of, so they come from the values
+            sample = next((row[i] for row in rows if row[i] is not None), None)
+            if isinstance(sample, int):
+                kind, charset, length = MYSQL_TYPE_LONGLONG, CHARSET_BINARY, 20
+            elif isinstance(sample, float):
+                kind, charset, length = MYSQL_TYPE_DOUBLE, CHARSET_BINARY, 22
+            elif isinstance(sample, bytes):
+                kind, charset, length = MYSQL_TYPE_BLOB, CHARSET_BINARY, 65535
+            else:
+                kind, charset, length = MYSQL_TYPE_VAR_STRING, CHARSET_UTF8MB4, 1020
+
+            name = column[0].encode()
+            self.write_packet(lenenc_str(b'def') + lenenc_str(b'cozmo') + lenenc_str(b'') + lenenc_str(b'')
+                              + lenenc_str(name) + lenenc_str(name) + b'\x0c'
+                              + struct.pack('<HIBHB', charset, length, kind, 0, 0) + b'\x00\x00')
+
+        self.write_eof()
+
+        for row in rows:
+            payload = b''
+            for value in row:
+                if value is None:
+                    payload += b'\xfb'
+                elif isinstance(value, bytes):
+                    payload += lenenc_str(value)
+                else:
+                    payload += lenenc_str(str(value).encode())
+            self.write_packet(payload)
+
+        self.write_eof(SERVER_STATUS_AUTOCOMMIT | more)
+
+
+class StandinServer(socketserver.ThreadingTCPServer):
+    """
+    The stand-in server, with one SQLite database shared by every connection.
+    """
+
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, port: int = 0):
+        super().__init__(('127.0.0.1', port), Connection)
+
+        self.lock = threading.Lock()
+        self.db = sqlite3.connect(':memory:', check_same_thread=False, isolation_level=None)
+        self.db.executescript(SCHEMA)
+
+        # Times are stored as the Unix time they were given as
+        self.db.create_function('FROM_UNIXTIME', 1, lambda t: t)
+
+    def seed_friends(self, count: int, dim: int, seed: int):
+        """
+        Fill the friends table with deterministic random embeddings.
+        """
+
+        rng = random.Random(seed)
+
+        rows = []
+        for friend_id in range(1, count + 1):
+            embedding = struct.pack('<{}f'.format(dim), *(rng.gauss(0, 1) for _ in range(dim)))
+            rows.append((friend_id, 'friend {}'.format(friend_id), embedding))
+
+        with self.lock:
+            self.db.executemany('INSERT INTO friends (id, name, embedding) VALUES (?, ?, ?)', rows)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='A MySQL stand-in backed by SQLite, for tests')
+    parser.add_argument('--port', type=int, default=0, help='the port to listen on (default: any free port)')
+    parser.add_argument('--friends', type=int, default=0, help='the number of friends to seed')
+    parser.add_argument('--dim', type=int, default=128, help='the embedding dimension of seeded friends')
+    parser.add_argument('--seed', type=int, default=1, help='the seed for seeded friends')
+    args = parser.parse_args()
+
+    server = StandinServer(args.port)
+    server.seed_friends(args.friends, args.dim, args.seed)
+
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+
+    print(server.server_address[1], flush=True)
+
+    # Serve until whoever started us closes our stdin
+    sys.stdin.read()
+
+    server.shutdown()
+    server.server_close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())